@@ -1,5 +1,9 @@
 #include <assert.h>
+#include <string.h>
+#include <algorithm>
 #include "btree.h"
+#include "btree_build.h"
+#include "btree_load.h"
 
 KeyValuePair::KeyValuePair()
 {}
@@ -15,13 +19,39 @@ KeyValuePair::KeyValuePair(const KeyValuePair &rhs) :
 {}
 
 
+// Blocks have no moves of their own, but their bytes are just a pointer
+// and a length
+static void SwapBlocks(Block &lhs, Block &rhs)
+{
+  swap(lhs.length,rhs.length);
+  swap(lhs.data,rhs.data);
+}
+
+
+KeyValuePair::KeyValuePair(KeyValuePair &&rhs)
+{
+  SwapBlocks(key,rhs.key);
+  SwapBlocks(value,rhs.value);
+}
+
+
 KeyValuePair::~KeyValuePair()
 {}
 
 
 KeyValuePair & KeyValuePair::operator=(const KeyValuePair &rhs)
 {
-  return *( new (this) KeyValuePair(rhs));
+  key=rhs.key;
+  value=rhs.value;
+  return *this;
+}
+
+
+KeyValuePair & KeyValuePair::operator=(KeyValuePair &&rhs)
+{
+  SwapBlocks(key,rhs.key);
+  SwapBlocks(value,rhs.value);
+  return *this;
 }
 
 BTreeIndex::BTreeIndex(SIZE_T keysize,
@@ -32,12 +62,73 @@ BTreeIndex::BTreeIndex(SIZE_T keysize,
   superblock.info.keysize=keysize;
   superblock.info.valuesize=valuesize;
   buffercache=cache;
+  mapped=0;
+  aio=0;
+  inmemory=false;
+  memory=0;
+  readahead=BTREE_READAHEAD;
+  seqrun=0;
+  lastleaf=0;
+  lastparent.block=lastparent.slot=lastparent.numkeys=0;
+  rablock=raslot=0;
+  numreads=numwrites=0;
+  trace=0;
+  fingerprinted=false;
+  summarized=false;
+  aggregate=0;
+  codec=0;
+  leafsize=0;
+  interiorsize=0;
   // note: ignoring unique now
 }
 
+BTreeIndex::BTreeIndex(SIZE_T keysize,
+		       SIZE_T valuesize,
+		       BTreeMmapStore *store,
+		       bool unique)
+{
+  superblock.info.keysize=keysize;
+  superblock.info.valuesize=valuesize;
+  buffercache=0;
+  mapped=store;
+  aio=0;
+  inmemory=false;
+  memory=0;
+  readahead=BTREE_READAHEAD;
+  seqrun=0;
+  lastleaf=0;
+  lastparent.block=lastparent.slot=lastparent.numkeys=0;
+  rablock=raslot=0;
+  numreads=numwrites=0;
+  trace=0;
+  fingerprinted=false;
+  summarized=false;
+  aggregate=0;
+  codec=0;
+  leafsize=0;
+  interiorsize=0;
+}
+
 BTreeIndex::BTreeIndex()
 {
   // shouldn't have to do anything
+  mapped=0;
+  aio=0;
+  inmemory=false;
+  memory=0;
+  readahead=BTREE_READAHEAD;
+  seqrun=0;
+  lastleaf=0;
+  lastparent.block=lastparent.slot=lastparent.numkeys=0;
+  rablock=raslot=0;
+  numreads=numwrites=0;
+  trace=0;
+  fingerprinted=false;
+  summarized=false;
+  aggregate=0;
+  codec=0;
+  leafsize=0;
+  interiorsize=0;
 }
 
 
@@ -47,19 +138,404 @@ BTreeIndex::BTreeIndex()
 BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
 {
   buffercache=rhs.buffercache;
+  // rhs's image in memory stays its own
+  mapped= rhs.mapped==rhs.memory ? 0 : rhs.mapped;
+  aio=rhs.aio;
+  inmemory=rhs.inmemory;
+  memory=0;
+  readahead=rhs.readahead;
+  seqrun=0;
+  lastleaf=0;
+  lastparent.block=lastparent.slot=lastparent.numkeys=0;
+  rablock=raslot=0;
+  numreads=numwrites=0;
+  trace=0;
+  fingerprinted=false;
+  summarized=false;
+  aggregate=0;
+  // Its leaves can't be read without the codec, so keep that
+  codec=rhs.codec;
+  leafsize=rhs.leafsize;
+  interiorsize=rhs.interiorsize;
+  if (codec) {
+    leafcache.Reset(BTREE_LEAF_CACHE);
+  }
   superblock_index=rhs.superblock_index;
   superblock=rhs.superblock;
 }
 
 BTreeIndex::~BTreeIndex()
 {
-  // shouldn't have to do anything
+  FreeMemory();
 }
 
 
+//
+// Like the copy constructor, will not attach, and keeps none of rhs's
+// caches, counters or tracing
+//
 BTreeIndex & BTreeIndex::operator=(const BTreeIndex &rhs)
 {
-  return *(new(this)BTreeIndex(rhs));
+  if (this==&rhs) {
+    return *this;
+  }
+  FreeMemory();
+  buffercache=rhs.buffercache;
+  mapped= rhs.mapped==rhs.memory ? 0 : rhs.mapped;
+  aio=rhs.aio;
+  inmemory=rhs.inmemory;
+  readahead=rhs.readahead;
+  seqrun=0;
+  lastleaf=0;
+  lastparent.block=lastparent.slot=lastparent.numkeys=0;
+  rablock=raslot=0;
+  numreads=numwrites=0;
+  trace=0;
+  fingerprinted=false;
+  summarized=false;
+  aggregate=0;
+  // Its leaves can't be read without the codec, so keep that
+  codec=rhs.codec;
+  leafsize=rhs.leafsize;
+  interiorsize=rhs.interiorsize;
+  if (codec) {
+    leafcache.Reset(BTREE_LEAF_CACHE);
+  } else {
+    leafcache.Clear();
+  }
+  fingerprints.Clear();
+  summaries.Clear();
+  lastpath.depth=0;
+  stats.Reset();
+  superblock_index=rhs.superblock_index;
+  superblock=rhs.superblock;
+  return *this;
+}
+
+
+// A node read straight out of a block laid out as Serialize would lay
+// it out, as BTreeMmapStore::Read does
+static void NodeFromBlock(const char *bytes, BTreeNode &b)
+{
+  NodeMetadata info;
+
+  memcpy(&info,bytes,sizeof(info));
+  b=BTreeNode(info.nodetype,info.keysize,info.valuesize,info.blocksize);
+  b.info=info;
+  if (b.data) {
+    memcpy(b.data,bytes+sizeof(info),info.GetNumDataBytes());
+  }
+}
+
+
+ERROR_T BTreeIndex::ReadNode(const SIZE_T &n, BTreeNode &b) const
+{
+  static thread_local Block image;
+  const char *bytes;
+  ERROR_T rc;
+
+  if (codec && leafcache.Get(n,b)) {
+    return ERROR_NOERROR;
+  }
+  numreads++;
+  if (codec) {
+    // Any block may hold a compressed leaf, so look at it raw first
+    if (mapped) {
+      rc=mapped->ReadBlock(n,bytes);
+    } else {
+      rc=buffercache->ReadBlock(n,image);
+      bytes=image.data;
+    }
+    if (!rc) {
+      if (BTreeIsPackedLeaf(bytes,GetBlockSize())) {
+	rc=BTreeUnpackLeaf(*codec,bytes,GetBlockSize(),b);
+	if (!rc) {
+	  leafcache.Put(n,b);
+	}
+      } else if (mapped) {
+	rc=mapped->Read(n,b);
+      } else {
+	NodeFromBlock(bytes,b);
+      }
+    }
+  } else if (mapped) {
+    rc=mapped->Read(n,b);
+  } else if (aio) {
+    rc=aio->Read(n,b);
+  } else {
+    rc=b.Unserialize(buffercache,n);
+  }
+  BTREE_STAT(if (!rc) { stats.CountRead(b.info.nodetype); });
+  return rc;
+}
+
+
+void BTreeIndex::NotifyAllocate(const SIZE_T &n) const
+{
+  if (aio) {
+    aio->NotifyAllocate(n);
+  } else if (buffercache) {
+    buffercache->NotifyAllocateBlock(n);
+  }
+}
+
+
+void BTreeIndex::NotifyDeallocate(const SIZE_T &n) const
+{
+  if (aio) {
+    aio->NotifyDeallocate(n);
+  } else if (buffercache) {
+    buffercache->NotifyDeallocateBlock(n);
+  }
+}
+
+
+ERROR_T BTreeIndex::WriteNode(const SIZE_T &n, const BTreeNode &b) const
+{
+  static thread_local Block image;
+  bool packed=false;
+  ERROR_T rc;
+
+  if (codec) {
+    packed= b.info.nodetype==BTREE_LEAF_NODE && b.info.blocksize>GetBlockSize();
+    if (packed) {
+      image.Resize(GetBlockSize(),false);
+      rc=BTreePackLeaf(*codec,b,image.data,GetBlockSize());
+      if (rc) {
+	// Nothing gets written, so whatever was expected of it isn't
+	// coming
+	if (fingerprinted) {
+	  fingerprints.Expect(BTREE_FP_UNKNOWN,0,0);
+	}
+	return rc;
+      }
+      leafcache.Put(n,b);
+    } else {
+      leafcache.Forget(n);
+    }
+  }
+  numwrites++;
+  BTREE_STAT(stats.CountWrite(b.info.nodetype));
+  if (fingerprinted) {
+    fingerprints.Note(n,b);
+  }
+  if (summarized) {
+    summaries.Note(n,b);
+  }
+  if (packed) {
+    return mapped ? mapped->WriteBlock(n,image.data) : buffercache->WriteBlock(n,image);
+  }
+  if (mapped) {
+    return mapped->Write(n,b);
+  }
+  if (b.info.blocksize<GetBlockSize()) {
+    // A compact interior node, which Serialize only takes a block of
+    image.Resize(GetBlockSize(),false);
+    memcpy(image.data,&b.info,sizeof(b.info));
+    memcpy(image.data+sizeof(b.info),b.data,b.info.GetNumDataBytes());
+    return buffercache->WriteBlock(n,image);
+  }
+  if (aio) {
+    return aio->SubmitWrite(n,b);
+  }
+  return b.Serialize(buffercache,n);
+}
+
+
+ERROR_T BTreeIndex::ViewNode(const SIZE_T &n, BTreeNodeView &b) const
+{
+  const char *bytes;
+
+  if (mapped && codec && mapped->ReadBlock(n,bytes)==ERROR_NOERROR &&
+      BTreeIsPackedLeaf(bytes,GetBlockSize())) {
+    // There is nothing to borrow but the compressed bytes
+    b.Release();
+    return ReadNode(n,b.node);
+  }
+  if (mapped) {
+    numreads++;
+    ERROR_T rc=mapped->View(n,b);
+    BTREE_STAT(if (!rc) { stats.CountRead(b.Get().info.nodetype); });
+    return rc;
+  }
+  b.Release();
+  return ReadNode(n,b.node);
+}
+
+
+SIZE_T BTreeIndex::GetBlockSize() const
+{
+  return mapped ? mapped->GetBlockSize() : buffercache->GetBlockSize();
+}
+
+
+SIZE_T BTreeIndex::GetNumBlocks() const
+{
+  return mapped ? mapped->GetNumBlocks() : buffercache->GetNumBlocks();
+}
+
+
+SIZE_T BTreeIndex::GetLeafSize() const
+{
+  return codec ? leafsize : GetBlockSize();
+}
+
+
+SIZE_T BTreeIndex::GetInteriorSize() const
+{
+  return interiorsize ? interiorsize : GetBlockSize();
+}
+
+
+bool BTreeIndex::LeafFits(const BTreeNode &b) const
+{
+  static thread_local Block image;
+
+  if (!codec || b.info.blocksize<=GetBlockSize()) {
+    return true;
+  }
+  image.Resize(GetBlockSize(),false);
+  return BTreePackLeaf(*codec,b,image.data,GetBlockSize())==ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::SetInMemory(const bool on)
+{
+  if (!buffercache) {
+    return ERROR_BADCONFIG;
+  }
+  inmemory=on;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::SetInteriorSize(const SIZE_T size)
+{
+  NodeMetadata info=superblock.info;
+
+  // Once attached, the index goes by the size in its superblock
+  if (superblock.info.nodetype==BTREE_SUPERBLOCK) {
+    return ERROR_BADCONFIG;
+  }
+  if (size==0 || size==GetBlockSize()) {
+    interiorsize=0;
+    return ERROR_NOERROR;
+  }
+  if (aio) {
+    return ERROR_BADCONFIG;
+  }
+  info.blocksize=size;
+  if (size>GetBlockSize() || size<sizeof(info)+sizeof(SIZE_T) ||
+      info.GetNumSlotsAsInterior()<3) {
+    return ERROR_SIZE;
+  }
+  interiorsize=size;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::SetAsyncIO(BTreeAsyncIO *io)
+{
+  if (io && (codec || interiorsize)) {
+    return ERROR_BADCONFIG;
+  }
+  aio=io;
+  return ERROR_NOERROR;
+}
+
+
+void BTreeIndex::SetReadahead(const SIZE_T blocks)
+{
+  readahead=blocks;
+}
+
+
+void BTreeIndex::SetTrace(BTreeTraceRecorder *recorder)
+{
+  trace=recorder;
+}
+
+
+void BTreeIndex::SetFingerprints(const bool on)
+{
+  fingerprinted=on;
+  if (on && superblock.info.nodetype==BTREE_SUPERBLOCK) {
+    NodeMetadata leaf=superblock.info;
+    leaf.blocksize=GetLeafSize();
+    fingerprints.Reset(GetNumBlocks(),leaf.GetNumSlotsAsLeaf());
+  } else {
+    fingerprints.Clear();
+  }
+}
+
+
+void BTreeIndex::SetSummaries(const bool on, const BTreeAggregate *agg)
+{
+  summarized=on;
+  aggregate= on ? agg : 0;
+  if (on && superblock.info.nodetype==BTREE_SUPERBLOCK) {
+    summaries.Reset(GetNumBlocks(),aggregate);
+  } else {
+    summaries.Clear();
+  }
+}
+
+
+ERROR_T BTreeIndex::SetLeafCompression(const BTreeLeafCodec *c, const SIZE_T blocks,
+				       const SIZE_T cached)
+{
+  if (c && (aio || blocks==0)) {
+    return ERROR_BADCONFIG;
+  }
+  codec=c;
+  leafsize=blocks*GetBlockSize();
+  if (codec) {
+    leafcache.Reset(cached);
+  } else {
+    leafcache.Clear();
+  }
+  // Leaves may hold more keys now
+  SetFingerprints(fingerprinted);
+  return ERROR_NOERROR;
+}
+
+
+void BTreeIndex::PrefetchNode(const SIZE_T &n) const
+{
+  if (mapped) {
+    mapped->Prefetch(n);
+  } else if (aio) {
+    aio->Prefetch(n);
+  }
+}
+
+
+void BTreeIndex::ReadAhead(const SIZE_T &n, const BTreeNode &b, const SIZE_T slot)
+{
+  SIZE_T offset;
+  SIZE_T last;
+  SIZE_T ptr;
+
+  if (readahead==0 || (!mapped && !aio)) {
+    return;
+  }
+
+  // The window is the readahead children after slot; only the part of
+  // it we have not asked for yet needs asking for
+  last=min((SIZE_T)(slot+readahead),(SIZE_T)b.info.numkeys);
+  offset=slot+1;
+  if (n==rablock && raslot>=offset) {
+    offset=raslot+1;
+  }
+  for (;offset<=last;offset++) {
+    if (b.GetPtr(offset,ptr)==ERROR_NOERROR) {
+      PrefetchNode(ptr);
+    }
+  }
+  if (n!=rablock || last>raslot) {
+    rablock=n;
+    raslot=last;
+  }
 }
 
 
@@ -73,15 +549,19 @@ ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
 
   BTreeNode node;
 
-  node.Unserialize(buffercache,n);
+  ReadNode(n,node);
 
   assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
 
   superblock.info.freelist=node.info.freelist;
 
-  superblock.Serialize(buffercache,superblock_index);
+  WriteNode(superblock_index,superblock);
+
+  NotifyAllocate(n);
+
+  BTREE_STAT(stats.CountAlloc());
 
-  buffercache->NotifyAllocateBlock(n);
+  lastpath.depth=0;
 
   return ERROR_NOERROR;
 }
@@ -91,26 +571,106 @@ ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 {
   BTreeNode node;
 
-  node.Unserialize(buffercache,n);
+  ReadNode(n,node);
 
   assert(node.info.nodetype!=BTREE_UNALLOCATED_BLOCK);
 
+  if (node.info.blocksize!=GetBlockSize()) {
+    // A compressed leaf or a compact interior node, whose block goes
+    // back to being a plain one
+    BTreeNode plain(BTREE_UNALLOCATED_BLOCK,node.info.keysize,node.info.valuesize,GetBlockSize());
+    plain.info.rootnode=node.info.rootnode;
+    node=plain;
+  }
+
   node.info.nodetype=BTREE_UNALLOCATED_BLOCK;
 
   node.info.freelist=superblock.info.freelist;
 
-  node.Serialize(buffercache,n);
+  WriteNode(n,node);
 
   superblock.info.freelist=n;
 
-  superblock.Serialize(buffercache,superblock_index);
+  WriteNode(superblock_index,superblock);
+
+  NotifyDeallocate(n);
+
+  BTREE_STAT(stats.CountFree());
 
-  buffercache->NotifyDeallocateBlock(n);
+  lastpath.depth=0;
 
   return ERROR_NOERROR;
 
 }
 
+BTreeWalk::BTreeWalk(const BTreeIndex &i, const SIZE_T r) :
+  index(i), root(r), started(false)
+{}
+
+
+void BTreeWalk::SkipChildren()
+{
+  path.entry[path.depth-1].slot=node[path.depth-1].Get().info.numkeys+1;
+}
+
+
+ERROR_T BTreeWalk::Next()
+{
+  ERROR_T rc;
+  SIZE_T ptr;
+  SIZE_T readptr;
+  SIZE_T offset;
+
+  if (!started) {
+    started=true;
+    ptr=root;
+  } else {
+    // Climb until some node still has a child we haven't been into
+    for (;;) {
+      if (path.depth==0) {
+	return ERROR_NONEXISTENT;
+      }
+      BTreePathEntry &e=path.entry[path.depth-1];
+      const BTreeNode &b=node[path.depth-1].Get();
+      if ((b.info.nodetype==BTREE_ROOT_NODE || b.info.nodetype==BTREE_INTERIOR_NODE) &&
+	  b.info.numkeys>0 && e.slot<=b.info.numkeys) {
+	rc=b.GetPtr(e.slot++,ptr);
+	if (rc) { return rc; }
+	// Slide the readahead window along by one child
+	if (index.readahead>0 && e.slot>1 && e.slot-1+index.readahead<=b.info.numkeys &&
+	    b.GetPtr(e.slot-1+index.readahead,readptr)==ERROR_NOERROR) {
+	  index.PrefetchNode(readptr);
+	}
+	break;
+      }
+      path.depth--;
+    }
+    if (path.depth==BTREE_MAX_DEPTH) {
+      return ERROR_INSANE;
+    }
+  }
+
+  rc=index.ViewNode(ptr,node[path.depth]);
+  if (rc) { return rc; }
+  path.entry[path.depth].block=ptr;
+  path.entry[path.depth].slot=0;
+  path.entry[path.depth].numkeys=node[path.depth].Get().info.numkeys;
+
+  // Child 0 is read right away; open the window on the ones after it
+  const BTreeNode &b=node[path.depth].Get();
+  if (b.info.nodetype==BTREE_ROOT_NODE || b.info.nodetype==BTREE_INTERIOR_NODE) {
+    for (offset=1;offset<=index.readahead && offset<=b.info.numkeys;offset++) {
+      if (b.GetPtr(offset,readptr)==ERROR_NOERROR) {
+	index.PrefetchNode(readptr);
+      }
+    }
+  }
+
+  path.depth++;
+  return ERROR_NOERROR;
+}
+
+
 ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
 {
   ERROR_T rc;
@@ -118,6 +678,14 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
   superblock_index=initblock;
   assert(superblock_index==0);
 
+  lastpath.depth=0;
+
+  FreeMemory();
+  if (inmemory) {
+    rc=LoadMemory(create);
+    if (rc) { return rc; }
+  }
+
   if (create) {
     // build a super block, root node, and a free space list
     //
@@ -127,14 +695,14 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
     BTreeNode newsuperblock(BTREE_SUPERBLOCK,
 			    superblock.info.keysize,
 			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
+			    GetBlockSize());
     newsuperblock.info.rootnode=superblock_index+1;
     newsuperblock.info.freelist=superblock_index+2;
-    newsuperblock.info.numkeys=0;
+    newsuperblock.info.numkeys=interiorsize;
 
-    buffercache->NotifyAllocateBlock(superblock_index);
+    NotifyAllocate(superblock_index);
 
-    rc=newsuperblock.Serialize(buffercache,superblock_index);
+    rc=WriteNode(superblock_index,newsuperblock);
 
     if (rc) {
       return rc;
@@ -143,28 +711,28 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
     BTreeNode newrootnode(BTREE_ROOT_NODE,
 			  superblock.info.keysize,
 			  superblock.info.valuesize,
-			  buffercache->GetBlockSize());
+			  GetInteriorSize());
     newrootnode.info.rootnode=superblock_index+1;
     newrootnode.info.freelist=superblock_index+2;
     newrootnode.info.numkeys=0;
 
-    buffercache->NotifyAllocateBlock(superblock_index+1);
+    NotifyAllocate(superblock_index+1);
 
-    rc=newrootnode.Serialize(buffercache,superblock_index+1);
+    rc=WriteNode(superblock_index+1,newrootnode);
 
     if (rc) {
       return rc;
     }
 
-    for (SIZE_T i=superblock_index+2; i<buffercache->GetNumBlocks();i++) {
+    for (SIZE_T i=superblock_index+2; i<GetNumBlocks();i++) {
       BTreeNode newfreenode(BTREE_UNALLOCATED_BLOCK,
 			    superblock.info.keysize,
 			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
+			    GetBlockSize());
       newfreenode.info.rootnode=superblock_index+1;
-      newfreenode.info.freelist= ((i+1)==buffercache->GetNumBlocks()) ? 0: i+1;
+      newfreenode.info.freelist= ((i+1)==GetNumBlocks()) ? 0: i+1;
 
-      rc = newfreenode.Serialize(buffercache,i);
+      rc = WriteNode(i,newfreenode);
 
       if (rc) {
 	return rc;
@@ -175,106 +743,607 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
 
   // OK, now, mounting the btree is simply a matter of reading the superblock
 
-  return superblock.Unserialize(buffercache,initblock);
+  rc=ReadNode(initblock,superblock);
+  if (rc) {
+    return rc;
+  }
+  // Compact interior nodes are written around async I/O
+  if (aio && superblock.info.numkeys!=0) {
+    return ERROR_BADCONFIG;
+  }
+  interiorsize=superblock.info.numkeys;
+  SetFingerprints(fingerprinted);
+  SetSummaries(summarized,aggregate);
+  return ERROR_NOERROR;
 }
 
 
-ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
+ERROR_T BTreeIndex::LoadMemory(const bool create)
 {
-  return superblock.Serialize(buffercache,superblock_index);
+  Block image;
+  SIZE_T n;
+  ERROR_T rc;
+
+  memory=new BTreeMmapStore;
+  rc=memory->CreateInMemory(buffercache->GetNumBlocks(),buffercache->GetBlockSize());
+  if (rc) {
+    FreeMemory();
+    return rc;
+  }
+  // A new index is written from scratch anyway
+  for (n=0; !create && n<memory->GetNumBlocks(); n++) {
+    rc=buffercache->ReadBlock(n,image);
+    if (!rc) {
+      rc=memory->WriteBlock(n,image.data);
+    }
+    if (rc) {
+      FreeMemory();
+      return rc;
+    }
+  }
+  memory->ClearChanged();
+  mapped=memory;
+  return ERROR_NOERROR;
 }
 
 
-ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
-					   const BTreeOp op,
-					   const KEY_T &key,
-					   VALUE_T &value)
+ERROR_T BTreeIndex::DumpMemory()
 {
-  BTreeNode b;
+  Block image(memory->GetBlockSize());
+  const char *bytes;
+  SIZE_T n;
   ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
 
-  rc= b.Unserialize(buffercache,node);
+  for (n=0;n<memory->GetNumBlocks();n++) {
+    if (!memory->IsChanged(n)) {
+      continue;
+    }
+    rc=memory->ReadBlock(n,bytes);
+    if (rc) { return rc; }
+    memcpy(image.data,bytes,image.length);
+    rc=buffercache->WriteBlock(n,image);
+    if (rc) { return rc; }
+  }
+  memory->ClearChanged();
+  return ERROR_NOERROR;
+}
 
-  if (rc!=ERROR_NOERROR) {
-    return rc;
+
+void BTreeIndex::FreeMemory()
+{
+  if (memory) {
+    if (mapped==memory) {
+      mapped=0;
+    }
+    delete memory;
+    memory=0;
+    // Leaves it had that never went back to the cache mustn't be
+    // found in the leaf cache
+    leafcache.Reset(leafcache.GetNumEntries());
   }
+}
 
-  switch (b.info.nodetype) {
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    // Scan through key/ptr pairs
-    //and recurse if possible
-    for (offset=0;offset<b.info.numkeys;offset++) {
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (key<testkey || key==testkey) {
-	// OK, so we now have the first key that's larger
-	// so we ned to recurse on the ptr immediately previous to
-	// this one, if it exists
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	return LookupOrUpdateInternal(ptr,op,key,value);
-      }
+
+ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
+{
+  ERROR_T rc;
+
+  // A read-only mapping can't have changed the superblock, and can't
+  // take it back
+  if (!(mapped && mapped->IsReadOnly())) {
+    rc=WriteNode(superblock_index,superblock);
+
+    if (rc) {
+      return rc;
     }
-    // if we got here, we need to go to the next pointer, if it exists
-    if (b.info.numkeys>0) {
-      rc=b.GetPtr(b.info.numkeys,ptr);
-      if (rc) { return rc; }
-      return LookupOrUpdateInternal(ptr,op,key,value);
-    } else {
-      // There are no keys at all on this node, so nowhere to go
-      return ERROR_NONEXISTENT;
+  }
+
+  // Queued writes have to be in the cache before anyone detaches it,
+  // and mapped ones in the file
+  if (memory) {
+    rc=DumpMemory();
+    FreeMemory();
+    return rc;
+  }
+  if (mapped) {
+    return mapped->Sync();
+  }
+  if (aio) {
+    return aio->Flush();
+  }
+  return ERROR_NOERROR;
+}
+
+
+void BTreeIndex::NoteLeaf(const BTreePath &path, const BTreeNode *parent)
+{
+  if (path.depth<2) {
+    seqrun=0;
+    return;
+  }
+
+  const BTreePathEntry &p=path.entry[path.depth-2];
+
+  if (path.entry[path.depth-1].block==lastleaf) {
+    // Same leaf again
+    seqrun++;
+  } else if (p.block==lastparent.block && p.slot==lastparent.slot+1) {
+    // The next leaf under the same parent
+    seqrun++;
+  } else if (p.block!=lastparent.block && p.slot==0 &&
+	     lastparent.slot==lastparent.numkeys) {
+    // Off the end of one parent and onto the first leaf of another
+    seqrun++;
+  } else {
+    seqrun=0;
+  }
+  lastleaf=path.entry[path.depth-1].block;
+  lastparent=p;
+
+  if (seqrun>=BTREE_SEQUENTIAL_RUN && parent) {
+    ReadAhead(p.block,*parent,p.slot);
+  }
+}
+
+
+// Copy len bytes into k, reusing its buffer if it is already that long
+static void CopyBytes(Block &k, const char *p, const SIZE_T len)
+{
+  if (k.length!=len) {
+    k.Resize(len,false);
+  }
+  memcpy(k.data,p,len);
+}
+
+
+ERROR_T BTreeIndex::Descend(const KEY_T &key, BTreePath &path, BTreeNode &b)
+{
+  ERROR_T rc;
+  BTreeNodeView views[2];
+  const BTreeNode *leaf;
+
+  rc=Descend(key,path,views,leaf);
+  if (rc==ERROR_NOERROR || (rc==ERROR_NONEXISTENT && path.depth>0)) {
+    views[(path.depth-1)%2].MoveTo(b);
+  }
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::Descend(const KEY_T &key, BTreePath &path, BTreeNodeView views[2],
+			    const BTreeNode *&leaf, const bool exact)
+{
+  SIZE_T node;
+  SIZE_T offset;
+  SIZE_T level;
+  SIZE_T start;
+  const SIZE_T keysize=superblock.info.keysize;
+  BorrowedKey testkey;
+
+  // Find the deepest level of the last descent whose subtree still
+  // covers key; everything above it is the same as last time
+  for (level=lastpath.depth; level>1; level--) {
+    if ((!lowbounded[level-1] || lastlow[level-1]<key) &&
+	(!highbounded[level-1] || key<lasthigh[level-1] || key==lasthigh[level-1])) {
+      break;
     }
-    break;
-  case BTREE_LEAF_NODE:
-    // Scan through keys looking for matching value
-    for (offset=0;offset<b.info.numkeys;offset++) {
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (testkey==key) {
-	if (op==BTREE_OP_LOOKUP) {
-	  return b.GetVal(offset,value);
-	} else {
-	  // BTREE_OP_UPDATE
-	  // WRITE ME
-	  rc = b.SetVal(offset, value);
-    if(rc){
-      return rc;
+  }
+  if (level<=1) {
+    level=1;
+    lowbounded[0]=false;
+    highbounded[0]=false;
+    node=superblock.info.rootnode;
+  } else {
+    node=lastpath.entry[level-1].block;
+  }
+  for (path.depth=0;path.depth<level-1;path.depth++) {
+    path.entry[path.depth]=lastpath.entry[path.depth];
+  }
+  lastpath.depth=0;
+  start=path.depth;
+
+  for (;;) {
+    if (path.depth==BTREE_MAX_DEPTH) {
+      return ERROR_INSANE;
     }
-    else{
-      return b.Serialize(buffercache, node);
+
+    // Nodes are just looked at, straight out of the store when it is
+    // mapped.  Levels alternate between two views so the leaf's parent
+    // is still there for readahead.
+    BTreeNodeView &view=views[path.depth%2];
+    ERROR_T rc=ViewNode(node,view);
+
+    if (rc!=ERROR_NOERROR) {
+      return rc;
     }
+
+    const BTreeNode &v=view.Get();
+
+    BTreePathEntry &e=path.entry[path.depth++];
+    e.block=node;
+    e.numkeys=v.info.numkeys;
+    leaf=&v;
+
+    switch (v.info.nodetype) {
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (v.info.numkeys==0) {
+	// There are no keys at all on this node, so nowhere to go
+	e.slot=0;
+	return ERROR_NONEXISTENT;
+      }
+      // Scan through key/ptr pairs for the first key that's larger
+      // or equal; the ptr immediately previous to it is where we go,
+      // and if there is none we take the last pointer
+      for (offset=0;offset<v.info.numkeys;offset++) {
+	const KEY_T &k=testkey.At(v.ResolveKey(offset),keysize);
+	if (key<k || key==k) {
+	  break;
+	}
+      }
+      e.slot=offset;
+      rc=v.GetPtr(offset,node);
+      if (rc) { return rc; }
+      // The child covers (key[offset-1], key[offset]], falling back to
+      // our own bounds at either end
+      if (path.depth<BTREE_MAX_DEPTH) {
+	if (offset>0) {
+	  CopyBytes(lastlow[path.depth],v.ResolveKey(offset-1),keysize);
+	  lowbounded[path.depth]=true;
+	} else if ((lowbounded[path.depth]=lowbounded[path.depth-1])) {
+	  CopyBytes(lastlow[path.depth],lastlow[path.depth-1].data,keysize);
+	}
+	if (offset<v.info.numkeys) {
+	  CopyBytes(lasthigh[path.depth],v.ResolveKey(offset),keysize);
+	  highbounded[path.depth]=true;
+	} else if ((highbounded[path.depth]=highbounded[path.depth-1])) {
+	  CopyBytes(lasthigh[path.depth],lasthigh[path.depth-1].data,keysize);
+	}
+      }
+      break;
+    case BTREE_LEAF_NODE:
+      if (exact && fingerprinted && key.length==keysize) {
+	// Only the keys whose fingerprints match can be ours
+	offset=fingerprints.Find(node,v,key.data);
+      } else {
+	// Find the first key that is not smaller than ours
+	for (offset=0;offset<v.info.numkeys;offset++) {
+	  if (!(testkey.At(v.ResolveKey(offset),keysize)<key)) {
+	    break;
+	  }
 	}
       }
+      e.slot=offset;
+      lastpath=path;
+      NoteLeaf(path, path.depth>=start+2 ? &views[path.depth%2].Get() : 0);
+      return ERROR_NOERROR;
+    default:
+      // We can't be looking at anything other than a root, internal, or leaf
+      return ERROR_INSANE;
     }
-    return ERROR_NONEXISTENT;
-    break;
-  default:
-    // We can't be looking at anything other than a root, internal, or leaf
-    return ERROR_INSANE;
-    break;
   }
 
   return ERROR_INSANE;
 }
 
 
-static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt)
+ERROR_T BTreeIndex::NextLeaf(BTreePath &path, BTreeNode &b)
+{
+  ERROR_T rc;
+  SIZE_T level;
+  SIZE_T leafdepth;
+  SIZE_T node;
+
+  leafdepth=path.depth;
+
+  // Climb to the nearest ancestor with a child after the one we took
+  for (level=path.depth-1; level>0; level--) {
+    if (path.entry[level-1].slot<path.entry[level-1].numkeys) {
+      break;
+    }
+  }
+  if (level==0) {
+    return ERROR_NONEXISTENT;
+  }
+  path.depth=level;
+  path.entry[level-1].slot++;
+
+  rc=ReadNode(path.entry[level-1].block,b);
+  if (rc) { return rc; }
+
+  // Then take the leftmost way down from its next child
+  for (;;) {
+    BTreePathEntry &e=path.entry[path.depth-1];
+    if (path.depth==leafdepth-1) {
+      ReadAhead(e.block,b,e.slot);
+    }
+    rc=b.GetPtr(e.slot,node);
+    if (rc) { return rc; }
+    if (path.depth==BTREE_MAX_DEPTH) {
+      return ERROR_INSANE;
+    }
+    rc=ReadNode(node,b);
+    if (rc) { return rc; }
+
+    BTreePathEntry &child=path.entry[path.depth++];
+    child.block=node;
+    child.slot=0;
+    child.numkeys=b.info.numkeys;
+
+    switch (b.info.nodetype) {
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      break;
+    case BTREE_LEAF_NODE:
+      return ERROR_NOERROR;
+    default:
+      return ERROR_INSANE;
+    }
+  }
+}
+
+
+BTreeNode & BTreeIndex::ScratchNode()
+{
+  static thread_local BTreeNode node;
+  return node;
+}
+
+
+ERROR_T BTreeIndex::LookupOrUpdateInternal(const BTreeOp op,
+					   const KEY_T &key,
+					   VALUE_T &value,
+					   BTreeModifier *modifier)
+{
+  BTreePath path;
+  BTreeNodeView views[2];
+  const BTreeNode *b;
+  ERROR_T rc;
+  BorrowedKey testkey;
+
+  rc=Descend(key,path,views,b,true);
+
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+
+  const BTreePathEntry &leaf=path.entry[path.depth-1];
+
+  if (leaf.slot>=b->info.numkeys) {
+    return ERROR_NONEXISTENT;
+  }
+  if (!(testkey.At(b->ResolveKey(leaf.slot),b->info.keysize)==key)) {
+    return ERROR_NONEXISTENT;
+  }
+
+  if (op==BTREE_OP_LOOKUP) {
+    CopyBytes(value,b->ResolveVal(leaf.slot),b->info.valuesize);
+    return ERROR_NOERROR;
+  } else {
+    // BTREE_OP_UPDATE or BTREE_OP_MODIFY
+    BTreeNode &node=ScratchNode();
+    views[(path.depth-1)%2].MoveTo(node);
+    if (op==BTREE_OP_MODIFY) {
+      rc = modifier->Modify(key, node.ResolveVal(leaf.slot), node.info.valuesize);
+    } else {
+      rc = node.SetVal(leaf.slot, value);
+    }
+    if (rc) { return rc; }
+    bool split;
+    rc = RewriteLeaf(path, node, leaf.slot, split);
+    if (rc) { return rc; }
+    NoteChange(path);
+    return ERROR_NOERROR;
+  }
+}
+
+
+// Orders a batch of lookups by their keys
+struct BatchKeyLess {
+  const KEY_T *keys;
+
+  BatchKeyLess(const KEY_T *k) : keys(k) {}
+  bool operator()(const SIZE_T lhs, const SIZE_T rhs) const { return keys[lhs]<keys[rhs]; }
+};
+
+
+// Once a batch runs into a node it can't use, none of its answers
+// can be trusted, so every lookup in it gets the error
+static ERROR_T FailBatch(ERROR_T *rcs, const SIZE_T n, const ERROR_T rc)
+{
+  SIZE_T i;
+
+  for (i=0;i<n;i++) {
+    rcs[i]=rc;
+  }
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::LookupBatch(const KEY_T *keys, VALUE_T *values, ERROR_T *rcs, const SIZE_T n)
+{
+  SIZE_T first;
+  ERROR_T rc=ERROR_NOERROR;
+  BTREE_STAT(BTreeStatTime start=BTreeStatNow());
+
+  if (trace) {
+    for (first=0;first<n;first++) {
+      trace->Record(BTREE_TRACE_LOOKUP,keys[first],0);
+    }
+  }
+  for (first=0;first<n && !rc;first+=BTREE_BATCH_MAX) {
+    rc=LookupBatchInternal(keys+first,values+first,rcs+first,
+			   min((SIZE_T)(n-first),(SIZE_T)BTREE_BATCH_MAX));
+  }
+  BTREE_STAT(for (first=0;first<n && !rc;first++) { stats.CountError(rcs[first]); });
+  BTREE_STAT(stats.CountOp(BTREE_STAT_BATCH,rc,start));
+  return rc;
+}
+
+
+//
+// Each lookup is a tiny state machine: the node it is waiting on.  Every
+// round moves all of them down one level.  Because the lookups are kept
+// in key order, the ones waiting on the same node sit next to each other
+// and, inside that node, each one's slot is at or after the previous
+// one's.  So each distinct node is read once per round and scanned once,
+// no matter how many lookups pass through it.
+//
+// With async I/O, a round first starts the reads of all its distinct
+// nodes and only then routes through them in order, so later nodes are
+// on their way while the earlier ones are being searched.
+//
+ERROR_T BTreeIndex::LookupBatchInternal(const KEY_T *keys,
+					VALUE_T *values,
+					ERROR_T *rcs,
+					const SIZE_T n)
+{
+  SIZE_T order[BTREE_BATCH_MAX];
+  SIZE_T node[BTREE_BATCH_MAX];
+  SIZE_T runblock[BTREE_BATCH_MAX];
+  SIZE_T ticket[BTREE_BATCH_MAX];
+  bool issued[BTREE_BATCH_MAX];
+  BTreeNode fetched[BTREE_BATCH_MAX];
+  SIZE_T active;
+  SIZE_T level;
+  SIZE_T runs;
+  SIZE_T run;
+  SIZE_T waited;
+  SIZE_T i;
+  SIZE_T j;
+  SIZE_T k;
+  SIZE_T offset=0;
+  BTreeNodeView view;
+  const BTreeNode *cur=&view.Get();
+  KEY_T testkey;
+  ERROR_T rc=ERROR_NOERROR;
+
+  for (i=0;i<n;i++) {
+    order[i]=i;
+    node[i]=superblock.info.rootnode;
+    rcs[i]=ERROR_NONEXISTENT;
+  }
+  sort(order,order+n,BatchKeyLess(keys));
+
+  for (active=n, level=0; active>0; active=j, level++) {
+    if (level==BTREE_MAX_DEPTH) {
+      return FailBatch(rcs,n,ERROR_INSANE);
+    }
+
+    // Find the distinct nodes this round needs, starting their reads
+    // if we can
+    for (i=0, runs=0; i<active && !rc; i++) {
+      k=order[i];
+      if (runs==0 || node[k]!=runblock[runs-1]) {
+	runblock[runs]=node[k];
+	issued[runs]=false;
+	if (aio && !mapped && runs<aio->GetDepth()) {
+	  numreads++;
+	  rc=aio->SubmitRead(node[k],fetched[runs],ticket[runs]);
+	  issued[runs]=!rc;
+	}
+	runs++;
+      }
+    }
+
+    // j counts the lookups that go on to the next round
+    for (i=0, j=0, run=0, waited=0; i<active && !rc; i++) {
+      k=order[i];
+      if (i==0 || node[k]!=runblock[run]) {
+	if (i>0) {
+	  run++;
+	}
+	waited=run+1;
+	if (issued[run]) {
+	  rc=aio->Wait(ticket[run]);
+	  cur=&fetched[run];
+	  BTREE_STAT(if (!rc) { stats.CountRead(cur->info.nodetype); });
+	} else {
+	  rc=ViewNode(node[k],view);
+	  cur=&view.Get();
+	}
+	if (rc) { break; }
+	offset=0;
+      }
+#ifdef __GNUC__
+      // The next lookup's key is caller memory we have not touched yet
+      if (i+1<active) {
+	__builtin_prefetch(keys[order[i+1]].data);
+      }
+#endif
+      switch (cur->info.nodetype) {
+      case BTREE_ROOT_NODE:
+      case BTREE_INTERIOR_NODE:
+	if (cur->info.numkeys==0) {
+	  // There are no keys at all on this node, so nowhere to go
+	  continue;
+	}
+	for (;offset<cur->info.numkeys;offset++) {
+	  rc=cur->GetKey(offset,testkey);
+	  if (rc || keys[k]<testkey || keys[k]==testkey) {
+	    break;
+	  }
+	}
+	if (rc) { break; }
+	rc=cur->GetPtr(offset,node[k]);
+	order[j++]=k;
+	break;
+      case BTREE_LEAF_NODE:
+	for (;offset<cur->info.numkeys;offset++) {
+	  rc=cur->GetKey(offset,testkey);
+	  if (rc || !(testkey<keys[k])) {
+	    break;
+	  }
+	}
+	if (rc) { break; }
+	if (offset<cur->info.numkeys && testkey==keys[k]) {
+	  rcs[k]=cur->GetVal(offset,values[k]);
+	}
+	break;
+      default:
+	// We can't be looking at anything other than a root, internal, or leaf
+	rcs[k]=ERROR_INSANE;
+	break;
+      }
+    }
+
+    if (rc) {
+      // Nothing may still be landing in fetched once we return
+      for (run=waited; run<runs; run++) {
+	if (issued[run]) {
+	  aio->Wait(ticket[run]);
+	}
+      }
+      return FailBatch(rcs,n,rc);
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+BTreeDisplayOptions::BTreeDisplayOptions() :
+  format(BTREE_KEYS_RAW), values(true), maxdepth(BTREE_MAX_DEPTH), maxnodes(0), maxkeys(0)
+{}
+
+
+static ERROR_T PrintNode(BTreeDisplayWriter &os, SIZE_T nodenum, const BTreeNode &b, BTreeDisplayType dt,
+			 const BTreeDisplayOptions &opt)
 {
-  KEY_T key;
-  VALUE_T value;
   SIZE_T ptr;
   SIZE_T offset;
+  SIZE_T shown;
   ERROR_T rc;
-  unsigned i;
+
+  shown= opt.maxkeys>0 && opt.maxkeys<b.info.numkeys ? opt.maxkeys : b.info.numkeys;
 
   if (dt==BTREE_DEPTH_DOT) {
-    os << nodenum << " [ label=\""<<nodenum<<": ";
+    os.PutNumber(nodenum);
+    os.Put(" [ label=\"");
+    os.PutNumber(nodenum);
+    os.Put(": ");
   } else if (dt==BTREE_DEPTH) {
-    os << nodenum << ": ";
+    os.PutNumber(nodenum);
+    os.Put(": ");
   } else {
   }
 
@@ -285,114 +1354,277 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
     } else {
       if (dt==BTREE_DEPTH_DOT) {
       } else {
-	os << "Interior: ";
+	os.Put("Interior: ");
       }
       for (offset=0;offset<=b.info.numkeys;offset++) {
+	if (offset==shown && shown<b.info.numkeys) {
+	  os.Put("... ");
+	  break;
+	}
 	rc=b.GetPtr(offset,ptr);
 	if (rc) { return rc; }
-	os << "*" << ptr << " ";
+	os.Put('*');
+	os.PutNumber(ptr);
+	os.Put(' ');
 	// Last pointer
 	if (offset==b.info.numkeys) break;
-	rc=b.GetKey(offset,key);
-	if (rc) {  return rc; }
-	for (i=0;i<b.info.keysize;i++) {
-	  os << key.data[i];
-	}
-	os << " ";
+	os.PutBytes(b.ResolveKey(offset),b.info.keysize,opt.format);
+	os.Put(' ');
       }
     }
     break;
   case BTREE_LEAF_NODE:
     if (dt==BTREE_DEPTH_DOT || dt==BTREE_SORTED_KEYVAL) {
     } else {
-      os << "Leaf: ";
+      os.Put("Leaf: ");
     }
-    for (offset=0;offset<b.info.numkeys;offset++) {
+    for (offset=0;offset<shown;offset++) {
       if (offset==0) {
 	// special case for first pointer
 	rc=b.GetPtr(offset,ptr);
 	if (rc) { return rc; }
 	if (dt!=BTREE_SORTED_KEYVAL) {
-	  os << "*" << ptr << " ";
+	  os.Put('*');
+	  os.PutNumber(ptr);
+	  os.Put(' ');
 	}
       }
       if (dt==BTREE_SORTED_KEYVAL) {
-	os << "(";
-      }
-      rc=b.GetKey(offset,key);
-      if (rc) {  return rc; }
-      for (i=0;i<b.info.keysize;i++) {
-	os << key.data[i];
-      }
-      if (dt==BTREE_SORTED_KEYVAL) {
-	os << ",";
-      } else {
-	os << " ";
+	os.Put('(');
       }
-      rc=b.GetVal(offset,value);
-      if (rc) {  return rc; }
-      for (i=0;i<b.info.valuesize;i++) {
-	os << value.data[i];
+      os.PutBytes(b.ResolveKey(offset),b.info.keysize,opt.format);
+      if (opt.values) {
+	if (dt==BTREE_SORTED_KEYVAL) {
+	  os.Put(',');
+	} else {
+	  os.Put(' ');
+	}
+	os.PutBytes(b.ResolveVal(offset),b.info.valuesize,opt.format);
       }
       if (dt==BTREE_SORTED_KEYVAL) {
-	os << ")\n";
+	os.Put(")\n");
       } else {
-	os << " ";
+	os.Put(' ');
       }
     }
+    if (shown<b.info.numkeys && dt!=BTREE_SORTED_KEYVAL) {
+      os.Put("... ");
+    }
     break;
   default:
     if (dt==BTREE_DEPTH_DOT) {
-      os << "Unknown("<<b.info.nodetype<<")";
+      os.Put("Unknown(");
+      os.PutNumber(b.info.nodetype);
+      os.Put(')');
     } else {
-      os << "Unsupported Node Type " << b.info.nodetype ;
+      os.Put("Unsupported Node Type ");
+      os.PutNumber(b.info.nodetype);
     }
   }
   if (dt==BTREE_DEPTH_DOT) {
-    os << "\" ]";
+    os.Put("\" ]");
   }
   return ERROR_NOERROR;
 }
 
-ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
-{
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
-}
 
-ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+// One element of BTREE_JSON's array of nodes
+static ERROR_T PrintNodeJSON(BTreeDisplayWriter &os, const BTreeWalk &walk, const BTreeDisplayOptions &opt)
 {
-  // WRITE ME
-  if(key.length != superblock.info.keysize || value.length != superblock.info.valuesize){
-    return ERROR_SIZE;
-  }
-
-
-  BTreeNode originalRoot;
-  ERROR_T rc;
-  SIZE_T offset;
+  const BTreeNode &b=walk.GetNode();
   SIZE_T ptr;
-  KEY_T testkey;
-  KEY_T newKey = key;
-  VALUE_T newValue = value;
+  SIZE_T offset;
+  SIZE_T shown;
+  ERROR_T rc;
 
-  rc = originalRoot.Unserialize(buffercache, superblock.info.rootnode);
-  if(rc){
-    return rc;
-  }
+  shown= opt.maxkeys>0 && opt.maxkeys<b.info.numkeys ? opt.maxkeys : b.info.numkeys;
 
+  os.Put("{\"block\":");
+  os.PutNumber(walk.GetBlock());
+  os.Put(",\"parent\":");
+  if (walk.GetDepth()>0) {
+    os.PutNumber(walk.GetParent());
+  } else {
+    os.Put("null");
+  }
+  os.Put(",\"depth\":");
+  os.PutNumber(walk.GetDepth());
+  os.Put(",\"type\":");
+  switch (b.info.nodetype) {
+  case BTREE_ROOT_NODE:
+    os.Put("\"root\"");
+    break;
+  case BTREE_INTERIOR_NODE:
+    os.Put("\"interior\"");
+    break;
+  case BTREE_LEAF_NODE:
+    os.Put("\"leaf\"");
+    break;
+  default:
+    os.Put("\"unknown\",\"nodetype\":");
+    os.PutNumber(b.info.nodetype);
+    os.Put('}');
+    return ERROR_INSANE;
+  }
+  os.Put(",\"numkeys\":");
+  os.PutNumber(b.info.numkeys);
 
-    if(Lookup(newKey, newValue)!=ERROR_NONEXISTENT){
-      return ERROR_CONFLICT;
+  os.Put(",\"keys\":[");
+  for (offset=0;offset<shown;offset++) {
+    if (offset>0) {
+      os.Put(',');
+    }
+    os.PutBytes(b.ResolveKey(offset),b.info.keysize,opt.format,true);
+  }
+  os.Put(']');
+
+  if (b.info.nodetype==BTREE_LEAF_NODE) {
+    if (opt.values) {
+      os.Put(",\"values\":[");
+      for (offset=0;offset<shown;offset++) {
+	if (offset>0) {
+	  os.Put(',');
+	}
+	os.PutBytes(b.ResolveVal(offset),b.info.valuesize,opt.format,true);
+      }
+      os.Put(']');
+    }
+  } else {
+    os.Put(",\"children\":[");
+    for (offset=0; b.info.numkeys>0 && offset<=b.info.numkeys; offset++) {
+      rc=b.GetPtr(offset,ptr);
+      if (rc) { return rc; }
+      if (offset>0) {
+	os.Put(',');
+      }
+      os.PutNumber(ptr);
     }
+    os.Put(']');
+  }
+  os.Put('}');
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+{
+  ERROR_T rc;
+  BTREE_STAT(BTreeStatTime start=BTreeStatNow());
+
+  if (trace) {
+    trace->Record(BTREE_TRACE_LOOKUP,key,0);
+  }
+  rc=LookupOrUpdateInternal(BTREE_OP_LOOKUP, key, value);
+  BTREE_STAT(stats.CountOp(BTREE_STAT_LOOKUP,rc,start));
+  return rc;
+}
+
+ERROR_T BTreeIndex::Scan(const KEY_T &low, const SIZE_T max, vector<KeyValuePair> &out)
+{
+  ERROR_T rc;
+  BTREE_STAT(BTreeStatTime start=BTreeStatNow());
+
+  if (trace) {
+    trace->Record(BTREE_TRACE_SCAN,low,max);
+  }
+  rc=ScanInternal(low,max,out);
+  BTREE_STAT(stats.CountOp(BTREE_STAT_SCAN,rc,start));
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::ScanInternal(const KEY_T &low, const SIZE_T max, vector<KeyValuePair> &out)
+{
+  BTreePath path;
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T slot;
+  KeyValuePair kv;
+
+  out.clear();
+
+  rc=Descend(low,path,b);
+  if (rc==ERROR_NONEXISTENT && path.depth==1) {
+    // Nothing in the index at all
+    return ERROR_NOERROR;
+  }
+  if (rc) { return rc; }
+
+  slot=path.entry[path.depth-1].slot;
+  while (out.size()<max) {
+    if (slot>=b.info.numkeys) {
+      rc=NextLeaf(path,b);
+      if (rc==ERROR_NONEXISTENT) {
+	break;
+      }
+      if (rc) { return rc; }
+      slot=0;
+      continue;
+    }
+    rc=b.GetKey(slot,kv.key);
+    if (rc) { return rc; }
+    rc=b.GetVal(slot,kv.value);
+    if (rc) { return rc; }
+    out.push_back(kv);
+    slot++;
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
+  BTREE_STAT(BTreeStatTime start=BTreeStatNow());
+
+  if (trace) {
+    trace->Record(BTREE_TRACE_INSERT,key,value.length);
+  }
+  rc=InsertInternal(key,value);
+  BTREE_STAT(stats.CountOp(BTREE_STAT_INSERT,rc,start));
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::Upsert(const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
+  bool replaced=false;
+  BTREE_STAT(BTreeStatTime start=BTreeStatNow());
+
+  rc=InsertInternal(key,value,&replaced);
+  if (trace) {
+    trace->Record(replaced ? BTREE_TRACE_UPDATE : BTREE_TRACE_INSERT,key,value.length);
+  }
+  BTREE_STAT(stats.CountOp(BTREE_STAT_UPSERT,rc,start));
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::InsertInternal(const KEY_T &key, const VALUE_T &value, bool *replaced)
+{
+  // WRITE ME
+  if(key.length != superblock.info.keysize || value.length != superblock.info.valuesize){
+    return ERROR_SIZE;
+  }
+
+  BTreePath path;
+  BTreeNodeView views[2];
+  const BTreeNode *found;
+  BTreeNode &b = ScratchNode();
+  ERROR_T rc;
+  BorrowedKey testkey;
+
+  rc = Descend(key, path, views, found);
+  if(rc == ERROR_NOERROR || (rc == ERROR_NONEXISTENT && path.depth == 1)){
+    views[(path.depth-1)%2].MoveTo(b);
+  }
 
   //Root is empty? Create left leaf with inserted val and right leaf for future use
-  if(originalRoot.info.numkeys == 0){
+  if(rc == ERROR_NONEXISTENT && path.depth == 1){
+    BTreeNode &originalRoot = b;
     BTreeNode newleaf(BTREE_LEAF_NODE,
         superblock.info.keysize,
         superblock.info.valuesize,
-        buffercache->GetBlockSize());
-
-
+        GetLeafSize());
 
     newleaf.info.rootnode = superblock_index + 1;
     newleaf.info.numkeys = 0;
@@ -407,928 +1639,2470 @@ ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
       return rc;
     }
     //empty right leaf
-    rc = newleaf.Serialize(buffercache, rightNode);
+    rc = WriteNode(rightNode, newleaf);
     if (rc) {return rc;}
     //now populate left leaf
     newleaf.info.numkeys = 1;
-    rc = newleaf.SetKey(0, newKey);
+    rc = newleaf.SetKey(0, key);
     if (rc) {return rc;}
-    rc = newleaf.SetVal(0, newValue);
+    rc = newleaf.SetVal(0, value);
     if (rc) {return rc;}
-    rc = newleaf.Serialize(buffercache, leftNode);
+    rc = WriteNode(leftNode, newleaf);
     if (rc) {return rc;}
     //now change root
     //So left node takes in keys/values less than OR EQUAL to current key
     originalRoot.info.numkeys = 1;
-    rc = originalRoot.SetKey(0, newKey);
+    rc = originalRoot.SetKey(0, key);
     if (rc) {return rc;}
     rc = originalRoot.SetPtr(0, leftNode);
     if (rc) {return rc;}
     rc = originalRoot.SetPtr(1, rightNode);
     if (rc) {return rc;}
-    rc = originalRoot.Serialize(buffercache, superblock.info.rootnode);
+    rc = WriteNode(superblock.info.rootnode, originalRoot);
     if (rc) {return rc;}
     return 0;
   }
-  //Else: btree already exists: Must recurse through tree, find leaf to place value and see if splits are needed
-  bool didsplit = false;
-  SIZE_T left = 0;
-  SIZE_T right = 0;
-  rc = recurse(superblock.info.rootnode, newKey, newValue, didsplit, left, right);
+  if(rc){
+    return rc;
+  }
 
-  return rc;
+  //Else: btree already exists. The descent found the leaf and the slot the
+  //key belongs in, so a match there is a conflict
+  const BTreePathEntry &leaf = path.entry[path.depth-1];
+  if(leaf.slot < b.info.numkeys){
+    if(testkey.At(b.ResolveKey(leaf.slot), b.info.keysize) == key){
+      if(!replaced){
+        return ERROR_CONFLICT;
+      }
+      //upsert: the leaf is already in hand, so just replace the value
+      *replaced = true;
+      rc = b.SetVal(leaf.slot, value);
+      if (rc) {return rc;}
+      bool split;
+      rc = RewriteLeaf(path, b, leaf.slot, split);
+      if (rc) {return rc;}
+      NoteChange(path);
+      return ERROR_NOERROR;
+    }
+  }
 
+  rc = InsertAlongPath(path, b, key, value);
+  if (rc) { return rc; }
+  NoteInsert(path);
+  return ERROR_NOERROR;
 }
 
-ERROR_T BTreeIndex::Interior_Split(SIZE_T &node, KEY_T &key, SIZE_T &left, SIZE_T &right){
-
-     BTreeNode b;
-     ERROR_T rc;
-     SIZE_T offset;
-     KEY_T currKey;
-     // SIZE_T currPtr;
-     KEY_T oldKey;
-     VALUE_T oldValue;
-     SIZE_T oldPtr;
-     SIZE_T target;
-
-     rc = b.Unserialize(buffercache, node);
-
-     // Initialize our new node that we want to insert
-     BTreeNode newNode = b;
-
-     // Find where we need to split, create the new right node and allocate it
-     SIZE_T splitLoc = b.info.numkeys / 2;
-     SIZE_T newRightNode;
-     rc = AllocateNode(newRightNode);
-     if (rc) { return rc; }
-     b.GetKey(splitLoc, oldKey);
-
-     // runs if statement if we want to put it inside the left node
-     if (key < oldKey) {
-       newNode.info.numkeys = b.info.numkeys - splitLoc;
-       for (offset = splitLoc; offset < b.info.numkeys; offset++) {
-         // Transfer the Key
-         rc = b.GetKey(offset, oldKey);
-         if (rc) { return rc; }
-         rc = newNode.SetKey((offset-splitLoc), oldKey);
-         if (rc) { return rc; }
-         // Transfer the Ptr
-         rc = b.GetPtr(offset, oldPtr);
-         if (rc) { return rc; }
-         rc = newNode.SetPtr((offset-splitLoc), oldPtr);
-         if (rc) { return rc; }
-         // update the next Ptr
-         rc = b.GetPtr(offset+1, oldPtr);
-         if (rc) { return rc; }
-         rc = newNode.SetPtr((offset-splitLoc+1), oldPtr);
-         if (rc) { return rc; }
-       }
-       // Insert the new right node
-       rc = newNode.Serialize(buffercache, newRightNode);
-       if (rc) { return rc; }
-       b.info.numkeys = splitLoc;
-
-       // Now we want to add the promoted node from below into the new split
-       for (offset = 0; offset < b.info.numkeys; offset++) {
-         rc = b.GetKey(offset, currKey);
-         if (rc) { return rc; }
-         if (key < currKey) {
-           break;
-         }
-       }
-
-       // Now offset is the loc where we want to insert the key,
-       // but we need to shift everything after the target location
-       target = offset;
-       b.info.numkeys += 1;
-
-       for (offset = b.info.numkeys-1; offset > target; offset--) {
-         // Shift the key
-         rc = b.GetKey(offset-1, oldKey);
-         if (rc) { return rc; }
-         rc = b.SetKey(offset, oldKey);
-         if (rc) { return rc; }
-         // Shift the ptr
-         rc = b.GetPtr(offset, oldPtr);
-         if (rc) { return rc; }
-         rc = b.SetPtr(offset+1, oldPtr);
-         if (rc) { return rc; }
-         rc = b.GetPtr(offset-1, oldPtr);
-         if (rc) { return rc; }
-         rc = b.SetPtr(offset, oldPtr);
-         if (rc) { return rc; }
-       }
-       // Now that everything after is shifted, insert the new key
-       rc = b.SetKey(target, key);
-       if (rc) { return rc; }
-       rc = b.SetPtr(target+1, right);
-       if (rc) { return rc; }
-       rc = b.SetPtr(target, left);
-       if (rc) { return rc; }
-
-       // We need to account for edge case where inserted key is largest key
-       // in the left node
-       KEY_T insertKey;
-       rc = b.GetKey(b.info.numkeys-1, insertKey);
-       if (rc) { return rc; }
-       if (insertKey == key) {
-         b.SetPtr(b.info.numkeys-1, left);
-         newNode.SetPtr(0, right);
-         newNode.Serialize(buffercache, newRightNode);
-       }
-       b.GetKey(b.info.numkeys-1, key);
-       left = node;
-       right = newRightNode;
-       b.info.numkeys--;
-       return b.Serialize(buffercache, node);
-     } else { // new key should be in the right after the split
-       newNode.info.numkeys = b.info.numkeys - splitLoc - 1;
-       SIZE_T temp = splitLoc + 1;
-       // write the new left node since it's the same
-       for (offset = splitLoc+1; offset < b.info.numkeys; offset++) {
-         rc = b.GetKey(offset, oldKey);
-         if (rc) { return rc; }
-         rc = newNode.SetKey((offset-temp), oldKey);
-         if (rc) { return rc; }
-         rc = b.GetPtr(offset, oldPtr);
-         if (rc) { return rc; }
-         rc = newNode.SetPtr((offset-temp), oldPtr);
-         if (rc) { return rc; }
-         rc = b.GetPtr((offset+1), oldPtr);
-         if (rc) { return rc; }
-         rc = newNode.SetPtr((offset-splitLoc), oldPtr);
-         if (rc) { return rc; }
-       }
-       b.info.numkeys = splitLoc + 1;
-
-       // now insert the key into the newNode
-       for (offset = 0; offset < newNode.info.numkeys; offset++) {
-         rc = newNode.GetKey(offset, currKey);
-         if (rc) { return rc; }
-         if (key < currKey) {
-           break; // we've found where we want to insert it
-         }
-       }
-       newNode.info.numkeys++;
-       target = offset;
-
-       // Like before, we now have to shift everything after it
-       for (offset = newNode.info.numkeys-1; offset > target; offset--) {
-         rc = newNode.GetKey(offset-1, oldKey);
-         if (rc) { return rc; }
-         rc = newNode.SetKey(offset, oldKey);
-         if (rc) { return rc; }
-         rc = newNode.GetPtr(offset, oldPtr);
-         if (rc) { return rc; }
-         rc = newNode.SetPtr(offset+1, oldPtr);
-         if (rc) { return rc; }
-         rc = newNode.GetPtr(offset-1, oldPtr);
-         if (rc) { return rc; }
-         rc = newNode.SetPtr(offset, oldPtr);
-         if (rc) { return rc; }
-       }
-       // Now that everything is properly shifted, insert the new node
-       rc = newNode.SetKey(target, key);
-       if (rc) { return rc; }
-       rc = newNode.SetPtr(target, left);
-       if (rc) { return rc; }
-       rc = newNode.SetPtr(target+1, right);
-       if (rc) { return rc; }
-
-       rc = b.GetKey(b.info.numkeys-1, key);
-       if (rc) { return rc; }
-       b.info.numkeys--;
-       rc = b.Serialize(buffercache, node);
-       if (rc) { return rc; }
-       right = newRightNode;
-       left = node;
-       return newNode.Serialize(buffercache, newRightNode);
-    }
-}
-
-
-ERROR_T BTreeIndex::Interior_No_Split(SIZE_T &node, KEY_T &key, SIZE_T &left, SIZE_T &right) {
-  BTreeNode b;
+ERROR_T BTreeIndex::InsertAlongPath(const BTreePath &path, BTreeNode &b, const KEY_T &key, const VALUE_T &value)
+{
   ERROR_T rc;
-  SIZE_T offset;
-  KEY_T currKey;
-  KEY_T oldKey;
-  SIZE_T oldPtr;
-  SIZE_T target;
-  rc = b.Unserialize(buffercache, node);
-
-  // Set offset to correct location in block
-  for (offset=0; offset<b.info.numkeys; offset++) {
-    rc = b.GetKey(offset, currKey);
-    if (rc) {return rc;}
-    if (key < currKey) {
-      break;
-    }
-  }
-  target = offset;
-  // Move key/ptr pairs over in block
-  b.info.numkeys += 1;
-  for (offset=b.info.numkeys-1; offset>target; offset--) {
-    rc = b.GetKey(offset-1, oldKey);
-    if (rc) {return rc;}
-    rc = b.SetKey(offset, oldKey);
-    if (rc) {return rc;}
-    rc = b.GetPtr(offset, oldPtr);
-    if (rc) {return rc;}
-    rc = b.SetPtr(offset+1, oldPtr);
-    if (rc) {return rc;}
-    rc = b.GetPtr(offset-1, oldPtr);
-    if (rc) {return rc;}
-    rc = b.SetPtr(offset, oldPtr);
+  SIZE_T level = path.depth - 1;
+  KEY_T splitKey;
+  SIZE_T right;
+
+  //leaf not full
+  if(b.info.numkeys < b.info.GetNumSlotsAsLeaf()){
+    rc = Leaf_No_Split(b, path.entry[level], key, value);
+    if (rc != ERROR_SIZE || !codec) {return rc;}
+    //it had a slot free but no longer compresses into a block, so take
+    //the pair back out and split after all
+    rc = BTreeShiftSlots(b, path.entry[level].slot + 1, path.entry[level].slot);
     if (rc) {return rc;}
   }
-  // Insert key into block
-  rc = b.SetKey(target, key);
-  if (rc) {return rc;}
-  rc = b.SetPtr(target, left);
-  if (rc) {return rc;}
-  rc = b.SetPtr(target+1, right);
-  if (rc) {return rc;}
-  return b.Serialize(buffercache, node);
-}
-
-ERROR_T BTreeIndex::Root_Split(SIZE_T &node, KEY_T &key, SIZE_T &left, SIZE_T &right) {
-  BTreeNode b;
-  ERROR_T rc;
-  SIZE_T offset;
-  KEY_T currKey;
-  KEY_T oldKey;
-  SIZE_T oldPtr;
-  SIZE_T target;
-  rc = b.Unserialize(buffercache, node);
-
-  // Create new root node, initialized to old root values
-  BTreeNode root = b;
-  // Create new interior node
-  b.info.nodetype = BTREE_INTERIOR_NODE;
-  BTreeNode newNode = b;
 
-  // Get middle of old root, to be split into left and right
-  SIZE_T midpoint = b.info.numkeys/2;
-  SIZE_T newLeft;
-  SIZE_T newRight;
-  rc = AllocateNode(newLeft);
-  if (rc) {return rc;}
-  rc = AllocateNode(newRight);
+  //leaf node is full, have to do a split. splitKey/right carry what the
+  //parent has to take in, and keep carrying it up while parents are full
+  splitKey = key;
+  rc = Leaf_Split(b, path.entry[level], splitKey, value, right);
   if (rc) {return rc;}
 
-  // Find whether to put new key in left or right
-  b.GetKey(midpoint, oldKey);
-
-  // Case 1: Key less than oldKey; key goes in left
-  if (key < oldKey) {
-    newNode.info.numkeys = b.info.numkeys - midpoint;
-    // Set up right node: last half of original
-    for (offset = midpoint; offset<b.info.numkeys; offset++) {
-      rc = b.GetKey(offset, oldKey);
-      if (rc) {return rc;}
-      rc = newNode.SetKey(offset-midpoint, oldKey);
-      if (rc) {return rc;}
-      rc = b.GetPtr(offset, oldPtr);
-      if (rc) {return rc;}
-      rc = newNode.SetPtr(offset-midpoint, oldPtr);
-      if (rc) {return rc;}
-      rc = b.GetPtr(offset+1, oldPtr);
-      if (rc) {return rc;}
-      rc = newNode.SetPtr(offset-midpoint+1, oldPtr);
-      if (rc) {return rc;}
-    }
-    rc = newNode.Serialize(buffercache, newRight);
-    if (rc) {return rc;}
-
-    // Set up left node: first half of original + promoted key
-    newNode.info.numkeys = midpoint;
-    // Find location in node to insert key
-    for (offset=0; offset<newNode.info.numkeys; offset++) {
-      rc = b.GetKey(offset, currKey);
-      if (rc) {return rc;}
-      if (key < currKey) {
-        break;
-      }
-    }
-    target = offset;
-    b.info.numkeys += 1;
-    for (offset=b.info.numkeys-1; offset>target; offset--) {
-      rc = b.GetKey(offset-1, oldKey);
-      if (rc) {return rc;}
-      rc = b.SetKey(offset, oldKey);
-      if (rc) {return rc;}
-      rc = b.GetPtr(offset, oldPtr);
-      if (rc) {return rc;}
-      rc = b.SetPtr(offset+1, oldPtr);
-      if (rc) {return rc;}
-      rc = b.GetPtr(offset-1, oldPtr);
-      if (rc) {return rc;}
-      rc = b.SetPtr(offset, oldPtr);
-      if (rc) {return rc;}
-    }
-    // Insert promoted key
-    rc = b.SetKey(target, key);
-    if (rc) {return rc;}
-    rc = b.SetPtr(target, left);
-    if (rc) {return rc;}
-    rc = b.SetPtr(target+1, right);
-    if (rc) {return rc;}
-    // Special case: if promoted key is largest in left node (becoming root)
-    KEY_T check;
-    b.GetKey(b.info.numkeys-1, check);
-    if (key == check) {
-      newNode.SetPtr(0, right);
-      newNode.Serialize(buffercache, newRight);
-      b.SetPtr(b.info.numkeys-1, left);
-    }
-
-    // Set up new root with key to be promoted
-    KEY_T rootkey;
-    b.GetKey(b.info.numkeys-1, rootkey);
-    b.info.numkeys -= 1;
-    rc = b.Serialize(buffercache, newLeft);
+  while(level > 0){
+    level--;
+    const BTreePathEntry &e = path.entry[level];
+    rc = ReadNode(e.block, b);
     if (rc) {return rc;}
-    root.info.numkeys = 1;
-    root.SetKey(0, rootkey);
-    root.SetPtr(0, newLeft);
-    root.SetPtr(1, newRight);
-    return root.Serialize(buffercache, superblock.info.rootnode);
-  }
-
-  // Case 2: Key goes in right node
-  else {
-    // Set up right node
-    // Move key/ptr pairs over
-    newNode.info.numkeys = b.info.numkeys - midpoint - 1;
-    for (offset=midpoint+1; offset<b.info.numkeys; offset++) {
-      rc = b.GetKey(offset, oldKey);
-      if (rc) {return rc;}
-      rc = newNode.SetKey(offset-midpoint-1, oldKey);
-      if (rc) {return rc;}
-      rc = b.GetPtr(offset, oldPtr);
-      if (rc) {return rc;}
-      rc = newNode.SetPtr(offset-midpoint-1, oldPtr);
-      if (rc) {return rc;}
-      rc = b.GetPtr(offset+1, oldPtr);
-      if (rc) {return rc;}
-      rc = newNode.SetPtr(offset-midpoint, oldPtr);
-      if (rc) {return rc;}
-    }
-    // Find location in node to insert key
-    for (offset=0; offset<newNode.info.numkeys; offset++) {
-      rc = newNode.GetKey(offset, currKey);
-      if (rc) {return rc;}
-      if (key < currKey) {
-        break;
-      }
+    if(b.info.numkeys < b.info.GetNumSlotsAsInterior()){ //node is not full
+      return Interior_No_Split(b, e, splitKey, right);
     }
-    target = offset;
-    // Update node, shift to make room for inserted key
-    newNode.info.numkeys += 1;
-    for (offset=newNode.info.numkeys-1; offset>target; offset--) {
-      rc = newNode.GetKey(offset-1, oldKey);
-      if (rc) {return rc;}
-      rc = newNode.SetKey(offset, oldKey);
-      if (rc) {return rc;}
-      rc = newNode.GetPtr(offset, oldPtr);
-      if (rc) {return rc;}
-      rc = newNode.SetPtr(offset+1, oldPtr);
-      if (rc) {return rc;}
-      rc = newNode.GetPtr(offset-1, oldPtr);
-      if (rc) {return rc;}
-      rc = newNode.SetPtr(offset, oldPtr);
-      if (rc) {return rc;}
+    if(b.info.nodetype == BTREE_ROOT_NODE){ //root is full, must split root
+      return Root_Split(b, e, splitKey, right);
     }
-    // Insert key
-    rc = newNode.SetKey(target, key);
-    rc = newNode.SetPtr(target+1, right);
-    if (rc) {return rc;}
-    rc = newNode.SetPtr(target, left);
+    //must split interior node as well, and go round again for the parent
+    rc = Interior_Split(b, e, splitKey, right);
     if (rc) {return rc;}
-    // Serialize right node
-    rc = newNode.Serialize(buffercache, newRight);
-    if (rc) {return rc;}
-
-    // Set up left node: first half of original node
-    b.info.numkeys = midpoint + 1;
-    // Get key to promote
-    KEY_T rootkey;
-    b.GetKey(b.info.numkeys-1, rootkey);
-    b.info.numkeys -= 1;
-    rc = b.Serialize(buffercache, newLeft);
-
-    // Update root
-    root.info.numkeys = 1;
-    root.SetKey(0, rootkey);
-    root.SetPtr(0, newLeft);
-    root.SetPtr(1, newRight);
-    return root.Serialize(buffercache, superblock.info.rootnode);
   }
+  //Only the root can end the climb
   return ERROR_INSANE;
 }
 
-ERROR_T BTreeIndex::recurse(SIZE_T &node, KEY_T &key, VALUE_T &value, bool &split, SIZE_T &left, SIZE_T &right){
-  BTreeNode b;
-  ERROR_T rc;
-  SIZE_T offset;
-  SIZE_T currPtr;
-  SIZE_T oldPtr;
-  KEY_T currKey;
-  KEY_T oldKey;
-  VALUE_T oldValue;
-  SIZE_T insertIndex;
-
-  bool found = false;
-  SIZE_T paramNode = node;
-  SIZE_T paramLeft = left;
-  SIZE_T paramRight = right;
-  KEY_T paramKey = key;
-
-
-
-  rc = b.Unserialize(buffercache,node);
-  if(rc!=ERROR_NOERROR){
-    return rc;
-  }
-  switch(b.info.nodetype){
-    case BTREE_ROOT_NODE:
-    case BTREE_INTERIOR_NODE:
-    if(b.info.numkeys <= 0){
-      return ERROR_INSANE;
-    }
-    for(offset = 0; offset<b.info.numkeys;offset++){
-      rc = b.GetKey(offset, currKey);
-      if(rc){
-        return rc;
-      }
-      if(key < currKey || currKey == key){
-        rc=b.GetPtr(offset, currPtr);
-        if(rc){
-          return rc;
-        }
-        rc = recurse(currPtr, key, value, split, left, right);
-        if(rc){
-          return rc;
-        }
-        found = true;
-        break;
-
-      }
-    }//end of iterating through keys at currentnode
-    //Examine last pointer in case appropriate key not found. Because last choice, must take it
-    if(found == false){
-      rc = b.GetPtr(b.info.numkeys, currPtr);
-      if(rc){
-        return rc;
-      }
-      rc = recurse(currPtr, key, value, split, left, right);
-      if(rc){
-        return rc;
-      }
-    }
-    //After recursing, split = 0 or 1
-    //check here for split, otherwise just add key/val and done SPLIT?
-    if(split){
-      //do stuff
-      //Cases: interior node dealing with leaf split
-      //interior node deals with leaf split and then must split itself as well
-      //root node must split because interior node split
-      //root node deals with interior split but is not full
-
-      //set split = 0 when split does not happen: means we can stop. New splits can cause more splits, however.
-      //if currently looking at int node after a split
-      if(b.info.nodetype == BTREE_INTERIOR_NODE){
-        if(b.info.numkeys < b.info.GetNumSlotsAsLeaf()){ //if interior node is not full
-          paramNode = node;
-          paramKey = key;
-          paramLeft = left;
-          paramRight = right;
-          rc = Interior_No_Split(paramNode, paramKey, paramLeft, paramRight);
-          node = paramNode;
-          key = paramKey;
-          left = paramLeft;
-          right = paramRight;
-          //Interior_No_Split
-          //Interior_Split
-          //Root_Split
-          split = 0;
-          return rc;
-        }
-        else{ //must split interior node as well
-          paramNode = node;
-          paramKey = key;
-          paramLeft = left;
-          paramRight = right;
-          rc = Interior_Split(paramNode, paramKey, paramLeft, paramRight);
-          node = paramNode;
-          key = paramKey;
-          left = paramLeft;
-          right = paramRight;
-          split = 1;
-          return rc;
-        }
-      }
-      else{ //Looking at root node immediately after splitting something
-        if(b.info.numkeys < b.info.GetNumSlotsAsLeaf()){ //root is not full
-          paramNode = node;
-          paramKey = key;
-          paramLeft = left;
-          paramRight = right;
-          rc = Interior_No_Split(paramNode, paramKey, paramLeft, paramRight);
-          node = paramNode;
-          key = paramKey;
-          left = paramLeft;
-          right = paramRight;
-          split = 0;
-          return rc;
-        }
-        else{ //root is full, must split root.
-          paramNode = node;
-          paramKey = key;
-          paramLeft = left;
-          paramRight = right;
-          rc = Root_Split(paramNode, paramKey, paramLeft, paramRight);
-          split = 0; //Root was split, but no function call to handle so no point in setting to 1
-          return rc;
-        }
-      }
-    }
-    else{
-      return rc;
-    }
-    break;
-
-    case BTREE_LEAF_NODE:
-    //leaf not full
-    if(b.info.numkeys < b.info.GetNumSlotsAsLeaf()){
-      for(offset = 0; offset<b.info.numkeys; offset++){
-        rc = b.GetKey(offset, currKey);
-        if(rc){
-          return rc;
-        }
-        if(key < currKey){ //we found the first key node that our insert key is greater than
-          break;
-        }
-      }
-      insertIndex = offset;
-      b.info.numkeys = b.info.numkeys + 1;
-      for(offset = b.info.numkeys - 1; offset > insertIndex; offset--){
-        rc = b.GetKey(offset-1,oldKey); //oldKey holding value for now to move it later
-        if(rc){
-          return rc;
-        }
-        rc = b.GetVal(offset - 1, oldValue);
-        if(rc){
-          return rc;
-        }
-        rc = b.SetKey(offset, oldKey);
-        if(rc){
-          return rc;
-        }
-        rc = b.SetVal(offset, oldValue);
-        if(rc){
-          return rc;
-        }
-      }
-      rc = b.SetVal(insertIndex, value); //insert value
-      if(rc){
-        return rc;
-      }
-      rc = b.SetKey(insertIndex, key); //insert key
-      if(rc){
-        return rc;
-      }
-      return b.Serialize(buffercache, node);
-      break;
-    }
-    else{ //leaf node is full, have to do a split
-      split = 1; //Telling previous level about split, so can add key to previous level
-      left = node; //current node becomes location of left pointer (original)
-      rc = AllocateNode(right); //right is new node
-      if(rc){
-        return rc;
-      }
-      BTreeNode newNode = b;
-      SIZE_T mid = b.info.numkeys / 2;
-      rc = b.GetKey(mid, oldKey); //key value at middle, see if new key is before or after
-      if(rc){return rc;}
-      if(key < oldKey){ //before
-        newNode.info.numkeys = b.info.numkeys - mid;
-        for(offset = mid; offset < b.info.numkeys; offset++){ //create right node and serialize
-          rc = b.GetKey(offset, oldKey);
-          if(rc){
-            return rc;
-          }
-          rc = b.GetVal(offset, oldValue);
-          if(rc){
-            return rc;
-          }
-          rc = newNode.SetKey(offset - mid, oldKey); //offset - mid to give starting indices of new node
-          if(rc){
-            return rc;
-          }
-          rc = newNode.SetVal(offset - mid, oldValue);
-          if(rc){
-            return rc;
-          }
-        }
-        rc = newNode.Serialize(buffercache, right);
-        if(rc){
-          return rc;
-        }
-        //Now insert into left half
-        b.info.numkeys = mid; //numkeys cut down
-        for(offset = 0; offset < b.info.numkeys; offset++){
-          rc = b.GetKey(offset, currKey);
-          if(rc){
-            return rc;
-          }
-          if(key < currKey){ //found first key greater than insert key
-            break;
-          }
-        }
-        insertIndex = offset;
-        b.info.numkeys++; //adding another key
-        for(offset = b.info.numkeys - 1; offset > insertIndex; offset--){//copy elements forward
-          rc = b.GetKey(offset-1, oldKey);
-          if(rc){
-            return rc;
-          }
-          rc = b.GetVal(offset-1, oldValue);
-          if(rc){
-            return rc;
-          }
-          rc = b.SetKey(offset, oldKey);
-          if(rc){
-            return rc;
-          }
-          rc = b.SetVal(offset, oldValue);
-          if(rc){
-            return rc;
-          }
-        }
-        rc = b.SetVal(insertIndex, value);
-        if(rc){
-          return rc;
-        }
-        rc = b.SetKey(insertIndex, key);
-        if(rc){
-          return rc;
-        }
-        b.GetKey(b.info.numkeys - 1, key); //modify global key because inserted orignal value, not needed anymore
-        return b.Serialize(buffercache,left);
-      }
-      else{//2nd half
-        newNode.info.numkeys = b.info.numkeys - mid - 1;
-        for(offset = mid + 1; offset < b.info.numkeys; offset++){ //copy right half to right node
-          rc = b.GetKey(offset, oldKey);
-          if(rc){
-            return rc;
-          }
-          rc = b.GetVal(offset, oldValue);
-          if(rc){
-            return rc;
-          }
-          rc = newNode.SetKey(offset - mid - 1, oldKey);
-          if(rc){
-            return rc;
-          }
-          rc = newNode.SetVal(offset - mid - 1, oldValue);
-          if(rc){
-            return rc;
-          }
-        }
-        b.info.numkeys = mid + 1; //restrict left side keys to split
-        rc = b.Serialize(buffercache, left);
-        if(rc){
-          return rc;
-        }//now insert into right node
-        for(offset = 0; offset < newNode.info.numkeys;offset++){
-          rc = newNode.GetKey(offset, currKey);
-          if(rc){
-            return rc;
-          }
-          if(key < currKey){
-            break;
-          }
-        }
-        insertIndex = offset;
-        newNode.info.numkeys += 1; //adding new key
-        for(offset = newNode.info.numkeys - 1; offset > insertIndex; offset--){
-          rc = newNode.GetKey(offset-1, oldKey);
-          if(rc){
-            return rc;
-          }
-          rc = newNode.GetVal(offset-1, oldValue);
-          if(rc){
-            return rc;
-          }
-          rc = newNode.SetKey(offset, oldKey);
-          if(rc){
-            return rc;
-          }
-          rc = newNode.SetVal(offset, oldValue);
-          if(rc){
-            return rc;
-          }
-        }
-        rc = newNode.SetVal(insertIndex, value);
-        if(rc){
-          return rc;
-        }
-        rc = newNode.SetKey(insertIndex, key);
-        if(rc){
-
-
-
-
-          return rc;
-        }
-        b.GetKey(b.info.numkeys-1, key); //changing key to greatest val in left
-        return newNode.Serialize(buffercache, right);
-
-      }
-    }
-    default:
-    return ERROR_INSANE;
-    break;
-
-
-  }//end of switch statement
-return ERROR_INSANE;
+static SIZE_T SlotStride(const BTreeNode &b)
+{
+  return b.info.keysize +
+    (b.info.nodetype==BTREE_LEAF_NODE ? b.info.valuesize : sizeof(SIZE_T));
 }
 
-
-
-ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+static char * SlotAt(const BTreeNode &b, const SIZE_T slot)
 {
-  // WRITE ME
-  VALUE_T x = value;
-  if(superblock.info.valuesize != value.length){
-    return ERROR_SIZE;
-  }
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, x);
+  return b.data + sizeof(SIZE_T) + slot*SlotStride(b);
 }
 
-
-ERROR_T BTreeIndex::Delete(const KEY_T &key)
+static bool SlotsFit(const BTreeNode &b, const SIZE_T slots)
 {
-  // This is optional extra credit
-  //
-  //
-  return ERROR_UNIMPL;
+  return sizeof(SIZE_T) + slots*SlotStride(b) <= b.info.GetNumDataBytes();
 }
 
-
-//
-//
-// DEPTH first traversal
-// DOT is Depth + DOT format
-//
-
-ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
-				    ostream &o,
-				    BTreeDisplayType display_type) const
+ERROR_T BTreeShiftSlots(BTreeNode &b, const SIZE_T first, const SIZE_T to)
 {
-  KEY_T testkey;
-  SIZE_T ptr;
-  BTreeNode b;
-  ERROR_T rc;
-  SIZE_T offset;
-
-  rc= b.Unserialize(buffercache,node);
-
-  if (rc!=ERROR_NOERROR) {
-    return rc;
-  }
-
-  rc = PrintNode(o,node,b,display_type);
-
-  if (rc) { return rc; }
+  SIZE_T count;
 
-  if (display_type==BTREE_DEPTH_DOT) {
-    o << ";";
+  if (first>b.info.numkeys) {
+    return ERROR_SIZE;
   }
-
-  if (display_type!=BTREE_SORTED_KEYVAL) {
-    o << endl;
+  count=b.info.numkeys-first;
+  if (!SlotsFit(b,to+count)) {
+    return ERROR_SIZE;
   }
-
-  switch (b.info.nodetype) {
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    if (b.info.numkeys>0) {
-      for (offset=0;offset<=b.info.numkeys;offset++) {
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	if (display_type==BTREE_DEPTH_DOT) {
-	  o << node << " -> "<<ptr<<";\n";
-	}
-	rc=DisplayInternal(ptr,o,display_type);
-	if (rc) { return rc; }
-      }
-    }
-    return ERROR_NOERROR;
-    break;
-  case BTREE_LEAF_NODE:
-    return ERROR_NOERROR;
-    break;
-  default:
-    if (display_type==BTREE_DEPTH_DOT) {
-    } else {
-      o << "Unsupported Node Type " << b.info.nodetype ;
-    }
-    return ERROR_INSANE;
+  if (count>0 && first!=to) {
+    memmove(SlotAt(b,to),SlotAt(b,first),count*SlotStride(b));
   }
-
+  b.info.numkeys=to+count;
   return ERROR_NOERROR;
 }
 
-
-ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
+ERROR_T BTreeMoveSlots(const BTreeNode &from, const SIZE_T first, const SIZE_T count,
+		       BTreeNode &to, const SIZE_T at)
 {
-  ERROR_T rc;
-  if (display_type==BTREE_DEPTH_DOT) {
-    o << "digraph tree { \n";
+  if (first+count>from.info.numkeys || !SlotsFit(to,at+count) ||
+      SlotStride(from)!=SlotStride(to)) {
+    return ERROR_SIZE;
   }
-  rc=DisplayInternal(superblock.info.rootnode,o,display_type);
-  if (display_type==BTREE_DEPTH_DOT) {
-    o << "}\n";
+  if (count>0) {
+    memmove(SlotAt(to,at),SlotAt(from,first),count*SlotStride(from));
   }
   return ERROR_NOERROR;
 }
 
-
-ERROR_T BTreeIndex::SanityCheck() const
+ERROR_T BTreeSplitSlots(BTreeNode &b, const SIZE_T at, BTreeNode &right)
 {
-  // WRITE ME
-  BTreeNode root;
-  ERROR_T rc;
-  SIZE_T offset;
-  KEY_T currKey;
-  SIZE_T currPtr;
-  KEY_T prevKey;
-  rc = root.Unserialize(buffercache, superblock.info.rootnode);
-  if(rc){return rc;}
-  rc = root.GetKey(0, prevKey);
-  if(rc){return rc;}
-  for(offset = 1; offset<root.info.numkeys;offset++){
-    rc = root.GetKey(offset, currKey);
-    if(rc){return rc;}
-    rc = root.GetPtr(offset, currPtr);
-    if(rc){return rc;}
-    if(prevKey == currKey || !(prevKey < currKey)){
-      return ERROR_BADCONFIG;
-    }
-    rc = root.GetKey(offset, prevKey);
-    if(rc){return rc;}
-  }
-  for(offset = 0; offset < root.info.numkeys; offset++){
-    rc = root.GetPtr(offset, currPtr);
-    if(rc){return rc;}
-    rc = SanityDfs(currPtr);
+  SIZE_T stride=SlotStride(b);
+  SIZE_T n=b.info.numkeys;
 
+  if (b.info.nodetype==BTREE_LEAF_NODE) {
+    if (at>n || !SlotsFit(right,n-at) || SlotStride(right)!=stride) {
+      return ERROR_SIZE;
+    }
+    memmove(SlotAt(right,0),SlotAt(b,at),(n-at)*stride);
+    right.info.numkeys=n-at;
+  } else {
+    if (at>=n || !SlotsFit(right,n-at-1) || SlotStride(right)!=stride) {
+      return ERROR_SIZE;
+    }
+    // Pointer at+1 through the last one, with the keys between them
+    memmove(right.data,SlotAt(b,at)+b.info.keysize,(n-at-1)*stride+sizeof(SIZE_T));
+    right.info.numkeys=n-at-1;
   }
-
+  b.info.numkeys=at;
   return ERROR_NOERROR;
+}
 
+// Open up slot in a leaf and put a pair there
+static ERROR_T InsertLeafSlot(BTreeNode &b, const SIZE_T slot, const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
 
+  rc = BTreeShiftSlots(b, slot, slot + 1);
+  if (rc) { return rc; }
+  rc = b.SetKey(slot, key);
+  if (rc) { return rc; }
+  return b.SetVal(slot, value);
 }
-ERROR_T BTreeIndex::SanityDfs(SIZE_T &node) const
+
+// Open up slot in an interior node for a key and the pointer after it
+static ERROR_T InsertInteriorSlot(BTreeNode &b, const SIZE_T slot, const KEY_T &key, const SIZE_T &ptr)
 {
-  BTreeNode b;
   ERROR_T rc;
-  SIZE_T offset;
-  KEY_T currKey;
-  SIZE_T currPtr;
-  KEY_T prevKey;
 
-  rc = b.Unserialize(buffercache, node);
-  if(rc){return rc;}
+  rc = BTreeShiftSlots(b, slot, slot + 1);
+  if (rc) { return rc; }
+  rc = b.SetKey(slot, key);
+  if (rc) { return rc; }
+  return b.SetPtr(slot + 1, ptr);
+}
 
-  if(b.info.numkeys == 0){
-    return ERROR_NOERROR;
-  }
-  rc = b.GetKey(0, prevKey);
-  if(rc){return rc;}
-  for(offset = 1; offset<b.info.numkeys;offset++){
-    rc = b.GetKey(offset, currKey);
-    if(rc){return rc;}
-    rc = b.GetPtr(offset, currPtr);
-    if(rc){return rc;}
-    if(prevKey == currKey || !(prevKey < currKey)){
-      return ERROR_BADCONFIG;
-    }
-    rc = b.GetKey(offset, prevKey);
-    if(rc){return rc;}
+//
+// Split a full interior node as if key, with the new right sibling just
+// after it, had already gone in at slot: of the n+1 keys that makes, b
+// keeps those below the middle one, to gets those above it, and key
+// comes back as the middle one for the parent to take.  Splitting first
+// and then inserting into the right half means nothing is copied twice.
+//
+static ERROR_T SplitInterior(BTreeNode &b, const SIZE_T slot, KEY_T &key,
+			     const SIZE_T &right, BTreeNode &to)
+{
+  ERROR_T rc;
+  SIZE_T n = b.info.numkeys;
+  SIZE_T mid = (n + 1) / 2;
+  KEY_T up;
+
+  if (slot == mid) {
+    // The new key is the middle one, and right starts the upper half
+    rc = BTreeMoveSlots(b, mid, n - mid, to, 0);
+    if (rc) { return rc; }
+    to.info.numkeys = n - mid;
+    b.info.numkeys = mid;
+    return to.SetPtr(0, right);
+  }
+  if (slot < mid) {
+    rc = b.GetKey(mid - 1, up);
+    if (rc) { return rc; }
+    rc = BTreeSplitSlots(b, mid - 1, to);
+    if (rc) { return rc; }
+    rc = InsertInteriorSlot(b, slot, key, right);
+  } else {
+    rc = b.GetKey(mid, up);
+    if (rc) { return rc; }
+    rc = BTreeSplitSlots(b, mid, to);
+    if (rc) { return rc; }
+    rc = InsertInteriorSlot(to, slot - mid - 1, key, right);
+  }
+  if (rc) { return rc; }
+  key = up;
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::RewriteLeaf(const BTreePath &path, BTreeNode &b, const SIZE_T slot, bool &split)
+{
+  ERROR_T rc;
+  const BTreePathEntry &e = path.entry[path.depth-1];
+  KEY_T key;
+  VALUE_T value;
+
+  split = false;
+  if (fingerprinted) {
+    fingerprints.Expect(e.block, slot, 0);
+  }
+  rc = WriteNode(e.block, b);
+  if (rc != ERROR_SIZE || !codec) {return rc;}
+
+  // The new value made the leaf too big to compress into a block, so
+  // take its pair out and insert it again, splitting the leaf
+  BTreePath at = path;
+  at.entry[at.depth-1].slot = slot;
+  rc = b.GetKey(slot, key);
+  if (rc) {return rc;}
+  rc = b.GetVal(slot, value);
+  if (rc) {return rc;}
+  rc = BTreeShiftSlots(b, slot + 1, slot);
+  if (rc) {return rc;}
+  split = true;
+  return InsertAlongPath(at, b, key, value);
+}
+
+ERROR_T BTreeIndex::Leaf_No_Split(BTreeNode &b, const BTreePathEntry &e, const KEY_T &key, const VALUE_T &value){
+  ERROR_T rc;
+
+  // The descent already found where the key goes, so just shift
+  // everything after it over by one pair, in place
+  rc = InsertLeafSlot(b, e.slot, key, value);
+  if (rc) { return rc; }
+  if (fingerprinted) {
+    fingerprints.Expect(e.block, e.slot, 1);
+  }
+  return WriteNode(e.block, b);
+}
+
+ERROR_T BTreeIndex::Leaf_Split(BTreeNode &b, const BTreePathEntry &e, KEY_T &key, const VALUE_T &value, SIZE_T &right){
+  ERROR_T rc;
+
+  rc = AllocateNode(right); //right is new node
+  if (rc) { return rc; }
+
+  if (b.info.blocksize < GetLeafSize()) {
+    // Leaves have got bigger since this one was made, so both halves
+    // get the new size
+    BTreeNode bigger(BTREE_LEAF_NODE, b.info.keysize, b.info.valuesize, GetLeafSize());
+    bigger.info = b.info;
+    bigger.info.blocksize = GetLeafSize();
+    rc = BTreeMoveSlots(b, 0, b.info.numkeys, bigger, 0);
+    if (rc) { return rc; }
+    b = bigger;
+  }
+
+  // Left keeps the lower half (and one more), right gets the rest.
+  // Split first so the new pair only has to go into its own half.
+  BTreeNode newNode = b;
+  SIZE_T mid = b.info.numkeys / 2 + 1;
+
+  if (e.slot < mid) {
+    rc = BTreeSplitSlots(b, mid - 1, newNode);
+    if (rc) { return rc; }
+    rc = InsertLeafSlot(b, e.slot, key, value);
+  } else {
+    rc = BTreeSplitSlots(b, mid, newNode);
+    if (rc) { return rc; }
+    rc = InsertLeafSlot(newNode, e.slot - mid, key, value);
+  }
+  if (rc) { return rc; }
+  rc = WriteNode(right, newNode);
+  if (rc) { return rc; }
+  BTREE_STAT(stats.CountSplit(BTREE_STAT_LEAF_SPLIT));
+  // The greatest key on the left is what the parent splits on
+  rc = b.GetKey(mid - 1, key);
+  if (rc) { return rc; }
+  return WriteNode(e.block, b);
+}
+
+ERROR_T BTreeIndex::Interior_No_Split(BTreeNode &b, const BTreePathEntry &e, const KEY_T &key, const SIZE_T &right) {
+  ERROR_T rc;
+
+  // The child at slot split into itself (still at ptr slot) and right,
+  // so the separator goes in at slot and right just after it
+  rc = InsertInteriorSlot(b, e.slot, key, right);
+  if (rc) {return rc;}
+  return WriteNode(e.block, b);
+}
+
+ERROR_T BTreeIndex::Interior_Split(BTreeNode &b, const BTreePathEntry &e, KEY_T &key, SIZE_T &right){
+  ERROR_T rc;
+  SIZE_T newRightNode;
+
+  rc = AllocateNode(newRightNode);
+  if (rc) { return rc; }
+
+  // Left keeps keys below mid, the key at mid moves up to the parent,
+  // and the new right node gets everything above it
+  BTreeNode newNode = b;
+
+  rc = SplitInterior(b, e.slot, key, right, newNode);
+  if (rc) { return rc; }
+
+  rc = WriteNode(newRightNode, newNode);
+  if (rc) { return rc; }
+  BTREE_STAT(stats.CountSplit(BTREE_STAT_INTERIOR_SPLIT));
+  right = newRightNode;
+  return WriteNode(e.block, b);
+}
+
+ERROR_T BTreeIndex::Root_Split(BTreeNode &b, const BTreePathEntry &e, const KEY_T &key, const SIZE_T &right) {
+  ERROR_T rc;
+  SIZE_T newLeft;
+  SIZE_T newRight;
+  KEY_T rootkey = key;
+
+  rc = AllocateNode(newLeft);
+  if (rc) {return rc;}
+  rc = AllocateNode(newRight);
+  if (rc) {return rc;}
+
+  // The root has to stay where the superblock says it is, so both
+  // halves move out to new interior nodes and the root keeps just the
+  // key between them
+  b.info.nodetype = BTREE_INTERIOR_NODE;
+  BTreeNode newNode = b;
+
+  rc = SplitInterior(b, e.slot, rootkey, right, newNode);
+  if (rc) {return rc;}
+
+  rc = WriteNode(newLeft, b);
+  if (rc) {return rc;}
+  rc = WriteNode(newRight, newNode);
+  if (rc) {return rc;}
+  BTREE_STAT(stats.CountSplit(BTREE_STAT_ROOT_SPLIT));
+
+  b.info.nodetype = BTREE_ROOT_NODE;
+  b.info.numkeys = 1;
+  rc = b.SetKey(0, rootkey);
+  if (rc) {return rc;}
+  rc = b.SetPtr(0, newLeft);
+  if (rc) {return rc;}
+  rc = b.SetPtr(1, newRight);
+  if (rc) {return rc;}
+  return WriteNode(superblock.info.rootnode, b);
+}
+
+
+
+
+ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
+  BTREE_STAT(BTreeStatTime start=BTreeStatNow());
+
+  if (trace) {
+    trace->Record(BTREE_TRACE_UPDATE,key,value.length);
+  }
+  if(superblock.info.valuesize != value.length){
+    rc = ERROR_SIZE;
+  } else {
+    // An update only reads the value, so there is no need to copy it
+    rc = LookupOrUpdateInternal(BTREE_OP_UPDATE, key, const_cast<VALUE_T &>(value));
+  }
+  BTREE_STAT(stats.CountOp(BTREE_STAT_UPDATE,rc,start));
+  return rc;
+}
+
+
+// Swaps in desired if the value is expected
+class BTreeCompareAndSwap : public BTreeModifier {
+ private:
+  const VALUE_T &expected;
+  const VALUE_T &desired;
+
+ public:
+  BTreeCompareAndSwap(const VALUE_T &e, const VALUE_T &d) : expected(e), desired(d) {}
+
+  ERROR_T Modify(const KEY_T &key, char *value, const SIZE_T valuesize) {
+    if (memcmp(value,expected.data,valuesize)) {
+      return ERROR_CONFLICT;
+    }
+    memcpy(value,desired.data,valuesize);
+    return ERROR_NOERROR;
+  }
+};
+
+
+ERROR_T BTreeIndex::CompareAndSwap(const KEY_T &key, const VALUE_T &expected, const VALUE_T &desired)
+{
+  ERROR_T rc;
+  BTreeCompareAndSwap cas(expected,desired);
+  BTREE_STAT(BTreeStatTime start=BTreeStatNow());
+
+  if (superblock.info.keysize!=key.length ||
+      superblock.info.valuesize!=expected.length || superblock.info.valuesize!=desired.length) {
+    rc=ERROR_SIZE;
+  } else {
+    rc=LookupOrUpdateInternal(BTREE_OP_MODIFY,key,const_cast<VALUE_T &>(desired),&cas);
+  }
+  if (trace) {
+    trace->Record(rc ? BTREE_TRACE_LOOKUP : BTREE_TRACE_UPDATE,key,rc ? 0 : desired.length);
+  }
+  BTREE_STAT(stats.CountOp(BTREE_STAT_MODIFY,rc,start));
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::Modify(const KEY_T &key, BTreeModifier &modifier)
+{
+  ERROR_T rc;
+  VALUE_T unused;
+  BTREE_STAT(BTreeStatTime start=BTreeStatNow());
+
+  if (superblock.info.keysize!=key.length) {
+    rc=ERROR_SIZE;
+  } else {
+    rc=LookupOrUpdateInternal(BTREE_OP_MODIFY,key,unused,&modifier);
+  }
+  if (trace) {
+    trace->Record(rc ? BTREE_TRACE_LOOKUP : BTREE_TRACE_UPDATE,key,rc ? 0 : superblock.info.valuesize);
+  }
+  BTREE_STAT(stats.CountOp(BTREE_STAT_MODIFY,rc,start));
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::Delete(const KEY_T &key)
+{
+  ERROR_T rc;
+  BTREE_STAT(BTreeStatTime start=BTreeStatNow());
+
+  if (trace) {
+    trace->Record(BTREE_TRACE_DELETE,key,0);
+  }
+  rc=DeleteInternal(key);
+  BTREE_STAT(stats.CountOp(BTREE_STAT_DELETE,rc,start));
+  return rc;
+}
+
+
+//
+//
+// DEPTH first traversal
+// DOT is Depth + DOT format
+//
+
+ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
+				    BTreeDisplayWriter &o,
+				    const BTreeDisplayType display_type,
+				    const BTreeDisplayOptions &options,
+				    bool &truncated) const
+{
+  BTreeWalk walk(*this,node);
+  ERROR_T rc;
+  SIZE_T shown;
+
+  truncated=false;
+  for (shown=0; options.maxnodes==0 || shown<options.maxnodes; shown++) {
+    rc=walk.Next();
+    if (rc) {
+      return rc==ERROR_NONEXISTENT ? ERROR_NOERROR : rc;
+    }
+    const BTreeNode &b=walk.GetNode();
+
+    if (walk.GetDepth()>=options.maxdepth) {
+      walk.SkipChildren();
+      // Leaves, and the root of an empty tree, have nothing to skip
+      if (b.info.nodetype!=BTREE_LEAF_NODE && b.info.numkeys>0) {
+	truncated=true;
+      }
+    }
+
+    if (display_type==BTREE_JSON) {
+      if (shown>0) {
+	o.Put(",\n");
+      }
+      rc=PrintNodeJSON(o,walk,options);
+      if (rc) { return rc; }
+      continue;
+    }
+
+    if (display_type==BTREE_DEPTH_DOT && walk.GetDepth()>0) {
+      o.PutNumber(walk.GetParent());
+      o.Put(" -> ");
+      o.PutNumber(walk.GetBlock());
+      o.Put(";\n");
+    }
+
+    rc = PrintNode(o,walk.GetBlock(),b,display_type,options);
+
+    if (rc) { return rc; }
+
+    if (display_type==BTREE_DEPTH_DOT) {
+      o.Put(';');
+    }
+
+    if (display_type!=BTREE_SORTED_KEYVAL) {
+      o.Put('\n');
+    }
+
+    switch (b.info.nodetype) {
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+    case BTREE_LEAF_NODE:
+      break;
+    default:
+      return ERROR_INSANE;
+    }
+  }
+
+  // maxnodes cut it short, unless that was the last node anyway
+  rc=walk.Next();
+  if (rc==ERROR_NOERROR) {
+    truncated=true;
+  }
+  return rc==ERROR_NONEXISTENT ? ERROR_NOERROR : rc;
+}
+
+
+ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
+{
+  return Display(o,display_type,BTreeDisplayOptions());
+}
+
+
+ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type,
+			    const BTreeDisplayOptions &options) const
+{
+  BTreeDisplayWriter w(o);
+  ERROR_T rc;
+  bool truncated;
+
+  if (display_type==BTREE_DEPTH_DOT) {
+    w.Put("digraph tree { \n");
+  } else if (display_type==BTREE_JSON) {
+    w.Put("{\"keysize\":");
+    w.PutNumber(superblock.info.keysize);
+    w.Put(",\"valuesize\":");
+    w.PutNumber(superblock.info.valuesize);
+    w.Put(",\"blocksize\":");
+    w.PutNumber(GetBlockSize());
+    w.Put(",\"root\":");
+    w.PutNumber(superblock.info.rootnode);
+    w.Put(",\"nodes\":[\n");
+  }
+  rc=DisplayInternal(superblock.info.rootnode,w,display_type,options,truncated);
+  if (display_type==BTREE_DEPTH_DOT) {
+    w.Put("}\n");
+  } else if (display_type==BTREE_JSON) {
+    w.Put("\n],\"truncated\":");
+    w.Put(truncated ? "true" : "false");
+    w.Put("}\n");
+  }
+  if (rc) {
+    w.Flush();
+    return rc;
+  }
+  return w.Flush();
+}
+
+
+ERROR_T BTreeIndex::Export(ostream &os) const
+{
+  BTreeExportWriter out(os,superblock.info.keysize,superblock.info.valuesize);
+  BTreeWalk walk(*this, superblock.info.rootnode);
+  ERROR_T rc;
+  SIZE_T offset;
+
+  rc=out.Start();
+  if (rc) { return rc; }
+  // A preorder walk comes to the leaves in key order
+  while ((rc=walk.Next())==ERROR_NOERROR) {
+    const BTreeNode &b=walk.GetNode();
+    if (b.info.nodetype!=BTREE_LEAF_NODE) {
+      continue;
+    }
+    for (offset=0;offset<b.info.numkeys;offset++) {
+      rc=out.Add(b.ResolveKey(offset),b.ResolveVal(offset));
+      if (rc) { return rc; }
+    }
+  }
+  if (rc!=ERROR_NONEXISTENT) {
+    return rc;
+  }
+  return out.Finish();
+}
+
+
+ERROR_T BTreeIndex::Import(istream &is, const SIZE_T fill)
+{
+  BTreeExportReader in(is);
+  BTreeBuilder build(*this,fill);
+  const char *key;
+  const char *value;
+  ERROR_T rc;
+
+  rc=in.Start();
+  if (rc) { return rc; }
+  if (in.GetKeySize()!=superblock.info.keysize || in.GetValueSize()!=superblock.info.valuesize) {
+    return ERROR_SIZE;
+  }
+  while ((rc=in.Next(key,value))==ERROR_NOERROR) {
+    rc=build.Add(key,value);
+    if (rc) { return rc; }
+  }
+  if (rc!=ERROR_NONEXISTENT) {
+    return rc;
+  }
+  return build.Finish();
+}
+
+
+ERROR_T BTreeIndex::Load(const char *pairs, const size_t n, const SIZE_T threads,
+			 const SIZE_T fill)
+{
+  BTreeLoader loader(*this,threads,fill);
+
+  return loader.Load(pairs,n);
+}
+
+
+ERROR_T BTreeIndex::SanityCheck() const
+{
+  return Verify(0);
+}
+
+
+// Shared by everything working on one Verify
+struct BTreeVerifyState {
+  SIZE_T                 numblocks;
+  // One bit per block, set once the block has been accounted for
+  vector<atomic<unsigned long long> > seen;
+  atomic<SIZE_T>         nodes;
+  atomic<SIZE_T>         leaves;
+  atomic<SIZE_T>         leafdepth;   // (SIZE_T)-1 until the first leaf
+  atomic<bool>           failed;
+  mutex                  lock;
+  ERROR_T                rc;
+  SIZE_T                 badblock;
+  string                 problem;
+
+  BTreeVerifyState(const SIZE_T n) :
+    numblocks(n), seen((n+63)/64), nodes(0), leaves(0), leafdepth((SIZE_T)-1),
+    failed(false), rc(ERROR_NOERROR), badblock(0) {}
+
+  // return false if the block had already been seen
+  bool Mark(const SIZE_T block) {
+    unsigned long long bit=1ULL<<(block%64);
+    return !(seen[block/64].fetch_or(bit)&bit);
+  }
+
+  bool Seen(const SIZE_T block) const { return seen[block/64].load()&(1ULL<<(block%64)); }
+
+  // Keep the first problem anyone runs into, and tell everyone to stop
+  ERROR_T Fail(const ERROR_T r, const SIZE_T block, const char *what) {
+    unique_lock<mutex> guard(lock);
+    if (!failed) {
+      rc=r;
+      badblock=block;
+      problem=what;
+      failed=true;
+    }
+    return r;
+  }
+};
+
+
+// A subtree handed to a worker
+struct BTreeVerifyTask : public BTreeTask {
+  const BTreeIndex  *index;
+  BTreeVerifyState  *state;
+  SIZE_T             block;
+  SIZE_T             depth;
+  KEY_T              low;
+  KEY_T              high;
+
+  void Run() { index->VerifySubtree(*state,block,depth,low,high); }
+};
+
+
+BTreeVerifyReport::BTreeVerifyReport() :
+  nodes(0), leaves(0), leafdepth(0), freeblocks(0), leaked(0), badblock(0)
+{}
+
+
+ostream & BTreeVerifyReport::Print(ostream &os) const
+{
+  if (!problem.empty()) {
+    os << "block " << badblock << ": " << problem << endl;
+  }
+  os << nodes << " nodes, " << leaves << " leaves at depth " << leafdepth << ", "
+     << freeblocks << " free blocks, " << leaked << " leaked" << endl;
+  return os;
+}
+
+
+ERROR_T BTreeIndex::VerifyNode(BTreeVerifyState &state, const SIZE_T block, const BTreeNode &b,
+			       const SIZE_T depth, const KEY_T &low, const KEY_T &high) const
+{
+  ERROR_T rc;
+  SIZE_T cap;
+  SIZE_T offset;
+  SIZE_T ptr;
+  SIZE_T expected;
+  KEY_T prev;
+  KEY_T key;
+
+  if (!state.Mark(block)) {
+    return state.Fail(ERROR_INSANE,block,"node reachable more than once");
+  }
+  state.nodes++;
+
+  switch (b.info.nodetype) {
+  case BTREE_ROOT_NODE:
+    if (depth!=0) {
+      return state.Fail(ERROR_INSANE,block,"root node below the top of the tree");
+    }
+    cap=b.info.GetNumSlotsAsInterior();
+    break;
+  case BTREE_INTERIOR_NODE:
+  case BTREE_LEAF_NODE:
+    if (depth==0) {
+      return state.Fail(ERROR_INSANE,block,"top of the tree is not a root node");
+    }
+    if (b.info.nodetype==BTREE_INTERIOR_NODE) {
+      if (b.info.numkeys==0) {
+	return state.Fail(ERROR_INSANE,block,"interior node with no keys");
+      }
+      cap=b.info.GetNumSlotsAsInterior();
+    } else {
+      cap=b.info.GetNumSlotsAsLeaf();
+    }
+    break;
+  default:
+    return state.Fail(ERROR_INSANE,block,"tree points at a block that is not a node");
+  }
+
+  if (b.info.keysize!=superblock.info.keysize || b.info.valuesize!=superblock.info.valuesize) {
+    return state.Fail(ERROR_INSANE,block,"node has the wrong key or value size");
+  }
+  if (b.info.numkeys>cap) {
+    return state.Fail(ERROR_INSANE,block,"node holds more keys than fit");
+  }
+
+  // Keys strictly increase, and all lie in (low, high]
+  for (offset=0;offset<b.info.numkeys;offset++) {
+    rc=b.GetKey(offset,key);
+    if (rc) { return state.Fail(rc,block,"unreadable key"); }
+    if (offset==0) {
+      if (low.length>0 && !(low<key)) {
+	return state.Fail(ERROR_BADCONFIG,block,"key not above its lower bound");
+      }
+    } else if (!(prev<key)) {
+      return state.Fail(ERROR_BADCONFIG,block,"keys out of order");
+    }
+    prev=key;
+  }
+  if (b.info.numkeys>0 && high.length>0 && high<prev) {
+    return state.Fail(ERROR_BADCONFIG,block,"key above its upper bound");
+  }
+
+  if (b.info.nodetype==BTREE_LEAF_NODE) {
+    expected=(SIZE_T)-1;
+    if (!state.leafdepth.compare_exchange_strong(expected,depth) && expected!=depth) {
+      return state.Fail(ERROR_INSANE,block,"leaves at different depths");
+    }
+    state.leaves++;
+  } else if (b.info.numkeys>0) {
+    // Check the pointers before anything follows them
+    for (offset=0;offset<=b.info.numkeys;offset++) {
+      rc=b.GetPtr(offset,ptr);
+      if (rc) { return state.Fail(rc,block,"unreadable pointer"); }
+      if (ptr==superblock_index || ptr>=state.numblocks) {
+	return state.Fail(ERROR_INSANE,block,"pointer off the disk or at the superblock");
+      }
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::VerifySubtree(BTreeVerifyState &state, const SIZE_T root,
+				  const SIZE_T depth, const KEY_T &low, const KEY_T &high) const
+{
+  BTreeWalk walk(*this, root);
+  ERROR_T rc;
+  SIZE_T d;
+  SIZE_T slot;
+  KEY_T lows[BTREE_MAX_DEPTH];
+  KEY_T highs[BTREE_MAX_DEPTH];
+
+  while (!state.failed && (rc=walk.Next())==ERROR_NOERROR) {
+    d=walk.GetDepth();
+    if (depth+d>=BTREE_MAX_DEPTH) {
+      return state.Fail(ERROR_INSANE,walk.GetBlock(),"tree too deep");
+    }
+    // A child's bounds are the separators on either side of the
+    // pointer to it, or its parent's own bounds at the ends
+    if (d==0) {
+      lows[0]=low;
+      highs[0]=high;
+    } else {
+      const BTreeNode &parent=walk.GetNode(d-1);
+      slot=walk.GetSlot(d-1);
+      if (slot>0) {
+	rc=parent.GetKey(slot-1,lows[d]);
+	if (rc) { return state.Fail(rc,walk.GetParent(),"unreadable key"); }
+      } else {
+	lows[d]=lows[d-1];
+      }
+      if (slot<parent.info.numkeys) {
+	rc=parent.GetKey(slot,highs[d]);
+	if (rc) { return state.Fail(rc,walk.GetParent(),"unreadable key"); }
+      } else {
+	highs[d]=highs[d-1];
+      }
+    }
+    rc=VerifyNode(state,walk.GetBlock(),walk.GetNode(),depth+d,lows[d],highs[d]);
+    if (rc) { return rc; }
+  }
+  if (state.failed) {
+    return state.rc;
+  }
+  if (rc!=ERROR_NONEXISTENT) {
+    return state.Fail(rc,root,"unreadable node in subtree");
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::Verify(const SIZE_T threads, BTreeVerifyReport *report) const
+{
+  BTreeVerifyState state(GetNumBlocks());
+  BTreeNode b;
+  ERROR_T rc=ERROR_NOERROR;
+  SIZE_T workers=threads;
+  SIZE_T depth;
+  SIZE_T offset;
+  SIZE_T n;
+  SIZE_T freeblocks=0;
+  SIZE_T leaked=0;
+
+  struct Subtree {
+    SIZE_T block;
+    KEY_T  low;
+    KEY_T  high;
+  };
+  vector<Subtree> frontier(1);
+  vector<Subtree> next;
+
+  if (!mapped && !aio) {
+    workers=0;
+  }
+
+  state.Mark(superblock_index);
+  frontier[0].block=superblock.info.rootnode;
+  if (frontier[0].block==superblock_index || frontier[0].block>=state.numblocks) {
+    state.Fail(ERROR_INSANE,frontier[0].block,"root off the disk or at the superblock");
+  }
+
+  // Check the top of the tree here, a level at a time, until there are
+  // enough subtrees below it to keep the workers busy
+  for (depth=0; !state.failed && workers>0 && !frontier.empty() &&
+	 frontier.size()<workers*4 && depth+1<BTREE_MAX_DEPTH; depth++) {
+    next.clear();
+    for (n=0;n<frontier.size() && !state.failed;n++) {
+      Subtree &t=frontier[n];
+      rc=ReadNode(t.block,b);
+      if (rc) {
+	state.Fail(rc,t.block,"unreadable node");
+	break;
+      }
+      if (VerifyNode(state,t.block,b,depth,t.low,t.high)) {
+	break;
+      }
+      if (b.info.nodetype==BTREE_LEAF_NODE || b.info.numkeys==0) {
+	continue;
+      }
+      for (offset=0;offset<=b.info.numkeys;offset++) {
+	next.push_back(Subtree());
+	Subtree &c=next.back();
+	b.GetPtr(offset,c.block);
+	if (offset>0) {
+	  b.GetKey(offset-1,c.low);
+	} else {
+	  c.low=t.low;
+	}
+	if (offset<b.info.numkeys) {
+	  b.GetKey(offset,c.high);
+	} else {
+	  c.high=t.high;
+	}
+      }
+    }
+    frontier.swap(next);
+  }
+
+  // Then hand out the subtrees
+  if (!state.failed && !frontier.empty()) {
+    vector<BTreeVerifyTask> tasks(frontier.size());
+    BTreeThreadPool pool(workers);
+
+    for (n=0;n<frontier.size();n++) {
+      tasks[n].index=this;
+      tasks[n].state=&state;
+      tasks[n].block=frontier[n].block;
+      tasks[n].depth=depth;
+      tasks[n].low=frontier[n].low;
+      tasks[n].high=frontier[n].high;
+    }
+    for (n=0;n<tasks.size();n++) {
+      pool.Submit(&tasks[n]);
+    }
+    // The pool finishes every task before it goes away, and it goes
+    // before the tasks do
+  }
+
+  // Every free block has to be free and on the list only once
+  for (n=superblock.info.freelist; n!=0 && !state.failed; n=b.info.freelist) {
+    if (n>=state.numblocks) {
+      state.Fail(ERROR_INSANE,n,"free list runs off the disk");
+      break;
+    }
+    if (!state.Mark(n)) {
+      state.Fail(ERROR_INSANE,n,"free block in use or free list has a cycle");
+      break;
+    }
+    rc=ReadNode(n,b);
+    if (rc) {
+      state.Fail(rc,n,"unreadable free block");
+      break;
+    }
+    if (b.info.nodetype!=BTREE_UNALLOCATED_BLOCK) {
+      state.Fail(ERROR_INSANE,n,"block on the free list is not free");
+      break;
+    }
+    freeblocks++;
+  }
+
+  // Anything still unseen has been lost track of
+  if (!state.failed) {
+    for (n=0;n<state.numblocks;n++) {
+      if (!state.Seen(n)) {
+	if (leaked==0) {
+	  state.Fail(ERROR_INSANE,n,"block neither reachable nor free");
+	}
+	leaked++;
+      }
+    }
+  }
+
+  if (report) {
+    report->nodes=state.nodes;
+    report->leaves=state.leaves;
+    report->leafdepth= state.leafdepth==(SIZE_T)-1 ? 0 : (SIZE_T)state.leafdepth;
+    report->freeblocks=freeblocks;
+    report->leaked=leaked;
+    report->badblock=state.badblock;
+    report->problem=state.problem;
+  }
+  return state.failed ? state.rc : ERROR_NOERROR;
+}
+
+
+BTreeLevelShape::BTreeLevelShape() : nodes(0), keys(0), capacity(0)
+{
+  SIZE_T i;
+
+  for (i=0;i<BTREE_FILL_BUCKETS;i++) {
+    fill[i]=0;
+  }
+}
+
+
+BTreeShape::BTreeShape() :
+  height(0), numblocks(0), nodes(0), freeblocks(0),
+  leafdistance(0), leafpairs(0), adjacentleaves(0), rebuiltnodes(0)
+{}
+
+
+ostream & BTreeShape::Print(ostream &os) const
+{
+  SIZE_T i;
+  SIZE_T j;
+
+  os << "height " << height << ", " << nodes << " nodes and "
+     << freeblocks << " free blocks of " << numblocks << endl;
+  for (i=0;i<height;i++) {
+    os << "level " << i << ": " << level[i].nodes << " nodes, "
+       << level[i].keys << " keys, " << (int)(level[i].GetFill()*100) << "% full, by tenths:";
+    for (j=0;j<BTREE_FILL_BUCKETS;j++) {
+      os << " " << level[i].fill[j];
+    }
+    os << endl;
+  }
+  os << "leaf distance: average " << GetAverageLeafDistance() << " blocks, "
+     << adjacentleaves << " of " << leafpairs << " neighbours adjacent" << endl;
+  os << "rebuild: " << rebuiltnodes << " nodes, saving "
+     << (nodes>rebuiltnodes ? nodes-rebuiltnodes : 0) << " blocks" << endl;
+  return os;
+}
+
+
+ostream & BTreeShape::PrintJSON(ostream &os) const
+{
+  SIZE_T i;
+  SIZE_T j;
+
+  os << "{\"height\":" << height
+     << ",\"numblocks\":" << numblocks
+     << ",\"nodes\":" << nodes
+     << ",\"free\":" << freeblocks
+     << ",\"levels\":[";
+  for (i=0;i<height;i++) {
+    os << (i ? "," : "") << "{\"nodes\":" << level[i].nodes
+       << ",\"keys\":" << level[i].keys
+       << ",\"capacity\":" << level[i].capacity
+       << ",\"fill\":" << level[i].GetFill()
+       << ",\"fill_tenths\":[";
+    for (j=0;j<BTREE_FILL_BUCKETS;j++) {
+      os << (j ? "," : "") << level[i].fill[j];
+    }
+    os << "]}";
+  }
+  os << "],\"leaf_distance\":" << GetAverageLeafDistance()
+     << ",\"adjacent_leaves\":" << adjacentleaves
+     << ",\"leaf_pairs\":" << leafpairs
+     << ",\"rebuilt_nodes\":" << rebuiltnodes
+     << ",\"rebuild_saves\":" << (nodes>rebuiltnodes ? nodes-rebuiltnodes : 0)
+     << "}";
+  return os;
+}
+
+
+ERROR_T BTreeIndex::Analyze(BTreeShape &shape) const
+{
+  BTreeWalk walk(*this, superblock.info.rootnode);
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T depth;
+  SIZE_T block;
+  SIZE_T lastleaf=0;
+  SIZE_T cap;
+  SIZE_T n;
+  unsigned long long below;
+
+  shape=BTreeShape();
+  shape.numblocks=GetNumBlocks();
+
+  while ((rc=walk.Next())==ERROR_NOERROR) {
+    const BTreeNode &node=walk.GetNode();
+    depth=walk.GetDepth();
+    block=walk.GetBlock();
+
+    switch (node.info.nodetype) {
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      cap=node.info.GetNumSlotsAsInterior();
+      break;
+    case BTREE_LEAF_NODE:
+      cap=node.info.GetNumSlotsAsLeaf();
+      if (lastleaf!=0) {
+	shape.leafdistance+= block>lastleaf ? block-lastleaf : lastleaf-block;
+	shape.leafpairs++;
+	if (block==lastleaf+1) {
+	  shape.adjacentleaves++;
+	}
+      }
+      lastleaf=block;
+      break;
+    default:
+      return ERROR_INSANE;
+    }
+
+    BTreeLevelShape &l=shape.level[depth];
+    l.nodes++;
+    l.keys+=node.info.numkeys;
+    l.capacity=cap;
+    l.fill[cap ? min((SIZE_T)(node.info.numkeys*(BTREE_FILL_BUCKETS-1)/cap),
+		     (SIZE_T)(BTREE_FILL_BUCKETS-1)) : 0]++;
+    if (depth+1>shape.height) {
+      shape.height=depth+1;
+    }
+    shape.nodes++;
+  }
+  if (rc!=ERROR_NONEXISTENT) {
+    return rc;
+  }
+
+  // Count the free list, which can't be longer than the disk
+  for (n=superblock.info.freelist; n!=0; n=b.info.freelist) {
+    if (shape.freeblocks>=shape.numblocks) {
+      return ERROR_INSANE;
+    }
+    rc=ReadNode(n,b);
+    if (rc) { return rc; }
+    if (b.info.nodetype!=BTREE_UNALLOCATED_BLOCK) {
+      return ERROR_INSANE;
+    }
+    shape.freeblocks++;
+  }
+
+  // Packed full, the leaves need keys/capacity nodes, and each level
+  // above needs one pointer for every node below it, up to one root
+  if (shape.height>1) {
+    const BTreeLevelShape &leaves=shape.level[shape.height-1];
+    n = leaves.capacity ? (SIZE_T)((leaves.keys+leaves.capacity-1)/leaves.capacity) : 1;
+    if (n==0) {
+      n=1;
+    }
+    cap=shape.level[0].capacity+1;
+    shape.rebuiltnodes=n;
+    do {
+      below=n;
+      n=(SIZE_T)((below+cap-1)/cap);
+      shape.rebuiltnodes+=n;
+    } while (n>1);
+  } else {
+    shape.rebuiltnodes=shape.nodes;
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+BTreeReorgCursor::BTreeReorgCursor() :
+  started(false), done(false), lastblock(0), leaves(0), merged(0), moved(0)
+{}
+
+
+// Drop key slot and the pointer after it from an interior node, so the
+// child before slot takes over the dropped child's range
+static ERROR_T RemoveInteriorEntry(BTreeNode &b, const SIZE_T slot)
+{
+  return BTreeShiftSlots(b,slot+1,slot);
+}
+
+
+ERROR_T BTreeIndex::MergeLeaves(BTreeReorgCursor &cursor, BTreePath &path, BTreeNode &b)
+{
+  ERROR_T rc;
+  SIZE_T right;
+  SIZE_T limit;
+  BTreeNode parent;
+  BTreeNode r;
+  BTreePathEntry &leaf=path.entry[path.depth-1];
+  BTreePathEntry &up=path.entry[path.depth-2];
+
+  limit=b.info.GetNumSlotsAsLeaf()*BTREE_REORG_FILL/100;
+
+  rc=ReadNode(up.block,parent);
+  if (rc) { return rc; }
+
+  // The parent must keep a key, or it would have nothing to route on
+  while (up.slot<parent.info.numkeys && parent.info.numkeys>1) {
+    rc=parent.GetPtr(up.slot+1,right);
+    if (rc) { return rc; }
+    rc=ReadNode(right,r);
+    if (rc) { return rc; }
+    if (r.info.nodetype!=BTREE_LEAF_NODE) {
+      return ERROR_INSANE;
+    }
+    if (b.info.numkeys+r.info.numkeys>limit) {
+      break;
+    }
+    rc=BTreeMoveSlots(r,0,r.info.numkeys,b,b.info.numkeys);
+    if (rc) { return rc; }
+    b.info.numkeys+=r.info.numkeys;
+    if (!LeafFits(b)) {
+      b.info.numkeys-=r.info.numkeys;
+      break;
+    }
+    // The leaf now covers its neighbour's range too, up to the
+    // neighbour's separator
+    rc=RemoveInteriorEntry(parent,up.slot);
+    if (rc) { return rc; }
+    rc=WriteNode(leaf.block,b);
+    if (rc) { return rc; }
+    rc=WriteNode(up.block,parent);
+    if (rc) { return rc; }
+    rc=DeallocateNode(right);
+    if (rc) { return rc; }
+    cursor.merged++;
+  }
+  leaf.numkeys=b.info.numkeys;
+  up.numkeys=parent.info.numkeys;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::FindParent(const SIZE_T block, const KEY_T &key, SIZE_T &parent, SIZE_T &slot) const
+{
+  ERROR_T rc;
+  SIZE_T node;
+  SIZE_T child;
+  SIZE_T depth;
+  SIZE_T offset;
+  KEY_T testkey;
+  BTreeNodeView view;
+
+  node=superblock.info.rootnode;
+  for (depth=0; depth<BTREE_MAX_DEPTH; depth++) {
+    rc=ViewNode(node,view);
+    if (rc) { return rc; }
+    const BTreeNode &v=view.Get();
+    if ((v.info.nodetype!=BTREE_ROOT_NODE && v.info.nodetype!=BTREE_INTERIOR_NODE) ||
+	v.info.numkeys==0) {
+      return ERROR_NONEXISTENT;
+    }
+    for (offset=0; offset<v.info.numkeys; offset++) {
+      rc=v.GetKey(offset,testkey);
+      if (rc) { return rc; }
+      if (key<testkey || key==testkey) {
+	break;
+      }
+    }
+    rc=v.GetPtr(offset,child);
+    if (rc) { return rc; }
+    if (child==block) {
+      parent=node;
+      slot=offset;
+      return ERROR_NOERROR;
+    }
+    node=child;
+  }
+  return ERROR_NONEXISTENT;
+}
+
+
+ERROR_T BTreeIndex::ClaimFreeNode(const SIZE_T block, const BTreeNode &b)
+{
+  ERROR_T rc;
+  SIZE_T prev;
+  SIZE_T count;
+  BTreeNode p;
+
+  if (superblock.info.freelist==block) {
+    superblock.info.freelist=b.info.freelist;
+    rc=WriteNode(superblock_index,superblock);
+    if (rc) { return rc; }
+  } else {
+    // The list is singly linked, so find whoever points at block
+    for (prev=superblock.info.freelist, count=0; prev!=0; prev=p.info.freelist, count++) {
+      if (count==BTREE_REORG_FREESCAN) {
+	return ERROR_NONEXISTENT;
+      }
+      rc=ReadNode(prev,p);
+      if (rc) { return rc; }
+      if (p.info.nodetype!=BTREE_UNALLOCATED_BLOCK) {
+	return ERROR_INSANE;
+      }
+      if (p.info.freelist==block) {
+	break;
+      }
+    }
+    if (prev==0) {
+      return ERROR_NONEXISTENT;
+    }
+    p.info.freelist=b.info.freelist;
+    rc=WriteNode(prev,p);
+    if (rc) { return rc; }
+  }
+
+  NotifyAllocate(block);
+
+  BTREE_STAT(stats.CountAlloc());
+
+  lastpath.depth=0;
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::MoveLeaf(BTreeReorgCursor &cursor, BTreePath &path, const BTreeNode &b)
+{
+  ERROR_T rc;
+  SIZE_T from;
+  SIZE_T to;
+  SIZE_T xparent=0;
+  SIZE_T xslot=0;
+  SIZE_T lparent;
+  BTreeNode x;
+  BTreeNode p;
+  KEY_T key;
+  BTreePathEntry &leaf=path.entry[path.depth-1];
+  const BTreePathEntry &up=path.entry[path.depth-2];
+
+  from=leaf.block;
+  to=cursor.lastblock+1;
+  if (cursor.lastblock==0 || to==from || to>=GetNumBlocks() || to==superblock_index) {
+    cursor.lastblock=from;
+    return ERROR_NOERROR;
+  }
+
+  rc=ReadNode(to,x);
+  if (rc) { return rc; }
+
+  if (x.info.nodetype==BTREE_LEAF_NODE) {
+    // If the next leaf is already there, leave this one out of line
+    // rather than shift every leaf after it along by one
+    BTreePath next=path;
+    rc=NextLeaf(next,p);
+    if (rc && rc!=ERROR_NONEXISTENT) { return rc; }
+    if (!rc && next.entry[next.depth-1].block==to) {
+      return ERROR_NOERROR;
+    }
+  }
+
+  switch (x.info.nodetype) {
+  case BTREE_UNALLOCATED_BLOCK:
+    rc=ClaimFreeNode(to,x);
+    if (rc==ERROR_NONEXISTENT) {
+      cursor.lastblock=from;
+      return ERROR_NOERROR;
+    }
+    if (rc) { return rc; }
+    rc=WriteNode(to,b);
+    if (rc) { return rc; }
+    rc=ReadNode(up.block,p);
+    if (rc) { return rc; }
+    rc=p.SetPtr(up.slot,to);
+    if (rc) { return rc; }
+    rc=WriteNode(up.block,p);
+    if (rc) { return rc; }
+    rc=DeallocateNode(from);
+    if (rc) { return rc; }
+    break;
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+  case BTREE_LEAF_NODE:
+    // Trade places with the node that's there, which first needs its
+    // parent found.  An empty node has no key to find it by.
+    if (x.info.nodetype!=BTREE_ROOT_NODE) {
+      if (x.info.numkeys==0) {
+	cursor.lastblock=from;
+	return ERROR_NOERROR;
+      }
+      rc=x.GetKey(0,key);
+      if (rc) { return rc; }
+      rc=FindParent(to,key,xparent,xslot);
+      if (rc==ERROR_NONEXISTENT) {
+	cursor.lastblock=from;
+	return ERROR_NOERROR;
+      }
+      if (rc) { return rc; }
+    }
+    rc=WriteNode(to,b);
+    if (rc) { return rc; }
+    rc=WriteNode(from,x);
+    if (rc) { return rc; }
+    if (x.info.nodetype==BTREE_ROOT_NODE) {
+      superblock.info.rootnode=from;
+      rc=WriteNode(superblock_index,superblock);
+      if (rc) { return rc; }
+    } else {
+      rc=ReadNode(xparent,p);
+      if (rc) { return rc; }
+      rc=p.SetPtr(xslot,from);
+      if (rc) { return rc; }
+      rc=WriteNode(xparent,p);
+      if (rc) { return rc; }
+    }
+    // If the other node was our parent, it has just moved to from
+    lparent= up.block==to ? from : up.block;
+    rc=ReadNode(lparent,p);
+    if (rc) { return rc; }
+    rc=p.SetPtr(up.slot,to);
+    if (rc) { return rc; }
+    rc=WriteNode(lparent,p);
+    if (rc) { return rc; }
+    lastpath.depth=0;
+    break;
+  default:
+    cursor.lastblock=from;
+    return ERROR_NOERROR;
+  }
+
+  leaf.block=to;
+  cursor.lastblock=to;
+  cursor.moved++;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::Reorganize(BTreeReorgCursor &cursor, const SIZE_T leaves)
+{
+  ERROR_T rc;
+  SIZE_T count;
+  BTreePath path;
+  BTreeNode b;
+  KEY_T testkey;
+
+  if (!cursor.started && cursor.key.length!=superblock.info.keysize) {
+    // No key sorts before all zeroes, so this finds the first leaf
+    cursor.key.Resize(superblock.info.keysize,false);
+    memset(cursor.key.data,0,cursor.key.length);
+  }
+
+  for (count=0; count<leaves && !cursor.done; count++) {
+    rc=Descend(cursor.key,path,b);
+    if (rc==ERROR_NONEXISTENT && path.depth==1) {
+      cursor.done=true;
+      break;
+    }
+    if (rc) { return rc; }
+
+    // Unless this is the first leaf of the pass, the descent lands on the
+    // leaf we did last (or on one holding keys up to it, if the index
+    // has changed since), so go on to the next one
+    const BTreePathEntry &e=path.entry[path.depth-1];
+    bool next=false;
+    if (cursor.started) {
+      if (e.slot>0 || e.slot>=b.info.numkeys) {
+	next=true;
+      } else {
+	rc=b.GetKey(e.slot,testkey);
+	if (rc) { return rc; }
+	next= testkey==cursor.key;
+      }
+    }
+
+    for (;;) {
+      if (next) {
+	rc=NextLeaf(path,b);
+	if (rc==ERROR_NONEXISTENT) {
+	  cursor.done=true;
+	  break;
+	}
+	if (rc) { return rc; }
+      }
+      if (path.depth<2) {
+	return ERROR_INSANE;
+      }
+      rc=MergeLeaves(cursor,path,b);
+      if (rc) { return rc; }
+      if (b.info.numkeys>0) {
+	break;
+      }
+      // An empty leaf nothing could be merged into has no key to
+      // remember our place by, and nothing worth moving, so step over it
+      // while the path is still good
+      next=true;
+    }
+    if (cursor.done) {
+      break;
+    }
+
+    rc=MoveLeaf(cursor,path,b);
+    if (rc) { return rc; }
+    rc=b.GetKey(b.info.numkeys-1,cursor.key);
+    if (rc) { return rc; }
+    cursor.started=true;
+    cursor.leaves++;
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+void BTreeIndex::NoteInsert(const BTreePath &path)
+{
+  SIZE_T level;
+
+  if (!summarized) {
+    return;
+  }
+  // The leaf has been written and knows its count already
+  for (level=0; level+1<path.depth; level++) {
+    summaries.Inserted(path.entry[level].block);
+  }
+}
+
+
+void BTreeIndex::NoteChange(const BTreePath &path)
+{
+  SIZE_T level;
+
+  if (!summarized) {
+    return;
+  }
+  for (level=0; level<path.depth; level++) {
+    summaries.Changed(path.entry[level].block);
+  }
+}
+
+
+ERROR_T BTreeIndex::Summarize(const SIZE_T block, const SIZE_T depth, SIZE_T &n, const char *&agg)
+{
+  ERROR_T rc;
+  SIZE_T offset;
+  SIZE_T child;
+  SIZE_T childn;
+  const char *childagg;
+  BTreeNodeView view;
+
+  if (summaries.Get(block,n,agg)) {
+    return ERROR_NOERROR;
+  }
+  if (depth>=BTREE_MAX_DEPTH || block>=GetNumBlocks()) {
+    return ERROR_INSANE;
+  }
+
+  vector<char> sum(aggregate ? aggregate->GetSize() : 0);
+
+  if (aggregate) {
+    aggregate->Identity(sum.data());
+  }
+  rc=ViewNode(block,view);
+  if (rc) { return rc; }
+  const BTreeNode &b=view.Get();
+
+  switch (b.info.nodetype) {
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    n=0;
+    for (offset=0; b.info.numkeys>0 && offset<=b.info.numkeys; offset++) {
+      rc=b.GetPtr(offset,child);
+      if (rc) { return rc; }
+      rc=Summarize(child,depth+1,childn,childagg);
+      if (rc) { return rc; }
+      n+=childn;
+      if (aggregate) {
+	aggregate->Combine(sum.data(),childagg);
+      }
+    }
+    break;
+  case BTREE_LEAF_NODE:
+    n=b.info.numkeys;
+    for (offset=0; aggregate && offset<b.info.numkeys; offset++) {
+      aggregate->Add(sum.data(),b.ResolveKey(offset),b.info.keysize,
+		     b.ResolveVal(offset),b.info.valuesize);
+    }
+    break;
+  default:
+    return ERROR_INSANE;
+  }
+  agg=summaries.Set(block,n,sum.data());
+  return ERROR_NOERROR;
+}
+
+
+// The child of interior node b that holds or would hold key
+static SIZE_T Route(const BTreeNode &b, const KEY_T &key)
+{
+  SIZE_T offset;
+  BorrowedKey testkey;
+
+  for (offset=0; offset<b.info.numkeys; offset++) {
+    const KEY_T &k=testkey.At(b.ResolveKey(offset),b.info.keysize);
+    if (key<k || key==k) {
+      break;
+    }
+  }
+  return offset;
+}
+
+
+// One end of the range on its way down: a node that the range only
+// partly covers, and which of the range's bounds cut into it
+struct BTreeRangeEnd {
+  SIZE_T node;
+  bool   low;
+  bool   high;
+};
+
+
+//
+// Walk down with the nodes that hold the ends of [low,high].  While
+// both ends lie under the same child there is one such node a level;
+// once they part there are two, and every child strictly between the
+// ends is inside the range whole and counted from its summary.  So
+// this reads at most two nodes a level, plus whatever summaries are
+// not known yet.
+//
+ERROR_T BTreeIndex::FoldRange(const KEY_T &low, const KEY_T &high, SIZE_T &n, char *agg)
+{
+  ERROR_T rc;
+  BTreeRangeEnd ends[2];
+  BTreeRangeEnd next[2];
+  SIZE_T nends;
+  SIZE_T nnext;
+  SIZE_T depth;
+  SIZE_T i;
+  SIZE_T offset;
+  SIZE_T first;
+  SIZE_T last;
+  SIZE_T lo;
+  SIZE_T hi;
+  SIZE_T child;
+  SIZE_T childn;
+  const char *childagg;
+  BTreeNodeView view;
+  BorrowedKey testkey;
+
+  if (!summarized) {
+    return ERROR_BADCONFIG;
+  }
+  n=0;
+  if (agg) {
+    aggregate->Identity(agg);
+  }
+  if (high<low) {
+    return ERROR_NOERROR;
+  }
+
+  ends[0].node=superblock.info.rootnode;
+  ends[0].low=ends[0].high=true;
+  for (nends=1, depth=0; nends>0; depth++) {
+    if (depth==BTREE_MAX_DEPTH) {
+      return ERROR_INSANE;
+    }
+    for (i=0, nnext=0; i<nends; i++) {
+      const BTreeRangeEnd &e=ends[i];
+      rc=ViewNode(e.node,view);
+      if (rc) { return rc; }
+      const BTreeNode &b=view.Get();
+
+      switch (b.info.nodetype) {
+      case BTREE_ROOT_NODE:
+      case BTREE_INTERIOR_NODE:
+	if (b.info.numkeys==0) {
+	  // Nothing in the index at all
+	  continue;
+	}
+	lo= e.low ? Route(b,low) : 0;
+	hi= e.high ? Route(b,high) : b.info.numkeys;
+	first= e.low ? lo+1 : 0;
+	last= e.high ? hi : b.info.numkeys+1;
+	for (offset=first; offset<last; offset++) {
+	  rc=b.GetPtr(offset,child);
+	  if (rc) { return rc; }
+	  rc=Summarize(child,depth+1,childn,childagg);
+	  if (rc) { return rc; }
+	  n+=childn;
+	  if (agg) {
+	    aggregate->Combine(agg,childagg);
+	  }
+	}
+	if (e.low && e.high && lo==hi) {
+	  // Both ends are still under the same child
+	  rc=b.GetPtr(lo,next[nnext].node);
+	  if (rc) { return rc; }
+	  next[nnext].low=next[nnext].high=true;
+	  nnext++;
+	  break;
+	}
+	if (e.low) {
+	  rc=b.GetPtr(lo,next[nnext].node);
+	  if (rc) { return rc; }
+	  next[nnext].low=true;
+	  next[nnext].high=false;
+	  nnext++;
+	}
+	if (e.high) {
+	  rc=b.GetPtr(hi,next[nnext].node);
+	  if (rc) { return rc; }
+	  next[nnext].low=false;
+	  next[nnext].high=true;
+	  nnext++;
+	}
+	break;
+      case BTREE_LEAF_NODE:
+	for (offset=0; offset<b.info.numkeys; offset++) {
+	  const KEY_T &k=testkey.At(b.ResolveKey(offset),b.info.keysize);
+	  if (e.low && k<low) {
+	    continue;
+	  }
+	  if (e.high && high<k) {
+	    break;
+	  }
+	  n++;
+	  if (agg) {
+	    aggregate->Add(agg,k.data,b.info.keysize,b.ResolveVal(offset),b.info.valuesize);
+	  }
+	}
+	break;
+      default:
+	return ERROR_INSANE;
+      }
+    }
+    for (nends=0; nends<nnext; nends++) {
+      ends[nends]=next[nends];
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::Count(SIZE_T &n)
+{
+  const char *agg;
+
+  if (!summarized) {
+    return ERROR_BADCONFIG;
+  }
+  return Summarize(superblock.info.rootnode,0,n,agg);
+}
+
+
+ERROR_T BTreeIndex::CountRange(const KEY_T &low, const KEY_T &high, SIZE_T &n)
+{
+  return FoldRange(low,high,n,0);
+}
+
+
+ERROR_T BTreeIndex::AggregateRange(const KEY_T &low, const KEY_T &high, char *agg)
+{
+  SIZE_T n;
+
+  if (!aggregate) {
+    return ERROR_BADCONFIG;
+  }
+  return FoldRange(low,high,n,agg);
+}
+
+
+ERROR_T BTreeIndex::Rank(const KEY_T &key, SIZE_T &rank)
+{
+  ERROR_T rc;
+  SIZE_T node;
+  SIZE_T depth;
+  SIZE_T offset;
+  SIZE_T slot;
+  SIZE_T child;
+  SIZE_T childn;
+  const char *childagg;
+  BTreeNodeView view;
+  BorrowedKey testkey;
+
+  if (!summarized) {
+    return ERROR_BADCONFIG;
+  }
+  rank=0;
+  node=superblock.info.rootnode;
+  for (depth=0; depth<BTREE_MAX_DEPTH; depth++) {
+    rc=ViewNode(node,view);
+    if (rc) { return rc; }
+    const BTreeNode &b=view.Get();
+
+    switch (b.info.nodetype) {
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (b.info.numkeys==0) {
+	return ERROR_NOERROR;
+      }
+      // Everything under the children before ours is smaller
+      slot=Route(b,key);
+      for (offset=0; offset<slot; offset++) {
+	rc=b.GetPtr(offset,child);
+	if (rc) { return rc; }
+	rc=Summarize(child,depth+1,childn,childagg);
+	if (rc) { return rc; }
+	rank+=childn;
+      }
+      rc=b.GetPtr(slot,node);
+      if (rc) { return rc; }
+      break;
+    case BTREE_LEAF_NODE:
+      for (offset=0; offset<b.info.numkeys; offset++) {
+	if (!(testkey.At(b.ResolveKey(offset),b.info.keysize)<key)) {
+	  break;
+	}
+      }
+      rank+=offset;
+      return ERROR_NOERROR;
+    default:
+      return ERROR_INSANE;
+    }
+  }
+  return ERROR_INSANE;
+}
+
+
+ERROR_T BTreeIndex::Select(const SIZE_T rank, KEY_T &key, VALUE_T &value)
+{
+  ERROR_T rc;
+  SIZE_T node;
+  SIZE_T depth;
+  SIZE_T offset;
+  SIZE_T left;
+  SIZE_T child;
+  SIZE_T childn;
+  const char *childagg;
+  BTreeNodeView view;
+
+  if (!summarized) {
+    return ERROR_BADCONFIG;
+  }
+  left=rank;
+  node=superblock.info.rootnode;
+  for (depth=0; depth<BTREE_MAX_DEPTH; depth++) {
+    rc=ViewNode(node,view);
+    if (rc) { return rc; }
+    const BTreeNode &b=view.Get();
+
+    switch (b.info.nodetype) {
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      // Skip whole children until the one the rank falls in
+      for (offset=0; b.info.numkeys>0 && offset<=b.info.numkeys; offset++) {
+	rc=b.GetPtr(offset,child);
+	if (rc) { return rc; }
+	rc=Summarize(child,depth+1,childn,childagg);
+	if (rc) { return rc; }
+	if (left<childn) {
+	  break;
+	}
+	left-=childn;
+      }
+      if (b.info.numkeys==0 || offset>b.info.numkeys) {
+	return ERROR_NONEXISTENT;
+      }
+      node=child;
+      break;
+    case BTREE_LEAF_NODE:
+      if (left>=b.info.numkeys) {
+	return ERROR_NONEXISTENT;
+      }
+      rc=b.GetKey(left,key);
+      if (rc) { return rc; }
+      return b.GetVal(left,value);
+    default:
+      return ERROR_INSANE;
+    }
+  }
+  return ERROR_INSANE;
+}
+
+
+void BTreeIndex::NoteRemove(const BTreePath &path)
+{
+  SIZE_T level;
+
+  if (!summarized) {
+    return;
+  }
+  // The leaf has been written and knows its count already
+  for (level=0; level+1<path.depth; level++) {
+    summaries.Removed(path.entry[level].block);
+  }
+}
+
+
+ERROR_T BTreeIndex::DeleteInternal(const KEY_T &key)
+{
+  BTreePath path;
+  BTreeNodeView views[2];
+  const BTreeNode *found;
+  ERROR_T rc;
+  BorrowedKey testkey;
+
+  if (key.length!=superblock.info.keysize) {
+    return ERROR_SIZE;
+  }
+  rc=Descend(key,path,views,found,true);
+  if (rc) { return rc; }
+
+  const BTreePathEntry &leaf=path.entry[path.depth-1];
+
+  if (leaf.slot>=found->info.numkeys ||
+      !(testkey.At(found->ResolveKey(leaf.slot),found->info.keysize)==key)) {
+    return ERROR_NONEXISTENT;
+  }
+
+  // Just close the gap; a leaf is allowed to run empty, and Reorganize
+  // or a DeleteRange next to it folds it into a neighbour
+  BTreeNode &b=ScratchNode();
+  views[(path.depth-1)%2].MoveTo(b);
+  rc=BTreeShiftSlots(b,leaf.slot+1,leaf.slot);
+  if (rc) { return rc; }
+  if (fingerprinted) {
+    fingerprints.Expect(leaf.block,leaf.slot,-1);
+  }
+  rc=WriteNode(leaf.block,b);
+  if (rc==ERROR_SIZE && codec && b.info.numkeys>0) {
+    // Taking the key out made the leaf compress worse, and now it no
+    // longer fits in a block, so split it by putting its last pair
+    // back in
+    bool split;
+    rc=RewriteLeaf(path,b,b.info.numkeys-1,split);
+  }
+  if (rc) { return rc; }
+  NoteRemove(path);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::DeallocateNodes(const vector<SIZE_T> &nodes)
+{
+  ERROR_T rc;
+  SIZE_T i;
+
+  if (nodes.empty()) {
+    return ERROR_NOERROR;
+  }
+
+  // None of them are read, since nothing in them is wanted; each is
+  // simply overwritten with a free node pointing at the next
+  BTreeNode node(BTREE_UNALLOCATED_BLOCK,
+		 superblock.info.keysize,
+		 superblock.info.valuesize,
+		 GetBlockSize());
+
+  node.info.rootnode=superblock.info.rootnode;
+  for (i=0;i<nodes.size();i++) {
+    node.info.freelist= i+1<nodes.size() ? nodes[i+1] : superblock.info.freelist;
+    rc=WriteNode(nodes[i],node);
+    if (rc) { return rc; }
+    NotifyDeallocate(nodes[i]);
+    BTREE_STAT(stats.CountFree());
+  }
+
+  superblock.info.freelist=nodes[0];
+
+  lastpath.depth=0;
+
+  return WriteNode(superblock_index,superblock);
+}
+
+
+// Fold interior node r, the child after key sep of parent, into l,
+// the child before it, with sep coming down between them
+static ERROR_T MergeInterior(BTreeNode &parent, const SIZE_T sep, BTreeNode &l, const BTreeNode &r)
+{
+  ERROR_T rc;
+  SIZE_T ptr;
+  SIZE_T n=l.info.numkeys;
+
+  l.info.numkeys=n+1;
+  rc=l.SetKey(n,BorrowedKey().At(parent.ResolveKey(sep),parent.info.keysize));
+  if (rc) { return rc; }
+  rc=r.GetPtr(0,ptr);
+  if (rc) { return rc; }
+  rc=l.SetPtr(n+1,ptr);
+  if (rc) { return rc; }
+  rc=BTreeMoveSlots(r,0,r.info.numkeys,l,n+1);
+  if (rc) { return rc; }
+  l.info.numkeys=n+1+r.info.numkeys;
+  return ERROR_NOERROR;
+}
+
+
+// Move the first count children of interior node r over to the end of
+// l, its left sibling, through key sep of their parent
+static ERROR_T ShiftLeft(BTreeNode &parent, const SIZE_T sep, BTreeNode &l, BTreeNode &r, const SIZE_T count)
+{
+  ERROR_T rc;
+  SIZE_T ptr;
+  SIZE_T n=l.info.numkeys;
+  BorrowedKey key;
+
+  l.info.numkeys=n+count;
+  rc=l.SetKey(n,key.At(parent.ResolveKey(sep),parent.info.keysize));
+  if (rc) { return rc; }
+  rc=r.GetPtr(0,ptr);
+  if (rc) { return rc; }
+  rc=l.SetPtr(n+1,ptr);
+  if (rc) { return rc; }
+  rc=BTreeMoveSlots(r,0,count-1,l,n+1);
+  if (rc) { return rc; }
+  // Key count-1 of r now separates the two
+  rc=parent.SetKey(sep,key.At(r.ResolveKey(count-1),r.info.keysize));
+  if (rc) { return rc; }
+  rc=r.GetPtr(count,ptr);
+  if (rc) { return rc; }
+  rc=BTreeShiftSlots(r,count,0);
+  if (rc) { return rc; }
+  return r.SetPtr(0,ptr);
+}
+
+
+// The other way: the last count children of l go to the front of r
+static ERROR_T ShiftRight(BTreeNode &parent, const SIZE_T sep, BTreeNode &l, BTreeNode &r, const SIZE_T count)
+{
+  ERROR_T rc;
+  SIZE_T ptr;
+  SIZE_T n=l.info.numkeys;
+  BorrowedKey key;
+
+  rc=r.GetPtr(0,ptr);
+  if (rc) { return rc; }
+  rc=BTreeShiftSlots(r,0,count);
+  if (rc) { return rc; }
+  rc=r.SetKey(count-1,key.At(parent.ResolveKey(sep),parent.info.keysize));
+  if (rc) { return rc; }
+  rc=r.SetPtr(count,ptr);
+  if (rc) { return rc; }
+  rc=BTreeMoveSlots(l,n-count+1,count-1,r,0);
+  if (rc) { return rc; }
+  rc=l.GetPtr(n-count+1,ptr);
+  if (rc) { return rc; }
+  rc=r.SetPtr(0,ptr);
+  if (rc) { return rc; }
+  rc=parent.SetKey(sep,key.At(l.ResolveKey(n-count),l.info.keysize));
+  if (rc) { return rc; }
+  l.info.numkeys=n-count;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::RebalanceAlongPath(const BTreePath &path, bool &again)
+{
+  ERROR_T rc;
+  SIZE_T level;
+  SIZE_T sep;
+  SIZE_T other;
+  SIZE_T lblock;
+  SIZE_T rblock;
+  SIZE_T count;
+  bool   merge;
+  BTreeNode b;
+  BTreeNode sibling;
+  BTreeNode parent;
+
+  again=false;
+  for (level=path.depth-1; level>0; level--) {
+    const BTreePathEntry &e=path.entry[level];
+    const BTreePathEntry &up=path.entry[level-1];
+
+    rc=ReadNode(e.block,b);
+    if (rc) { return rc; }
+    rc=ReadNode(up.block,parent);
+    if (rc) { return rc; }
+    if (b.info.nodetype==BTREE_LEAF_NODE) {
+      // As in MergeLeaves, the parent must keep a key
+      if (parent.info.numkeys<2) {
+	continue;
+      }
+    } else if (b.info.numkeys>0) {
+      // Interior nodes only need help once they are down to one child
+      continue;
+    } else if (parent.info.numkeys==0) {
+      // So is the parent, so there is no neighbour to turn to until
+      // the parent has been dealt with, further up
+      again=true;
+      continue;
+    }
+
+    // Pair up with the next child, or the one before if we are last
+    if (up.slot<parent.info.numkeys) {
+      sep=up.slot;
+      rc=parent.GetPtr(sep+1,other);
+    } else {
+      sep=up.slot-1;
+      rc=parent.GetPtr(sep,other);
+    }
+    if (rc) { return rc; }
+    rc=ReadNode(other,sibling);
+    if (rc) { return rc; }
+    if (sibling.info.nodetype!=b.info.nodetype) {
+      return ERROR_INSANE;
+    }
+    BTreeNode &l= sep==up.slot ? b : sibling;
+    BTreeNode &r= sep==up.slot ? sibling : b;
+    lblock= sep==up.slot ? e.block : other;
+    rblock= sep==up.slot ? other : e.block;
+
+    if (b.info.nodetype==BTREE_LEAF_NODE) {
+      merge= l.info.numkeys+r.info.numkeys <= l.info.GetNumSlotsAsLeaf()*BTREE_REORG_FILL/100;
+      if (!merge) {
+	continue;
+      }
+      rc=BTreeMoveSlots(r,0,r.info.numkeys,l,l.info.numkeys);
+      if (rc) { return rc; }
+      l.info.numkeys+=r.info.numkeys;
+      if (!LeafFits(l)) {
+	l.info.numkeys-=r.info.numkeys;
+	continue;
+      }
+    } else {
+      merge= l.info.numkeys+1+r.info.numkeys <= b.info.GetNumSlotsAsInterior();
+      if (merge) {
+	rc=MergeInterior(parent,sep,l,r);
+      } else if (l.info.numkeys==0) {
+	// The neighbour is full, so take half of it
+	count=(r.info.numkeys+1)/2;
+	rc=ShiftLeft(parent,sep,l,r,count);
+      } else {
+	count=(l.info.numkeys+1)/2;
+	rc=ShiftRight(parent,sep,l,r,count);
+      }
+      if (rc) { return rc; }
+    }
+
+    if (!merge) {
+      rc=WriteNode(lblock,l);
+      if (rc) { return rc; }
+      rc=WriteNode(rblock,r);
+      if (rc) { return rc; }
+      rc=WriteNode(up.block,parent);
+      if (rc) { return rc; }
+      continue;
+    }
+
+    // l now covers r's range too, up to r's separator
+    rc=RemoveInteriorEntry(parent,sep);
+    if (rc) { return rc; }
+    if (parent.info.nodetype==BTREE_ROOT_NODE && parent.info.numkeys==0) {
+      // The root is down to one child, which is interior, since
+      // leaves never take the parent's last key.  It becomes the root,
+      // and the tree a level shorter.
+      l.info.nodetype=BTREE_ROOT_NODE;
+      rc=WriteNode(up.block,l);
+      if (rc) { return rc; }
+      rc=DeallocateNode(lblock);
+      if (rc) { return rc; }
+    } else {
+      rc=WriteNode(lblock,l);
+      if (rc) { return rc; }
+      rc=WriteNode(up.block,parent);
+      if (rc) { return rc; }
+    }
+    rc=DeallocateNode(rblock);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::DeleteRange(const KEY_T &low, const KEY_T &high)
+{
+  ERROR_T rc;
+  BTreeRangeEnd ends[2];
+  BTreeRangeEnd next[2];
+  SIZE_T nends;
+  SIZE_T nnext;
+  SIZE_T depth;
+  SIZE_T i;
+  SIZE_T offset;
+  SIZE_T first;
+  SIZE_T last;
+  SIZE_T lo;
+  SIZE_T hi;
+  SIZE_T child;
+  bool leaves;
+  bool again;
+  BTreeNode b;
+  BTreeNodeView view;
+  BTreePath path;
+  BorrowedKey testkey;
+  // Subtrees wholly inside the range, by their roots at this level and
+  // the next one down, and every block they take up
+  vector<SIZE_T> covered;
+  vector<SIZE_T> below;
+  vector<SIZE_T> freed;
+  // Keys an edge leaf couldn't be written without
+  vector<KEY_T> leftover;
+
+  if (low.length!=superblock.info.keysize || high.length!=superblock.info.keysize) {
+    return ERROR_SIZE;
+  }
+  if (high<low) {
+    return ERROR_NOERROR;
+  }
+
+  // Go down both edges of the range at once, as FoldRange does.  Each
+  // node the range only partly covers drops the children it wholly
+  // covers; the two leaves at the ends drop just the keys in it.
+  ends[0].node=superblock.info.rootnode;
+  ends[0].low=ends[0].high=true;
+  for (nends=1, depth=0; nends>0; depth++) {
+    if (depth==BTREE_MAX_DEPTH) {
+      return ERROR_INSANE;
+    }
+    leaves=false;
+    for (i=0, nnext=0; i<nends; i++) {
+      const BTreeRangeEnd &e=ends[i];
+      rc=ReadNode(e.node,b);
+      if (rc) { return rc; }
+
+      switch (b.info.nodetype) {
+      case BTREE_ROOT_NODE:
+      case BTREE_INTERIOR_NODE:
+	if (b.info.numkeys==0) {
+	  // Nothing in the index at all
+	  continue;
+	}
+	if (summarized) {
+	  // Whatever we take away, this node's count goes down
+	  summaries.Forget(e.node);
+	}
+	lo= e.low ? Route(b,low) : 0;
+	hi= e.high ? Route(b,high) : b.info.numkeys;
+	first= e.low ? lo+1 : 0;
+	last= e.high ? hi : b.info.numkeys+1;
+	for (offset=first; offset<last; offset++) {
+	  rc=b.GetPtr(offset,child);
+	  if (rc) { return rc; }
+	  below.push_back(child);
+	}
+	if (e.low && e.high && lo==hi) {
+	  rc=b.GetPtr(lo,next[nnext].node);
+	  if (rc) { return rc; }
+	  next[nnext].low=next[nnext].high=true;
+	  nnext++;
+	  break;
+	}
+	if (e.low) {
+	  rc=b.GetPtr(lo,next[nnext].node);
+	  if (rc) { return rc; }
+	  next[nnext].low=true;
+	  next[nnext].high=false;
+	  nnext++;
+	}
+	if (e.high) {
+	  rc=b.GetPtr(hi,next[nnext].node);
+	  if (rc) { return rc; }
+	  next[nnext].low=false;
+	  next[nnext].high=true;
+	  nnext++;
+	}
+	if (first>=last) {
+	  break;
+	}
+	if (first>0) {
+	  // The child before them takes over their range
+	  rc=BTreeShiftSlots(b,last-1,first-1);
+	} else {
+	  // Only an edge the high end cuts into loses its first
+	  // children, and then the child at last comes first
+	  rc=b.GetPtr(last,child);
+	  if (rc) { return rc; }
+	  rc=BTreeShiftSlots(b,last,0);
+	  if (rc) { return rc; }
+	  rc=b.SetPtr(0,child);
+	}
+	if (rc) { return rc; }
+	rc=WriteNode(e.node,b);
+	if (rc) { return rc; }
+	break;
+      case BTREE_LEAF_NODE:
+	leaves=true;
+	for (first=0; e.low && first<b.info.numkeys; first++) {
+	  if (!(testkey.At(b.ResolveKey(first),b.info.keysize)<low)) {
+	    break;
+	  }
+	}
+	for (last=first; last<b.info.numkeys; last++) {
+	  if (e.high && high<testkey.At(b.ResolveKey(last),b.info.keysize)) {
+	    break;
+	  }
+	}
+	if (last>first) {
+	  rc=BTreeShiftSlots(b,last,first);
+	  if (rc) { return rc; }
+	  rc=WriteNode(e.node,b);
+	  if (rc==ERROR_SIZE && codec) {
+	    // Taking the keys out made the leaf compress worse, so it
+	    // keeps them for now, and they go one at a time once the
+	    // rest of the range is gone
+	    rc=ReadNode(e.node,b);
+	    if (rc) { return rc; }
+	    for (offset=first; offset<last; offset++) {
+	      leftover.push_back(KEY_T());
+	      rc=b.GetKey(offset,leftover.back());
+	      if (rc) { return rc; }
+	    }
+	  }
+	  if (rc) { return rc; }
+	}
+	break;
+      default:
+	return ERROR_INSANE;
+      }
+    }
+
+    // The subtrees covered at this level are as deep as the edges, so
+    // only interior ones have to be read, to find their children
+    for (i=0; i<covered.size(); i++) {
+      if (!leaves) {
+	rc=ViewNode(covered[i],view);
+	if (rc) { return rc; }
+	const BTreeNode &v=view.Get();
+	if (v.info.nodetype!=BTREE_INTERIOR_NODE) {
+	  return ERROR_INSANE;
+	}
+	for (offset=0; offset<=v.info.numkeys; offset++) {
+	  rc=v.GetPtr(offset,child);
+	  if (rc) { return rc; }
+	  below.push_back(child);
+	}
+      }
+      freed.push_back(covered[i]);
+    }
+    covered.swap(below);
+    below.clear();
+
+    for (i=0; i<nnext; i++) {
+      ends[i]=next[i];
+    }
+    nends=nnext;
+  }
+  if (!covered.empty()) {
+    return ERROR_INSANE;
+  }
+
+  rc=DeallocateNodes(freed);
+  if (rc) { return rc; }
+
+  // Then mend the two edges, each of which may be left with leaves
+  // worth merging or interior nodes down to one child.  Descend would
+  // stop at those, so find the way down here.
+  for (i=0; i<2; ) {
+    const KEY_T &key= i==0 ? low : high;
+
+    for (path.depth=0, child=superblock.info.rootnode; ; path.depth++) {
+      if (path.depth==BTREE_MAX_DEPTH) {
+	return ERROR_INSANE;
+      }
+      rc=ViewNode(child,view);
+      if (rc) { return rc; }
+      const BTreeNode &v=view.Get();
+      BTreePathEntry &e=path.entry[path.depth];
+      e.block=child;
+      e.numkeys=v.info.numkeys;
+      e.slot=0;
+      if (v.info.nodetype==BTREE_LEAF_NODE ||
+	  (v.info.nodetype==BTREE_ROOT_NODE && v.info.numkeys==0)) {
+	// The edge, or else nothing is left in the index at all
+	path.depth++;
+	break;
+      }
+      e.slot=Route(v,key);
+      rc=v.GetPtr(e.slot,child);
+      if (rc) { return rc; }
+    }
+    rc=RebalanceAlongPath(path,again);
+    if (rc) { return rc; }
+    if (!again) {
+      i++;
+    }
+  }
+
+  // Separators may have moved without any node coming or going
+  lastpath.depth=0;
+
+  for (i=0; i<leftover.size(); i++) {
+    rc=DeleteInternal(leftover[i]);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::UpdateRange(const KEY_T &low, const KEY_T &high, BTreeModifier &modifier)
+{
+  ERROR_T rc;
+  SIZE_T slot;
+  bool changed;
+  bool done;
+  bool split;
+  BTreePath path;
+  BTreeNode b;
+  VALUE_T saved(superblock.info.valuesize);
+  KEY_T last;
+  BorrowedKey testkey;
+
+  if (low.length!=superblock.info.keysize || high.length!=superblock.info.keysize) {
+    return ERROR_SIZE;
+  }
+  if (high<low) {
+    return ERROR_NOERROR;
   }
-  for(offset = 0; offset < b.info.numkeys; offset++){
-    rc = b.GetPtr(offset, currPtr);
-    if(rc){return rc;}
-    return SanityDfs(currPtr);
+
+  rc=Descend(low,path,b);
+  if (rc==ERROR_NONEXISTENT && path.depth==1) {
+    // Nothing in the index at all
+    return ERROR_NOERROR;
+  }
+  if (rc) { return rc; }
+
+  slot=path.entry[path.depth-1].slot;
+  for (done=false; !done; ) {
+    for (changed=false; slot<b.info.numkeys; slot++) {
+      const KEY_T &key=testkey.At(b.ResolveKey(slot),b.info.keysize);
+      if (high<key) {
+	done=true;
+	break;
+      }
+      // Keep the value, so a failed change leaves it as it was
+      memcpy(saved.data,b.ResolveVal(slot),b.info.valuesize);
+      rc=modifier.Modify(key,b.ResolveVal(slot),b.info.valuesize);
+      if (rc) {
+	memcpy(b.ResolveVal(slot),saved.data,b.info.valuesize);
+	done=true;
+	break;
+      }
+      changed=true;
+    }
+    split=false;
+    if (changed) {
+      ERROR_T wrc;
+      wrc=b.GetKey(slot-1,last);
+      if (wrc) { return wrc; }
+      wrc=RewriteLeaf(path,b,slot-1,split);
+      if (wrc) { return wrc; }
+      NoteChange(path);
+    }
+    if (rc) { return rc; }
+    if (done) {
+      break;
+    }
+    if (split) {
+      // The leaf split under us, so find the last pair changed again
+      // and go on after it
+      rc=Descend(last,path,b);
+      if (rc) { return rc; }
+      slot=path.entry[path.depth-1].slot+1;
+      continue;
+    }
+    rc=NextLeaf(path,b);
+    if (rc==ERROR_NONEXISTENT) {
+      return ERROR_NOERROR;
+    }
+    if (rc) { return rc; }
+    slot=0;
   }
+  return ERROR_NOERROR;
+}
+
+
+void BTreeIndex::GetStats(BTreeStatCounters &counters) const
+{
+  stats.Get(counters);
+}
+
+
+void BTreeIndex::ResetStats()
+{
+  stats.Reset();
 }
 
 
@@ -3,6 +3,8 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <atomic>
 
 #include "global.h"
 #include "block.h"
@@ -10,6 +12,15 @@
 #include "buffercache.h"
 
 #include "btree_ds.h"
+#include "btree_aio.h"
+#include "btree_mmap.h"
+#include "btree_stats.h"
+#include "btree_trace.h"
+#include "btree_fingerprint.h"
+#include "btree_aggregate.h"
+#include "btree_compress.h"
+#include "btree_export.h"
+#include "btree_display.h"
 
 using namespace std;
 
@@ -32,48 +43,498 @@ struct KeyValuePair {
   KeyValuePair();
   KeyValuePair(const KEY_T &key, const VALUE_T &value);
   KeyValuePair(const KeyValuePair &rhs);
+  // Moves take rhs's bytes instead of copying them
+  KeyValuePair(KeyValuePair &&rhs);
   virtual ~KeyValuePair();
   KeyValuePair & operator=(const KeyValuePair &rhs);
+  KeyValuePair & operator=(KeyValuePair &&rhs);
 
 };
 
-enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE,BTREE_OP_LOOKUP};
+// A KEY_T that borrows its bytes from a node instead of holding a copy,
+// so keys can be compared where they lie without allocating.  Like a
+// BTreeNodeView, it lets go of the bytes before it is destroyed.
+class BorrowedKey {
+ private:
+  KEY_T key;
+
+ public:
+  ~BorrowedKey() { key.data=0; key.length=0; }
+
+  const KEY_T & At(const char *p, const SIZE_T len) { key.data=(char*)p; key.length=len; return key; }
+};
+
+enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE,BTREE_OP_LOOKUP,
+	      BTREE_OP_MODIFY};
+
+// A change to one value, for BTreeIndex::Modify.  Modify is handed the
+// valuesize bytes of the value where they sit in a copy of the leaf and
+// changes them in place.  Returning anything but ERROR_NOERROR leaves
+// the index as it was.
+class BTreeModifier {
+ public:
+  virtual ~BTreeModifier() {}
+
+  virtual ERROR_T Modify(const KEY_T &key, char *value, const SIZE_T valuesize) = 0;
+};
+
+enum BTreeDisplayType {BTREE_DEPTH, BTREE_DEPTH_DOT, BTREE_SORTED_KEYVAL, BTREE_JSON};
+
+// How much of a tree Display shows, so that a big one can be sampled.
+// By default it shows everything, as it is.
+struct BTreeDisplayOptions {
+  BTreeKeyFormat format;     // of keys and values
+  bool           values;     // show the values in leaves, not just keys
+  SIZE_T         maxdepth;   // levels to show below the root
+  SIZE_T         maxnodes;   // nodes to show in all, 0 for all of them
+  SIZE_T         maxkeys;    // keys to show of each node, 0 for all of them
+
+  BTreeDisplayOptions();
+};
+
+// Deepest tree we are willing to walk.  Even with tiny blocks the
+// fanout makes this far more levels than a disk can hold.
+#define BTREE_MAX_DEPTH 32
+
+// One level of a root-to-leaf descent: the block we visited, the slot
+// we took out of it (the pointer we followed for an interior node, the
+// key position for a leaf) and how many keys the node held
+struct BTreePathEntry {
+  SIZE_T block;
+  SIZE_T slot;
+  SIZE_T numkeys;
+};
+
+// Fixed-capacity stack of the nodes visited on the way down.
+// entry[0] is the root and entry[depth-1] is the deepest node.
+// Splits walk it back up instead of unwinding a recursion.
+struct BTreePath {
+  SIZE_T         depth;
+  BTreePathEntry entry[BTREE_MAX_DEPTH];
+
+  BTreePath() : depth(0) {}
+};
+
+// Bulk slot operations on a node's raw arrays, one memmove apiece.  A
+// slot is a key and its value in a leaf, and a key and the pointer
+// after it in an interior node, so either way the slots lie end to end
+// after the first pointer.  Each fails with ERROR_SIZE rather than run
+// off the end of a node.
+//
+// BTreeShiftSlots moves slots [first,numkeys) to start at to, opening
+// or closing a gap, and adjusts numkeys to match.
+ERROR_T BTreeShiftSlots(BTreeNode &b, const SIZE_T first, const SIZE_T to);
+// BTreeMoveSlots copies count slots from one node to another (or the
+// same one) without touching either's numkeys.
+ERROR_T BTreeMoveSlots(const BTreeNode &from, const SIZE_T first, const SIZE_T count,
+		       BTreeNode &to, const SIZE_T at);
+// BTreeSplitSlots leaves b with the slots below at and puts the rest in
+// right.  An interior node keeps pointers [0,at] and right gets the
+// pointers after key at, so key at itself is dropped; read it first.
+ERROR_T BTreeSplitSlots(BTreeNode &b, const SIZE_T at, BTreeNode &right);
+
+// Most lookups LookupBatch keeps in flight at once
+#define BTREE_BATCH_MAX 64
+
+// How many blocks ahead ordered traversals prefetch by default
+#define BTREE_READAHEAD 8
+
+// How many descents in a row have to land on the same or the next leaf
+// before they count as a sequential stream worth reading ahead of
+#define BTREE_SEQUENTIAL_RUN 2
+
+class BTreeIndex;
+
+// Preorder walk over every node under a root, driven by a BTreePath
+// instead of recursion.  For the walk, each entry's slot is the next
+// child pointer still to be visited.  Since the walk visits children in
+// key order, it keeps the index's readahead window of upcoming children
+// prefetching while it works through the current one.
+class BTreeWalk {
+ private:
+  const BTreeIndex &index;
+  SIZE_T       root;
+  bool         started;
+  BTreePath    path;
+  BTreeNodeView node[BTREE_MAX_DEPTH];
+
+ public:
+  BTreeWalk(const BTreeIndex &index, const SIZE_T root);
+
+  // Move to the next node in preorder
+  // return ERROR_NONEXISTENT once every node has been visited
+  ERROR_T Next();
+
+  SIZE_T GetDepth() const { return path.depth-1; }
+  SIZE_T GetBlock() const { return path.entry[path.depth-1].block; }
+  SIZE_T GetParent() const { return path.entry[path.depth-2].block; }
+  const BTreeNode & GetNode() const { return node[path.depth-1].Get(); }
+
+  // Don't go into the current node's children
+  void SkipChildren();
+
+  // The current node's ancestor at depth, and which of its pointers
+  // led here
+  const BTreeNode & GetNode(const SIZE_T depth) const { return node[depth].Get(); }
+  SIZE_T GetSlot(const SIZE_T depth) const { return path.entry[depth].slot-1; }
+};
+
+// How many decompressed leaves SetLeafCompression keeps by default
+#define BTREE_LEAF_CACHE 1024
+
+// Fill ratios are counted in tenths; the last bucket is completely full
+#define BTREE_FILL_BUCKETS 11
 
-enum BTreeDisplayType {BTREE_DEPTH, BTREE_DEPTH_DOT, BTREE_SORTED_KEYVAL};
+// What Verify found.  problem and badblock describe the first thing
+// that was wrong, if anything was.
+struct BTreeVerifyReport {
+  SIZE_T       nodes;        // reachable from the root
+  SIZE_T       leaves;
+  SIZE_T       leafdepth;
+  SIZE_T       freeblocks;   // on the free list
+  SIZE_T       leaked;       // neither reachable nor free
+  SIZE_T       badblock;
+  string       problem;
+
+  BTreeVerifyReport();
+
+  ostream & Print(ostream &os) const;
+};
+
+struct BTreeVerifyState;
+
+// What one level of the tree looks like
+struct BTreeLevelShape {
+  SIZE_T             nodes;
+  unsigned long long keys;
+  SIZE_T             capacity;   // keys a node on this level can hold
+  SIZE_T             fill[BTREE_FILL_BUCKETS];
+
+  BTreeLevelShape();
+
+  double GetFill() const { return nodes && capacity ? (double)keys/((double)nodes*capacity) : 0; }
+};
+
+// The shape of an index and how well it uses its blocks, as worked out
+// by BTreeIndex::Analyze
+struct BTreeShape {
+  SIZE_T             height;
+  SIZE_T             numblocks;
+  SIZE_T             nodes;         // reachable from the root
+  SIZE_T             freeblocks;    // on the free list
+  BTreeLevelShape    level[BTREE_MAX_DEPTH];
+
+  // Physical distance, in blocks, between each leaf and the next one
+  // in key order
+  unsigned long long leafdistance;
+  SIZE_T             leafpairs;
+  SIZE_T             adjacentleaves;  // pairs where the next leaf is the next block
+
+  // Nodes a rebuild with every node packed full would take
+  SIZE_T             rebuiltnodes;
+
+  BTreeShape();
+
+  double GetAverageLeafDistance() const { return leafpairs ? (double)leafdistance/leafpairs : 0; }
+
+  ostream & Print(ostream &os) const;
+  ostream & PrintJSON(ostream &os) const;
+};
+
+// A leaf only takes in its right neighbour if the two together fill
+// no more than this percentage of a leaf, leaving room for inserts
+#define BTREE_REORG_FILL 90
+
+// How far down the free list Reorganize looks for a block it wants
+// before giving up on putting a leaf there
+#define BTREE_REORG_FREESCAN 16
+
+// How full a BTreeBuilder fills each node by default, in percent,
+// leaving room for inserts afterwards
+#define BTREE_BUILD_FILL 90
+
+// Where an incremental BTreeIndex::Reorganize pass has got to.  A new
+// cursor starts a new pass.
+struct BTreeReorgCursor {
+  KEY_T              key;        // greatest key of the last leaf dealt with
+  bool               started;
+  bool               done;       // the pass got past the last leaf
+  SIZE_T             lastblock;  // where that leaf ended up
+  SIZE_T             leaves;     // leaves dealt with
+  SIZE_T             merged;     // leaves folded into their left neighbour
+  SIZE_T             moved;      // leaves moved next to their left neighbour
+
+  BTreeReorgCursor();
+};
+
+struct BTreeVerifyTask;
+class BTreeBuilder;
+class BTreeLoader;
 
 class BTreeIndex {
+  friend class BTreeWalk;
+  friend struct BTreeVerifyTask;
+  friend class BTreeBuilder;
+  friend class BTreeLoader;
+  template <class Key, class Value, class Compare, SIZE_T BlockSize> friend class BTreeIndexT;
+
  private:
   BufferCache *buffercache;
+  BTreeMmapStore *mapped;
+  BTreeAsyncIO *aio;
   SIZE_T       superblock_index;
   BTreeNode    superblock;
 
+  // Memory mode: the whole cache is copied into memory, which mapped
+  // points at, on Attach, and what changed goes back on Detach
+  bool         inmemory;
+  BTreeMmapStore *memory;
+
+  // Copy every block of the cache into a new memory, or the blocks
+  // that changed back into the cache
+  ERROR_T      LoadMemory(const bool create);
+  ERROR_T      DumpMemory();
+  void         FreeMemory();
+
+  // The last descent, along with the key range covered by the subtree
+  // at each level, so the next descent can restart from the deepest
+  // ancestor that still covers its key.  lastlow is exclusive, lasthigh
+  // inclusive, and each only counts if its bounded flag is set; the
+  // keys' buffers are kept and reused.  Allocating or freeing a node
+  // changes the shape of the tree and forgets it.
+  BTreePath    lastpath;
+  KEY_T        lastlow[BTREE_MAX_DEPTH];
+  KEY_T        lasthigh[BTREE_MAX_DEPTH];
+  bool         lowbounded[BTREE_MAX_DEPTH];
+  bool         highbounded[BTREE_MAX_DEPTH];
+
+  // Readahead.  seqrun counts descents in a row that stayed on the
+  // last leaf (lastleaf, reached through the path entry lastparent)
+  // or moved on to the next one.  Readahead for children of rablock
+  // has already been issued up to raslot.
+  SIZE_T       readahead;
+  SIZE_T       seqrun;
+  SIZE_T       lastleaf;
+  BTreePathEntry lastparent;
+  SIZE_T       rablock;
+  SIZE_T       raslot;
+
+  // Nodes read and written since the index was built.  Atomic, since
+  // Verify reads from several threads.
+  mutable atomic<SIZE_T> numreads;
+  mutable atomic<SIZE_T> numwrites;
+
+  // Everything else worth counting; see btree_stats.h
+  mutable BTreeStats stats;
+
+  // Where public operations are traced to, if anywhere
+  BTreeTraceRecorder *trace;
+
+  // Leaf key fingerprints for point lookups, if fingerprinted.  Kept
+  // up to date by WriteNode.
+  bool         fingerprinted;
+  mutable BTreeFingerprints fingerprints;
+
+  // Key counts, and aggregate if there is one, of every subtree, if
+  // summarized.  Kept up to date by WriteNode, NoteInsert and
+  // NoteChange.
+  bool         summarized;
+  const BTreeAggregate *aggregate;
+  mutable BTreeSummaries summaries;
+
+  // Leaves leafsize bytes long, each compressed by codec into a block,
+  // if codec isn't 0, with the latest ones kept decompressed in
+  // leafcache.  Kept up to date by WriteNode.
+  const BTreeLeafCodec *codec;
+  SIZE_T       leafsize;
+  mutable BTreeLeafCache leafcache;
+
+  // Interior nodes, the root among them, interiorsize bytes long at the
+  // front of their block, or a whole block if it is 0.  The superblock
+  // has no keys, so it keeps this in its numkeys, which every index
+  // made before had as 0.
+  SIZE_T       interiorsize;
+
  protected:
 
+  // Every node the index reads or writes goes through these, so that
+  // with async I/O turned on, writes go behind us and reads see them
+  ERROR_T      ReadNode(const SIZE_T &node, BTreeNode &b) const;
+
+  ERROR_T      WriteNode(const SIZE_T &node, const BTreeNode &b) const;
+
+  // Tell the buffer cache, if there is one, that a block was allocated
+  // or freed, under the async I/O lock when aio shares the cache
+  void         NotifyAllocate(const SIZE_T &node) const;
+
+  void         NotifyDeallocate(const SIZE_T &node) const;
+
+  // Read a node only to look at it.  From a mapped store this does not
+  // copy the node at all.
+  ERROR_T      ViewNode(const SIZE_T &node, BTreeNodeView &b) const;
+
+  // Start pulling a node in without waiting for it.  This only does
+  // anything with async I/O or a mapped store.
+  void         PrefetchNode(const SIZE_T &node) const;
+
+  // Issue readahead for the children of interior node b (at block
+  // node) after slot, unless it has been issued already
+  void         ReadAhead(const SIZE_T &node, const BTreeNode &b, const SIZE_T slot);
+
+  // Note the leaf a descent ended on and read ahead once descents look
+  // sequential.  parent is the leaf's parent if this descent read it.
+  void         NoteLeaf(const BTreePath &path, const BTreeNode *parent);
+
+  // Geometry of whichever store the index lives on
+  SIZE_T       GetBlockSize() const;
+
+  SIZE_T       GetNumBlocks() const;
+
+  // How big a new leaf is: a block, or more with compressed leaves
+  SIZE_T       GetLeafSize() const;
+
+  // How big an interior node is: a block, or less if set so
+  SIZE_T       GetInteriorSize() const;
+
+  // Whether leaf b can be written, which for a compressed leaf means
+  // whether it compresses into a block
+  bool         LeafFits(const BTreeNode &b) const;
+
   ERROR_T      AllocateNode(SIZE_T &node);
 
   ERROR_T      DeallocateNode(const SIZE_T &node);
 
-  ERROR_T      LookupOrUpdateInternal(const SIZE_T &Node,
-				      const BTreeOp op,
+  // Free a batch of nodes without reading them, writing the superblock
+  // once for all of them
+  ERROR_T      DeallocateNodes(const vector<SIZE_T> &nodes);
+
+  // Walk from the root (or the deepest still-valid ancestor of the
+  // last descent) down to the leaf that holds or would hold key.
+  // On return path covers every level and leaf holds the leaf node;
+  // the leaf entry's slot is the first key not less than key.
+  // return ERROR_NONEXISTENT if the tree is empty
+  ERROR_T      Descend(const KEY_T &key, BTreePath &path, BTreeNode &leaf);
+
+  // Same, but without copying the leaf out: it is left in one of views,
+  // and leaf points at it.  Nothing is allocated along the way when the
+  // store is mapped.  With exact, the caller only wants key itself, and
+  // if it isn't there the leaf's slot may just be past its last key.
+  ERROR_T      Descend(const KEY_T &key, BTreePath &path, BTreeNodeView views[2],
+		       const BTreeNode *&leaf, const bool exact=false);
+
+  // Move path, which ends at a leaf, on to the next leaf in key order
+  // and read it into leaf.
+  // return ERROR_NONEXISTENT if path was at the last leaf
+  ERROR_T      NextLeaf(BTreePath &path, BTreeNode &leaf);
+
+  // Each thread's node for point operations to change a leaf in, so
+  // that once a thread has done one, the next ones have a buffer to
+  // reuse instead of allocating
+  static BTreeNode & ScratchNode();
+
+  // With replaced, a key that is already there has its value replaced
+  // instead of being a conflict, and *replaced says whether it was
+  ERROR_T      InsertInternal(const KEY_T &key, const VALUE_T &value, bool *replaced=0);
+
+  ERROR_T      DeleteInternal(const KEY_T &key);
+
+  ERROR_T      ScanInternal(const KEY_T &low, const SIZE_T max, vector<KeyValuePair> &out);
+
+  // BTREE_OP_MODIFY hands the value to modifier and writes the leaf
+  // back only if it succeeds
+  ERROR_T      LookupOrUpdateInternal(const BTreeOp op,
 				      const KEY_T &key,
-				      VALUE_T &val);
+				      VALUE_T &val,
+				      BTreeModifier *modifier=0);
+
+  // One batch of at most BTREE_BATCH_MAX lookups
+  ERROR_T      LookupBatchInternal(const KEY_T *keys,
+				   VALUE_T *values,
+				   ERROR_T *rcs,
+				   const SIZE_T n);
 
 
   ERROR_T      DisplayInternal(const SIZE_T &node,
-			       ostream &o,
-			       const BTreeDisplayType display_type=BTREE_DEPTH) const;
+			       BTreeDisplayWriter &o,
+			       const BTreeDisplayType display_type,
+			       const BTreeDisplayOptions &options,
+			       bool &truncated) const;
+
+
+  // Split helpers.  Each one works on the node at a given path entry,
+  // already read into b, and inserts at that entry's slot.  When a node
+  // splits, key and right come back holding the separator and the new
+  // right sibling that the parent has to take in.
+  ERROR_T     Leaf_No_Split(BTreeNode &b, const BTreePathEntry &e, const KEY_T &key, const VALUE_T &value);
+
+  ERROR_T     Leaf_Split(BTreeNode &b, const BTreePathEntry &e, KEY_T &key, const VALUE_T &value, SIZE_T &right);
+
+  ERROR_T     Interior_Split(BTreeNode &b, const BTreePathEntry &e, KEY_T &key, SIZE_T &right);
+
+  ERROR_T     Root_Split(BTreeNode &b, const BTreePathEntry &e, const KEY_T &key, const SIZE_T &right);
+
+  ERROR_T     Interior_No_Split(BTreeNode &b, const BTreePathEntry &e, const KEY_T &key, const SIZE_T &right);
+
+  // Check one node found by Verify at depth, whose keys must lie in
+  // (low, high], with an empty key meaning unbounded
+  ERROR_T     VerifyNode(BTreeVerifyState &state, const SIZE_T block, const BTreeNode &b,
+			 const SIZE_T depth, const KEY_T &low, const KEY_T &high) const;
+
+  // Check a whole subtree, streaming through it one path at a time
+  ERROR_T     VerifySubtree(BTreeVerifyState &state, const SIZE_T root,
+			    const SIZE_T depth, const KEY_T &low, const KEY_T &high) const;
 
+  // Insert into the leaf at the bottom of path, then carry any split up
+  // the path until some ancestor has room
+  ERROR_T     InsertAlongPath(const BTreePath &path, BTreeNode &leaf, const KEY_T &key, const VALUE_T &value);
 
-  ERROR_T      recurse(SIZE_T &node, KEY_T &key, VALUE_T &value, bool &split, SIZE_T &left, SIZE_T &right);
+  // Write back the leaf at the bottom of path after the value at slot
+  // changed in place.  If the leaf no longer compresses into a block,
+  // it is split around that pair instead, and split says so.
+  ERROR_T     RewriteLeaf(const BTreePath &path, BTreeNode &leaf, const SIZE_T slot, bool &split);
 
+  // Tell the subtree summaries that a key went into the leaf at the
+  // bottom of path, or that a value there changed.  The leaf itself has
+  // to have been written already.
+  void        NoteInsert(const BTreePath &path);
 
-  ERROR_T     SanityDfs(SIZE_T &node) const;
+  void        NoteChange(const BTreePath &path);
 
-  ERROR_T     Interior_Split(SIZE_T &node, KEY_T &key, SIZE_T &left, SIZE_T &right);
+  void        NoteRemove(const BTreePath &path);
 
-  ERROR_T     Root_Split(SIZE_T &node, KEY_T &key, SIZE_T &left, SIZE_T &right);
+  // Walk back up path after a DeleteRange, folding each node into a
+  // neighbour or taking children from it where it has to: leaves when
+  // the two fit comfortably in one, interior nodes when they are down to
+  // a single child.  A root left with one child gives way to it.  again
+  // comes back set if a node had to be passed over because its parent
+  // was down to one child as well, and the walk has to be done again.
+  ERROR_T     RebalanceAlongPath(const BTreePath &path, bool &again);
 
-  ERROR_T     Interior_No_Split(SIZE_T &node, KEY_T &key, SIZE_T &left, SIZE_T &right);
+  // The number of keys under block, at depth, and their aggregate (0
+  // without one), working them out from its children if they aren't
+  // known
+  ERROR_T     Summarize(const SIZE_T block, const SIZE_T depth, SIZE_T &n, const char *&agg);
+
+  // Count the keys in [low,high] into n and fold them into agg, if it
+  // isn't 0
+  ERROR_T     FoldRange(const KEY_T &low, const KEY_T &high, SIZE_T &n, char *agg);
+
+  // Fold the leaf at the bottom of path's right siblings under the same
+  // parent into it while they fit, freeing them
+  ERROR_T     MergeLeaves(BTreeReorgCursor &cursor, BTreePath &path, BTreeNode &leaf);
+
+  // Move the leaf at the bottom of path to the block after the last
+  // one the cursor placed, if that can be done cheaply, and remember
+  // where the next leaf should go
+  ERROR_T     MoveLeaf(BTreeReorgCursor &cursor, BTreePath &path, const BTreeNode &leaf);
+
+  // Find the node pointing at block by routing key down from the root
+  // return ERROR_NONEXISTENT if the way down doesn't pass through it
+  ERROR_T     FindParent(const SIZE_T block, const KEY_T &key, SIZE_T &parent, SIZE_T &slot) const;
+
+  // Take block, which holds the free node b, off the free list
+  // return ERROR_NONEXISTENT if it isn't near enough the head
+  ERROR_T     ClaimFreeNode(const SIZE_T block, const BTreeNode &b);
 
 //  ERROR_T
 public:
@@ -92,6 +553,12 @@ public:
 	     BufferCache *cache,
 	     bool unique=true);   // true if a  key maps to a single value
 
+  // Same, but the index lives in a memory-mapped image instead of
+  // going through a buffer cache.  Async I/O does not apply.
+  BTreeIndex(SIZE_T keysize,
+	     SIZE_T valuesize,
+	     BTreeMmapStore *store,
+	     bool unique=true);
 
   BTreeIndex();
   BTreeIndex(const BTreeIndex &rhs);
@@ -107,8 +574,85 @@ public:
   // you need to find the elements of the tree.
   // return zero on success or ERROR_NOTANINDEX if we are
   // giving you an incorrect block to start with
+  // return ERROR_BADCONFIG if the index has compact interior nodes and
+  // async I/O is on
   ERROR_T Attach(const SIZE_T initblock, const bool create=false );
 
+  // Keep the whole index in memory while it is attached, for an index
+  // on a buffer cache that only has to be on disk between runs.  Attach
+  // reads every block of the cache into one image in anonymous memory,
+  // and from then on nodes are read and written there as in a mapped
+  // store, never touching the cache, which also lets Verify and Load use
+  // threads.  Detach writes the blocks that changed back into the cache
+  // in the usual format, so the index can be attached again either way.
+  // Anything not detached is lost, including when the index is
+  // destroyed or attached again.  A copy of the index doesn't share the
+  // image; it sees what was last detached.  Takes effect at the next
+  // Attach.
+  // return ERROR_BADCONFIG if the index isn't on a buffer cache
+  ERROR_T SetInMemory(const bool on);
+
+  // Route node I/O through aio: node writes are queued behind the
+  // caller, and LookupBatch keeps each level's reads in flight
+  // together.  aio must be built on this index's cache and must not be
+  // changed while operations are running.  Pass 0 to go back to plain
+  // synchronous I/O; Detach flushes any queued writes.
+  // return ERROR_BADCONFIG with compressed leaves or compact interior
+  // nodes, which are read and written around it
+  ERROR_T SetAsyncIO(BTreeAsyncIO *aio);
+
+  // How many child blocks ahead ordered traversals, and point
+  // operations that walk the keys in order, prefetch.  0 turns
+  // readahead off.  The default is BTREE_READAHEAD.
+  void SetReadahead(const SIZE_T blocks);
+
+  // Trace every Insert, Lookup, Update, Delete, Scan and LookupBatch
+  // to recorder, which must already be open and outlive the tracing.
+  // Pass 0 to stop.
+  void SetTrace(BTreeTraceRecorder *recorder);
+
+  // Keep a byte-sized fingerprint of every leaf key in memory, so that
+  // Lookup and Update only compare in full the keys in a leaf that
+  // might be theirs; see btree_fingerprint.h.  Off by default.
+  void SetFingerprints(const bool on);
+
+  // Keep the number of keys under every node in memory, along with
+  // aggregate's summary of their pairs if aggregate isn't 0, so that
+  // Count, CountRange, AggregateRange, Rank and Select read only a
+  // couple of nodes a level; see btree_aggregate.h.  Nothing is known
+  // at first, so the first of them reads whatever it covers.  Off by
+  // default; aggregate must outlive its use.
+  void SetSummaries(const bool on, const BTreeAggregate *aggregate=0);
+
+  // Let each leaf made from now on, whether new or half of a split,
+  // hold blocks blocks' worth of pairs, compressed by codec into one
+  // block, and keep the cached leaves used last decompressed in memory;
+  // see btree_compress.h.  A leaf that stops compressing into a block
+  // splits early.  Leaves already there stay as they are until they
+  // split.  codec has to outlive the index and be set again every time
+  // it is attached, since its leaves can't be read without it.  Pass 0
+  // to stop, which only makes sense before any leaf was compressed.
+  // Leaves are compressed and read synchronously, so this does not go
+  // with async I/O.
+  // return ERROR_BADCONFIG with async I/O on, or if blocks is 0
+  ERROR_T SetLeafCompression(const BTreeLeafCodec *codec, const SIZE_T blocks=4,
+			     const SIZE_T cached=BTREE_LEAF_CACHE);
+
+  // Make interior nodes, the root among them, size bytes long instead
+  // of a whole block, in an index about to be created with
+  // Attach(initblock,true).  Each still takes a block of its own, but
+  // holds fewer keys, so a descent reads and searches less of each
+  // level on its way down, at the cost of more levels.  0 means a whole
+  // block, which is the default.  The size is kept in the superblock,
+  // and an index that already exists always goes by that: attaching it
+  // replaces whatever was set here.  Large leaves come from
+  // SetLeafCompression.  Compact nodes are written a block at a time,
+  // so this does not go with async I/O.
+  // return ERROR_SIZE if size is more than a block, or leaves room for
+  // fewer than three keys
+  // return ERROR_BADCONFIG with async I/O on, or once attached
+  ERROR_T SetInteriorSize(const SIZE_T size);
+
   // This is called after all inserts, updates, or deletes are done.
   // We expect you to tell us the number of your superblock, which
   // we will return to you on the next attach
@@ -125,20 +669,155 @@ public:
   // return ERROR_SIZE if the key or value are the wrong size for this index
   ERROR_T Update(const KEY_T &key, const VALUE_T &value);
 
+  // Insert, or Update if the key is already there, in one descent
+  // return zero on success
+  // return ERROR_NOSPACE if you run out of disk space
+  // return ERROR_SIZE if the key or value are the wrong size for this index
+  ERROR_T Upsert(const KEY_T &key, const VALUE_T &value);
+
+  // Update to desired only if the value is still expected, in one
+  // descent
+  // return zero on success
+  // return ERROR_NONEXISTENT  if the key doesn't exist
+  // return ERROR_CONFLICT if the value isn't expected
+  // return ERROR_SIZE if the key or values are the wrong size for this index
+  ERROR_T CompareAndSwap(const KEY_T &key, const VALUE_T &expected, const VALUE_T &desired);
+
+  // Read, change and write back the key's value with modifier, in one
+  // descent, writing only the leaf that holds it
+  // return zero on success
+  // return ERROR_NONEXISTENT  if the key doesn't exist
+  // return ERROR_SIZE if the key is the wrong size for this index
+  // return whatever modifier returns if it fails
+  ERROR_T Modify(const KEY_T &key, BTreeModifier &modifier);
+
+  // Leaves are not merged as they empty; Reorganize or a DeleteRange
+  // next to them does that
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
   ERROR_T Delete(const KEY_T &key);
 
+  // Delete every key in [low,high].  Subtrees wholly inside the range
+  // are unhooked and freed as they stand, reading only their interior
+  // nodes; just the two leaves at the ends of the range have keys taken
+  // out of them, and then the two edges are rebalanced once.
+  // return zero on success, whether or not there was anything to delete
+  // return ERROR_SIZE if the keys are the wrong size for this index
+  ERROR_T DeleteRange(const KEY_T &low, const KEY_T &high);
+
+  // Modify every pair in [low,high] with modifier, in key order, leaf
+  // by leaf, writing each leaf back once.  It stops at the first pair
+  // modifier fails on, which is left as it was, along with the pairs
+  // after it, and returns what modifier did.
+  // return ERROR_SIZE if the keys are the wrong size for this index
+  ERROR_T UpdateRange(const KEY_T &low, const KEY_T &high, BTreeModifier &modifier);
+
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
 
+  // Look up n keys at once.  rcs[i] gets what Lookup would have
+  // returned for keys[i] and values[i] gets its value.  The lookups
+  // descend together a level at a time, so a node on the way to
+  // several of them is read once for all of them.
+  // return zero unless a node could not be read or makes no sense
+  ERROR_T LookupBatch(const KEY_T *keys, VALUE_T *values, ERROR_T *rcs, const SIZE_T n);
+
+  // Put into out, in key order, the first max pairs whose keys are not
+  // less than low.  Running off the end of the index is not an error;
+  // out just comes back short.
+  ERROR_T Scan(const KEY_T &low, const SIZE_T max, vector<KeyValuePair> &out);
+
+  // Range queries, which need SetSummaries and otherwise return
+  // ERROR_BADCONFIG.  Count gives the number of keys in the index and
+  // CountRange the number in [low,high].  AggregateRange folds the
+  // pairs in [low,high] into agg, which has room for the aggregate
+  // given to SetSummaries (ERROR_BADCONFIG if there was none).  Rank
+  // gives the number of keys less than key, and Select the pair with
+  // rank keys before it, or ERROR_NONEXISTENT past the end; together
+  // with Count they give quantiles.
+  ERROR_T Count(SIZE_T &n);
+  ERROR_T CountRange(const KEY_T &low, const KEY_T &high, SIZE_T &n);
+  ERROR_T AggregateRange(const KEY_T &low, const KEY_T &high, char *agg);
+  ERROR_T Rank(const KEY_T &key, SIZE_T &rank);
+  ERROR_T Select(const SIZE_T rank, KEY_T &key, VALUE_T &value);
+
+  SIZE_T GetKeySize() const { return superblock.info.keysize; }
+  SIZE_T GetValueSize() const { return superblock.info.valuesize; }
+
+  // How many nodes the index has read and written so far
+  SIZE_T GetNumNodeReads() const { return numreads; }
+  SIZE_T GetNumNodeWrites() const { return numwrites; }
+
+  // Counters and latency histograms, added up over every thread that
+  // has used the index.  All zero unless built with BTREE_STATS.
+  void GetStats(BTreeStatCounters &counters) const;
+
+  void ResetStats();
+
   // Here you should figure out if your index makes sense
   // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
   // a valid use ratio?
   ERROR_T SanityCheck() const;
 
+  // Check everything: node types and sizes, keys in order and inside
+  // the bounds set by the separators above them, every leaf at the same
+  // depth, no block reachable twice, and every block either reachable,
+  // on a free list without cycles, or the superblock.  Subtrees are
+  // checked on up to threads threads, each holding only one path of
+  // nodes at a time.  A plain BufferCache can't be read from more than
+  // one thread, so without async I/O or a mapped store the check runs
+  // on the caller's thread.
+  // return ERROR_BADCONFIG for keys out of order or out of bounds, and
+  // ERROR_INSANE for anything else wrong
+  ERROR_T Verify(const SIZE_T threads, BTreeVerifyReport *report=0) const;
+
+  // Walk the whole index, and its free list, working out its shape:
+  // height, nodes and keys per level, how full the nodes are, how far
+  // apart neighbouring leaves are on disk, and what a rebuild would
+  // save.  The walk streams, holding one node per level.
+  ERROR_T Analyze(BTreeShape &shape) const;
+
+  // Do one bounded step of online reorganization: deal with at most
+  // leaves leaves, in key order, from where cursor left off.  Each leaf
+  // first takes in the following leaves under the same parent while
+  // they fit (see BTREE_REORG_FILL), and then moves to the block after
+  // the previous leaf, trading places with whatever node was there and
+  // fixing up the parent pointers.  After a whole pass the leaves are
+  // fuller and mostly laid out in key order, which is what scans and
+  // readahead want.  A free block is only taken for a leaf if it is
+  // near the head of the free list (see BTREE_REORG_FREESCAN), so after
+  // a lot of frees a rebuild lays the leaves out better.  Other
+  // operations may run between steps; a pass that races with them just
+  // does less.  cursor.done is set once the pass is over.
+  ERROR_T Reorganize(BTreeReorgCursor &cursor, const SIZE_T leaves);
+
+  // Write every pair to os, in key order, in the format of
+  // btree_export.h, streaming through the leaves
+  // return ERROR_NOSPACE if os fails
+  ERROR_T Export(ostream &os) const;
+
+  // Build the index out of what Export wrote, bottom up with a
+  // BTreeBuilder filling nodes to fill percent.  The index has to be
+  // empty.
+  // return ERROR_NOTANINDEX if is doesn't start like an export
+  // return ERROR_SIZE if its keys or values are the wrong size
+  // return ERROR_INSANE if it is cut short or damaged
+  // return ERROR_BADCONFIG if the index isn't empty or the keys are out of order
+  // return ERROR_NOSPACE if the index runs out of blocks
+  ERROR_T Import(istream &is, const SIZE_T fill=BTREE_BUILD_FILL);
+
+  // Build the index out of n pairs in any order, packed back to back at
+  // pairs as each key's bytes followed by its value's, with a
+  // BTreeLoader sorting them and filling leaves on threads threads.  The
+  // index has to be empty.
+  // return ERROR_CONFLICT if a key is there more than once
+  // return ERROR_BADCONFIG if the index isn't empty
+  // return ERROR_NOSPACE if the index runs out of blocks
+  ERROR_T Load(const char *pairs, const size_t n, const SIZE_T threads,
+	       const SIZE_T fill=BTREE_BUILD_FILL);
+
   // Display tree
   // BTREE_DEPTH means to do a depth first traversal of
   // the tree, printing each node
@@ -149,8 +828,20 @@ public:
   // key/value pairs in the leaves, one "(key, value)" tuple
   // per line.  This will be the keys and values in the tree
   // sorted in order of keys.
+  // BTREE_JSON means to write one JSON object with the index's
+  // geometry and an array of its nodes in the same order, each with its
+  // block, parent, depth, type, numkeys, keys, and either children or
+  // values.  Its "truncated" says whether options.maxnodes or
+  // options.maxdepth left any nodes out.
+  // Output is gathered up and written a buffer at a time.
+  // return ERROR_NOSPACE if o fails
   ERROR_T Display(ostream &o, BTreeDisplayType display_type=BTREE_DEPTH) const;
 
+  // Same, showing only what options ask for.  Nodes below maxdepth are
+  // not even read.
+  ERROR_T Display(ostream &o, BTreeDisplayType display_type,
+		  const BTreeDisplayOptions &options) const;
+
   ostream & Print(ostream &os) const;
 
 };
@@ -0,0 +1,204 @@
+#include <string.h>
+
+#include "btree_aggregate.h"
+
+
+static unsigned long long ValueOf(const char *value, const SIZE_T valuesize)
+{
+  unsigned long long v=0;
+  SIZE_T i;
+
+  for (i=0;i<valuesize && i<8;i++) {
+    v|=(unsigned long long)(unsigned char)value[i]<<(8*i);
+  }
+  return v;
+}
+
+
+SIZE_T BTreeValueSum::GetSize() const
+{
+  return sizeof(unsigned long long);
+}
+
+
+void BTreeValueSum::Identity(char *agg) const
+{
+  unsigned long long zero=0;
+
+  memcpy(agg,&zero,sizeof(zero));
+}
+
+
+void BTreeValueSum::Add(char *agg, const char *key, const SIZE_T keysize,
+			const char *value, const SIZE_T valuesize) const
+{
+  unsigned long long sum;
+
+  memcpy(&sum,agg,sizeof(sum));
+  sum+=ValueOf(value,valuesize);
+  memcpy(agg,&sum,sizeof(sum));
+}
+
+
+void BTreeValueSum::Combine(char *agg, const char *other) const
+{
+  unsigned long long sum;
+  unsigned long long more;
+
+  memcpy(&sum,agg,sizeof(sum));
+  memcpy(&more,other,sizeof(more));
+  sum+=more;
+  memcpy(agg,&sum,sizeof(sum));
+}
+
+
+SIZE_T BTreeValueMinMax::GetSize() const
+{
+  return 2*sizeof(unsigned long long);
+}
+
+
+void BTreeValueMinMax::Identity(char *agg) const
+{
+  unsigned long long m[2]={~0ULL,0};
+
+  memcpy(agg,m,sizeof(m));
+}
+
+
+void BTreeValueMinMax::Add(char *agg, const char *key, const SIZE_T keysize,
+			   const char *value, const SIZE_T valuesize) const
+{
+  unsigned long long v=ValueOf(value,valuesize);
+  unsigned long long m[2]={v,v};
+
+  Combine(agg,(const char *)m);
+}
+
+
+void BTreeValueMinMax::Combine(char *agg, const char *other) const
+{
+  unsigned long long m[2];
+  unsigned long long o[2];
+
+  memcpy(m,agg,sizeof(m));
+  memcpy(o,other,sizeof(o));
+  if (o[0]<m[0]) {
+    m[0]=o[0];
+  }
+  if (o[1]>m[1]) {
+    m[1]=o[1];
+  }
+  memcpy(agg,m,sizeof(m));
+}
+
+
+BTreeSummaries::BTreeSummaries() : aggregate(0), aggsize(0)
+{}
+
+
+void BTreeSummaries::Reset(const SIZE_T numblocks, const BTreeAggregate *agg)
+{
+  aggregate=agg;
+  aggsize=agg ? agg->GetSize() : 0;
+  count.assign(numblocks,BTREE_SUMMARY_UNKNOWN);
+  aggs.assign((size_t)numblocks*aggsize,0);
+  aggknown.assign(agg ? numblocks : 0,false);
+}
+
+
+void BTreeSummaries::Clear()
+{
+  aggregate=0;
+  aggsize=0;
+  vector<SIZE_T>().swap(count);
+  vector<char>().swap(aggs);
+  vector<bool>().swap(aggknown);
+}
+
+
+void BTreeSummaries::Note(const SIZE_T block, const BTreeNode &b)
+{
+  if (block>=count.size()) {
+    return;
+  }
+  count[block]= b.info.nodetype==BTREE_LEAF_NODE ? b.info.numkeys : BTREE_SUMMARY_UNKNOWN;
+  if (aggregate) {
+    aggknown[block]=false;
+  }
+}
+
+
+void BTreeSummaries::Inserted(const SIZE_T block)
+{
+  if (block>=count.size()) {
+    return;
+  }
+  if (count[block]!=BTREE_SUMMARY_UNKNOWN) {
+    count[block]++;
+  }
+  if (aggregate) {
+    aggknown[block]=false;
+  }
+}
+
+
+void BTreeSummaries::Removed(const SIZE_T block)
+{
+  if (block>=count.size()) {
+    return;
+  }
+  if (count[block]!=BTREE_SUMMARY_UNKNOWN) {
+    count[block]--;
+  }
+  if (aggregate) {
+    aggknown[block]=false;
+  }
+}
+
+
+void BTreeSummaries::Changed(const SIZE_T block)
+{
+  if (block<count.size() && aggregate) {
+    aggknown[block]=false;
+  }
+}
+
+
+void BTreeSummaries::Forget(const SIZE_T block)
+{
+  if (block>=count.size()) {
+    return;
+  }
+  count[block]=BTREE_SUMMARY_UNKNOWN;
+  if (aggregate) {
+    aggknown[block]=false;
+  }
+}
+
+
+bool BTreeSummaries::Get(const SIZE_T block, SIZE_T &n, const char *&agg) const
+{
+  if (block>=count.size() || count[block]==BTREE_SUMMARY_UNKNOWN ||
+      (aggregate && !aggknown[block])) {
+    return false;
+  }
+  n=count[block];
+  agg= aggregate ? &aggs[(size_t)block*aggsize] : 0;
+  return true;
+}
+
+
+const char *BTreeSummaries::Set(const SIZE_T block, const SIZE_T n, const char *agg)
+{
+  if (block>=count.size()) {
+    return 0;
+  }
+  count[block]=n;
+  if (!aggregate) {
+    return 0;
+  }
+  memcpy(&aggs[(size_t)block*aggsize],agg,aggsize);
+  aggknown[block]=true;
+  return &aggs[(size_t)block*aggsize];
+}
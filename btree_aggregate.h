@@ -0,0 +1,111 @@
+#ifndef _btree_aggregate
+#define _btree_aggregate
+
+#include <vector>
+
+#include "global.h"
+#include "btree_ds.h"
+
+using namespace std;
+
+//
+// Pluggable aggregates over an index's key/value pairs, for
+// BTreeIndex::AggregateRange.  An aggregate is GetSize() bytes; the
+// pairs in a range are folded into one with Add, and whole subtrees'
+// aggregates with Combine.  Pairs and subtrees are folded in no
+// particular order, so Add and Combine have to be commutative and
+// associative, with Identity as the unit, like a sum, a minimum or a
+// maximum.
+//
+class BTreeAggregate {
+ public:
+  virtual ~BTreeAggregate() {}
+
+  virtual SIZE_T GetSize() const = 0;
+  virtual void   Identity(char *agg) const = 0;
+  virtual void   Add(char *agg, const char *key, const SIZE_T keysize,
+		     const char *value, const SIZE_T valuesize) const = 0;
+  virtual void   Combine(char *agg, const char *other) const = 0;
+};
+
+
+// The first (up to) 8 bytes of each value, read as a little-endian
+// unsigned integer.  Both aggregates are held as unsigned long longs.
+class BTreeValueSum : public BTreeAggregate {
+ public:
+  SIZE_T GetSize() const;
+  void   Identity(char *agg) const;
+  void   Add(char *agg, const char *key, const SIZE_T keysize,
+	     const char *value, const SIZE_T valuesize) const;
+  void   Combine(char *agg, const char *other) const;
+};
+
+// The smallest then the largest value, as BTreeValueSum reads them
+class BTreeValueMinMax : public BTreeAggregate {
+ public:
+  SIZE_T GetSize() const;
+  void   Identity(char *agg) const;
+  void   Add(char *agg, const char *key, const SIZE_T keysize,
+	     const char *value, const SIZE_T valuesize) const;
+  void   Combine(char *agg, const char *other) const;
+};
+
+
+//
+// How many keys lie under each block, and their aggregate, kept in
+// memory beside the index.  A leaf's count is known as soon as the
+// index writes it.  Anything else that is written is forgotten, as is
+// any aggregate a write could have changed, and BTreeIndex works them
+// out again from the node's children the next time it needs them.
+// Inserts add one to the count of every node above the leaf instead of
+// forgetting them.
+//
+
+// What a block's count says when it isn't known
+#define BTREE_SUMMARY_UNKNOWN ((SIZE_T)-1)
+
+class BTreeSummaries {
+ private:
+  const BTreeAggregate *aggregate;
+  SIZE_T                aggsize;
+  vector<SIZE_T>        count;
+  vector<char>          aggs;
+  vector<bool>          aggknown;
+
+ public:
+  BTreeSummaries();
+
+  // Make room for numblocks blocks, knowing none
+  void Reset(const SIZE_T numblocks, const BTreeAggregate *aggregate);
+
+  void Clear();
+
+  bool Enabled() const { return !count.empty(); }
+
+  const BTreeAggregate *GetAggregate() const { return aggregate; }
+
+  // block has just been written with b
+  void Note(const SIZE_T block, const BTreeNode &b);
+
+  // A key went in somewhere under the interior node at block, which
+  // counts it unless a write has already made it forget
+  void Inserted(const SIZE_T block);
+
+  // A key came out from under the interior node at block
+  void Removed(const SIZE_T block);
+
+  // The values under block changed
+  void Changed(const SIZE_T block);
+
+  // Anything could have changed under block
+  void Forget(const SIZE_T block);
+
+  // Whether block's summary is known, and if so what it is.  agg is 0
+  // without an aggregate.
+  bool Get(const SIZE_T block, SIZE_T &n, const char *&agg) const;
+
+  // Remember block's summary, returning where its aggregate is kept
+  const char *Set(const SIZE_T block, const SIZE_T n, const char *agg);
+};
+
+#endif
@@ -0,0 +1,222 @@
+#include "btree_aio.h"
+
+BTreeAsyncIO::BTreeAsyncIO(BufferCache *cache, const SIZE_T threads, const SIZE_T depth) :
+  buffercache(cache), requests(depth), prefetching(0), writeerror(ERROR_NOERROR), pool(threads)
+{
+  SIZE_T i;
+
+  for (i=0;i<depth;i++) {
+    requests[i].aio=this;
+    idle.push_back(i);
+  }
+}
+
+
+BTreeAsyncIO::~BTreeAsyncIO()
+{
+  Flush();
+}
+
+
+// Take an idle request, waiting for one to come free if need be
+SIZE_T BTreeAsyncIO::Grab(unique_lock<mutex> &guard)
+{
+  SIZE_T i;
+
+  while (idle.empty()) {
+    changed.wait(guard);
+  }
+  i=idle.back();
+  idle.pop_back();
+  requests[i].started=false;
+  requests[i].done=false;
+  requests[i].rc=ERROR_NOERROR;
+  return i;
+}
+
+
+void BTreeAsyncIO::Complete(Request &r)
+{
+  ERROR_T rc;
+
+  {
+    unique_lock<mutex> guard(lock);
+    r.started=true;
+  }
+
+  {
+    unique_lock<mutex> guard(cachelock);
+    switch (r.kind) {
+    case WRITE:
+      rc=r.node.Serialize(buffercache,r.block);
+      break;
+    case PREFETCH:
+      rc=r.node.Unserialize(buffercache,r.block);
+      break;
+    default:
+      rc=r.dest->Unserialize(buffercache,r.block);
+      break;
+    }
+  }
+
+  {
+    unique_lock<mutex> guard(lock);
+    r.rc=rc;
+    r.done=true;
+    if (r.kind==WRITE) {
+      if (rc && !writeerror) {
+	writeerror=rc;
+      }
+      map<SIZE_T,Request *>::iterator i=pending.find(r.block);
+      if (i!=pending.end() && i->second==&r) {
+	pending.erase(i);
+      }
+    }
+    if (r.kind==PREFETCH) {
+      prefetching--;
+    }
+    // Nobody waits for a write or a prefetch, so they retire themselves
+    if (r.kind!=READ) {
+      idle.push_back(&r-&requests[0]);
+    }
+  }
+  changed.notify_all();
+}
+
+
+ERROR_T BTreeAsyncIO::SubmitRead(const SIZE_T block, BTreeNode &node, SIZE_T &ticket)
+{
+  unique_lock<mutex> guard(lock);
+
+  ticket=Grab(guard);
+
+  Request &r=requests[ticket];
+
+  r.kind=READ;
+  r.block=block;
+  r.dest=&node;
+
+  map<SIZE_T,Request *>::iterator i=pending.find(block);
+  if (i!=pending.end()) {
+    // Still on its way out, so the freshest copy is right here
+    node=i->second->node;
+    r.started=true;
+    r.done=true;
+    return ERROR_NOERROR;
+  }
+
+  guard.unlock();
+  pool.Submit(&r);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeAsyncIO::Wait(const SIZE_T ticket)
+{
+  unique_lock<mutex> guard(lock);
+  Request &r=requests[ticket];
+  ERROR_T rc;
+
+  while (!r.done) {
+    changed.wait(guard);
+  }
+  rc=r.rc;
+  idle.push_back(ticket);
+  guard.unlock();
+  changed.notify_all();
+  return rc;
+}
+
+
+void BTreeAsyncIO::Prefetch(const SIZE_T block)
+{
+  unique_lock<mutex> guard(lock);
+
+  // A block with a write queued is as warm as it gets
+  if (idle.empty() || pending.find(block)!=pending.end()) {
+    return;
+  }
+
+  Request &r=requests[Grab(guard)];
+
+  r.kind=PREFETCH;
+  r.block=block;
+  r.dest=0;
+  prefetching++;
+
+  guard.unlock();
+  pool.Submit(&r);
+}
+
+
+ERROR_T BTreeAsyncIO::SubmitWrite(const SIZE_T block, const BTreeNode &node)
+{
+  unique_lock<mutex> guard(lock);
+  map<SIZE_T,Request *>::iterator i;
+
+  // An older write of this block that is already on its way to the
+  // cache has to land first, or it could land on top of this one
+  while ((i=pending.find(block))!=pending.end() && i->second->started) {
+    changed.wait(guard);
+  }
+  if (i!=pending.end()) {
+    i->second->node=node;
+    return ERROR_NOERROR;
+  }
+
+  Request &r=requests[Grab(guard)];
+
+  r.kind=WRITE;
+  r.block=block;
+  r.dest=0;
+  r.node=node;
+  pending[block]=&r;
+
+  guard.unlock();
+  pool.Submit(&r);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeAsyncIO::Flush()
+{
+  unique_lock<mutex> guard(lock);
+  ERROR_T rc;
+
+  while (!pending.empty() || prefetching>0) {
+    changed.wait(guard);
+  }
+  rc=writeerror;
+  writeerror=ERROR_NOERROR;
+  return rc;
+}
+
+
+ERROR_T BTreeAsyncIO::Read(const SIZE_T block, BTreeNode &node)
+{
+  {
+    unique_lock<mutex> guard(lock);
+    map<SIZE_T,Request *>::iterator i=pending.find(block);
+    if (i!=pending.end()) {
+      node=i->second->node;
+      return ERROR_NOERROR;
+    }
+  }
+
+  unique_lock<mutex> guard(cachelock);
+  return node.Unserialize(buffercache,block);
+}
+
+
+ERROR_T BTreeAsyncIO::NotifyAllocate(const SIZE_T block)
+{
+  unique_lock<mutex> guard(cachelock);
+  return buffercache->NotifyAllocateBlock(block);
+}
+
+
+ERROR_T BTreeAsyncIO::NotifyDeallocate(const SIZE_T block)
+{
+  unique_lock<mutex> guard(cachelock);
+  return buffercache->NotifyDeallocateBlock(block);
+}
@@ -0,0 +1,100 @@
+#ifndef _btree_aio
+#define _btree_aio
+
+#include <map>
+#include <vector>
+
+#include "global.h"
+#include "buffercache.h"
+#include "btree_ds.h"
+#include "btree_pool.h"
+
+using namespace std;
+
+//
+// Asynchronous node reads and write-back against a BufferCache.
+//
+// Reads are tickets: SubmitRead queues the read and returns at once,
+// and Wait blocks until that node has landed.  A caller may hold at
+// most GetDepth() unwaited reads.
+//
+// Prefetches only warm the cache.  They are dropped rather than queued
+// when every request is busy, since nobody is waiting on them.
+//
+// Writes are write-behind: SubmitWrite copies the node and returns.
+// Until the write reaches the cache, reads of that block are answered
+// from the copy, and writing the block again before the first write
+// has started just replaces the copy.  Flush waits for all of them.
+//
+// BufferCache is not thread safe, so the workers here and the index
+// that shares the cache with them only ever touch it under one lock.
+// What this buys is overlap, not parallel cache access: the caller
+// keeps routing keys and building nodes while up to GetDepth()
+// requests are queued behind it.
+//
+class BTreeAsyncIO {
+ private:
+  enum RequestKind {READ, WRITE, PREFETCH};
+
+  struct Request : public BTreeTask {
+    BTreeAsyncIO *aio;
+    RequestKind   kind;
+    bool          started;
+    bool          done;
+    SIZE_T        block;
+    BTreeNode    *dest;   // where a read lands
+    BTreeNode     node;   // what a write writes, or where a prefetch lands
+    ERROR_T       rc;
+
+    void Run() { aio->Complete(*this); }
+  };
+
+  BufferCache            *buffercache;
+  mutex                   cachelock;
+  mutex                   lock;
+  condition_variable      changed;
+  vector<Request>         requests;
+  vector<SIZE_T>          idle;
+  map<SIZE_T,Request *>   pending;   // outstanding write for each block
+  SIZE_T                  prefetching;
+  ERROR_T                 writeerror;
+  // Last, so it is torn down first and its workers are gone before
+  // anything they use
+  BTreeThreadPool         pool;
+
+  SIZE_T  Grab(unique_lock<mutex> &guard);
+  void    Complete(Request &r);
+
+ public:
+  BTreeAsyncIO(BufferCache *cache, const SIZE_T threads=4, const SIZE_T depth=32);
+  // Flushes
+  virtual ~BTreeAsyncIO();
+
+  SIZE_T  GetDepth() const { return requests.size(); }
+
+  // Start reading block into node, which must stay put until Wait
+  ERROR_T SubmitRead(const SIZE_T block, BTreeNode &node, SIZE_T &ticket);
+
+  // return whatever the read behind ticket returned
+  ERROR_T Wait(const SIZE_T ticket);
+
+  // Start pulling block into the cache, if there is room to
+  void    Prefetch(const SIZE_T block);
+
+  // Queue a copy of node to be written to block
+  ERROR_T SubmitWrite(const SIZE_T block, const BTreeNode &node);
+
+  // Wait for every queued write, and for any prefetch still using the
+  // cache
+  // return the first error any of them ran into since the last Flush
+  ERROR_T Flush();
+
+  // Read block right now, seeing any write still queued for it
+  ERROR_T Read(const SIZE_T block, BTreeNode &node);
+
+  // Tell the cache block was allocated or freed
+  ERROR_T NotifyAllocate(const SIZE_T block);
+  ERROR_T NotifyDeallocate(const SIZE_T block);
+};
+
+#endif
@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <new>
+
+#include "btree.h"
+#include "btree_workload.h"
+
+//
+// btree_allocs: count the heap allocations the index makes in Lookup,
+// Update and Insert, and print them as one JSON line.
+//
+// Every operator new in the program is counted, but only the calls into
+// the index are measured, so making the keys and values is not.  Each
+// kind of operation is done once first, so per-thread scratch space is
+// already in place.  Inserts are split by whether they wrote just the
+// one leaf or had to split.
+//
+// Through a BufferCache, reading a node allocates inside the cache and
+// BTreeNode::Unserialize; with -m nodes are looked at where they lie in
+// the mapping, and nothing should be allocated at all.
+//
+
+static atomic<unsigned long long> allocations(0);
+
+void *operator new(size_t n)
+{
+  void *p;
+
+  allocations++;
+  if (!(p=malloc(n ? n : 1))) {
+    throw bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t n)
+{
+  return operator new(n);
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+  free(p);
+}
+
+
+static void usage()
+{
+  cerr << "usage: btree_allocs [options] filestem cachesize\n"
+       << "       btree_allocs [options] -m image:numblocks:blocksize\n"
+       << "  -r records     records loaded first (10000)\n"
+       << "  -n operations  operations of each kind (10000)\n"
+       << "  -k keysize     key size in bytes (8)\n"
+       << "  -v valuesize   value size in bytes (8)\n"
+       << "  -S seed        random seed (1)\n";
+}
+
+
+struct AllocCount {
+  SIZE_T             ops;
+  unsigned long long allocs;
+
+  AllocCount() : ops(0), allocs(0) {}
+
+  void PrintJSON(ostream &os) const {
+    os << "{\"ops\":" << ops << ",\"allocs\":" << allocs
+       << ",\"per_op\":" << (ops ? (double)allocs/ops : 0) << "}";
+  }
+};
+
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  ERROR_T rc;
+  SIZE_T records=10000;
+  SIZE_T operations=10000;
+  SIZE_T keysize=8;
+  SIZE_T valuesize=8;
+  unsigned long seed=1;
+  SIZE_T numblocks=0;
+  SIZE_T blocksize=0;
+  SIZE_T superblock;
+  string image;
+  BTreeMmapStore store;
+  DiskSystem *disk=0;
+  BufferCache *cache=0;
+  BTreeIndex *btree;
+
+  while ((opt=getopt(argc,argv,"r:n:k:v:S:m:"))!=-1) {
+    switch (opt) {
+    case 'r':
+      records=atoi(optarg);
+      break;
+    case 'n':
+      operations=atoi(optarg);
+      break;
+    case 'k':
+      keysize=atoi(optarg);
+      break;
+    case 'v':
+      valuesize=atoi(optarg);
+      break;
+    case 'S':
+      seed=strtoul(optarg,0,0);
+      break;
+    case 'm':
+      {
+	string arg(optarg);
+	size_t c1=arg.find(':');
+	size_t c2=arg.find(':',c1==string::npos ? c1 : c1+1);
+	if (c1==string::npos || c2==string::npos) {
+	  usage();
+	  return -1;
+	}
+	image=arg.substr(0,c1);
+	numblocks=atoi(arg.substr(c1+1,c2-c1-1).c_str());
+	blocksize=atoi(arg.substr(c2+1).c_str());
+      }
+      break;
+    default:
+      usage();
+      return -1;
+    }
+  }
+
+  if (image.empty()) {
+    if (argc-optind!=2) {
+      usage();
+      return -1;
+    }
+    disk=new DiskSystem(argv[optind]);
+    cache=new BufferCache(disk,atoi(argv[optind+1]));
+    if ((rc=cache->Attach())!=ERROR_NOERROR) {
+      cerr << "Can't attach buffer cache due to error " << rc << endl;
+      return -1;
+    }
+    blocksize=cache->GetBlockSize();
+    btree=new BTreeIndex(keysize,valuesize,cache);
+  } else {
+    if (argc!=optind) {
+      usage();
+      return -1;
+    }
+    if ((rc=store.Create(image.c_str(),numblocks,blocksize))!=ERROR_NOERROR) {
+      cerr << "Can't create " << image << " due to error " << rc << endl;
+      return -1;
+    }
+    btree=new BTreeIndex(keysize,valuesize,&store);
+  }
+
+  if ((rc=btree->Attach(0,true))!=ERROR_NOERROR) {
+    cerr << "Can't create index due to error " << rc << endl;
+    return -1;
+  }
+
+  KEY_T key;
+  VALUE_T value;
+  VALUE_T found;
+  SIZE_T i;
+  SIZE_T writes;
+  unsigned long long before;
+  AllocCount lookups;
+  AllocCount updates;
+  AllocCount inserts;
+  AllocCount splits;
+
+  for (i=0;i<records;i++) {
+    BTreeMakeKey(i,false,keysize,key);
+    BTreeMakeValue(i,0,valuesize,value);
+    if ((rc=btree->Insert(key,value))!=ERROR_NOERROR) {
+      cerr << "Load failed at record " << i << " due to error " << rc << endl;
+      return -1;
+    }
+  }
+
+  // Warm up, so the measured calls find their scratch space in place
+  BTreeMakeKey(0,false,keysize,key);
+  BTreeMakeValue(0,1,valuesize,value);
+  btree->Lookup(key,found);
+  btree->Update(key,value);
+  BTreeMakeKey(records,false,keysize,key);
+  btree->Insert(key,value);
+
+  srand(seed);
+  for (i=0;i<operations;i++) {
+    BTreeMakeKey(rand()%records,false,keysize,key);
+    before=allocations;
+    rc=btree->Lookup(key,found);
+    lookups.allocs+=allocations-before;
+    lookups.ops++;
+    if (rc) {
+      cerr << "Lookup failed due to error " << rc << endl;
+      return -1;
+    }
+  }
+  for (i=0;i<operations;i++) {
+    BTreeMakeKey(rand()%records,false,keysize,key);
+    BTreeMakeValue(i,2,valuesize,value);
+    before=allocations;
+    rc=btree->Update(key,value);
+    updates.allocs+=allocations-before;
+    updates.ops++;
+    if (rc) {
+      cerr << "Update failed due to error " << rc << endl;
+      return -1;
+    }
+  }
+  for (i=0;i<operations;i++) {
+    BTreeMakeKey(records+1+i,false,keysize,key);
+    BTreeMakeValue(i,0,valuesize,value);
+    writes=btree->GetNumNodeWrites();
+    before=allocations;
+    rc=btree->Insert(key,value);
+    AllocCount &c= btree->GetNumNodeWrites()-writes==1 ? inserts : splits;
+    c.allocs+=allocations-before;
+    c.ops++;
+    if (rc) {
+      cerr << "Insert failed due to error " << rc << endl;
+      return -1;
+    }
+  }
+
+  cout << "{\"records\":" << records
+       << ",\"keysize\":" << keysize
+       << ",\"valuesize\":" << valuesize
+       << ",\"blocksize\":" << blocksize
+       << ",\"store\":\"" << (image.empty() ? "cache" : "mmap") << "\""
+       << ",\"lookup\":";
+  lookups.PrintJSON(cout);
+  cout << ",\"update\":";
+  updates.PrintJSON(cout);
+  cout << ",\"insert\":";
+  inserts.PrintJSON(cout);
+  cout << ",\"insert_split\":";
+  splits.PrintJSON(cout);
+  cout << "}" << endl;
+
+  if ((rc=btree->Detach(superblock))!=ERROR_NOERROR) {
+    cerr << "Can't detach index due to error " << rc << endl;
+    return -1;
+  }
+  delete btree;
+  if (cache) {
+    cache->Detach();
+    delete cache;
+    delete disk;
+  } else {
+    store.Detach();
+  }
+  return 0;
+}
@@ -0,0 +1,318 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+
+#include "btree.h"
+#include "btree_workload.h"
+
+//
+// btree_bench: build a fresh index and run a YCSB style workload on it,
+// printing one JSON line with the results.
+//
+// The index goes either on a disk made with makedisk, through a
+// BufferCache, or with -m into a memory-mapped image that gets created
+// from scratch.
+//
+// With -p the image is then reattached read-only, the way readers
+// sharing it would see it, and the records looked up again.
+//
+// Built with BTREE_STATS, the line also carries the index's own
+// counters for the run.
+//
+
+// Pairs the leaf compression dictionary is trained on, and its size
+#define BENCH_DICT_SAMPLES 512
+#define BENCH_DICT_SIZE    8192
+
+static void usage()
+{
+  cerr << "usage: btree_bench [options] filestem cachesize\n"
+       << "       btree_bench [options] -m image:numblocks:blocksize\n"
+       << "  -w A..F        YCSB core workload (default: lookups only)\n"
+       << "  -x op=w,...    custom mix of insert, lookup, update, delete, scan, rmw\n"
+       << "  -d dist        uniform, zipfian, sequential or latest\n"
+       << "  -r records     records loaded before the run (10000)\n"
+       << "  -n operations  operations in the run (100000)\n"
+       << "  -s maxscan     longest scan (100)\n"
+       << "  -k keysize     key size in bytes (8)\n"
+       << "  -v valuesize   value size in bytes (8)\n"
+       << "  -o             keys in record order instead of hashed\n"
+       << "  -S seed        random seed (1)\n"
+       << "  -a threads     async I/O with this many threads\n"
+       << "  -R blocks      readahead (0 is off)\n"
+       << "  -f             keep fingerprints of leaf keys\n"
+       << "  -z blocks      compress leaves of this many blocks each into one\n"
+       << "  -i bytes       interior nodes of this many bytes (a whole block)\n"
+       << "  -t trace       trace the load and the run to this file\n"
+       << "  -p             with -m, then look records up in the image read-only\n";
+}
+
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  ERROR_T rc;
+  BTreeWorkload work;
+  SIZE_T keysize=8;
+  SIZE_T valuesize=8;
+  SIZE_T aiothreads=0;
+  SIZE_T readahead=BTREE_READAHEAD;
+  bool fingerprints=false;
+  bool readonly=false;
+  SIZE_T leafblocks=1;
+  SIZE_T interiorsize=0;
+  BTreeLZCodec codec;
+  SIZE_T blocksize=0;
+  SIZE_T superblock;
+  string image;
+  string tracefile;
+  BTreeTraceRecorder trace;
+  SIZE_T numblocks=0;
+  BTreeMmapStore store;
+  DiskSystem *disk=0;
+  BufferCache *cache=0;
+  BTreeAsyncIO *aio=0;
+  BTreeIndex *btree;
+
+  while ((opt=getopt(argc,argv,"w:x:d:r:n:s:k:v:oS:a:R:fm:t:z:i:p"))!=-1) {
+    switch (opt) {
+    case 'w':
+      if (work.SetStandard(optarg[0])) {
+	cerr << "unknown workload " << optarg << endl;
+	return -1;
+      }
+      break;
+    case 'x':
+      if (work.SetMix(optarg)) {
+	cerr << "bad mix " << optarg << endl;
+	return -1;
+      }
+      break;
+    case 'd':
+      if (work.SetDist(optarg)) {
+	cerr << "unknown distribution " << optarg << endl;
+	return -1;
+      }
+      break;
+    case 'r':
+      work.records=atoi(optarg);
+      break;
+    case 'n':
+      work.operations=atoi(optarg);
+      break;
+    case 's':
+      work.maxscan=atoi(optarg);
+      break;
+    case 'k':
+      keysize=atoi(optarg);
+      break;
+    case 'v':
+      valuesize=atoi(optarg);
+      break;
+    case 'o':
+      work.ordered=true;
+      break;
+    case 'S':
+      work.seed=strtoul(optarg,0,0);
+      break;
+    case 'a':
+      aiothreads=atoi(optarg);
+      break;
+    case 'R':
+      readahead=atoi(optarg);
+      break;
+    case 'f':
+      fingerprints=true;
+      break;
+    case 't':
+      tracefile=optarg;
+      break;
+    case 'z':
+      leafblocks=atoi(optarg);
+      break;
+    case 'i':
+      interiorsize=atoi(optarg);
+      break;
+    case 'p':
+      readonly=true;
+      break;
+    case 'm':
+      {
+	string arg(optarg);
+	size_t c1=arg.find(':');
+	size_t c2=arg.find(':',c1==string::npos ? c1 : c1+1);
+	if (c1==string::npos || c2==string::npos) {
+	  usage();
+	  return -1;
+	}
+	image=arg.substr(0,c1);
+	numblocks=atoi(arg.substr(c1+1,c2-c1-1).c_str());
+	blocksize=atoi(arg.substr(c2+1).c_str());
+      }
+      break;
+    default:
+      usage();
+      return -1;
+    }
+  }
+
+  if (image.empty()) {
+    if (argc-optind!=2 || readonly) {
+      usage();
+      return -1;
+    }
+    disk=new DiskSystem(argv[optind]);
+    cache=new BufferCache(disk,atoi(argv[optind+1]));
+    if ((rc=cache->Attach())!=ERROR_NOERROR) {
+      cerr << "Can't attach buffer cache due to error " << rc << endl;
+      return -1;
+    }
+    blocksize=cache->GetBlockSize();
+    btree=new BTreeIndex(keysize,valuesize,cache);
+    if (aiothreads>0) {
+      aio=new BTreeAsyncIO(cache,aiothreads);
+      if ((rc=btree->SetAsyncIO(aio))!=ERROR_NOERROR) {
+	cerr << "Can't use async I/O due to error " << rc << endl;
+	return -1;
+      }
+    }
+  } else {
+    if (argc!=optind) {
+      usage();
+      return -1;
+    }
+    if ((rc=store.Create(image.c_str(),numblocks,blocksize))!=ERROR_NOERROR) {
+      cerr << "Can't create " << image << " due to error " << rc << endl;
+      return -1;
+    }
+    btree=new BTreeIndex(keysize,valuesize,&store);
+  }
+  btree->SetReadahead(readahead);
+  btree->SetFingerprints(fingerprints);
+  if (leafblocks>1) {
+    // Train the dictionary on pairs like the ones the workload makes
+    string samples;
+    string dict;
+    KEY_T key;
+    VALUE_T value;
+    for (SIZE_T i=0;i<BENCH_DICT_SAMPLES;i++) {
+      BTreeMakeKey(i,work.ordered,keysize,key);
+      BTreeMakeValue(i,0,valuesize,value);
+      samples.append(key.data,key.length);
+      samples.append(value.data,value.length);
+    }
+    BTreeLZCodec::Train(samples.data(),samples.size(),BENCH_DICT_SIZE,dict);
+    codec.SetDictionary(dict.data(),dict.size());
+    if ((rc=btree->SetLeafCompression(&codec,leafblocks))!=ERROR_NOERROR) {
+      cerr << "Can't compress leaves due to error " << rc << endl;
+      return -1;
+    }
+  }
+
+  if ((rc=btree->SetInteriorSize(interiorsize))!=ERROR_NOERROR) {
+    cerr << "Can't make interior nodes " << interiorsize << " bytes due to error " << rc << endl;
+    return -1;
+  }
+
+  if ((rc=btree->Attach(0,true))!=ERROR_NOERROR) {
+    cerr << "Can't create index due to error " << rc << endl;
+    return -1;
+  }
+
+  if (!tracefile.empty()) {
+    if ((rc=trace.Open(tracefile.c_str(),keysize,valuesize))!=ERROR_NOERROR) {
+      cerr << "Can't open trace " << tracefile << " due to error " << rc << endl;
+      return -1;
+    }
+    btree->SetTrace(&trace);
+  }
+
+  BTreeWorkloadRunner runner(*btree,work);
+  BTreeWorkStats load;
+  BTreeWorkStats run;
+
+  if ((rc=runner.Load(load))!=ERROR_NOERROR) {
+    cerr << "Load failed due to error " << rc << endl;
+    return -1;
+  }
+  btree->ResetStats();
+  if ((rc=runner.Run(run))!=ERROR_NOERROR) {
+    cerr << "Run failed due to error " << rc << endl;
+    return -1;
+  }
+
+#ifdef BTREE_STATS
+  BTreeStatCounters counters;
+  btree->GetStats(counters);
+#endif
+
+  btree->SetTrace(0);
+  if ((rc=trace.Close())!=ERROR_NOERROR) {
+    cerr << "Can't finish trace " << tracefile << " due to error " << rc << endl;
+    return -1;
+  }
+  if ((rc=btree->Detach(superblock))!=ERROR_NOERROR) {
+    cerr << "Can't detach index due to error " << rc << endl;
+    return -1;
+  }
+
+  BTreeWorkStats reread;
+
+  if (readonly) {
+    if ((rc=store.Attach(image.c_str()))!=ERROR_NOERROR) {
+      cerr << "Can't attach " << image << " read-only due to error " << rc << endl;
+      return -1;
+    }
+    if ((rc=btree->Attach(0))!=ERROR_NOERROR) {
+      cerr << "Can't attach index read-only due to error " << rc << endl;
+      return -1;
+    }
+    // Lookups only, through the runner that knows which records there are
+    for (int op=0;op<BTREE_WORK_NUMOPS;op++) {
+      work.mix[op]= op==BTREE_WORK_LOOKUP ? 1 : 0;
+    }
+    if ((rc=runner.Run(reread))!=ERROR_NOERROR) {
+      cerr << "Read-only run failed due to error " << rc << endl;
+      return -1;
+    }
+    if ((rc=btree->Detach(superblock))!=ERROR_NOERROR) {
+      cerr << "Can't detach read-only index due to error " << rc << endl;
+      return -1;
+    }
+  }
+
+  cout << "{\"workload\":\"" << work.name << "\""
+       << ",\"distribution\":\"" << BTreeKeyDistName(work.dist) << "\""
+       << ",\"records\":" << work.records
+       << ",\"keysize\":" << keysize
+       << ",\"valuesize\":" << valuesize
+       << ",\"blocksize\":" << blocksize
+       << ",\"leafblocks\":" << leafblocks
+       << ",\"interiorsize\":" << (interiorsize ? interiorsize : blocksize)
+       << ",\"store\":\"" << (image.empty() ? (aio ? "aio" : "cache") : "mmap") << "\""
+       << ",\"load\":";
+  load.PrintJSON(cout);
+  cout << ",\"run\":";
+  run.PrintJSON(cout);
+  if (readonly) {
+    cout << ",\"readonly\":";
+    reread.PrintJSON(cout);
+  }
+#ifdef BTREE_STATS
+  cout << ",\"stats\":";
+  counters.PrintJSON(cout);
+#endif
+  cout << "}" << endl;
+
+  delete btree;
+  delete aio;
+  if (cache) {
+    cache->Detach();
+    delete cache;
+    delete disk;
+  } else {
+    store.Detach();
+  }
+  return 0;
+}
@@ -0,0 +1,299 @@
+#include <string.h>
+#include <algorithm>
+
+#include "btree_build.h"
+
+
+BTreeBuilder::BTreeBuilder(BTreeIndex &i, const SIZE_T f) :
+  index(i), fill(f>100 ? 100 : f), started(false), count(0), leafcap(0), interiorcap(0)
+{}
+
+
+ERROR_T BTreeBuilder::Start()
+{
+  BTreeNode root;
+  ERROR_T rc;
+
+  rc=index.ReadNode(index.superblock.info.rootnode,root);
+  if (rc) { return rc; }
+  if (root.info.nodetype!=BTREE_ROOT_NODE || root.info.numkeys>0) {
+    return ERROR_BADCONFIG;
+  }
+
+  leaf=BTreeNode(BTREE_LEAF_NODE,index.GetKeySize(),index.GetValueSize(),index.GetLeafSize());
+  leaf.info.rootnode=index.superblock.info.rootnode;
+  leaf.info.numkeys=0;
+  leafcap=max((SIZE_T)1,leaf.info.GetNumSlotsAsLeaf()*fill/100);
+  last.Resize(index.GetKeySize(),false);
+
+  // An interior node gives a child away if Finish has to even out the
+  // last two on a level, so it needs at least two keys
+  root.info.nodetype=BTREE_INTERIOR_NODE;
+  interiorcap=min(root.info.GetNumSlotsAsInterior(),
+		  max((SIZE_T)2,root.info.GetNumSlotsAsInterior()*fill/100));
+  if (interiorcap<2) {
+    return ERROR_SIZE;
+  }
+
+  index.lastpath.depth=0;
+  started=true;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeBuilder::TakeBlock(SIZE_T &block)
+{
+  ERROR_T rc;
+
+  block=index.superblock.info.freelist;
+  if (block==0) {
+    return ERROR_NOSPACE;
+  }
+  rc=index.ViewNode(block,freenode);
+  if (rc) { return rc; }
+  if (freenode.Get().info.nodetype!=BTREE_UNALLOCATED_BLOCK) {
+    return ERROR_INSANE;
+  }
+  // Finish writes the superblock once for every block taken
+  index.superblock.info.freelist=freenode.Get().info.freelist;
+  index.NotifyAllocate(block);
+  BTREE_STAT(index.stats.CountAlloc());
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeBuilder::FlushLeaf()
+{
+  ERROR_T rc;
+  SIZE_T n=leaf.info.numkeys;
+  SIZE_T lo;
+  SIZE_T hi;
+  SIZE_T block;
+
+  if (!index.LeafFits(leaf)) {
+    // Find the most pairs that compress into a block; one pair always
+    // has to
+    leaf.info.numkeys=1;
+    if (!index.LeafFits(leaf)) {
+      leaf.info.numkeys=n;
+      return ERROR_SIZE;
+    }
+    for (lo=1, hi=n; hi-lo>1; ) {
+      leaf.info.numkeys=(lo+hi)/2;
+      if (index.LeafFits(leaf)) {
+	lo=leaf.info.numkeys;
+      } else {
+	hi=leaf.info.numkeys;
+      }
+    }
+    leaf.info.numkeys=lo;
+  }
+
+  rc=TakeBlock(block);
+  if (rc) { return rc; }
+  rc=index.WriteNode(block,leaf);
+  if (rc) { return rc; }
+  rc=AddChild(0,BorrowedKey().At(leaf.ResolveKey(leaf.info.numkeys-1),leaf.info.keysize),block);
+  if (rc) { return rc; }
+
+  // Whatever didn't fit starts the next leaf
+  lo=leaf.info.numkeys;
+  leaf.info.numkeys=n;
+  return BTreeShiftSlots(leaf,lo,0);
+}
+
+
+ERROR_T BTreeBuilder::AddLeaf(const SIZE_T block, const KEY_T &key, const SIZE_T numkeys)
+{
+  ERROR_T rc;
+
+  if (!started) {
+    rc=Start();
+    if (rc) { return rc; }
+  }
+  if (leaf.info.numkeys>0) {
+    return ERROR_BADCONFIG;
+  }
+  last=key;
+  count+=numkeys;
+  return AddChild(0,key,block);
+}
+
+
+ERROR_T BTreeBuilder::AddChild(const SIZE_T level, const KEY_T &key, const SIZE_T block)
+{
+  ERROR_T rc;
+
+  if (level==nodes.size()) {
+    nodes.push_back(BTreeNode(BTREE_INTERIOR_NODE,index.GetKeySize(),index.GetValueSize(),
+			      index.GetInteriorSize()));
+    nodes.back().info.rootnode=index.superblock.info.rootnode;
+    nodes.back().info.numkeys=0;
+    children.push_back(0);
+    first.push_back(0);
+    lastkey.push_back(KEY_T());
+    prev.push_back(BTreeNode());
+    prevblock.push_back(0);
+  }
+  if (children[level]>0 && nodes[level].info.numkeys==interiorcap) {
+    rc=FlushNode(level);
+    if (rc) { return rc; }
+  }
+
+  BTreeNode &b=nodes[level];
+
+  if (children[level]==0) {
+    first[level]=block;
+  } else {
+    b.info.numkeys++;
+    if (children[level]==1) {
+      rc=b.SetPtr(0,first[level]);
+      if (rc) { return rc; }
+    }
+    rc=b.SetKey(b.info.numkeys-1,lastkey[level]);
+    if (rc) { return rc; }
+    rc=b.SetPtr(b.info.numkeys,block);
+    if (rc) { return rc; }
+  }
+  children[level]++;
+  lastkey[level]=key;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeBuilder::FlushNode(const SIZE_T level)
+{
+  ERROR_T rc;
+  SIZE_T block;
+  // Copied, since handing it up can grow the levels
+  KEY_T key=lastkey[level];
+
+  rc=TakeBlock(block);
+  if (rc) { return rc; }
+  rc=index.WriteNode(block,nodes[level]);
+  if (rc) { return rc; }
+  prev[level]=nodes[level];
+  prevblock[level]=block;
+  nodes[level].info.numkeys=0;
+  children[level]=0;
+  return AddChild(level+1,key,block);
+}
+
+
+ERROR_T BTreeBuilder::Add(const KEY_T &key, const VALUE_T &value)
+{
+  if (key.length!=index.GetKeySize() || value.length!=index.GetValueSize()) {
+    return ERROR_SIZE;
+  }
+  return Add(key.data,value.data);
+}
+
+
+ERROR_T BTreeBuilder::Add(const char *key, const char *value)
+{
+  ERROR_T rc;
+  BorrowedKey k;
+  BorrowedKey v;
+
+  if (!started) {
+    rc=Start();
+    if (rc) { return rc; }
+  }
+  const KEY_T &newkey=k.At(key,leaf.info.keysize);
+  if (count>0) {
+    if (newkey==last) {
+      return ERROR_CONFLICT;
+    }
+    if (newkey<last) {
+      return ERROR_BADCONFIG;
+    }
+  }
+
+  if (leaf.info.numkeys==leafcap) {
+    rc=FlushLeaf();
+    if (rc) { return rc; }
+  }
+  leaf.info.numkeys++;
+  rc=leaf.SetKey(leaf.info.numkeys-1,newkey);
+  if (rc) { return rc; }
+  rc=leaf.SetVal(leaf.info.numkeys-1,v.At(value,leaf.info.valuesize));
+  if (rc) { return rc; }
+  memcpy(last.data,key,leaf.info.keysize);
+  count++;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeBuilder::Finish()
+{
+  ERROR_T rc;
+  SIZE_T level;
+  SIZE_T block;
+  SIZE_T ptr;
+  SIZE_T m;
+
+  if (!started) {
+    // Nothing was added, so the index is as it was
+    return ERROR_NOERROR;
+  }
+
+  while (leaf.info.numkeys>0) {
+    rc=FlushLeaf();
+    if (rc) { return rc; }
+  }
+
+  if (nodes.size()==1 && children[0]==1) {
+    // The root needs two children, so one leaf gets an empty one after
+    // it, as the first insert into an empty index makes
+    rc=TakeBlock(block);
+    if (rc) { return rc; }
+    rc=index.WriteNode(block,leaf);
+    if (rc) { return rc; }
+    rc=AddChild(0,last,block);
+    if (rc) { return rc; }
+  }
+
+  // Every level but the top has a node to finish.  Since it was started
+  // by a child that didn't fit in the one before, it has at least one;
+  // one on its own would leave it without a key, so the node before it
+  // gives up its last child.  Finishing a level can finish the one
+  // above as well, and even add another.
+  for (level=0; level+1<nodes.size(); level++) {
+    if (children[level]==1) {
+      BTreeNode &p=prev[level];
+      BTreeNode &b=nodes[level];
+
+      m=p.info.numkeys;
+      rc=p.GetPtr(m,ptr);
+      if (rc) { return rc; }
+      b.info.numkeys=1;
+      rc=b.SetPtr(0,ptr);
+      if (rc) { return rc; }
+      rc=b.SetKey(0,lastkey[level+1]);
+      if (rc) { return rc; }
+      rc=b.SetPtr(1,first[level]);
+      if (rc) { return rc; }
+      // The node before now ends one key sooner
+      rc=p.GetKey(m-1,lastkey[level+1]);
+      if (rc) { return rc; }
+      p.info.numkeys=m-1;
+      rc=index.WriteNode(prevblock[level],p);
+      if (rc) { return rc; }
+      children[level]=2;
+    }
+    rc=FlushNode(level);
+    if (rc) { return rc; }
+  }
+
+  // What is left on top becomes the root, where the old empty one was
+  BTreeNode &root=nodes[nodes.size()-1];
+  root.info.nodetype=BTREE_ROOT_NODE;
+  rc=index.WriteNode(index.superblock.info.rootnode,root);
+  if (rc) { return rc; }
+  rc=index.WriteNode(index.superblock_index,index.superblock);
+  if (rc) { return rc; }
+
+  index.lastpath.depth=0;
+  started=false;
+  return ERROR_NOERROR;
+}
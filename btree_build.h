@@ -0,0 +1,102 @@
+#ifndef _btree_build
+#define _btree_build
+
+#include <vector>
+
+#include "btree.h"
+
+using namespace std;
+
+//
+// Builds an empty index bottom up out of pairs handed over in increasing
+// key order, instead of inserting them one at a time.  Leaves are filled
+// left to right and each is written once, when the next pair doesn't go
+// in it; each level above is built the same way out of the greatest key
+// and the block of every node finished below it.  Only one node per
+// level is held at a time, and nothing is read but the free list.  The
+// root stays where it is and is written last, so until Finish the index
+// is still empty.
+//
+// Blocks are taken from the front of the free list, so in a newly
+// created index the leaves come out in key order, with an interior node
+// after every run of its children.
+//
+
+class BTreeLoader;
+
+class BTreeBuilder {
+  friend class BTreeLoader;
+
+ private:
+  BTreeIndex         &index;
+  SIZE_T              fill;
+  bool                started;
+  unsigned long long  count;
+  BTreeNodeView       freenode;
+
+  // The leaf being filled, and the greatest key handed over so far
+  BTreeNode           leaf;
+  SIZE_T              leafcap;
+  KEY_T               last;
+
+  // The node being filled on each level above the leaves, how many
+  // children it has so far, its first child until it has a second, and
+  // the greatest key of its last child, which only becomes one of its
+  // keys once another child comes after it
+  vector<BTreeNode>   nodes;
+  vector<SIZE_T>      children;
+  vector<SIZE_T>      first;
+  vector<KEY_T>       lastkey;
+  SIZE_T              interiorcap;
+
+  // The last node finished on each level above the leaves and where it
+  // went, so that Finish can lend the node after it a child
+  vector<BTreeNode>   prev;
+  vector<SIZE_T>      prevblock;
+
+  ERROR_T Start();
+
+  // Take the block at the head of the free list
+  ERROR_T TakeBlock(SIZE_T &block);
+
+  // Write out the leaf, or as much of it as compresses into a block,
+  // keeping the rest
+  ERROR_T FlushLeaf();
+
+  // Hand over a leaf written elsewhere at block, holding numkeys pairs
+  // up to key, in place of the pairs themselves
+  ERROR_T AddLeaf(const SIZE_T block, const KEY_T &key, const SIZE_T numkeys);
+
+  // Hand block, whose greatest key is key, to level
+  ERROR_T AddChild(const SIZE_T level, const KEY_T &key, const SIZE_T block);
+
+  // Write out level's node and hand it to the level above
+  ERROR_T FlushNode(const SIZE_T level);
+
+ public:
+  // index must be attached and empty, and must not be used for anything
+  // else until Finish.  Each node is filled to fill percent of what it
+  // holds, leaving room for the rest; with compressed leaves, a leaf gets
+  // no more than compresses into its block.
+  BTreeBuilder(BTreeIndex &index, const SIZE_T fill=BTREE_BUILD_FILL);
+
+  // Add a pair, whose key has to be greater than the last one's
+  // return ERROR_SIZE if the key or value are the wrong size for the index
+  // return ERROR_BADCONFIG if the key is out of order, or the index isn't
+  // empty
+  // return ERROR_CONFLICT if the key is the last one again
+  // return ERROR_NOSPACE if the index runs out of blocks
+  ERROR_T Add(const KEY_T &key, const VALUE_T &value);
+
+  // Same, with the index's keysize and valuesize bytes at key and value
+  ERROR_T Add(const char *key, const char *value);
+
+  // Write out whatever is still being filled, put the root over it and
+  // write the superblock.  A build that fails partway leaves the index
+  // empty, but without the blocks it took.
+  ERROR_T Finish();
+
+  unsigned long long GetCount() const { return count; }
+};
+
+#endif
@@ -0,0 +1,435 @@
+#include <string.h>
+#include <algorithm>
+
+#include "btree_compress.h"
+
+// Shortest match worth an offset, and how far back one can be
+#define LZ_MINMATCH  4
+#define LZ_MAXOFFSET 65535
+#define LZ_HASHBITS  12
+// Misses in a row before each step skips another byte
+#define LZ_SKIPSTRENGTH 5
+
+// What an unused cache entry holds
+#define LEAFCACHE_EMPTY ((SIZE_T)-1)
+
+
+static unsigned int Load32(const char *p)
+{
+  unsigned int v;
+
+  memcpy(&v,p,sizeof(v));
+  return v;
+}
+
+
+static unsigned int Hash4(const unsigned int v)
+{
+  return (v*2654435761u)>>(32-LZ_HASHBITS);
+}
+
+
+// 16 bits of the 8 bytes at p, for training
+static unsigned int Hash8(const char *p)
+{
+  unsigned long long v;
+
+  memcpy(&v,p,sizeof(v));
+  return (unsigned int)((v*0x9E3779B97F4A7C15ull)>>48);
+}
+
+
+BTreeLZCodec::BTreeLZCodec() :
+  table(1<<LZ_HASHBITS,0)
+{}
+
+
+void BTreeLZCodec::SetDictionary(const char *d, const SIZE_T len)
+{
+  SIZE_T i;
+
+  dict.assign(d,min(len,(SIZE_T)BTREE_LZ_DICT_MAX));
+  table.assign(1<<LZ_HASHBITS,0);
+  // Positions are kept one up so that 0 can mean none
+  for (i=0;i+LZ_MINMATCH<=dict.size();i++) {
+    table[Hash4(Load32(dict.data()+i))]=i+1;
+  }
+}
+
+
+void BTreeLZCodec::Train(const char *samples, const SIZE_T len, const SIZE_T size, string &dict)
+{
+  const SIZE_T window=8;
+  const SIZE_T segment=64;
+  const SIZE_T step=16;
+  const SIZE_T most=min(size,(SIZE_T)BTREE_LZ_DICT_MAX);
+  vector<unsigned int> counts(1<<16,0);
+  vector<pair<unsigned long long,SIZE_T> > segments;
+  unsigned long long score;
+  SIZE_T start;
+  SIZE_T i;
+  SIZE_T s;
+
+  dict.clear();
+  if (len<=most) {
+    dict.assign(samples,len);
+    return;
+  }
+
+  for (i=0;i+window<=len;i++) {
+    counts[Hash8(samples+i)]++;
+  }
+  for (start=0;start+segment<=len;start+=step) {
+    for (score=0, i=start; i+window<=start+segment; i++) {
+      score+=counts[Hash8(samples+i)];
+    }
+    segments.push_back(make_pair(score,start));
+  }
+  sort(segments.rbegin(),segments.rend());
+
+  // Take the best segments first.  Once a segment is in, its substrings
+  // count for nothing, so a later one that mostly repeats it scores low
+  // and is passed over.
+  for (s=0; s<segments.size() && dict.size()+segment<=most; s++) {
+    start=segments[s].second;
+    for (score=0, i=start; i+window<=start+segment; i++) {
+      score+=counts[Hash8(samples+i)];
+    }
+    if (score*2<segments[s].first) {
+      continue;
+    }
+    dict.append(samples+start,segment);
+    for (i=start;i+window<=start+segment;i++) {
+      counts[Hash8(samples+i)]=0;
+    }
+  }
+}
+
+
+// Room for the bytes that carry on a length of len in a token's nibble
+static SIZE_T ExtraBytes(const SIZE_T len)
+{
+  return len<15 ? 0 : (len-15)/255+1;
+}
+
+
+static char *PutExtra(char *op, SIZE_T len)
+{
+  if (len<15) {
+    return op;
+  }
+  for (len-=15;len>=255;len-=255) {
+    *op++=(char)255;
+  }
+  *op++=(char)len;
+  return op;
+}
+
+
+// One sequence: litlen literals, then a match of matchlen bytes offset
+// back, or nothing for the last sequence (matchlen 0)
+static ERROR_T PutSequence(char *&op, const char *oend, const char *literals, const SIZE_T litlen,
+			   const SIZE_T offset, const SIZE_T matchlen)
+{
+  const SIZE_T ml= matchlen ? matchlen-LZ_MINMATCH : 0;
+  SIZE_T need=1+ExtraBytes(litlen)+litlen;
+
+  if (matchlen) {
+    need+=2+ExtraBytes(ml);
+  }
+  if (need>(SIZE_T)(oend-op)) {
+    return ERROR_SIZE;
+  }
+  *op++=(char)((min(litlen,(SIZE_T)15)<<4) | min(ml,(SIZE_T)15));
+  op=PutExtra(op,litlen);
+  memcpy(op,literals,litlen);
+  op+=litlen;
+  if (matchlen) {
+    *op++=(char)(offset&0xff);
+    *op++=(char)(offset>>8);
+    op=PutExtra(op,ml);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeLZCodec::Compress(const char *src, const SIZE_T n,
+			       char *dst, const SIZE_T room, SIZE_T &out) const
+{
+  static thread_local vector<unsigned int> hashes;
+  // Positions run through the dictionary and on into src
+  const SIZE_T d=dict.size();
+  const SIZE_T end=d+n;
+  const char *in=src-d;
+  char *op=dst;
+  const char *oend=dst+room;
+  unsigned int v;
+  unsigned int h;
+  SIZE_T ip;
+  SIZE_T anchor;
+  SIZE_T cand;
+  SIZE_T m;
+  SIZE_T len;
+  SIZE_T misses;
+  ERROR_T rc;
+
+  hashes=table;
+  // Like LZ4, step faster through data that keeps failing to match
+  for (ip=anchor=d, misses=0; ip+LZ_MINMATCH<=end; ip+=1+(misses++>>LZ_SKIPSTRENGTH)) {
+    v=Load32(in+ip);
+    h=Hash4(v);
+    cand=hashes[h];
+    hashes[h]=ip+1;
+    if (cand==0 || ip-(cand-1)>LZ_MAXOFFSET) {
+      continue;
+    }
+    m=cand-1;
+    if (m<d) {
+      // In the dictionary, and maybe running on past its end into src
+      if (Load32(dict.data()+m)!=v) {
+	continue;
+      }
+      for (len=LZ_MINMATCH;
+	   ip+len<end && (m+len<d ? dict[m+len] : in[m+len])==in[ip+len];
+	   len++) {
+      }
+    } else {
+      if (Load32(in+m)!=v) {
+	continue;
+      }
+      for (len=LZ_MINMATCH; ip+len<end && in[m+len]==in[ip+len]; len++) {
+      }
+    }
+    rc=PutSequence(op,oend,in+anchor,ip-anchor,ip-m,len);
+    if (rc) { return rc; }
+    anchor=ip+len;
+    // Let the next match start just before this one ended
+    if (anchor-2+LZ_MINMATCH<=end) {
+      hashes[Hash4(Load32(in+anchor-2))]=anchor-2+1;
+    }
+    ip=anchor-1;
+    misses=0;
+  }
+  rc=PutSequence(op,oend,in+anchor,end-anchor,0,0);
+  if (rc) { return rc; }
+  out=op-dst;
+  return ERROR_NOERROR;
+}
+
+
+// Read the bytes carrying on a length whose nibble was 15
+static bool GetExtra(const unsigned char *&ip, const unsigned char *iend, SIZE_T &len)
+{
+  unsigned char c;
+
+  do {
+    if (ip>=iend) {
+      return false;
+    }
+    c=*ip++;
+    len+=c;
+  } while (c==255);
+  return true;
+}
+
+
+ERROR_T BTreeLZCodec::Decompress(const char *src, const SIZE_T n,
+				 char *dst, const SIZE_T len) const
+{
+  const SIZE_T d=dict.size();
+  const unsigned char *ip=(const unsigned char *)src;
+  const unsigned char *iend=ip+n;
+  SIZE_T pos=0;
+  SIZE_T lit;
+  SIZE_T offset;
+  SIZE_T ml;
+  SIZE_T k;
+  unsigned char token;
+
+  for (;;) {
+    if (ip>=iend) {
+      return ERROR_INSANE;
+    }
+    token=*ip++;
+    lit=token>>4;
+    if (lit==15 && !GetExtra(ip,iend,lit)) {
+      return ERROR_INSANE;
+    }
+    if (lit>(SIZE_T)(iend-ip) || lit>len-pos) {
+      return ERROR_INSANE;
+    }
+    memcpy(dst+pos,ip,lit);
+    ip+=lit;
+    pos+=lit;
+    if (ip==iend) {
+      break;
+    }
+
+    if (iend-ip<2) {
+      return ERROR_INSANE;
+    }
+    offset=ip[0] | (SIZE_T)ip[1]<<8;
+    ip+=2;
+    ml=(token&15)+LZ_MINMATCH;
+    if ((token&15)==15 && !GetExtra(ip,iend,ml)) {
+      return ERROR_INSANE;
+    }
+    if (offset==0 || offset>pos+d || ml>len-pos) {
+      return ERROR_INSANE;
+    }
+    if (offset>pos) {
+      // The match starts in the dictionary
+      k=min(ml,offset-pos);
+      memcpy(dst+pos,dict.data()+d-(offset-pos),k);
+      pos+=k;
+      ml-=k;
+    }
+    if (offset>=ml) {
+      memcpy(dst+pos,dst+pos-offset,ml);
+      pos+=ml;
+    } else {
+      // Overlapping, so it repeats what it is copying
+      for (;ml>0;ml--,pos++) {
+	dst[pos]=dst[pos-offset];
+      }
+    }
+  }
+  return pos==len ? ERROR_NOERROR : ERROR_INSANE;
+}
+
+
+// The part of a leaf's data that matters: the leading pointer and the
+// pairs in use
+static SIZE_T LeafBytes(const NodeMetadata &info)
+{
+  return sizeof(SIZE_T)+info.numkeys*(info.keysize+info.valuesize);
+}
+
+
+// Make b a node like info, keeping its data if it already fits
+static void Shape(BTreeNode &b, const NodeMetadata &info)
+{
+  if (!b.data || b.info.nodetype!=info.nodetype || b.info.keysize!=info.keysize ||
+      b.info.valuesize!=info.valuesize || b.info.blocksize!=info.blocksize) {
+    b=BTreeNode(info.nodetype,info.keysize,info.valuesize,info.blocksize);
+  }
+  b.info=info;
+}
+
+
+bool BTreeIsPackedLeaf(const char *image, const SIZE_T blocksize)
+{
+  NodeMetadata info;
+
+  memcpy(&info,image,sizeof(info));
+  return info.nodetype==BTREE_LEAF_NODE && info.blocksize>blocksize;
+}
+
+
+ERROR_T BTreePackLeaf(const BTreeLeafCodec &codec, const BTreeNode &b,
+		      char *image, const SIZE_T blocksize)
+{
+  const SIZE_T header=sizeof(NodeMetadata)+sizeof(SIZE_T);
+  SIZE_T n;
+  ERROR_T rc;
+
+  if (blocksize<=header || LeafBytes(b.info)>b.info.GetNumDataBytes()) {
+    return ERROR_SIZE;
+  }
+  rc=codec.Compress(b.data,LeafBytes(b.info),image+header,blocksize-header,n);
+  if (rc) { return rc; }
+  memcpy(image,&b.info,sizeof(b.info));
+  memcpy(image+sizeof(b.info),&n,sizeof(n));
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeUnpackLeaf(const BTreeLeafCodec &codec, const char *image,
+			const SIZE_T blocksize, BTreeNode &b)
+{
+  const SIZE_T header=sizeof(NodeMetadata)+sizeof(SIZE_T);
+  NodeMetadata info;
+  SIZE_T n;
+
+  memcpy(&info,image,sizeof(info));
+  memcpy(&n,image+sizeof(info),sizeof(n));
+  if (info.nodetype!=BTREE_LEAF_NODE || n>blocksize-header ||
+      LeafBytes(info)>info.GetNumDataBytes()) {
+    return ERROR_INSANE;
+  }
+  Shape(b,info);
+  return codec.Decompress(image+header,n,b.data,LeafBytes(info));
+}
+
+
+BTreeLeafCache::BTreeLeafCache()
+{}
+
+
+void BTreeLeafCache::Reset(const SIZE_T entries)
+{
+  unique_lock<mutex> guard(lock);
+
+  blocks.assign(entries,LEAFCACHE_EMPTY);
+  nodes.assign(entries,vector<char>());
+}
+
+
+void BTreeLeafCache::Clear()
+{
+  unique_lock<mutex> guard(lock);
+
+  vector<SIZE_T>().swap(blocks);
+  vector<vector<char> >().swap(nodes);
+}
+
+
+bool BTreeLeafCache::Get(const SIZE_T block, BTreeNode &b)
+{
+  unique_lock<mutex> guard(lock);
+  NodeMetadata info;
+  SIZE_T i;
+
+  if (blocks.empty()) {
+    return false;
+  }
+  i=block%blocks.size();
+  if (blocks[i]!=block) {
+    return false;
+  }
+  memcpy(&info,nodes[i].data(),sizeof(info));
+  Shape(b,info);
+  memcpy(b.data,nodes[i].data()+sizeof(info),nodes[i].size()-sizeof(info));
+  return true;
+}
+
+
+void BTreeLeafCache::Put(const SIZE_T block, const BTreeNode &b)
+{
+  unique_lock<mutex> guard(lock);
+  SIZE_T i;
+
+  if (blocks.empty()) {
+    return;
+  }
+  i=block%blocks.size();
+  nodes[i].resize(sizeof(b.info)+LeafBytes(b.info));
+  memcpy(nodes[i].data(),&b.info,sizeof(b.info));
+  memcpy(nodes[i].data()+sizeof(b.info),b.data,LeafBytes(b.info));
+  blocks[i]=block;
+}
+
+
+void BTreeLeafCache::Forget(const SIZE_T block)
+{
+  unique_lock<mutex> guard(lock);
+  SIZE_T i;
+
+  if (blocks.empty()) {
+    return;
+  }
+  i=block%blocks.size();
+  if (blocks[i]==block) {
+    blocks[i]=LEAFCACHE_EMPTY;
+  }
+}
@@ -0,0 +1,149 @@
+#ifndef _btree_compress
+#define _btree_compress
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "global.h"
+#include "block.h"
+#include "btree_ds.h"
+
+using namespace std;
+
+//
+// Compressed leaves, for BTreeIndex::SetLeafCompression.  A compressed
+// leaf is a leaf node whose blocksize is some multiple of the store's,
+// so it holds that many blocks' worth of pairs, packed by a codec into
+// a single physical block:
+//
+//   NodeMetadata    as the node has it, with the bigger blocksize
+//   SIZE_T          how many compressed bytes follow
+//   compressed      the node's data, up to its last pair
+//
+// Any node whose blocksize is the store's is written as it always was,
+// so an index can hold both kinds, and telling them apart needs nothing
+// but the header.  A leaf whose pairs don't compress into a block can't
+// be written and has to split instead.
+//
+
+// Compresses and decompresses leaf data.  Codecs are used from several
+// threads at once by Verify, so they must keep no state of their own
+// between calls.
+class BTreeLeafCodec {
+ public:
+  virtual ~BTreeLeafCodec() {}
+
+  // Compress the n bytes at src into at most room bytes at dst, and say
+  // how many it took in out
+  // return ERROR_SIZE if they don't fit
+  virtual ERROR_T Compress(const char *src, const SIZE_T n,
+			   char *dst, const SIZE_T room, SIZE_T &out) const = 0;
+
+  // Decompress the n bytes at src into exactly len bytes at dst
+  // return ERROR_INSANE if src doesn't hold that
+  virtual ERROR_T Decompress(const char *src, const SIZE_T n,
+			     char *dst, const SIZE_T len) const = 0;
+};
+
+
+// How many bytes of dictionary BTreeLZCodec keeps at most, which leaves
+// all of it within reach of a match's 16 bit offset
+#define BTREE_LZ_DICT_MAX 32768
+
+//
+// A byte-oriented LZ77 codec in the style of LZ4's block format: each
+// sequence is a token byte holding a literal run length and a match
+// length, the literals, and a two byte offset back to the match.
+// Lengths that don't fit in the token's four bits carry on in bytes of
+// 255 and a final smaller one.  Compressing a leaf's worth of fixed
+// size keys and values is mostly finding the bytes they share.
+//
+// With a dictionary, matches may also reach back into it as if it came
+// just before the data, which is what makes small leaves of similar
+// values compress well.  The dictionary is not kept in the index, so an
+// index has to be given the same one every time it is attached.
+//
+class BTreeLZCodec : public BTreeLeafCodec {
+ private:
+  string               dict;
+  // The hash table the compressor starts from, with the dictionary's
+  // positions already in it
+  vector<unsigned int> table;
+
+ public:
+  BTreeLZCodec();
+
+  // Use the first BTREE_LZ_DICT_MAX bytes (at most) at d as the
+  // dictionary.  0 bytes means none.
+  void   SetDictionary(const char *d, const SIZE_T len);
+
+  const string & GetDictionary() const { return dict; }
+
+  // Build a dictionary of at most size bytes from the len bytes of
+  // samples, such as a few leaves' worth of typical pairs, out of the
+  // short segments whose 8 byte substrings recur most across them
+  static void Train(const char *samples, const SIZE_T len, const SIZE_T size, string &dict);
+
+  ERROR_T Compress(const char *src, const SIZE_T n,
+		   char *dst, const SIZE_T room, SIZE_T &out) const;
+  ERROR_T Decompress(const char *src, const SIZE_T n,
+		     char *dst, const SIZE_T len) const;
+};
+
+
+// Whether the physical block at image, of blocksize bytes, holds a
+// compressed leaf
+bool    BTreeIsPackedLeaf(const char *image, const SIZE_T blocksize);
+
+// Compress leaf b into a block of blocksize bytes at image
+// return ERROR_SIZE if it doesn't fit
+ERROR_T BTreePackLeaf(const BTreeLeafCodec &codec, const BTreeNode &b,
+		      char *image, const SIZE_T blocksize);
+
+// Decompress the leaf in the block at image into b, reusing b's data if
+// it is the right size
+// return ERROR_INSANE if the block doesn't hold a sensible one
+ERROR_T BTreeUnpackLeaf(const BTreeLeafCodec &codec, const char *image,
+			const SIZE_T blocksize, BTreeNode &b);
+
+
+//
+// Decompressed leaves, kept in memory so that reading a leaf that was
+// read or written lately costs a copy rather than I/O and
+// decompression.  Each block can only be kept in one entry (its number
+// modulo the number of entries), which takes over from whatever was
+// there.  The index puts every compressed leaf it writes here and
+// forgets whatever else it writes, so what is kept is never stale.  A
+// lock makes it safe to share between Verify's threads.
+//
+class BTreeLeafCache {
+ private:
+  mutex                  lock;
+  vector<SIZE_T>         blocks;
+  vector<vector<char> >  nodes;
+
+  BTreeLeafCache(const BTreeLeafCache &rhs);
+  BTreeLeafCache & operator=(const BTreeLeafCache &rhs);
+
+ public:
+  BTreeLeafCache();
+
+  // Make room for entries leaves, keeping none
+  void Reset(const SIZE_T entries);
+
+  void Clear();
+
+  bool Enabled() const { return !blocks.empty(); }
+  SIZE_T GetNumEntries() const { return blocks.size(); }
+
+  // Copy block's leaf into b, if it is kept, reusing b's data if it is
+  // the right size
+  bool Get(const SIZE_T block, BTreeNode &b);
+
+  void Put(const SIZE_T block, const BTreeNode &b);
+
+  void Forget(const SIZE_T block);
+};
+
+#endif
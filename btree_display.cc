@@ -0,0 +1,109 @@
+#include <string.h>
+
+#include "btree_display.h"
+
+static const char digits[] = "0123456789abcdef";
+
+
+BTreeDisplayWriter::BTreeDisplayWriter(ostream &os) :
+  out(os), buf(BTREE_DISPLAY_BUFFER), used(0)
+{}
+
+
+BTreeDisplayWriter::~BTreeDisplayWriter()
+{
+  Flush();
+}
+
+
+void BTreeDisplayWriter::Put(const char *s)
+{
+  Put(s,strlen(s));
+}
+
+
+void BTreeDisplayWriter::Put(const char *p, const SIZE_T n)
+{
+  if (n>buf.size()) {
+    Flush();
+    out.write(p,n);
+    return;
+  }
+  Room(n);
+  memcpy(&buf[used],p,n);
+  used+=n;
+}
+
+
+void BTreeDisplayWriter::PutNumber(unsigned long long n)
+{
+  char d[20];
+  SIZE_T i=sizeof(d);
+
+  do {
+    d[--i]='0'+n%10;
+    n/=10;
+  } while (n>0);
+  Put(d+i,sizeof(d)-i);
+}
+
+
+void BTreeDisplayWriter::PutBytes(const char *p, const SIZE_T len, const BTreeKeyFormat format,
+				  const bool json)
+{
+  unsigned char c;
+  SIZE_T i;
+
+  if (json) {
+    Put('"');
+  }
+  if (format==BTREE_KEYS_RAW && !json) {
+    Put(p,len);
+  } else if (format==BTREE_KEYS_HEX) {
+    for (i=0;i<len;i++) {
+      c=p[i];
+      Room(2);
+      buf[used++]=digits[c>>4];
+      buf[used++]=digits[c&0xf];
+    }
+  } else {
+    for (i=0;i<len;i++) {
+      c=p[i];
+      Room(6);
+      if (c=='"' || c=='\\') {
+	buf[used++]='\\';
+	buf[used++]=c;
+      } else if (c>=0x20 && c<0x7f) {
+	buf[used++]=c;
+      } else if (c=='\n' || c=='\t' || c=='\r') {
+	buf[used++]='\\';
+	buf[used++]= c=='\n' ? 'n' : c=='\t' ? 't' : 'r';
+      } else {
+	// JSON has no \x, so a byte goes in as the code point it is
+	buf[used++]='\\';
+	if (json) {
+	  buf[used++]='u';
+	  buf[used++]='0';
+	  buf[used++]='0';
+	} else {
+	  buf[used++]='x';
+	}
+	buf[used++]=digits[c>>4];
+	buf[used++]=digits[c&0xf];
+      }
+    }
+  }
+  if (json) {
+    Put('"');
+  }
+}
+
+
+ERROR_T BTreeDisplayWriter::Flush()
+{
+  if (used>0) {
+    out.write(&buf[0],used);
+    used=0;
+  }
+  return out ? ERROR_NOERROR : ERROR_NOSPACE;
+}
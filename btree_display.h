@@ -0,0 +1,50 @@
+#ifndef _btree_display
+#define _btree_display
+
+#include <iostream>
+#include <vector>
+
+#include "global.h"
+
+using namespace std;
+
+// How BTreeIndex::Display writes keys and values: their bytes as they
+// are, two hex digits a byte, or printable ASCII as it is and anything
+// else escaped C style (\n, \\, \x7f and so on).  In JSON they are
+// always strings, so raw bytes are escaped there too.
+enum BTreeKeyFormat {BTREE_KEYS_RAW, BTREE_KEYS_HEX, BTREE_KEYS_ESCAPED};
+
+// How many bytes BTreeDisplayWriter gathers before each write
+#define BTREE_DISPLAY_BUFFER 65536
+
+//
+// Gathers text into a buffer and hands it to a stream a buffer at a
+// time, rather than a character at a time through <<.
+//
+class BTreeDisplayWriter {
+ private:
+  ostream      &out;
+  vector<char>  buf;
+  SIZE_T        used;
+
+  void Room(const SIZE_T n) { if (used+n>buf.size()) { Flush(); } }
+
+ public:
+  BTreeDisplayWriter(ostream &os);
+  // Flushes
+  virtual ~BTreeDisplayWriter();
+
+  void    Put(const char c) { Room(1); buf[used++]=c; }
+  void    Put(const char *s);
+  void    Put(const char *p, const SIZE_T n);
+  void    PutNumber(unsigned long long n);
+
+  // len bytes at p in format, as a JSON string if json is set
+  void    PutBytes(const char *p, const SIZE_T len, const BTreeKeyFormat format,
+		   const bool json=false);
+
+  // return ERROR_NOSPACE if the stream has failed
+  ERROR_T Flush();
+};
+
+#endif
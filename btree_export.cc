@@ -0,0 +1,225 @@
+#include <string.h>
+
+#include "btree_export.h"
+
+static const char magic[8] = {'B','T','E','X','P','R','T','1'};
+
+// count, length and checksum
+#define CHUNK_HEADER 12
+
+
+// Slicing-by-8 tables for the CRC-32C polynomial, reflected
+struct BTreeChecksumTable {
+  unsigned int t[8][256];
+
+  BTreeChecksumTable() {
+    unsigned int i;
+    unsigned int k;
+    unsigned int c;
+
+    for (i=0;i<256;i++) {
+      for (c=i, k=0; k<8; k++) {
+	c= (c&1) ? (c>>1)^0x82f63b78u : c>>1;
+      }
+      t[0][i]=c;
+    }
+    for (i=0;i<256;i++) {
+      for (k=1;k<8;k++) {
+	t[k][i]=(t[k-1][i]>>8)^t[0][t[k-1][i]&0xff];
+      }
+    }
+  }
+};
+
+
+unsigned int BTreeChecksum(unsigned int crc, const char *p, SIZE_T n)
+{
+  static const BTreeChecksumTable table;
+  const unsigned int (*t)[256]=table.t;
+  const unsigned char *b=(const unsigned char *)p;
+  unsigned int lo;
+
+  crc=~crc;
+  for (;n>=8;n-=8, b+=8) {
+    lo=crc^(b[0] | (b[1]<<8) | (b[2]<<16) | ((unsigned int)b[3]<<24));
+    crc=t[7][lo&0xff] ^ t[6][(lo>>8)&0xff] ^ t[5][(lo>>16)&0xff] ^ t[4][lo>>24] ^
+      t[3][b[4]] ^ t[2][b[5]] ^ t[1][b[6]] ^ t[0][b[7]];
+  }
+  for (;n>0;n--, b++) {
+    crc=t[0][(crc^*b)&0xff]^(crc>>8);
+  }
+  return ~crc;
+}
+
+
+static void PutBytes(char *p, unsigned long long w, const SIZE_T n)
+{
+  SIZE_T i;
+
+  for (i=0;i<n;i++, w>>=8) {
+    p[i]=w&0xff;
+  }
+}
+
+
+static unsigned long long GetBytes(const char *p, const SIZE_T n)
+{
+  unsigned long long w=0;
+  SIZE_T i;
+
+  for (i=n;i>0;i--) {
+    w=(w<<8)|(unsigned char)p[i-1];
+  }
+  return w;
+}
+
+
+// Fill in the header of the chunk at c, whose length bytes of pairs
+// follow it, and say how long the whole thing is
+static SIZE_T SealChunk(char *c, const SIZE_T count, const SIZE_T length)
+{
+  PutBytes(c,count,4);
+  PutBytes(c+4,length,4);
+  PutBytes(c+8,BTreeChecksum(BTreeChecksum(0,c,8),c+CHUNK_HEADER,length),4);
+  return CHUNK_HEADER+length;
+}
+
+
+BTreeExportWriter::BTreeExportWriter(ostream &os, const SIZE_T ks, const SIZE_T vs) :
+  out(os), keysize(ks), valuesize(vs), pairs(0), total(0)
+{
+  perchunk=BTREE_EXPORT_CHUNK/(ks+vs);
+  if (perchunk==0) {
+    perchunk=1;
+  }
+  chunk.resize(CHUNK_HEADER+perchunk*(ks+vs));
+}
+
+
+ERROR_T BTreeExportWriter::Start()
+{
+  char h[sizeof(magic)+8];
+
+  memcpy(h,magic,sizeof(magic));
+  PutBytes(h+sizeof(magic),keysize,4);
+  PutBytes(h+sizeof(magic)+4,valuesize,4);
+  return out.write(h,sizeof(h)) ? ERROR_NOERROR : ERROR_NOSPACE;
+}
+
+
+ERROR_T BTreeExportWriter::Flush()
+{
+  SIZE_T n;
+
+  if (pairs==0) {
+    return ERROR_NOERROR;
+  }
+  n=SealChunk(&chunk[0],pairs,pairs*(keysize+valuesize));
+  pairs=0;
+  return out.write(&chunk[0],n) ? ERROR_NOERROR : ERROR_NOSPACE;
+}
+
+
+ERROR_T BTreeExportWriter::Add(const char *key, const char *value)
+{
+  char *p=&chunk[CHUNK_HEADER+pairs*(keysize+valuesize)];
+
+  memcpy(p,key,keysize);
+  memcpy(p+keysize,value,valuesize);
+  total++;
+  if (++pairs==perchunk) {
+    return Flush();
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeExportWriter::Finish()
+{
+  char end[CHUNK_HEADER+8];
+  ERROR_T rc;
+
+  rc=Flush();
+  if (rc) { return rc; }
+  PutBytes(end+CHUNK_HEADER,total,8);
+  if (!out.write(end,SealChunk(end,0,8)) || !out.flush()) {
+    return ERROR_NOSPACE;
+  }
+  return ERROR_NOERROR;
+}
+
+
+BTreeExportReader::BTreeExportReader(istream &is) :
+  in(is), keysize(0), valuesize(0), pairs(0), next(0), total(0), ended(false)
+{}
+
+
+ERROR_T BTreeExportReader::Start()
+{
+  char h[sizeof(magic)+8];
+
+  if (!in.read(h,sizeof(h)) || memcmp(h,magic,sizeof(magic))) {
+    return ERROR_NOTANINDEX;
+  }
+  keysize=GetBytes(h+sizeof(magic),4);
+  valuesize=GetBytes(h+sizeof(magic)+4,4);
+  if (keysize+valuesize==0) {
+    return ERROR_NOTANINDEX;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeExportReader::Fill()
+{
+  char h[CHUNK_HEADER];
+  SIZE_T count;
+  SIZE_T length;
+  SIZE_T most;
+
+  if (!in.read(h,CHUNK_HEADER)) {
+    return ERROR_INSANE;
+  }
+  count=GetBytes(h,4);
+  length=GetBytes(h+4,4);
+  // Nothing the writer makes is any longer, so anything that is must
+  // be damage, and is not worth allocating for
+  most=keysize+valuesize>BTREE_EXPORT_CHUNK ? keysize+valuesize : BTREE_EXPORT_CHUNK;
+  if (count==0 ? length!=8 :
+      length>most || (unsigned long long)count*(keysize+valuesize)!=length) {
+    return ERROR_INSANE;
+  }
+  if (chunk.size()<length) {
+    chunk.resize(length);
+  }
+  if (!in.read(&chunk[0],length) ||
+      BTreeChecksum(BTreeChecksum(0,h,8),&chunk[0],length)!=GetBytes(h+8,4)) {
+    return ERROR_INSANE;
+  }
+  if (count==0) {
+    ended=true;
+    return GetBytes(&chunk[0],8)==total ? ERROR_NOERROR : ERROR_INSANE;
+  }
+  pairs=count;
+  next=0;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeExportReader::Next(const char *&key, const char *&value)
+{
+  ERROR_T rc;
+
+  while (next==pairs) {
+    if (ended) {
+      return ERROR_NONEXISTENT;
+    }
+    rc=Fill();
+    if (rc) { return rc; }
+  }
+  key=&chunk[next*(keysize+valuesize)];
+  value=key+keysize;
+  next++;
+  total++;
+  return ERROR_NOERROR;
+}
@@ -0,0 +1,97 @@
+#ifndef _btree_export
+#define _btree_export
+
+#include <iostream>
+#include <vector>
+
+#include "global.h"
+
+using namespace std;
+
+//
+// A whole index's pairs as a stream, for BTreeIndex::Export and Import,
+// to back up, move or reshard an index.  The stream is a header, then
+// the pairs in increasing key order in chunks, then an end chunk:
+//
+//   header:  "BTEXPRT1", keysize and valuesize as 4 byte little-endian
+//   chunk:   count          4 bytes, how many pairs follow
+//            length         4 bytes, count*(keysize+valuesize)
+//            checksum       4 bytes, CRC-32C of count, length and pairs
+//            pairs          each keysize bytes of key then valuesize
+//                           bytes of value
+//   end:     a chunk with a count of 0, whose 8 bytes of "pairs" are the
+//            number of pairs in the stream
+//
+// All numbers are little-endian.  A chunk holds at most
+// BTREE_EXPORT_CHUNK bytes of pairs (or just one pair, if that is
+// bigger), and goes out in a single write.
+//
+
+#define BTREE_EXPORT_CHUNK (1<<20)
+
+// CRC-32C of n bytes at p, carrying on from crc (0 to start)
+unsigned int BTreeChecksum(unsigned int crc, const char *p, SIZE_T n);
+
+class BTreeExportWriter {
+ private:
+  ostream            &out;
+  SIZE_T              keysize;
+  SIZE_T              valuesize;
+  SIZE_T              perchunk;
+  // The chunk being filled, with room for its header at the front
+  vector<char>        chunk;
+  SIZE_T              pairs;
+  unsigned long long  total;
+
+  ERROR_T Flush();
+
+ public:
+  BTreeExportWriter(ostream &os, const SIZE_T keysize, const SIZE_T valuesize);
+
+  // Write the header
+  // return ERROR_NOSPACE if the stream fails
+  ERROR_T Start();
+
+  // Add the keysize bytes at key and the valuesize bytes at value.  Keys
+  // have to come in increasing order, which is not checked here.
+  // return ERROR_NOSPACE if the stream fails
+  ERROR_T Add(const char *key, const char *value);
+
+  // Write what is left and the end chunk, and flush the stream
+  // return ERROR_NOSPACE if the stream fails
+  ERROR_T Finish();
+
+  unsigned long long GetCount() const { return total; }
+};
+
+class BTreeExportReader {
+ private:
+  istream            &in;
+  SIZE_T              keysize;
+  SIZE_T              valuesize;
+  vector<char>        chunk;
+  SIZE_T              pairs;
+  SIZE_T              next;
+  unsigned long long  total;
+  bool                ended;
+
+  ERROR_T Fill();
+
+ public:
+  BTreeExportReader(istream &is);
+
+  // Read the header
+  // return ERROR_NOTANINDEX if the stream is not an export
+  ERROR_T Start();
+
+  SIZE_T  GetKeySize() const { return keysize; }
+  SIZE_T  GetValueSize() const { return valuesize; }
+
+  // Point key and value at the next pair, which stays put until the
+  // next call
+  // return ERROR_NONEXISTENT after the last pair, and ERROR_INSANE if
+  // the stream is cut short, fails its checksums or makes no sense
+  ERROR_T Next(const char *&key, const char *&value);
+};
+
+#endif
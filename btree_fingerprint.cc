@@ -0,0 +1,160 @@
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "btree_fingerprint.h"
+
+
+BTreeFingerprints::BTreeFingerprints() :
+  stride(0), nextblock(BTREE_FP_UNKNOWN), nextslot(0), nextchange(0)
+{}
+
+
+void BTreeFingerprints::Reset(const SIZE_T numblocks, const SIZE_T slots)
+{
+  stride=(slots+15)&~(SIZE_T)15;
+  prints.assign((size_t)numblocks*stride,0);
+  count.assign(numblocks,BTREE_FP_UNKNOWN);
+  nextblock=BTREE_FP_UNKNOWN;
+}
+
+
+void BTreeFingerprints::Clear()
+{
+  stride=0;
+  vector<unsigned char>().swap(prints);
+  vector<SIZE_T>().swap(count);
+}
+
+
+// FNV-1a, folded down to a byte
+unsigned char BTreeFingerprints::Of(const char *key, const SIZE_T len)
+{
+  unsigned int h=2166136261u;
+  SIZE_T i;
+
+  for (i=0;i<len;i++) {
+    h=(h^(unsigned char)key[i])*16777619u;
+  }
+  h^=h>>16;
+  return (unsigned char)(h^(h>>8));
+}
+
+
+void BTreeFingerprints::Build(const SIZE_T block, const BTreeNode &b)
+{
+  unsigned char *p=&prints[(size_t)block*stride];
+  SIZE_T slot;
+
+  for (slot=0;slot<b.info.numkeys;slot++) {
+    p[slot]=Of(b.ResolveKey(slot),b.info.keysize);
+  }
+  count[block]=b.info.numkeys;
+}
+
+
+void BTreeFingerprints::Expect(const SIZE_T block, const SIZE_T slot, const int change)
+{
+  nextblock=block;
+  nextslot=slot;
+  nextchange=change;
+}
+
+
+void BTreeFingerprints::Note(const SIZE_T block, const BTreeNode &b)
+{
+  unsigned char *p;
+  bool expected=block==nextblock;
+
+  nextblock=BTREE_FP_UNKNOWN;
+  if (block>=count.size()) {
+    return;
+  }
+  if (!expected || b.info.nodetype!=BTREE_LEAF_NODE || count[block]==BTREE_FP_UNKNOWN ||
+      count[block]+nextchange!=b.info.numkeys || b.info.numkeys>stride ||
+      nextslot>=count[block]+(nextchange>0)) {
+    count[block]=BTREE_FP_UNKNOWN;
+    return;
+  }
+  p=&prints[(size_t)block*stride];
+  if (nextchange>0) {
+    memmove(p+nextslot+1,p+nextslot,count[block]-nextslot);
+    p[nextslot]=Of(b.ResolveKey(nextslot),b.info.keysize);
+  } else if (nextchange<0) {
+    memmove(p+nextslot,p+nextslot+1,count[block]-nextslot-1);
+  }
+  count[block]=b.info.numkeys;
+}
+
+
+// Bit i set for each of the 16 bytes at p that is fp
+static unsigned int Match16(const unsigned char *p, const unsigned char fp)
+{
+#ifdef __SSE2__
+  __m128i v=_mm_loadu_si128((const __m128i *)p);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(v,_mm_set1_epi8((char)fp)));
+#else
+  unsigned int mask=0;
+  SIZE_T i;
+
+  for (i=0;i<16;i++) {
+    mask|=(unsigned int)(p[i]==fp)<<i;
+  }
+  return mask;
+#endif
+}
+
+
+static SIZE_T LowestBit(const unsigned int mask)
+{
+#ifdef __GNUC__
+  return __builtin_ctz(mask);
+#else
+  SIZE_T i;
+
+  for (i=0;!(mask&(1u<<i));i++) {
+  }
+  return i;
+#endif
+}
+
+
+SIZE_T BTreeFingerprints::Find(const SIZE_T block, const BTreeNode &b, const char *key)
+{
+  const SIZE_T n=b.info.numkeys;
+  const SIZE_T keysize=b.info.keysize;
+  unsigned int mask;
+  SIZE_T first;
+  SIZE_T slot;
+
+  if (block>=count.size() || n>stride) {
+    // Nothing to go on, so look at every key
+    for (slot=0;slot<n;slot++) {
+      if (!memcmp(b.ResolveKey(slot),key,keysize)) {
+	return slot;
+      }
+    }
+    return n;
+  }
+  if (count[block]!=n) {
+    Build(block,b);
+  }
+
+  const unsigned char *p=&prints[(size_t)block*stride];
+  const unsigned char fp=Of(key,keysize);
+
+  for (first=0;first<n;first+=16) {
+    mask=Match16(p+first,fp);
+    if (n-first<16) {
+      mask&=(1u<<(n-first))-1;
+    }
+    for (;mask;mask&=mask-1) {
+      slot=first+LowestBit(mask);
+      if (!memcmp(b.ResolveKey(slot),key,keysize)) {
+	return slot;
+      }
+    }
+  }
+  return n;
+}
@@ -0,0 +1,70 @@
+#ifndef _btree_fingerprint
+#define _btree_fingerprint
+
+#include <vector>
+
+#include "global.h"
+#include "btree_ds.h"
+
+using namespace std;
+
+//
+// One-byte fingerprints of the keys in each leaf, in the style of
+// FPTree, so a point lookup can pick out the few slots that might hold
+// its key, sixteen at a time with SSE2, and compare only those in full.
+//
+// The fingerprints are kept in memory beside the index rather than in
+// the leaves, so turning them on leaves the disk format alone.  They
+// take a byte per leaf slot for every block, a small fraction of the
+// index itself.  Every write of a block is noted.  One that was said
+// to be coming (inserting or removing a single key, or leaving the
+// keys alone) updates the block's fingerprints in place; any other
+// write, such as a split or a merge, forgets them, and the next lookup
+// to land on the leaf fingerprints it afresh.
+//
+
+// What a block's count says when its fingerprints aren't known
+#define BTREE_FP_UNKNOWN ((SIZE_T)-1)
+
+class BTreeFingerprints {
+ private:
+  // Bytes kept per block, a multiple of 16 so a match can always
+  // read a whole vector
+  SIZE_T                stride;
+  vector<unsigned char> prints;
+  // How many keys of each block are fingerprinted, or
+  // BTREE_FP_UNKNOWN if none are
+  vector<SIZE_T>        count;
+  // The write Expect said was coming next
+  SIZE_T                nextblock;
+  SIZE_T                nextslot;
+  int                   nextchange;
+
+  void Build(const SIZE_T block, const BTreeNode &b);
+
+ public:
+  BTreeFingerprints();
+
+  // Make room for numblocks blocks of up to slots keys, knowing none
+  void Reset(const SIZE_T numblocks, const SIZE_T slots);
+
+  // Let go of everything
+  void Clear();
+
+  bool Enabled() const { return !count.empty(); }
+
+  static unsigned char Of(const char *key, const SIZE_T len);
+
+  // The next write of block only inserts a key at slot (change 1),
+  // removes the one at slot (-1), or keeps the keys as they are (0)
+  void Expect(const SIZE_T block, const SIZE_T slot, const int change);
+
+  // block has just been written with b
+  void Note(const SIZE_T block, const BTreeNode &b);
+
+  // The slot of leaf b, which is at block, whose key is the keysize
+  // bytes at key, or b's numkeys if there is none
+  SIZE_T Find(const SIZE_T block, const BTreeNode &b, const char *key);
+};
+
+#endif
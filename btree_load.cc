@@ -0,0 +1,356 @@
+#include <string.h>
+#include <algorithm>
+
+#include "btree_load.h"
+#include "btree_pool.h"
+
+enum {BTREE_LOAD_COUNT, BTREE_LOAD_SCATTER, BTREE_LOAD_SORT, BTREE_LOAD_PLAN, BTREE_LOAD_WRITE};
+
+// One thread's part of a step of a load
+struct BTreeLoadTask : public BTreeTask {
+  BTreeLoader *loader;
+  int          step;
+  SIZE_T       item;
+
+  void Run() {
+    ERROR_T rc=ERROR_NOERROR;
+
+    switch (step) {
+    case BTREE_LOAD_COUNT:   rc=loader->Count(item); break;
+    case BTREE_LOAD_SCATTER: rc=loader->Scatter(item); break;
+    case BTREE_LOAD_SORT:    rc=loader->SortBucket(item); break;
+    case BTREE_LOAD_PLAN:    rc=loader->PlanRun(item); break;
+    case BTREE_LOAD_WRITE:   rc=loader->WriteRun(item); break;
+    }
+    loader->rcs[item]=rc;
+  }
+};
+
+
+BTreeLoader::BTreeLoader(BTreeIndex &i, const SIZE_T t, const SIZE_T fill) :
+  index(i), builder(i,fill), threads(t), keysize(0), pairsize(0), pairs(0), n(0),
+  slices(0), buckets(0)
+{}
+
+
+BTreeLoader::Entry BTreeLoader::MakeEntry(const char *pair) const
+{
+  Entry e;
+  SIZE_T i;
+
+  e.prefix=0;
+  for (i=0;i<8;i++) {
+    e.prefix=(e.prefix<<8) | (i<keysize ? (unsigned char)pair[i] : 0);
+  }
+  e.pair=pair;
+  return e;
+}
+
+
+bool BTreeLoader::Less(const Entry &l, const Entry &r) const
+{
+  if (l.prefix!=r.prefix) {
+    return l.prefix<r.prefix;
+  }
+  return keysize>8 && memcmp(l.pair+8,r.pair+8,keysize-8)<0;
+}
+
+
+SIZE_T BTreeLoader::Classify(const Entry &e) const
+{
+  // The first splitter above e, so equal keys always land together
+  return upper_bound(splitters.begin(),splitters.end(),e,
+		     [this](const Entry &l, const Entry &r) { return Less(l,r); })-splitters.begin();
+}
+
+
+ERROR_T BTreeLoader::Count(const SIZE_T slice)
+{
+  size_t i=n*slice/slices;
+  size_t end=n*(slice+1)/slices;
+  size_t *c=&counts[(size_t)slice*buckets];
+  SIZE_T b;
+
+  for (;i<end;i++) {
+    b= buckets>1 ? Classify(MakeEntry(pairs+i*pairsize)) : 0;
+    bucketof[i]=b;
+    c[b]++;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeLoader::Scatter(const SIZE_T slice)
+{
+  size_t i=n*slice/slices;
+  size_t end=n*(slice+1)/slices;
+  size_t *c=&counts[(size_t)slice*buckets];
+
+  for (;i<end;i++) {
+    sorted[c[bucketof[i]]++]=MakeEntry(pairs+i*pairsize);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeLoader::SortBucket(const SIZE_T bucket)
+{
+  Entry *first=&sorted[0]+bucketstart[bucket];
+  Entry *last=&sorted[0]+bucketstart[bucket+1];
+  Entry *e;
+
+  sort(first,last,[this](const Entry &l, const Entry &r) { return Less(l,r); });
+  for (e=first; e+1<last; e++) {
+    if (!Less(e[0],e[1])) {
+      return ERROR_CONFLICT;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+void BTreeLoader::FillLeaf(BTreeNode &b, const size_t first, const SIZE_T numkeys) const
+{
+  SIZE_T i;
+
+  b.info.numkeys=numkeys;
+  for (i=0;i<numkeys;i++) {
+    memcpy(b.ResolveKey(i),sorted[first+i].pair,pairsize);
+  }
+}
+
+
+ERROR_T BTreeLoader::PlanRun(const SIZE_T run)
+{
+  size_t p=runstart[run];
+  size_t end=runstart[run+1];
+  SIZE_T k;
+  SIZE_T lo;
+  SIZE_T hi;
+  BTreeNode b=builder.leaf;
+
+  for (;p<end;p+=k) {
+    k=min((size_t)builder.leafcap,end-p);
+    if (index.codec) {
+      // The most pairs that compress into a block, as BTreeBuilder finds
+      // them
+      FillLeaf(b,p,k);
+      if (!index.LeafFits(b)) {
+	b.info.numkeys=1;
+	if (!index.LeafFits(b)) {
+	  return ERROR_SIZE;
+	}
+	for (lo=1, hi=k; hi-lo>1; ) {
+	  b.info.numkeys=(lo+hi)/2;
+	  if (index.LeafFits(b)) {
+	    lo=b.info.numkeys;
+	  } else {
+	    hi=b.info.numkeys;
+	  }
+	}
+	k=lo;
+      }
+    }
+    runleaves[run].push_back(k);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeLoader::WriteLeaf(const SIZE_T block, const BTreeNode &b) const
+{
+  static thread_local Block image;
+
+  if (!index.mapped) {
+    return index.WriteNode(block,b);
+  }
+  index.numwrites++;
+  BTREE_STAT(index.stats.CountWrite(b.info.nodetype));
+  if (index.codec && b.info.blocksize>index.GetBlockSize()) {
+    image.Resize(index.GetBlockSize(),false);
+    ERROR_T rc=BTreePackLeaf(*index.codec,b,image.data,index.GetBlockSize());
+    if (rc) { return rc; }
+    return index.mapped->WriteBlock(block,image.data);
+  }
+  return index.mapped->Write(block,b);
+}
+
+
+ERROR_T BTreeLoader::WriteRun(const SIZE_T run)
+{
+  ERROR_T rc;
+  size_t p=runstart[run];
+  size_t j;
+  BTreeNode b=builder.leaf;
+
+  for (j=0;j<runleaves[run].size();j++) {
+    FillLeaf(b,p,runleaves[run][j]);
+    rc=WriteLeaf(blocks[runfirst[run]+j],b);
+    if (rc) { return rc; }
+    p+=runleaves[run][j];
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeLoader::RunStep(const int step, const SIZE_T count, const SIZE_T t)
+{
+  vector<BTreeLoadTask> tasks(count);
+  SIZE_T i;
+
+  rcs.assign(count,ERROR_NOERROR);
+  {
+    BTreeThreadPool pool(min(t,count));
+
+    for (i=0;i<count;i++) {
+      tasks[i].loader=this;
+      tasks[i].step=step;
+      tasks[i].item=i;
+      pool.Submit(&tasks[i]);
+    }
+    // The pool finishes every task before it goes away
+  }
+  for (i=0;i<count;i++) {
+    if (rcs[i]) {
+      return rcs[i];
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeLoader::Sort()
+{
+  ERROR_T rc;
+  SIZE_T b;
+  SIZE_T s;
+  SIZE_T i;
+  size_t at;
+  size_t c;
+  unsigned long long x=0x9e3779b97f4a7c15ull;
+  vector<Entry> samples;
+
+  slices= threads>0 ? threads : 1;
+  buckets=min((size_t)BTREE_LOAD_BUCKETS,
+	      min((size_t)slices*BTREE_LOAD_SPLIT,n/BTREE_LOAD_SAMPLES+1));
+  if (threads==0) {
+    buckets=1;
+  }
+
+  // Every BTREE_LOAD_SAMPLES'th of the sorted samples goes between two
+  // buckets
+  splitters.clear();
+  if (buckets>1) {
+    for (i=0;i<(SIZE_T)buckets*BTREE_LOAD_SAMPLES;i++) {
+      x^=x<<13;
+      x^=x>>7;
+      x^=x<<17;
+      samples.push_back(MakeEntry(pairs+(x%n)*pairsize));
+    }
+    sort(samples.begin(),samples.end(),[this](const Entry &l, const Entry &r) { return Less(l,r); });
+    for (b=1;b<buckets;b++) {
+      splitters.push_back(samples[(size_t)b*BTREE_LOAD_SAMPLES]);
+    }
+  }
+
+  bucketof.resize(n);
+  counts.assign((size_t)slices*buckets,0);
+  rc=RunStep(BTREE_LOAD_COUNT,slices,threads);
+  if (rc) { return rc; }
+
+  // Each bucket's pairs from each slice follow the ones from the slice
+  // before; counts becomes where each slice's next one goes
+  bucketstart.assign(buckets+1,0);
+  for (at=0, b=0; b<buckets; b++) {
+    bucketstart[b]=at;
+    for (s=0;s<slices;s++) {
+      c=counts[(size_t)s*buckets+b];
+      counts[(size_t)s*buckets+b]=at;
+      at+=c;
+    }
+  }
+  bucketstart[buckets]=at;
+
+  sorted.resize(n);
+  rc=RunStep(BTREE_LOAD_SCATTER,slices,threads);
+  if (rc) { return rc; }
+  vector<unsigned char>().swap(bucketof);
+  return RunStep(BTREE_LOAD_SORT,buckets,threads);
+}
+
+
+ERROR_T BTreeLoader::Build()
+{
+  ERROR_T rc;
+  SIZE_T runs;
+  SIZE_T r;
+  size_t per;
+  size_t leaves;
+  size_t j;
+  size_t p;
+  BorrowedKey k;
+
+  // Runs of whole leaves, so that without compression every leaf but
+  // the last gets as many pairs as a BTreeBuilder would give it
+  runs= threads>0 ? threads*BTREE_LOAD_SPLIT : 1;
+  per=(n+runs-1)/runs;
+  per=(per+builder.leafcap-1)/builder.leafcap*builder.leafcap;
+  runstart.clear();
+  for (p=0;p<n;p+=per) {
+    runstart.push_back(p);
+  }
+  runs=runstart.size();
+  runstart.push_back(n);
+  runleaves.assign(runs,vector<SIZE_T>());
+  rc=RunStep(BTREE_LOAD_PLAN,runs,threads);
+  if (rc) { return rc; }
+
+  // The runs' blocks, off the front of the free list in order
+  runfirst.resize(runs);
+  for (leaves=0, r=0; r<runs; r++) {
+    runfirst[r]=leaves;
+    leaves+=runleaves[r].size();
+  }
+  blocks.resize(leaves);
+  for (j=0;j<leaves;j++) {
+    rc=builder.TakeBlock(blocks[j]);
+    if (rc) { return rc; }
+  }
+
+  rc=RunStep(BTREE_LOAD_WRITE,runs,index.mapped ? threads : 0);
+  if (rc) { return rc; }
+
+  for (p=0, r=0; r<runs; r++) {
+    for (j=0;j<runleaves[r].size();j++) {
+      p+=runleaves[r][j];
+      rc=builder.AddLeaf(blocks[runfirst[r]+j],k.At(sorted[p-1].pair,keysize),runleaves[r][j]);
+      if (rc) { return rc; }
+    }
+  }
+  return builder.Finish();
+}
+
+
+ERROR_T BTreeLoader::Load(const char *p, const size_t count)
+{
+  ERROR_T rc;
+
+  pairs=p;
+  n=count;
+  keysize=index.GetKeySize();
+  pairsize=keysize+index.GetValueSize();
+  if (n==0) {
+    return ERROR_NOERROR;
+  }
+
+  // Finds out before any work is done whether the index is empty
+  rc=builder.Start();
+  if (rc) { return rc; }
+
+  rc=Sort();
+  if (rc==ERROR_NOERROR) {
+    rc=Build();
+  }
+  vector<Entry>().swap(sorted);
+  return rc;
+}
@@ -0,0 +1,129 @@
+#ifndef _btree_load
+#define _btree_load
+
+#include <vector>
+
+#include "btree.h"
+#include "btree_build.h"
+
+using namespace std;
+
+// Buckets the sort splits the pairs into for each thread, so one that
+// comes out larger than the rest doesn't hold everything up; and runs
+// of leaves the build splits them into for each thread, for the same
+// reason
+#define BTREE_LOAD_SPLIT   4
+// No more buckets than this, so a pair's bucket fits in a byte
+#define BTREE_LOAD_BUCKETS 256
+// Keys sampled for each bucket to pick the keys between them
+#define BTREE_LOAD_SAMPLES 64
+
+struct BTreeLoadTask;
+
+//
+// Builds an empty index out of pairs in no particular order, using
+// every thread it is given.  The pairs are sample sorted: a sample of
+// their keys picks the keys that split them into buckets, the pairs
+// are counted into the buckets and scattered to them a slice of the
+// input per thread, and each bucket is sorted on its own.  What gets
+// sorted is a pointer to each pair along with its first 8 key bytes,
+// so most comparisons don't leave the array.
+//
+// The sorted pairs are then cut into runs of whole leaves.  Once it is
+// known how many leaves each run makes, every run is given its own
+// range of blocks off the free list and fills them at the same time as
+// the others.  Only then are the interior levels built over the leaves,
+// out of the greatest key of each, by a BTreeBuilder on one thread,
+// which is little work next to the leaves.  The root and the superblock
+// are written last, once.
+//
+// Leaves are only written from more than one thread when the index is
+// on a mapped store, since the buffer cache and the index's side tables
+// are for one thread.  They go straight into the mapping; the side
+// tables already know nothing of blocks on the free list, which is
+// what they were.  Otherwise the sort still uses every thread, and the
+// leaves are written through the index on the caller's.
+//
+// Without compression the index comes out with the same nodes as a
+// BTreeBuilder would make out of the sorted pairs, though in different
+// blocks: the leaves take the front of the free list, and the interior
+// nodes come after all of them.
+//
+class BTreeLoader {
+  friend struct BTreeLoadTask;
+
+ private:
+  // A pair to sort, and the first 8 bytes of its key, most significant
+  // first, zero filled
+  struct Entry {
+    unsigned long long prefix;
+    const char        *pair;
+  };
+
+  BTreeIndex         &index;
+  BTreeBuilder        builder;
+  SIZE_T              threads;
+  SIZE_T              keysize;
+  SIZE_T              pairsize;
+  const char         *pairs;
+  size_t              n;
+
+  // The keys between buckets, the bucket each pair goes in, and for
+  // each slice of the input, how many of its pairs each bucket gets and
+  // then where the next of them goes
+  SIZE_T              slices;
+  SIZE_T              buckets;
+  vector<Entry>       splitters;
+  vector<unsigned char> bucketof;
+  vector<size_t>      counts;
+  vector<size_t>      bucketstart;
+  vector<Entry>       sorted;
+
+  // Where each run starts in sorted, how many pairs each of its leaves
+  // gets, and where its blocks start in blocks
+  vector<size_t>      runstart;
+  vector<vector<SIZE_T> > runleaves;
+  vector<size_t>      runfirst;
+  vector<SIZE_T>      blocks;
+
+  vector<ERROR_T>     rcs;
+
+  Entry   MakeEntry(const char *pair) const;
+  bool    Less(const Entry &l, const Entry &r) const;
+  SIZE_T  Classify(const Entry &e) const;
+
+  // Each of these is one thread's part of a step
+  ERROR_T Count(const SIZE_T slice);
+  ERROR_T Scatter(const SIZE_T slice);
+  ERROR_T SortBucket(const SIZE_T bucket);
+  ERROR_T PlanRun(const SIZE_T run);
+  ERROR_T WriteRun(const SIZE_T run);
+
+  // Run step on items 0..count-1, on as many threads as there are
+  // for it, and say how the first to fail did
+  ERROR_T RunStep(const int step, const SIZE_T count, const SIZE_T threads);
+
+  // Put the first numkeys pairs from sorted at first into b
+  void    FillLeaf(BTreeNode &b, const size_t first, const SIZE_T numkeys) const;
+  ERROR_T WriteLeaf(const SIZE_T block, const BTreeNode &b) const;
+
+  ERROR_T Sort();
+  ERROR_T Build();
+
+ public:
+  // index must be attached and empty, and must not be used for anything
+  // else while Load runs.  threads 0 does everything on the caller's
+  // thread.  fill is as for a BTreeBuilder.
+  BTreeLoader(BTreeIndex &index, const SIZE_T threads, const SIZE_T fill=BTREE_BUILD_FILL);
+
+  // Build the index out of the n pairs at p, each the index's keysize
+  // bytes of key followed by its valuesize bytes of value, in any order.
+  // p is only read, and not after Load returns.
+  // return ERROR_CONFLICT if a key is there more than once
+  // return ERROR_BADCONFIG if the index isn't empty
+  // return ERROR_SIZE if a pair doesn't compress into a block
+  // return ERROR_NOSPACE if the index runs out of blocks
+  ERROR_T Load(const char *p, const size_t n);
+};
+
+#endif
@@ -0,0 +1,300 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "btree_mmap.h"
+
+void BTreeNodeView::MoveTo(BTreeNode &b)
+{
+  if (borrowed) {
+    // Copy into b's own buffer if it already has one the right size
+    if (b.data && b.info.GetNumDataBytes()==node.info.GetNumDataBytes()) {
+      b.info=node.info;
+      memcpy(b.data,node.data,node.info.GetNumDataBytes());
+    } else {
+      b=node;
+    }
+  } else {
+    NodeMetadata info=b.info;
+    char *data=b.data;
+    b.info=node.info;
+    b.data=node.data;
+    node.info=info;
+    node.data=data;
+  }
+}
+
+
+BTreeMmapStore::BTreeMmapStore() :
+  fd(-1), base(0), blocksize(0), numblocks(0), readonly(true)
+{}
+
+
+BTreeMmapStore::~BTreeMmapStore()
+{
+  Detach();
+}
+
+
+ERROR_T BTreeMmapStore::Map(const size_t length)
+{
+  void *p;
+
+  if (fd<0) {
+    p=mmap(0,length,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  } else {
+    p=mmap(0,length,readonly ? PROT_READ : PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+  }
+
+  if (p==MAP_FAILED) {
+    return ERROR_NOSPACE;
+  }
+  base=(char *)p;
+#ifdef MADV_HUGEPAGE
+  if (fd<0) {
+    // Nothing to page in from, so fewer, bigger pages only save TLB misses
+    madvise(base,length,MADV_HUGEPAGE);
+  }
+#endif
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeMmapStore::Create(const char *filename, const SIZE_T n, const SIZE_T bs)
+{
+  ERROR_T rc;
+
+  Detach();
+
+  fd=open(filename,O_RDWR|O_CREAT|O_TRUNC,0644);
+
+  if (fd<0) {
+    return ERROR_NONEXISTENT;
+  }
+
+  // A fresh file reads back as zeros, which is all Attach needs
+  if (ftruncate(fd,(off_t)n*bs)<0) {
+    Detach();
+    return ERROR_NOSPACE;
+  }
+
+  blocksize=bs;
+  numblocks=n;
+  readonly=false;
+
+  rc=Map((size_t)n*bs);
+  if (rc) {
+    Detach();
+  }
+  return rc;
+}
+
+
+ERROR_T BTreeMmapStore::CreateInMemory(const SIZE_T n, const SIZE_T bs)
+{
+  ERROR_T rc;
+
+  Detach();
+
+  blocksize=bs;
+  numblocks=n;
+  readonly=false;
+
+  rc=Map((size_t)n*bs);
+  if (rc) {
+    Detach();
+    return rc;
+  }
+  changed.assign(n,0);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeMmapStore::Attach(const char *filename, const bool ro)
+{
+  struct stat st;
+  NodeMetadata info;
+  ERROR_T rc;
+
+  Detach();
+
+  fd=open(filename,ro ? O_RDONLY : O_RDWR);
+
+  if (fd<0) {
+    return ERROR_NONEXISTENT;
+  }
+
+  if (fstat(fd,&st)<0 || (size_t)st.st_size<sizeof(info) ||
+      pread(fd,&info,sizeof(info),0)!=(ssize_t)sizeof(info)) {
+    Detach();
+    return ERROR_NOTANINDEX;
+  }
+
+  if (info.nodetype!=BTREE_SUPERBLOCK || info.blocksize<sizeof(info) ||
+      (size_t)st.st_size%info.blocksize) {
+    Detach();
+    return ERROR_NOTANINDEX;
+  }
+
+  blocksize=info.blocksize;
+  numblocks=st.st_size/info.blocksize;
+  readonly=ro;
+
+  rc=Map(st.st_size);
+  if (rc) {
+    Detach();
+  }
+  return rc;
+}
+
+
+ERROR_T BTreeMmapStore::Sync()
+{
+  if (base && fd>=0 && !readonly && msync(base,(size_t)numblocks*blocksize,MS_SYNC)<0) {
+    return ERROR_NOSPACE;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeMmapStore::Detach()
+{
+  ERROR_T rc;
+
+  rc=Sync();
+  if (base) {
+    munmap(base,(size_t)numblocks*blocksize);
+    base=0;
+  }
+  if (fd>=0) {
+    close(fd);
+    fd=-1;
+  }
+  vector<unsigned char>().swap(changed);
+  return rc;
+}
+
+
+ERROR_T BTreeMmapStore::Read(const SIZE_T block, BTreeNode &node) const
+{
+  NodeMetadata info;
+
+  if (block>=numblocks) {
+    return ERROR_NONEXISTENT;
+  }
+
+  memcpy(&info,Resolve(block),sizeof(info));
+  if (info.blocksize>blocksize) {
+    // A compressed leaf, which only the index can make sense of
+    return ERROR_INSANE;
+  }
+
+  // Let the node decide for itself whether its type carries data
+  node=BTreeNode(info.nodetype,info.keysize,info.valuesize,info.blocksize);
+  node.info=info;
+  if (node.data) {
+    memcpy(node.data,Resolve(block)+sizeof(info),info.GetNumDataBytes());
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeMmapStore::Write(const SIZE_T block, const BTreeNode &node)
+{
+  if (readonly) {
+    return ERROR_BADCONFIG;
+  }
+  if (block>=numblocks) {
+    return ERROR_NONEXISTENT;
+  }
+  if (node.info.blocksize>blocksize) {
+    return ERROR_SIZE;
+  }
+
+  if (!changed.empty()) {
+    changed[block]=1;
+  }
+  memcpy(Resolve(block),&node.info,sizeof(node.info));
+  if (node.data) {
+    memcpy(Resolve(block)+sizeof(node.info),node.data,node.info.GetNumDataBytes());
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeMmapStore::ReadBlock(const SIZE_T block, const char *&bytes) const
+{
+  if (block>=numblocks) {
+    return ERROR_NONEXISTENT;
+  }
+  bytes=Resolve(block);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeMmapStore::WriteBlock(const SIZE_T block, const char *bytes)
+{
+  if (readonly) {
+    return ERROR_BADCONFIG;
+  }
+  if (block>=numblocks) {
+    return ERROR_NONEXISTENT;
+  }
+  if (!changed.empty()) {
+    changed[block]=1;
+  }
+  memcpy(Resolve(block),bytes,blocksize);
+  return ERROR_NOERROR;
+}
+
+
+void BTreeMmapStore::ClearChanged()
+{
+  if (!changed.empty()) {
+    changed.assign(numblocks,0);
+  }
+}
+
+
+void BTreeMmapStore::Prefetch(const SIZE_T block) const
+{
+  size_t page=sysconf(_SC_PAGESIZE);
+  size_t start;
+  size_t end;
+
+  if (block>=numblocks) {
+    return;
+  }
+  start=(size_t)block*blocksize;
+  end=start+blocksize;
+  start-=start%page;
+  madvise(base+start,end-start,MADV_WILLNEED);
+}
+
+
+ERROR_T BTreeMmapStore::View(const SIZE_T block, BTreeNodeView &view) const
+{
+  if (block>=numblocks) {
+    return ERROR_NONEXISTENT;
+  }
+
+  view.Release();
+  view.node=BTreeNode();
+  memcpy(&view.node.info,Resolve(block),sizeof(view.node.info));
+  if (view.node.info.blocksize>blocksize) {
+    return ERROR_INSANE;
+  }
+  switch (view.node.info.nodetype) {
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+  case BTREE_LEAF_NODE:
+    view.node.data=Resolve(block)+sizeof(view.node.info);
+    view.borrowed=true;
+    break;
+  default:
+    break;
+  }
+  return ERROR_NOERROR;
+}
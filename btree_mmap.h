@@ -0,0 +1,126 @@
+#ifndef _btree_mmap
+#define _btree_mmap
+
+#include <vector>
+
+#include "global.h"
+#include "btree_ds.h"
+
+using namespace std;
+
+class BTreeIndex;
+class BTreeMmapStore;
+
+// A node we only look at.  Read from a mapped store it borrows the
+// mapped bytes instead of copying them; read any other way it holds
+// an ordinary copy.  Either way it must not be written through, and a
+// borrowed view must not outlive the store's mapping.
+class BTreeNodeView {
+  friend class BTreeIndex;
+  friend class BTreeMmapStore;
+
+ private:
+  BTreeNode node;
+  bool      borrowed;
+
+  BTreeNodeView(const BTreeNodeView &rhs);
+  BTreeNodeView & operator=(const BTreeNodeView &rhs);
+
+  // Forget any borrowed bytes so the node can be reused or destroyed
+  void Release() { if (borrowed) { node.data=0; borrowed=false; } }
+
+ public:
+  BTreeNodeView() : borrowed(false) {}
+  virtual ~BTreeNodeView() { Release(); }
+
+  const BTreeNode & Get() const { return node; }
+
+  // Leave the node in b, copying it only if it is borrowed
+  void MoveTo(BTreeNode &b);
+};
+
+//
+// A block store backed by one memory-mapped image file, for indexes
+// that fit in memory.  Blocks are laid out back to back exactly as
+// Serialize would write them, starting with the superblock at block 0.
+//
+// Nothing is read up front: attaching only maps the file, and pages are
+// faulted in as nodes are touched.  Mapped read-only, the image is
+// shared by every process that has the same index open.  Writes go
+// straight into the mapping and reach the file on Sync (msync), which
+// the index also does on Detach.
+//
+// Made with CreateInMemory instead, the image is anonymous memory with
+// no file behind it, and the store notes which blocks have been written
+// since it was made or last told to forget, so whoever filled it can
+// put just those back where they came from.  This is what an index in
+// memory mode (BTreeIndex::SetInMemory) lives on between Attach and
+// Detach.
+//
+class BTreeMmapStore {
+ private:
+  int     fd;
+  char   *base;
+  SIZE_T  blocksize;
+  SIZE_T  numblocks;
+  bool    readonly;
+  // A byte per block, set when it is written, only in memory; bytes
+  // rather than bits so threads writing different blocks don't collide
+  vector<unsigned char> changed;
+
+  BTreeMmapStore(const BTreeMmapStore &rhs);
+  BTreeMmapStore & operator=(const BTreeMmapStore &rhs);
+
+  ERROR_T Map(const size_t length);
+  char *  Resolve(const SIZE_T block) const { return base+(size_t)block*blocksize; }
+
+ public:
+  BTreeMmapStore();
+  // Detaches
+  virtual ~BTreeMmapStore();
+
+  // Make a new zero-filled image of numblocks blocks and map it
+  // read-write, ready for an Attach(initblock,true) of the index
+  ERROR_T Create(const char *filename, const SIZE_T numblocks, const SIZE_T blocksize);
+
+  // Make a new zero-filled image of numblocks blocks in anonymous
+  // memory, with no blocks written yet
+  ERROR_T CreateInMemory(const SIZE_T numblocks, const SIZE_T blocksize);
+
+  // Map an existing image.  The block size comes from its superblock.
+  // return ERROR_NOTANINDEX if block 0 is not a superblock
+  ERROR_T Attach(const char *filename, const bool readonly=true);
+
+  // Push every change to the file
+  ERROR_T Sync();
+
+  ERROR_T Detach();
+
+  SIZE_T  GetBlockSize() const { return blocksize; }
+  SIZE_T  GetNumBlocks() const { return numblocks; }
+  bool    IsReadOnly() const { return readonly; }
+  bool    IsInMemory() const { return fd<0 && base; }
+
+  // Whether an image made in memory has had block written since
+  // ClearChanged; always false for a file
+  bool    IsChanged(const SIZE_T block) const { return block<changed.size() && changed[block]; }
+  void    ClearChanged();
+
+  // These mirror Unserialize/Serialize.  Writing a read-only store
+  // returns ERROR_BADCONFIG.
+  ERROR_T Read(const SIZE_T block, BTreeNode &node) const;
+  ERROR_T Write(const SIZE_T block, const BTreeNode &node);
+
+  // A block's raw bytes, for nodes stored some other way than
+  // Serialize's.  ReadBlock points bytes at them inside the mapping.
+  ERROR_T ReadBlock(const SIZE_T block, const char *&bytes) const;
+  ERROR_T WriteBlock(const SIZE_T block, const char *bytes);
+
+  // Ask the kernel to start faulting block in
+  void    Prefetch(const SIZE_T block) const;
+
+  // Point view at the block inside the mapping without copying it
+  ERROR_T View(const SIZE_T block, BTreeNodeView &view) const;
+};
+
+#endif
@@ -0,0 +1,306 @@
+#include <algorithm>
+#include <condition_variable>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "btree_partition.h"
+
+
+// Counts down the tasks a caller is waiting on
+class BTreePartitionWait {
+ private:
+  mutex              lock;
+  condition_variable done;
+  SIZE_T             left;
+
+ public:
+  BTreePartitionWait(const SIZE_T n) : left(n) {}
+
+  void Done() {
+    unique_lock<mutex> guard(lock);
+    if (--left==0) {
+      done.notify_all();
+    }
+  }
+
+  void Wait() {
+    unique_lock<mutex> guard(lock);
+    while (left>0) {
+      done.wait(guard);
+    }
+  }
+};
+
+
+// One partition's share of an Execute
+struct BTreePartitionBatch : public BTreeTask {
+  BTreePartitionedIndex *index;
+  SIZE_T                 part;
+  BTreePartitionOp      *ops;
+  vector<SIZE_T>         which;
+  BTreePartitionWait    *wait;
+
+  void Run() {
+    SIZE_T i;
+
+    for (i=0;i<which.size();i++) {
+      index->Run(part,ops[which[i]]);
+    }
+    wait->Done();
+  }
+};
+
+
+#ifdef __linux__
+// Binds the worker it runs on to cpu
+struct BTreePartitionBind : public BTreeTask {
+  SIZE_T              cpu;
+  BTreePartitionWait *wait;
+
+  void Run() {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu,&set);
+    pthread_setaffinity_np(pthread_self(),sizeof(set),&set);
+    wait->Done();
+  }
+};
+#endif
+
+
+// FNV-1a
+static unsigned int HashKey(const KEY_T &key)
+{
+  unsigned int h=2166136261u;
+  SIZE_T i;
+
+  for (i=0;i<key.length;i++) {
+    h=(h^(unsigned char)key.data[i])*16777619u;
+  }
+  return h;
+}
+
+
+BTreePartitionedIndex::BTreePartitionedIndex(const vector<BTreeIndex *> &partitions) :
+  parts(partitions), locks(partitions.size()), partitioning(BTREE_PARTITION_HASH)
+{}
+
+
+BTreePartitionedIndex::~BTreePartitionedIndex()
+{
+  Unpin();
+}
+
+
+ERROR_T BTreePartitionedIndex::SetRanges(const vector<KEY_T> &b)
+{
+  SIZE_T i;
+
+  if (b.size()+1!=parts.size()) {
+    return ERROR_BADCONFIG;
+  }
+  for (i=1;i<b.size();i++) {
+    if (!(b[i-1]<b[i])) {
+      return ERROR_BADCONFIG;
+    }
+  }
+  bounds=b;
+  partitioning=BTREE_PARTITION_RANGE;
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BTreePartitionedIndex::GetPartition(const KEY_T &key) const
+{
+  if (partitioning==BTREE_PARTITION_RANGE) {
+    // The first partition whose greatest key is not less than ours
+    return lower_bound(bounds.begin(),bounds.end(),key)-bounds.begin();
+  }
+  return HashKey(key)%parts.size();
+}
+
+
+void BTreePartitionedIndex::Pin(const bool cpus)
+{
+  SIZE_T p;
+
+  Unpin();
+  for (p=0;p<parts.size();p++) {
+    workers.push_back(new BTreeThreadPool(1));
+  }
+#ifdef __linux__
+  SIZE_T ncpus=thread::hardware_concurrency();
+
+  if (cpus && ncpus>0) {
+    vector<BTreePartitionBind> binds(parts.size());
+    BTreePartitionWait wait(parts.size());
+
+    for (p=0;p<parts.size();p++) {
+      binds[p].cpu=p%ncpus;
+      binds[p].wait=&wait;
+      workers[p]->Submit(&binds[p]);
+    }
+    wait.Wait();
+  }
+#endif
+}
+
+
+void BTreePartitionedIndex::Unpin()
+{
+  SIZE_T p;
+
+  for (p=0;p<workers.size();p++) {
+    delete workers[p];
+  }
+  workers.clear();
+}
+
+
+void BTreePartitionedIndex::Run(const SIZE_T p, BTreePartitionOp &op)
+{
+  unique_lock<mutex> guard(locks[p]);
+
+  switch (op.op) {
+  case BTREE_OP_INSERT:
+    op.rc=parts[p]->Insert(op.key,op.value);
+    break;
+  case BTREE_OP_UPDATE:
+    op.rc=parts[p]->Update(op.key,op.value);
+    break;
+  case BTREE_OP_DELETE:
+    op.rc=parts[p]->Delete(op.key);
+    break;
+  case BTREE_OP_LOOKUP:
+    op.rc=parts[p]->Lookup(op.key,op.value);
+    break;
+  default:
+    op.rc=ERROR_UNIMPL;
+    break;
+  }
+}
+
+
+ERROR_T BTreePartitionedIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+  SIZE_T p=GetPartition(key);
+  unique_lock<mutex> guard(locks[p]);
+
+  return parts[p]->Insert(key,value);
+}
+
+
+ERROR_T BTreePartitionedIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+  SIZE_T p=GetPartition(key);
+  unique_lock<mutex> guard(locks[p]);
+
+  return parts[p]->Update(key,value);
+}
+
+
+ERROR_T BTreePartitionedIndex::Delete(const KEY_T &key)
+{
+  SIZE_T p=GetPartition(key);
+  unique_lock<mutex> guard(locks[p]);
+
+  return parts[p]->Delete(key);
+}
+
+
+ERROR_T BTreePartitionedIndex::Lookup(const KEY_T &key, VALUE_T &value)
+{
+  SIZE_T p=GetPartition(key);
+  unique_lock<mutex> guard(locks[p]);
+
+  return parts[p]->Lookup(key,value);
+}
+
+
+ERROR_T BTreePartitionedIndex::Scan(const KEY_T &low, const SIZE_T max, vector<KeyValuePair> &out)
+{
+  ERROR_T rc;
+  SIZE_T p;
+  SIZE_T best;
+  vector<vector<KeyValuePair> > runs(parts.size());
+  vector<SIZE_T> next(parts.size(),0);
+
+  out.clear();
+
+  if (partitioning==BTREE_PARTITION_RANGE) {
+    // Partitions after low's hold only greater keys, so just go on
+    // into them until there are enough
+    for (p=GetPartition(low); p<parts.size() && out.size()<max; p++) {
+      {
+	unique_lock<mutex> guard(locks[p]);
+	rc=parts[p]->Scan(low,max-out.size(),runs[p]);
+      }
+      if (rc) { return rc; }
+      for (best=0;best<runs[p].size();best++) {
+	out.push_back(move(runs[p][best]));
+      }
+    }
+    return ERROR_NOERROR;
+  }
+
+  // Any partition may hold any of the first max keys, so take max from
+  // each and merge
+  for (p=0;p<parts.size();p++) {
+    unique_lock<mutex> guard(locks[p]);
+    rc=parts[p]->Scan(low,max,runs[p]);
+    if (rc) { return rc; }
+  }
+  while (out.size()<max) {
+    best=parts.size();
+    for (p=0;p<parts.size();p++) {
+      if (next[p]<runs[p].size() &&
+	  (best==parts.size() || runs[p][next[p]].key<runs[best][next[best]].key)) {
+	best=p;
+      }
+    }
+    if (best==parts.size()) {
+      break;
+    }
+    out.push_back(move(runs[best][next[best]++]));
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreePartitionedIndex::Execute(BTreePartitionOp *ops, const SIZE_T n)
+{
+  SIZE_T i;
+  SIZE_T p;
+  SIZE_T busy;
+  vector<BTreePartitionBatch> batches(parts.size());
+
+  for (i=0;i<n;i++) {
+    batches[GetPartition(ops[i].key)].which.push_back(i);
+  }
+  for (p=0, busy=0; p<parts.size(); p++) {
+    busy+= batches[p].which.empty() ? 0 : 1;
+  }
+
+  BTreePartitionWait wait(busy);
+
+  for (p=0;p<parts.size();p++) {
+    BTreePartitionBatch &b=batches[p];
+    if (b.which.empty()) {
+      continue;
+    }
+    b.index=this;
+    b.part=p;
+    b.ops=ops;
+    b.wait=&wait;
+    if (workers.empty()) {
+      b.Run();
+    } else {
+      workers[p]->Submit(&b);
+    }
+  }
+  wait.Wait();
+  return ERROR_NOERROR;
+}
@@ -0,0 +1,96 @@
+#ifndef _btree_partition
+#define _btree_partition
+
+#include <vector>
+#include <mutex>
+
+#include "btree.h"
+#include "btree_pool.h"
+
+using namespace std;
+
+//
+// One index split across several BTreeIndexes.  Each partition is a
+// whole index on a store of its own, with its own superblock, root and
+// free blocks, so partitions never touch each other's nodes.  Keys go
+// to a partition by a hash of their bytes, or by range.
+//
+// Every call into a partition holds that partition's lock, so threads
+// working on different partitions never wait for one another, while
+// each BTreeIndex is still only used by one thread at a time.  Pin
+// gives every partition a worker thread of its own, optionally bound to
+// a CPU; Execute then hands each partition its share of a batch and
+// they all run at once, sharing nothing.
+//
+
+enum BTreePartitioning {BTREE_PARTITION_HASH, BTREE_PARTITION_RANGE};
+
+// One operation in a batch for BTreePartitionedIndex::Execute.  value
+// is what to insert or update with, or where a lookup's answer goes.
+struct BTreePartitionOp {
+  BTreeOp op;
+  KEY_T   key;
+  VALUE_T value;
+  ERROR_T rc;
+};
+
+struct BTreePartitionBatch;
+
+class BTreePartitionedIndex {
+  friend struct BTreePartitionBatch;
+
+ private:
+  vector<BTreeIndex *>      parts;
+  vector<mutex>             locks;
+  BTreePartitioning         partitioning;
+  // The greatest key of every partition but the last, for ranges
+  vector<KEY_T>             bounds;
+  vector<BTreeThreadPool *> workers;
+
+  // Run op on partition p, holding its lock
+  void    Run(const SIZE_T p, BTreePartitionOp &op);
+
+ public:
+  // The partitions must already be attached, each to a store of its
+  // own, and must outlive this.  Keys are hashed across them.
+  BTreePartitionedIndex(const vector<BTreeIndex *> &partitions);
+  // Unpins
+  virtual ~BTreePartitionedIndex();
+
+  // Partition by range instead: partition i takes the keys above
+  // bounds[i-1] up to and including bounds[i], and the last partition
+  // everything above that.  Only do this before anything is inserted.
+  // return ERROR_BADCONFIG unless there is one bound fewer than there
+  // are partitions, in increasing order
+  ERROR_T SetRanges(const vector<KEY_T> &bounds);
+
+  SIZE_T  GetNumPartitions() const { return parts.size(); }
+
+  BTreeIndex & GetIndex(const SIZE_T p) { return *parts[p]; }
+
+  // Which partition key belongs to
+  SIZE_T  GetPartition(const KEY_T &key) const;
+
+  // Give each partition a worker thread for Execute, bound to a CPU of
+  // its own (round robin) if cpus is set and the system allows it
+  void    Pin(const bool cpus=false);
+
+  // Stop the workers once they have finished what they were given
+  void    Unpin();
+
+  // Like BTreeIndex's, on the key's partition
+  ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
+  ERROR_T Update(const KEY_T &key, const VALUE_T &value);
+  ERROR_T Delete(const KEY_T &key);
+  ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
+
+  // Like BTreeIndex's, merging the partitions' keys back into order
+  ERROR_T Scan(const KEY_T &low, const SIZE_T max, vector<KeyValuePair> &out);
+
+  // Run n operations, each partition's in the order given and, once
+  // pinned, on its own worker with every partition at once.  Each op
+  // gets its own rc.
+  ERROR_T Execute(BTreePartitionOp *ops, const SIZE_T n);
+};
+
+#endif
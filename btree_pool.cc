@@ -0,0 +1,60 @@
+#include "btree_pool.h"
+
+BTreeThreadPool::BTreeThreadPool(const SIZE_T threads) : stopping(false)
+{
+  SIZE_T i;
+
+  for (i=0;i<threads;i++) {
+    workers.push_back(thread(&BTreeThreadPool::Worker,this));
+  }
+}
+
+
+BTreeThreadPool::~BTreeThreadPool()
+{
+  SIZE_T i;
+
+  {
+    unique_lock<mutex> guard(lock);
+    stopping=true;
+  }
+  ready.notify_all();
+  for (i=0;i<workers.size();i++) {
+    workers[i].join();
+  }
+}
+
+
+void BTreeThreadPool::Submit(BTreeTask *task)
+{
+  if (workers.empty()) {
+    task->Run();
+    return;
+  }
+  {
+    unique_lock<mutex> guard(lock);
+    queue.push_back(task);
+  }
+  ready.notify_one();
+}
+
+
+void BTreeThreadPool::Worker()
+{
+  BTreeTask *task;
+
+  for (;;) {
+    {
+      unique_lock<mutex> guard(lock);
+      while (queue.empty() && !stopping) {
+	ready.wait(guard);
+      }
+      if (queue.empty()) {
+	return;
+      }
+      task=queue.front();
+      queue.pop_front();
+    }
+    task->Run();
+  }
+}
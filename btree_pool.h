@@ -0,0 +1,44 @@
+#ifndef _btree_pool
+#define _btree_pool
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "global.h"
+
+using namespace std;
+
+// A unit of work handed to a BTreeThreadPool.  The pool never owns
+// tasks; whoever submits one keeps it alive until it has run.
+class BTreeTask {
+ public:
+  virtual ~BTreeTask() {}
+  virtual void Run()=0;
+};
+
+// Fixed set of worker threads draining a FIFO of tasks.  With zero
+// threads, Submit simply runs the task on the caller's thread.
+class BTreeThreadPool {
+ private:
+  mutex                lock;
+  condition_variable   ready;
+  deque<BTreeTask *>   queue;
+  vector<thread>       workers;
+  bool                 stopping;
+
+  void Worker();
+
+ public:
+  BTreeThreadPool(const SIZE_T threads);
+  // Runs whatever is still queued, then joins the workers
+  virtual ~BTreeThreadPool();
+
+  void Submit(BTreeTask *task);
+
+  SIZE_T GetNumThreads() const { return workers.size(); }
+};
+
+#endif
@@ -0,0 +1,250 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include "btree.h"
+#include "btree_trace.h"
+#include "btree_workload.h"
+
+//
+// btree_replay: run a trace taken with BTreeTraceRecorder against an
+// index and print one JSON line with the same metrics btree_bench
+// reports.
+//
+// The index is a fresh one on a makedisk disk (or, with -e, whatever
+// index is already on it), a fresh memory-mapped image, or a copy of a
+// saved image, so the snapshot itself is never changed.
+//
+
+static void usage()
+{
+  cerr << "usage: btree_replay [options] trace filestem cachesize\n"
+       << "       btree_replay [options] trace -m image:numblocks:blocksize\n"
+       << "       btree_replay [options] trace -s snapshot:image\n"
+       << "  -e             use the index already on the disk\n"
+       << "  -T             keep the trace's timing instead of going flat out\n"
+       << "  -a threads     async I/O with this many threads\n";
+}
+
+
+static BTreeWorkOp WorkOp(const BTreeTraceOp op)
+{
+  switch (op) {
+  case BTREE_TRACE_INSERT:
+    return BTREE_WORK_INSERT;
+  case BTREE_TRACE_UPDATE:
+    return BTREE_WORK_UPDATE;
+  case BTREE_TRACE_DELETE:
+    return BTREE_WORK_DELETE;
+  case BTREE_TRACE_SCAN:
+    return BTREE_WORK_SCAN;
+  default:
+    return BTREE_WORK_LOOKUP;
+  }
+}
+
+
+static bool CopyFile(const string &from, const string &to)
+{
+  ifstream in(from.c_str(),ios::in|ios::binary);
+  ofstream out(to.c_str(),ios::out|ios::binary|ios::trunc);
+
+  if (!in || !out) {
+    return false;
+  }
+  out << in.rdbuf();
+  return (bool)out;
+}
+
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  ERROR_T rc;
+  bool existing=false;
+  bool timed=false;
+  SIZE_T aiothreads=0;
+  SIZE_T superblock;
+  SIZE_T numblocks=0;
+  SIZE_T blocksize=0;
+  string image;
+  string snapshot;
+  BTreeTraceReader reader;
+  BTreeTraceEntry e;
+  BTreeMmapStore store;
+  DiskSystem *disk=0;
+  BufferCache *cache=0;
+  BTreeAsyncIO *aio=0;
+  BTreeIndex *btree;
+
+  while ((opt=getopt(argc,argv,"eTa:m:s:"))!=-1) {
+    switch (opt) {
+    case 'e':
+      existing=true;
+      break;
+    case 'T':
+      timed=true;
+      break;
+    case 'a':
+      aiothreads=atoi(optarg);
+      break;
+    case 'm':
+      {
+	string arg(optarg);
+	size_t c1=arg.find(':');
+	size_t c2=arg.find(':',c1==string::npos ? c1 : c1+1);
+	if (c1==string::npos || c2==string::npos) {
+	  usage();
+	  return -1;
+	}
+	image=arg.substr(0,c1);
+	numblocks=atoi(arg.substr(c1+1,c2-c1-1).c_str());
+	blocksize=atoi(arg.substr(c2+1).c_str());
+      }
+      break;
+    case 's':
+      {
+	string arg(optarg);
+	size_t c=arg.find(':');
+	if (c==string::npos) {
+	  usage();
+	  return -1;
+	}
+	snapshot=arg.substr(0,c);
+	image=arg.substr(c+1);
+      }
+      break;
+    default:
+      usage();
+      return -1;
+    }
+  }
+
+  if (argc-optind<1) {
+    usage();
+    return -1;
+  }
+  if ((rc=reader.Open(argv[optind]))!=ERROR_NOERROR) {
+    cerr << "Can't read trace " << argv[optind] << " due to error " << rc << endl;
+    return -1;
+  }
+
+  if (image.empty()) {
+    if (argc-optind!=3) {
+      usage();
+      return -1;
+    }
+    disk=new DiskSystem(argv[optind+1]);
+    cache=new BufferCache(disk,atoi(argv[optind+2]));
+    if ((rc=cache->Attach())!=ERROR_NOERROR) {
+      cerr << "Can't attach buffer cache due to error " << rc << endl;
+      return -1;
+    }
+    if (existing) {
+      btree=new BTreeIndex(0,0,cache);
+    } else {
+      btree=new BTreeIndex(reader.GetKeySize(),reader.GetValueSize(),cache);
+    }
+    if (aiothreads>0) {
+      aio=new BTreeAsyncIO(cache,aiothreads);
+      if ((rc=btree->SetAsyncIO(aio))!=ERROR_NOERROR) {
+	cerr << "Can't use async I/O due to error " << rc << endl;
+	return -1;
+      }
+    }
+  } else {
+    if (argc-optind!=1) {
+      usage();
+      return -1;
+    }
+    if (!snapshot.empty()) {
+      if (!CopyFile(snapshot,image)) {
+	cerr << "Can't copy " << snapshot << " to " << image << endl;
+	return -1;
+      }
+      rc=store.Attach(image.c_str(),false);
+      existing=true;
+      btree=new BTreeIndex(0,0,&store);
+    } else {
+      rc=store.Create(image.c_str(),numblocks,blocksize);
+      btree=new BTreeIndex(reader.GetKeySize(),reader.GetValueSize(),&store);
+    }
+    if (rc) {
+      cerr << "Can't set up " << image << " due to error " << rc << endl;
+      return -1;
+    }
+  }
+
+  if ((rc=btree->Attach(0,!existing))!=ERROR_NOERROR) {
+    cerr << "Can't attach index due to error " << rc << endl;
+    return -1;
+  }
+  if (btree->GetKeySize()!=reader.GetKeySize() || btree->GetValueSize()!=reader.GetValueSize()) {
+    cerr << "Trace is for " << reader.GetKeySize() << "/" << reader.GetValueSize()
+	 << " byte keys/values but the index has " << btree->GetKeySize() << "/"
+	 << btree->GetValueSize() << endl;
+    return -1;
+  }
+
+  BTreeWorkStats run;
+  VALUE_T value;
+  SIZE_T record;
+  chrono::steady_clock::time_point start=chrono::steady_clock::now();
+
+  btree->ResetStats();
+  run.Start(*btree);
+  for (record=0; (rc=reader.Next(e))==ERROR_NOERROR; record++) {
+    if (timed) {
+      this_thread::sleep_until(start+chrono::nanoseconds(e.time));
+    }
+    // Only the value's length was kept, so make one up
+    if (e.op==BTREE_TRACE_INSERT || e.op==BTREE_TRACE_UPDATE) {
+      BTreeMakeValue(record,0,e.length,value);
+    }
+    rc=run.Execute(*btree,WorkOp(e.op),e.key,value,e.length);
+    if (rc) {
+      run.Stop(*btree);
+      cerr << "Replay failed at record " << record << " due to error " << rc << endl;
+      return -1;
+    }
+  }
+  run.Stop(*btree);
+  if (rc!=ERROR_NONEXISTENT) {
+    cerr << "Trace is corrupt after record " << record << endl;
+    return -1;
+  }
+
+  cout << "{\"trace\":\"" << argv[optind] << "\""
+       << ",\"records\":" << record
+       << ",\"keysize\":" << btree->GetKeySize()
+       << ",\"valuesize\":" << btree->GetValueSize()
+       << ",\"timing\":\"" << (timed ? "original" : "fast") << "\""
+       << ",\"store\":\"" << (image.empty() ? (aio ? "aio" : "cache") : "mmap") << "\""
+       << ",\"run\":";
+  run.PrintJSON(cout);
+#ifdef BTREE_STATS
+  BTreeStatCounters counters;
+  btree->GetStats(counters);
+  cout << ",\"stats\":";
+  counters.PrintJSON(cout);
+#endif
+  cout << "}" << endl;
+
+  if ((rc=btree->Detach(superblock))!=ERROR_NOERROR) {
+    cerr << "Can't detach index due to error " << rc << endl;
+    return -1;
+  }
+  delete btree;
+  delete aio;
+  if (cache) {
+    cache->Detach();
+    delete cache;
+    delete disk;
+  } else {
+    store.Detach();
+  }
+  return 0;
+}
@@ -0,0 +1,324 @@
+#include <math.h>
+#include <atomic>
+
+#include "btree_ds.h"
+#include "btree_stats.h"
+
+static const char *opnames[BTREE_STAT_NUMOPS] = {"insert", "lookup", "update", "delete", "scan", "batch",
+						   "upsert", "modify"};
+
+static const char *splitnames[BTREE_STAT_NUMSPLITS] = {"leaf", "interior", "root"};
+
+static const char *NodeTypeName(const SIZE_T type)
+{
+  switch (type) {
+  case BTREE_UNALLOCATED_BLOCK:
+    return "unallocated";
+  case BTREE_SUPERBLOCK:
+    return "superblock";
+  case BTREE_ROOT_NODE:
+    return "root";
+  case BTREE_INTERIOR_NODE:
+    return "interior";
+  case BTREE_LEAF_NODE:
+    return "leaf";
+  default:
+    return 0;
+  }
+}
+
+
+SIZE_T BTreeHistogram::Bucket(const unsigned long long v)
+{
+  SIZE_T e;
+
+  if (v<BTREE_HIST_SUB) {
+    return v;
+  }
+  // v is in [2^e, 2^(e+1)), split into BTREE_HIST_SUB even pieces
+  e=63-__builtin_clzll(v);
+  return (e-3)*BTREE_HIST_SUB + ((v>>(e-4))&(BTREE_HIST_SUB-1));
+}
+
+
+unsigned long long BTreeHistogram::BucketValue(const SIZE_T i)
+{
+  SIZE_T e;
+  unsigned long long low;
+
+  if (i<BTREE_HIST_SUB) {
+    return i;
+  }
+  e=i/BTREE_HIST_SUB+3;
+  low=(unsigned long long)(BTREE_HIST_SUB+i%BTREE_HIST_SUB)<<(e-4);
+  return low+((1ULL<<(e-4))>>1);
+}
+
+
+void BTreeHistogram::Clear()
+{
+  SIZE_T i;
+
+  for (i=0;i<BTREE_HIST_BUCKETS;i++) {
+    buckets[i]=0;
+  }
+  count=sum=max=0;
+}
+
+
+void BTreeHistogram::Add(const unsigned long long v)
+{
+  buckets[Bucket(v)]++;
+  count++;
+  sum+=v;
+  if (v>max) {
+    max=v;
+  }
+}
+
+
+void BTreeHistogram::Merge(const BTreeHistogram &rhs)
+{
+  SIZE_T i;
+
+  for (i=0;i<BTREE_HIST_BUCKETS;i++) {
+    buckets[i]+=rhs.buckets[i];
+  }
+  count+=rhs.count;
+  sum+=rhs.sum;
+  if (rhs.max>max) {
+    max=rhs.max;
+  }
+}
+
+
+unsigned long long BTreeHistogram::Percentile(const double q) const
+{
+  SIZE_T i;
+  unsigned long long rank;
+  unsigned long long seen;
+
+  if (count==0) {
+    return 0;
+  }
+  rank=(unsigned long long)ceil(q*count);
+  if (rank==0) {
+    rank=1;
+  }
+  for (seen=0,i=0;i<BTREE_HIST_BUCKETS;i++) {
+    seen+=buckets[i];
+    if (seen>=rank) {
+      break;
+    }
+  }
+  // The top bucket's middle can overshoot what was actually seen
+  return BucketValue(i)<max ? BucketValue(i) : max;
+}
+
+
+void BTreeStatCounters::Clear()
+{
+  SIZE_T i;
+
+  for (i=0;i<BTREE_STAT_NODETYPES;i++) {
+    reads[i]=writes[i]=0;
+  }
+  for (i=0;i<BTREE_STAT_NUMSPLITS;i++) {
+    splits[i]=0;
+  }
+  allocs=frees=0;
+  conflicts=nonexistent=0;
+  for (i=0;i<BTREE_STAT_NUMOPS;i++) {
+    latency[i].Clear();
+  }
+}
+
+
+void BTreeStatCounters::Merge(const BTreeStatCounters &rhs)
+{
+  SIZE_T i;
+
+  for (i=0;i<BTREE_STAT_NODETYPES;i++) {
+    reads[i]+=rhs.reads[i];
+    writes[i]+=rhs.writes[i];
+  }
+  for (i=0;i<BTREE_STAT_NUMSPLITS;i++) {
+    splits[i]+=rhs.splits[i];
+  }
+  allocs+=rhs.allocs;
+  frees+=rhs.frees;
+  conflicts+=rhs.conflicts;
+  nonexistent+=rhs.nonexistent;
+  for (i=0;i<BTREE_STAT_NUMOPS;i++) {
+    latency[i].Merge(rhs.latency[i]);
+  }
+}
+
+
+ostream & BTreeStatCounters::PrintText(ostream &os) const
+{
+  SIZE_T i;
+
+  os << "reads:";
+  for (i=0;i<BTREE_STAT_NODETYPES;i++) {
+    if (reads[i]) {
+      os << " " << (NodeTypeName(i) ? NodeTypeName(i) : "other") << " " << reads[i];
+    }
+  }
+  os << endl << "writes:";
+  for (i=0;i<BTREE_STAT_NODETYPES;i++) {
+    if (writes[i]) {
+      os << " " << (NodeTypeName(i) ? NodeTypeName(i) : "other") << " " << writes[i];
+    }
+  }
+  os << endl << "splits:";
+  for (i=0;i<BTREE_STAT_NUMSPLITS;i++) {
+    os << " " << splitnames[i] << " " << splits[i];
+  }
+  os << endl << "allocs: " << allocs << " frees: " << frees << endl;
+  os << "conflicts: " << conflicts << " nonexistent: " << nonexistent << endl;
+  for (i=0;i<BTREE_STAT_NUMOPS;i++) {
+    const BTreeHistogram &h=latency[i];
+    if (h.GetCount()==0) {
+      continue;
+    }
+    os << opnames[i] << ": count " << h.GetCount()
+       << " mean " << h.GetMean()
+       << " p50 " << h.Percentile(0.5)
+       << " p99 " << h.Percentile(0.99)
+       << " p999 " << h.Percentile(0.999)
+       << " max " << h.GetMax() << " ns" << endl;
+  }
+  return os;
+}
+
+
+ostream & BTreeStatCounters::PrintJSON(ostream &os) const
+{
+  SIZE_T i;
+  bool first;
+
+  os << "{\"reads\":{";
+  for (first=true,i=0;i<BTREE_STAT_NODETYPES;i++) {
+    if (reads[i]) {
+      os << (first ? "" : ",") << "\"" << (NodeTypeName(i) ? NodeTypeName(i) : "other") << "\":" << reads[i];
+      first=false;
+    }
+  }
+  os << "},\"writes\":{";
+  for (first=true,i=0;i<BTREE_STAT_NODETYPES;i++) {
+    if (writes[i]) {
+      os << (first ? "" : ",") << "\"" << (NodeTypeName(i) ? NodeTypeName(i) : "other") << "\":" << writes[i];
+      first=false;
+    }
+  }
+  os << "},\"splits\":{";
+  for (i=0;i<BTREE_STAT_NUMSPLITS;i++) {
+    os << (i ? "," : "") << "\"" << splitnames[i] << "\":" << splits[i];
+  }
+  os << "},\"allocs\":" << allocs
+     << ",\"frees\":" << frees
+     << ",\"conflicts\":" << conflicts
+     << ",\"nonexistent\":" << nonexistent
+     << ",\"latency_ns\":{";
+  for (first=true,i=0;i<BTREE_STAT_NUMOPS;i++) {
+    const BTreeHistogram &h=latency[i];
+    if (h.GetCount()==0) {
+      continue;
+    }
+    os << (first ? "" : ",") << "\"" << opnames[i] << "\":{\"count\":" << h.GetCount()
+       << ",\"mean\":" << h.GetMean()
+       << ",\"p50\":" << h.Percentile(0.5)
+       << ",\"p99\":" << h.Percentile(0.99)
+       << ",\"p999\":" << h.Percentile(0.999)
+       << ",\"max\":" << h.GetMax() << "}";
+    first=false;
+  }
+  os << "}}";
+  return os;
+}
+
+
+// Every BTreeStats gets its own id, never reused, so a thread's cached
+// counters can't be mistaken for another one's that landed at the same
+// address
+static atomic<unsigned long long> nextid(1);
+
+BTreeStats::BTreeStats() : id(nextid++)
+{}
+
+
+BTreeStats::BTreeStats(const BTreeStats &rhs) : id(nextid++)
+{}
+
+
+BTreeStats::~BTreeStats()
+{
+  map<thread::id, BTreeStatCounters *>::iterator i;
+
+  for (i=threads.begin();i!=threads.end();i++) {
+    delete i->second;
+  }
+}
+
+
+BTreeStatCounters & BTreeStats::Local()
+{
+  // Remember the last set this thread used, so the usual case is just
+  // a comparison
+  static thread_local unsigned long long cachedid=0;
+  static thread_local BTreeStatCounters *cached=0;
+
+  if (cachedid==id) {
+    return *cached;
+  }
+
+  unique_lock<mutex> guard(lock);
+  BTreeStatCounters *&c=threads[this_thread::get_id()];
+  if (!c) {
+    c=new BTreeStatCounters;
+  }
+  cachedid=id;
+  cached=c;
+  return *c;
+}
+
+
+void BTreeStats::CountOp(const BTreeStatOp op, const ERROR_T rc, const BTreeStatTime &start)
+{
+  Local().latency[op].Add(chrono::duration_cast<chrono::nanoseconds>(BTreeStatNow()-start).count());
+  CountError(rc);
+}
+
+
+void BTreeStats::CountError(const ERROR_T rc)
+{
+  if (rc==ERROR_CONFLICT) {
+    Local().conflicts++;
+  } else if (rc==ERROR_NONEXISTENT) {
+    Local().nonexistent++;
+  }
+}
+
+
+void BTreeStats::Get(BTreeStatCounters &total) const
+{
+  unique_lock<mutex> guard(lock);
+  map<thread::id, BTreeStatCounters *>::const_iterator i;
+
+  total.Clear();
+  for (i=threads.begin();i!=threads.end();i++) {
+    total.Merge(*i->second);
+  }
+}
+
+
+void BTreeStats::Reset()
+{
+  unique_lock<mutex> guard(lock);
+  map<thread::id, BTreeStatCounters *>::iterator i;
+
+  for (i=threads.begin();i!=threads.end();i++) {
+    i->second->Clear();
+  }
+}
@@ -0,0 +1,131 @@
+#ifndef _btree_stats
+#define _btree_stats
+
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+
+#include "global.h"
+
+using namespace std;
+
+//
+// Operation counters and latency histograms for a BTreeIndex.
+//
+// Counting only happens when built with -DBTREE_STATS.  Otherwise every
+// BTREE_STAT(...) in the index compiles away and the stats always read
+// as zero.
+//
+// Each thread counts into its own set of counters, with no locking or
+// atomics on the way.  Reading the stats adds up every thread's set.
+// The merged numbers are only exact once the threads doing operations
+// have stopped.
+//
+#ifdef BTREE_STATS
+#define BTREE_STAT(...) __VA_ARGS__
+#else
+#define BTREE_STAT(...)
+#endif
+
+// Operations with a latency histogram
+enum BTreeStatOp {BTREE_STAT_INSERT, BTREE_STAT_LOOKUP, BTREE_STAT_UPDATE,
+		  BTREE_STAT_DELETE, BTREE_STAT_SCAN, BTREE_STAT_BATCH,
+		  BTREE_STAT_UPSERT, BTREE_STAT_MODIFY, BTREE_STAT_NUMOPS};
+
+enum BTreeStatSplit {BTREE_STAT_LEAF_SPLIT, BTREE_STAT_INTERIOR_SPLIT, BTREE_STAT_ROOT_SPLIT,
+		     BTREE_STAT_NUMSPLITS};
+
+// Node types are small; anything past this is counted as the last one
+#define BTREE_STAT_NODETYPES 8
+
+// Sub-buckets per power of two.  Values below this are exact, and
+// above it each bucket is within 1/BTREE_HIST_SUB of what it holds.
+#define BTREE_HIST_SUB 16
+#define BTREE_HIST_BUCKETS (61*BTREE_HIST_SUB)
+
+// Log-linear histogram in the style of HdrHistogram, in nanoseconds
+class BTreeHistogram {
+ private:
+  unsigned long long buckets[BTREE_HIST_BUCKETS];
+  unsigned long long count;
+  unsigned long long sum;
+  unsigned long long max;
+
+  static SIZE_T Bucket(const unsigned long long v);
+  // Middle of what bucket i covers
+  static unsigned long long BucketValue(const SIZE_T i);
+
+ public:
+  BTreeHistogram() { Clear(); }
+
+  void Clear();
+  void Add(const unsigned long long v);
+  void Merge(const BTreeHistogram &rhs);
+
+  unsigned long long GetCount() const { return count; }
+  unsigned long long GetMax() const { return max; }
+  double GetMean() const { return count ? (double)sum/count : 0; }
+
+  // q in [0,1]
+  unsigned long long Percentile(const double q) const;
+};
+
+struct BTreeStatCounters {
+  unsigned long long reads[BTREE_STAT_NODETYPES];   // by node type
+  unsigned long long writes[BTREE_STAT_NODETYPES];
+  unsigned long long splits[BTREE_STAT_NUMSPLITS];
+  unsigned long long allocs;
+  unsigned long long frees;
+  unsigned long long conflicts;     // ERROR_CONFLICT returned
+  unsigned long long nonexistent;   // ERROR_NONEXISTENT returned
+  BTreeHistogram     latency[BTREE_STAT_NUMOPS];
+
+  BTreeStatCounters() { Clear(); }
+
+  void Clear();
+  void Merge(const BTreeStatCounters &rhs);
+
+  ostream & PrintText(ostream &os) const;
+  ostream & PrintJSON(ostream &os) const;
+};
+
+typedef chrono::steady_clock::time_point BTreeStatTime;
+
+inline BTreeStatTime BTreeStatNow() { return chrono::steady_clock::now(); }
+
+class BTreeStats {
+ private:
+  unsigned long long id;
+  mutable mutex lock;
+  map<thread::id, BTreeStatCounters *> threads;
+
+ public:
+  BTreeStats();
+  // A copy starts out empty
+  BTreeStats(const BTreeStats &rhs);
+  virtual ~BTreeStats();
+
+  // This thread's counters
+  BTreeStatCounters & Local();
+
+  void CountRead(const SIZE_T nodetype) { Local().reads[nodetype<BTREE_STAT_NODETYPES ? nodetype : BTREE_STAT_NODETYPES-1]++; }
+  void CountWrite(const SIZE_T nodetype) { Local().writes[nodetype<BTREE_STAT_NODETYPES ? nodetype : BTREE_STAT_NODETYPES-1]++; }
+  void CountSplit(const BTreeStatSplit kind) { Local().splits[kind]++; }
+  void CountAlloc() { Local().allocs++; }
+  void CountFree() { Local().frees++; }
+
+  // An operation that started at start has returned rc
+  void CountOp(const BTreeStatOp op, const ERROR_T rc, const BTreeStatTime &start);
+
+  // One operation's worth of ERROR_CONFLICT or ERROR_NONEXISTENT
+  void CountError(const ERROR_T rc);
+
+  // Every thread's counters added up
+  void Get(BTreeStatCounters &total) const;
+
+  void Reset();
+};
+
+#endif
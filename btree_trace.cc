@@ -0,0 +1,185 @@
+#include <string.h>
+
+#include "btree_trace.h"
+
+static const char magic[8] = {'B','T','T','R','A','C','E','1'};
+
+
+static void PutWord(ostream &os, const SIZE_T w)
+{
+  char b[4];
+
+  b[0]=w&0xff;
+  b[1]=(w>>8)&0xff;
+  b[2]=(w>>16)&0xff;
+  b[3]=(w>>24)&0xff;
+  os.write(b,4);
+}
+
+
+static bool GetWord(istream &is, SIZE_T &w)
+{
+  unsigned char b[4];
+
+  if (!is.read((char*)b,4)) {
+    return false;
+  }
+  w=b[0] | (b[1]<<8) | (b[2]<<16) | ((SIZE_T)b[3]<<24);
+  return true;
+}
+
+
+static void PutVarint(ostream &os, unsigned long long v)
+{
+  char b[10];
+  SIZE_T n;
+
+  for (n=0;v>=0x80;n++) {
+    b[n]=(v&0x7f)|0x80;
+    v>>=7;
+  }
+  b[n++]=v;
+  os.write(b,n);
+}
+
+
+static bool GetVarint(istream &is, unsigned long long &v)
+{
+  int c;
+  SIZE_T shift;
+
+  v=0;
+  for (shift=0;shift<64;shift+=7) {
+    if ((c=is.get())==EOF) {
+      return false;
+    }
+    v|=(unsigned long long)(c&0x7f)<<shift;
+    if (!(c&0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+BTreeTraceRecorder::BTreeTraceRecorder() : keysize(0), last(0), count(0)
+{}
+
+
+BTreeTraceRecorder::~BTreeTraceRecorder()
+{
+  Close();
+}
+
+
+ERROR_T BTreeTraceRecorder::Open(const char *filename, const SIZE_T ks, const SIZE_T vs)
+{
+  unique_lock<mutex> guard(lock);
+
+  if (out.is_open()) {
+    return ERROR_BADCONFIG;
+  }
+  out.open(filename,ios::out|ios::binary|ios::trunc);
+  if (!out) {
+    return ERROR_NONEXISTENT;
+  }
+  out.write(magic,sizeof(magic));
+  PutWord(out,ks);
+  PutWord(out,vs);
+  keysize=ks;
+  start=chrono::steady_clock::now();
+  last=0;
+  count=0;
+  return out ? ERROR_NOERROR : ERROR_NOSPACE;
+}
+
+
+ERROR_T BTreeTraceRecorder::Close()
+{
+  unique_lock<mutex> guard(lock);
+  bool ok;
+
+  if (!out.is_open()) {
+    return ERROR_NOERROR;
+  }
+  out.flush();
+  ok=(bool)out;
+  out.close();
+  return ok ? ERROR_NOERROR : ERROR_NOSPACE;
+}
+
+
+void BTreeTraceRecorder::Record(const BTreeTraceOp op, const Block &key, const SIZE_T length)
+{
+  unsigned long long now;
+
+  if (key.length!=keysize) {
+    return;
+  }
+
+  unique_lock<mutex> guard(lock);
+
+  if (!out.is_open()) {
+    return;
+  }
+  // Taken under the lock so the times go up in file order
+  now=chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-start).count();
+  out.put((char)op);
+  PutVarint(out,now-last);
+  out.write(key.data,keysize);
+  PutVarint(out,length);
+  last=now;
+  count++;
+}
+
+
+BTreeTraceReader::BTreeTraceReader() : keysize(0), valuesize(0), time(0)
+{}
+
+
+ERROR_T BTreeTraceReader::Open(const char *filename)
+{
+  char m[sizeof(magic)];
+
+  in.open(filename,ios::in|ios::binary);
+  if (!in) {
+    return ERROR_NONEXISTENT;
+  }
+  if (!in.read(m,sizeof(m)) || memcmp(m,magic,sizeof(magic)) ||
+      !GetWord(in,keysize) || !GetWord(in,valuesize)) {
+    in.close();
+    return ERROR_NOTANINDEX;
+  }
+  time=0;
+  return ERROR_NOERROR;
+}
+
+
+void BTreeTraceReader::Close()
+{
+  in.close();
+}
+
+
+ERROR_T BTreeTraceReader::Next(BTreeTraceEntry &e)
+{
+  int op;
+  unsigned long long delta;
+  unsigned long long length;
+
+  if ((op=in.get())==EOF) {
+    return ERROR_NONEXISTENT;
+  }
+  if (op>=BTREE_TRACE_NUMOPS || !GetVarint(in,delta)) {
+    return ERROR_INSANE;
+  }
+  e.key.Resize(keysize,false);
+  if (!in.read(e.key.data,keysize) || !GetVarint(in,length)) {
+    return ERROR_INSANE;
+  }
+  time+=delta;
+  e.op=(BTreeTraceOp)op;
+  e.time=time;
+  e.length=length;
+  return ERROR_NOERROR;
+}
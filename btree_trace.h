@@ -0,0 +1,93 @@
+#ifndef _btree_trace
+#define _btree_trace
+
+#include <fstream>
+#include <mutex>
+#include <chrono>
+
+#include "global.h"
+#include "block.h"
+
+using namespace std;
+
+//
+// Traces of the operations done through a BTreeIndex's public API.
+//
+// The file is a header followed by one record per operation:
+//
+//   header:  "BTTRACE1", keysize and valuesize as 4 byte little-endian
+//   record:  op             1 byte, a BTreeTraceOp
+//            delta          varint, ns since the previous record
+//            key            keysize bytes
+//            length         varint, the value length for an insert or
+//                           update, the most pairs asked for by a scan,
+//                           and 0 otherwise
+//
+// Varints are 7 bits to a byte, low bits first, high bit set on all
+// but the last byte.  A batch lookup is traced as its single lookups.
+// An upsert is traced as the insert or update it turned out to be, and
+// a compare-and-swap or modify as an update if it wrote and a lookup
+// if it didn't.  Range deletes and updates are not traced.
+// Values are not kept, only their lengths.  Calls with keys of the
+// wrong size are not traced.
+//
+
+enum BTreeTraceOp {BTREE_TRACE_INSERT, BTREE_TRACE_LOOKUP, BTREE_TRACE_UPDATE,
+		   BTREE_TRACE_DELETE, BTREE_TRACE_SCAN, BTREE_TRACE_NUMOPS};
+
+struct BTreeTraceEntry {
+  BTreeTraceOp        op;
+  unsigned long long  time;     // ns since the trace started
+  Block               key;
+  SIZE_T              length;
+};
+
+class BTreeTraceRecorder {
+ private:
+  mutex               lock;
+  ofstream            out;
+  SIZE_T              keysize;
+  chrono::steady_clock::time_point start;
+  unsigned long long  last;
+  unsigned long long  count;
+
+ public:
+  BTreeTraceRecorder();
+  // Closes
+  virtual ~BTreeTraceRecorder();
+
+  // Start a new trace in filename for an index with these sizes
+  ERROR_T Open(const char *filename, const SIZE_T keysize, const SIZE_T valuesize);
+
+  ERROR_T Close();
+
+  // Safe to call from any number of threads
+  void    Record(const BTreeTraceOp op, const Block &key, const SIZE_T length);
+
+  unsigned long long GetCount() const { return count; }
+};
+
+class BTreeTraceReader {
+ private:
+  ifstream            in;
+  SIZE_T              keysize;
+  SIZE_T              valuesize;
+  unsigned long long  time;
+
+ public:
+  BTreeTraceReader();
+
+  // return ERROR_NOTANINDEX if filename is not a trace
+  ERROR_T Open(const char *filename);
+
+  void    Close();
+
+  // return ERROR_NONEXISTENT at the end of the trace, and
+  // ERROR_INSANE if it stops partway into a record
+  ERROR_T Next(BTreeTraceEntry &e);
+
+  SIZE_T  GetKeySize() const { return keysize; }
+  SIZE_T  GetValueSize() const { return valuesize; }
+};
+
+#endif
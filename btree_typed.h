@@ -0,0 +1,409 @@
+#ifndef _btree_typed
+#define _btree_typed
+
+#include <string.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "btree.h"
+
+//
+// BTreeIndexT is a BTreeIndex whose keys and values are plain fixed-size
+// types instead of Blocks.  The index on disk is exactly the one
+// BTreeIndex builds, in the same store, so the two can be used on the
+// same index, and everything without a typed version here (splits,
+// Verify, Analyze, Reorganize, ...) is just BTreeIndex's.
+//
+// Where a key or value sits in a node is fixed by the types, so the hot
+// paths - Lookup, Update, Insert without a split, and Scan - work on a
+// node's bytes directly: keys are binary searched with an inlined
+// Compare on native copies, and nothing is allocated.
+//
+// Compare has to order keys the way KEY_T does, by their bytes, or the
+// typed and untyped paths will disagree about where keys go.
+// BTreeKeyLess does that for any type; use BTreeBigEndian for integers
+// that should sort by value.
+//
+
+// Orders keys by their bytes, the way KEY_T does
+template <class Key>
+struct BTreeKeyLess {
+  bool operator()(const Key &lhs, const Key &rhs) const { return memcmp(&lhs,&rhs,sizeof(Key))<0; }
+};
+
+// An unsigned integer kept most significant byte first, so that its
+// bytes sort the way its value does
+template <class T>
+struct BTreeBigEndian {
+  unsigned char bytes[sizeof(T)];
+
+  BTreeBigEndian() {}
+  BTreeBigEndian(const T v) { Set(v); }
+
+  void Set(T v) {
+    for (SIZE_T i=sizeof(T); i>0; i--) {
+      bytes[i-1]=v&0xff;
+      v>>=8;
+    }
+  }
+  T Get() const {
+    T v=0;
+    for (SIZE_T i=0; i<sizeof(T); i++) {
+      v=(v<<8)|bytes[i];
+    }
+    return v;
+  }
+  operator T() const { return Get(); }
+};
+
+template <class T>
+struct BTreeKeyLess<BTreeBigEndian<T> > {
+  bool operator()(const BTreeBigEndian<T> &lhs, const BTreeBigEndian<T> &rhs) const { return lhs.Get()<rhs.Get(); }
+};
+
+
+// BlockSize, if given, fixes the block size at compile time too, so the
+// slot counts are constants; Attach then refuses any other size.  With
+// 0 they are worked out from the store when it attaches.
+template <class Key, class Value, class Compare=BTreeKeyLess<Key>, SIZE_T BlockSize=0>
+class BTreeIndexT : public BTreeIndex {
+  static_assert(std::is_trivially_copyable<Key>::value, "BTreeIndexT keys must be trivially copyable");
+  static_assert(std::is_trivially_copyable<Value>::value, "BTreeIndexT values must be trivially copyable");
+
+ public:
+  // A node's data is laid out as BTreeNode lays it out:
+  //   interior: ptr key ptr key ... ptr
+  //   leaf:     ptr key value key value ...
+  static constexpr SIZE_T interiorstride=sizeof(SIZE_T)+sizeof(Key);
+  static constexpr SIZE_T leafstride=sizeof(Key)+sizeof(Value);
+
+  static constexpr SIZE_T InteriorKey(const SIZE_T slot) { return sizeof(SIZE_T)+slot*interiorstride; }
+  static constexpr SIZE_T InteriorPtr(const SIZE_T slot) { return slot*interiorstride; }
+  static constexpr SIZE_T LeafKey(const SIZE_T slot) { return sizeof(SIZE_T)+slot*leafstride; }
+  static constexpr SIZE_T LeafVal(const SIZE_T slot) { return LeafKey(slot)+sizeof(Key); }
+
+  static constexpr SIZE_T LeafSlots(const SIZE_T blocksize) {
+    return (blocksize-sizeof(NodeMetadata)-sizeof(SIZE_T))/leafstride;
+  }
+  static constexpr SIZE_T InteriorSlots(const SIZE_T blocksize) {
+    return (blocksize-sizeof(NodeMetadata)-sizeof(SIZE_T))/interiorstride;
+  }
+
+ private:
+  Compare      less;
+  SIZE_T       leafslots;
+
+  SIZE_T GetLeafSlots() const { return BlockSize ? LeafSlots(BlockSize) : leafslots; }
+
+  static void ToBlock(const void *p, const SIZE_T len, Block &b) {
+    b.Resize(len,false);
+    memcpy(b.data,p,len);
+  }
+
+  // First slot of n whose key, stride bytes apart from keys on, is not
+  // less than key
+  SIZE_T Search(const char *keys, const SIZE_T stride, SIZE_T n, const Key &key) const;
+
+  // Descend to key's leaf, alternating between the two views so the
+  // leaf's parent is still there for readahead.  leaf is left pointing
+  // at whichever view holds the leaf.
+  ERROR_T Find(const Key &key, BTreePath &path, BTreeNodeView views[2], const BTreeNode *&leaf);
+
+  // Whether slot of leaf holds key
+  bool Holds(const BTreeNode &leaf, const SIZE_T slot, const Key &key) const;
+
+ public:
+  BTreeIndexT(BufferCache *cache, bool unique=true) :
+    BTreeIndex(sizeof(Key),sizeof(Value),cache,unique), leafslots(0) {}
+  BTreeIndexT(BTreeMmapStore *store, bool unique=true) :
+    BTreeIndex(sizeof(Key),sizeof(Value),store,unique), leafslots(0) {}
+
+  using BTreeIndex::Insert;
+  using BTreeIndex::Update;
+  using BTreeIndex::Lookup;
+  using BTreeIndex::Scan;
+
+  // As BTreeIndex::Attach, but also
+  // return ERROR_SIZE if an existing index has other key or value sizes
+  // return ERROR_BADCONFIG if the block size is not BlockSize
+  ERROR_T Attach(const SIZE_T initblock, const bool create=false);
+
+  // As the BTreeIndex versions
+  ERROR_T Insert(const Key &key, const Value &value);
+  ERROR_T Update(const Key &key, const Value &value);
+  ERROR_T Lookup(const Key &key, Value &value);
+  ERROR_T Scan(const Key &low, const SIZE_T max, vector<pair<Key,Value> > &out);
+};
+
+
+template <class Key, class Value, class Compare, SIZE_T BlockSize>
+SIZE_T BTreeIndexT<Key,Value,Compare,BlockSize>::Search(const char *keys, const SIZE_T stride,
+							 SIZE_T n, const Key &key) const
+{
+  SIZE_T low=0;
+  SIZE_T half;
+  Key k;
+
+  while (n>0) {
+    half=n/2;
+    memcpy(&k,keys+(low+half)*stride,sizeof(Key));
+    if (less(k,key)) {
+      low+=half+1;
+      n-=half+1;
+    } else {
+      n=half;
+    }
+  }
+  return low;
+}
+
+
+template <class Key, class Value, class Compare, SIZE_T BlockSize>
+ERROR_T BTreeIndexT<Key,Value,Compare,BlockSize>::Find(const Key &key, BTreePath &path,
+						       BTreeNodeView views[2], const BTreeNode *&leaf)
+{
+  ERROR_T rc;
+  SIZE_T node;
+
+  node=superblock.info.rootnode;
+  for (path.depth=0;;) {
+    if (path.depth==BTREE_MAX_DEPTH) {
+      return ERROR_INSANE;
+    }
+    BTreeNodeView &view=views[path.depth%2];
+    rc=ViewNode(node,view);
+    if (rc) { return rc; }
+
+    const BTreeNode &b=view.Get();
+    BTreePathEntry &e=path.entry[path.depth++];
+    e.block=node;
+    e.numkeys=b.info.numkeys;
+    leaf=&b;
+
+    switch (b.info.nodetype) {
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (b.info.numkeys==0) {
+	// There are no keys at all on this node, so nowhere to go
+	e.slot=0;
+	return ERROR_NONEXISTENT;
+      }
+      e.slot=Search(b.data+InteriorKey(0),interiorstride,b.info.numkeys,key);
+      memcpy(&node,b.data+InteriorPtr(e.slot),sizeof(SIZE_T));
+      break;
+    case BTREE_LEAF_NODE:
+      e.slot=Search(b.data+LeafKey(0),leafstride,b.info.numkeys,key);
+      NoteLeaf(path, path.depth>=2 ? &views[path.depth%2].Get() : 0);
+      return ERROR_NOERROR;
+    default:
+      return ERROR_INSANE;
+    }
+  }
+}
+
+
+template <class Key, class Value, class Compare, SIZE_T BlockSize>
+bool BTreeIndexT<Key,Value,Compare,BlockSize>::Holds(const BTreeNode &leaf, const SIZE_T slot,
+						     const Key &key) const
+{
+  Key k;
+
+  if (slot>=leaf.info.numkeys) {
+    return false;
+  }
+  memcpy(&k,leaf.data+LeafKey(slot),sizeof(Key));
+  return !less(key,k);
+}
+
+
+template <class Key, class Value, class Compare, SIZE_T BlockSize>
+ERROR_T BTreeIndexT<Key,Value,Compare,BlockSize>::Attach(const SIZE_T initblock, const bool create)
+{
+  ERROR_T rc;
+
+  rc=BTreeIndex::Attach(initblock,create);
+  if (rc) { return rc; }
+
+  if (GetKeySize()!=sizeof(Key) || GetValueSize()!=sizeof(Value)) {
+    return ERROR_SIZE;
+  }
+  if (BlockSize && GetBlockSize()!=BlockSize) {
+    return ERROR_BADCONFIG;
+  }
+  leafslots=LeafSlots(GetBlockSize());
+  // Our idea of the layout had better be BTreeNode's
+  if (leafslots!=superblock.info.GetNumSlotsAsLeaf() ||
+      InteriorSlots(GetBlockSize())!=superblock.info.GetNumSlotsAsInterior()) {
+    return ERROR_BADCONFIG;
+  }
+  return ERROR_NOERROR;
+}
+
+
+template <class Key, class Value, class Compare, SIZE_T BlockSize>
+ERROR_T BTreeIndexT<Key,Value,Compare,BlockSize>::Lookup(const Key &key, Value &value)
+{
+  ERROR_T rc;
+  BTreePath path;
+  BTreeNodeView views[2];
+  const BTreeNode *leaf;
+  BTREE_STAT(BTreeStatTime start=BTreeStatNow());
+
+  if (trace) {
+    KEY_T k;
+    ToBlock(&key,sizeof(Key),k);
+    trace->Record(BTREE_TRACE_LOOKUP,k,0);
+  }
+  rc=Find(key,path,views,leaf);
+  if (!rc) {
+    const SIZE_T slot=path.entry[path.depth-1].slot;
+    if (Holds(*leaf,slot,key)) {
+      memcpy(&value,leaf->data+LeafVal(slot),sizeof(Value));
+    } else {
+      rc=ERROR_NONEXISTENT;
+    }
+  }
+  BTREE_STAT(stats.CountOp(BTREE_STAT_LOOKUP,rc,start));
+  return rc;
+}
+
+
+template <class Key, class Value, class Compare, SIZE_T BlockSize>
+ERROR_T BTreeIndexT<Key,Value,Compare,BlockSize>::Update(const Key &key, const Value &value)
+{
+  ERROR_T rc;
+  BTreePath path;
+  BTreeNodeView views[2];
+  const BTreeNode *leaf;
+  BTreeNode &b=ScratchNode();
+  BTREE_STAT(BTreeStatTime start=BTreeStatNow());
+
+  if (trace) {
+    KEY_T k;
+    ToBlock(&key,sizeof(Key),k);
+    trace->Record(BTREE_TRACE_UPDATE,k,sizeof(Value));
+  }
+  rc=Find(key,path,views,leaf);
+  if (!rc) {
+    const BTreePathEntry &e=path.entry[path.depth-1];
+    if (Holds(*leaf,e.slot,key)) {
+      bool split;
+      views[(path.depth-1)%2].MoveTo(b);
+      memcpy(b.data+LeafVal(e.slot),&value,sizeof(Value));
+      rc=RewriteLeaf(path,b,e.slot,split);
+      if (!rc) {
+	NoteChange(path);
+      }
+    } else {
+      rc=ERROR_NONEXISTENT;
+    }
+  }
+  BTREE_STAT(stats.CountOp(BTREE_STAT_UPDATE,rc,start));
+  return rc;
+}
+
+
+template <class Key, class Value, class Compare, SIZE_T BlockSize>
+ERROR_T BTreeIndexT<Key,Value,Compare,BlockSize>::Insert(const Key &key, const Value &value)
+{
+  ERROR_T rc;
+  BTreePath path;
+  BTreeNodeView views[2];
+  const BTreeNode *leaf;
+  BTreeNode &b=ScratchNode();
+  KEY_T k;
+  VALUE_T v;
+  BTREE_STAT(BTreeStatTime start=BTreeStatNow());
+
+  if (trace) {
+    ToBlock(&key,sizeof(Key),k);
+    trace->Record(BTREE_TRACE_INSERT,k,sizeof(Value));
+  }
+  rc=Find(key,path,views,leaf);
+  if (!rc || (rc==ERROR_NONEXISTENT && path.depth==1)) {
+    const BTreePathEntry &e=path.entry[path.depth-1];
+    if (!rc && Holds(*leaf,e.slot,key)) {
+      rc=ERROR_CONFLICT;
+    } else if (!rc && leaf->info.numkeys<GetLeafSlots()) {
+      // Room in the leaf: open up the slot and drop the pair in
+      views[(path.depth-1)%2].MoveTo(b);
+      rc=BTreeShiftSlots(b,e.slot,e.slot+1);
+      if (!rc) {
+	memcpy(b.data+LeafKey(e.slot),&key,sizeof(Key));
+	memcpy(b.data+LeafVal(e.slot),&value,sizeof(Value));
+	if (fingerprinted) {
+	  fingerprints.Expect(e.block,e.slot,1);
+	}
+	rc=WriteNode(e.block,b);
+	if (!rc) {
+	  NoteInsert(path);
+	} else if (rc==ERROR_SIZE && codec) {
+	  // The leaf no longer compresses into a block; nothing was
+	  // written, so let the general code split it
+	  ToBlock(&key,sizeof(Key),k);
+	  ToBlock(&value,sizeof(Value),v);
+	  rc=InsertInternal(k,v);
+	}
+      }
+    } else {
+      // A first insert or a split, which the general code does
+      ToBlock(&key,sizeof(Key),k);
+      ToBlock(&value,sizeof(Value),v);
+      rc=InsertInternal(k,v);
+    }
+  }
+  BTREE_STAT(stats.CountOp(BTREE_STAT_INSERT,rc,start));
+  return rc;
+}
+
+
+template <class Key, class Value, class Compare, SIZE_T BlockSize>
+ERROR_T BTreeIndexT<Key,Value,Compare,BlockSize>::Scan(const Key &low, const SIZE_T max,
+						       vector<pair<Key,Value> > &out)
+{
+  ERROR_T rc;
+  BTreePath path;
+  BTreeNodeView views[2];
+  const BTreeNode *leaf;
+  BTreeNode &b=ScratchNode();
+  SIZE_T slot;
+  pair<Key,Value> kv;
+  BTREE_STAT(BTreeStatTime start=BTreeStatNow());
+
+  if (trace) {
+    KEY_T k;
+    ToBlock(&low,sizeof(Key),k);
+    trace->Record(BTREE_TRACE_SCAN,k,max);
+  }
+  out.clear();
+  rc=Find(low,path,views,leaf);
+  if (rc==ERROR_NONEXISTENT && path.depth==1) {
+    // Nothing in the index at all
+    rc=ERROR_NOERROR;
+  } else if (!rc) {
+    views[(path.depth-1)%2].MoveTo(b);
+    slot=path.entry[path.depth-1].slot;
+    while (out.size()<max) {
+      if (slot>=b.info.numkeys) {
+	rc=NextLeaf(path,b);
+	if (rc) {
+	  break;
+	}
+	slot=0;
+	continue;
+      }
+      memcpy(&kv.first,b.data+LeafKey(slot),sizeof(Key));
+      memcpy(&kv.second,b.data+LeafVal(slot),sizeof(Value));
+      out.push_back(kv);
+      slot++;
+    }
+    if (rc==ERROR_NONEXISTENT) {
+      rc=ERROR_NOERROR;
+    }
+  }
+  BTREE_STAT(stats.CountOp(BTREE_STAT_SCAN,rc,start));
+  return rc;
+}
+
+#endif
@@ -0,0 +1,518 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#include "btree_workload.h"
+
+static const char *opnames[BTREE_WORK_NUMOPS] = {"insert", "lookup", "update", "delete", "scan", "rmw"};
+
+static const char *distnames[] = {"uniform", "zipfian", "sequential", "latest"};
+
+
+const char *BTreeWorkOpName(const BTreeWorkOp op)
+{
+  return opnames[op];
+}
+
+
+const char *BTreeKeyDistName(const BTreeKeyDist dist)
+{
+  return distnames[dist];
+}
+
+
+static double Now()
+{
+  return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+BTreeWorkload::BTreeWorkload()
+{
+  SIZE_T i;
+
+  name="custom";
+  dist=BTREE_DIST_ZIPFIAN;
+  for (i=0;i<BTREE_WORK_NUMOPS;i++) {
+    mix[i]=0;
+  }
+  mix[BTREE_WORK_LOOKUP]=1;
+  records=10000;
+  operations=100000;
+  maxscan=100;
+  ordered=false;
+  seed=1;
+}
+
+
+ERROR_T BTreeWorkload::SetStandard(const char which)
+{
+  SIZE_T i;
+
+  for (i=0;i<BTREE_WORK_NUMOPS;i++) {
+    mix[i]=0;
+  }
+  dist=BTREE_DIST_ZIPFIAN;
+
+  switch (which) {
+  case 'A':  // update heavy
+    mix[BTREE_WORK_LOOKUP]=0.5;
+    mix[BTREE_WORK_UPDATE]=0.5;
+    break;
+  case 'B':  // read mostly
+    mix[BTREE_WORK_LOOKUP]=0.95;
+    mix[BTREE_WORK_UPDATE]=0.05;
+    break;
+  case 'C':  // read only
+    mix[BTREE_WORK_LOOKUP]=1;
+    break;
+  case 'D':  // read latest
+    mix[BTREE_WORK_LOOKUP]=0.95;
+    mix[BTREE_WORK_INSERT]=0.05;
+    dist=BTREE_DIST_LATEST;
+    break;
+  case 'E':  // short ranges
+    mix[BTREE_WORK_SCAN]=0.95;
+    mix[BTREE_WORK_INSERT]=0.05;
+    break;
+  case 'F':  // read-modify-write
+    mix[BTREE_WORK_LOOKUP]=0.5;
+    mix[BTREE_WORK_RMW]=0.5;
+    break;
+  default:
+    return ERROR_BADCONFIG;
+  }
+  name=string(1,which);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeWorkload::SetDist(const string &d)
+{
+  SIZE_T i;
+
+  for (i=0;i<sizeof(distnames)/sizeof(distnames[0]);i++) {
+    if (d==distnames[i]) {
+      dist=(BTreeKeyDist)i;
+      return ERROR_NOERROR;
+    }
+  }
+  return ERROR_BADCONFIG;
+}
+
+
+ERROR_T BTreeWorkload::SetMix(const string &m)
+{
+  SIZE_T i;
+  size_t start;
+  size_t end;
+  size_t eq;
+  double newmix[BTREE_WORK_NUMOPS];
+
+  for (i=0;i<BTREE_WORK_NUMOPS;i++) {
+    newmix[i]=0;
+  }
+
+  for (start=0;start<m.length();start=end+1) {
+    end=m.find(',',start);
+    if (end==string::npos) {
+      end=m.length();
+    }
+    eq=m.find('=',start);
+    if (eq==string::npos || eq>end) {
+      return ERROR_BADCONFIG;
+    }
+    for (i=0;i<BTREE_WORK_NUMOPS;i++) {
+      if (m.compare(start,eq-start,opnames[i])==0) {
+	break;
+      }
+    }
+    if (i==BTREE_WORK_NUMOPS) {
+      return ERROR_BADCONFIG;
+    }
+    newmix[i]=atof(m.substr(eq+1,end-eq-1).c_str());
+    if (newmix[i]<0) {
+      return ERROR_BADCONFIG;
+    }
+  }
+
+  for (i=0;i<BTREE_WORK_NUMOPS;i++) {
+    mix[i]=newmix[i];
+  }
+  name="custom";
+  return ERROR_NOERROR;
+}
+
+
+BTreeZipfian::BTreeZipfian(const double t) :
+  theta(t), alpha(1.0/(1.0-t)), zeta2(1.0+pow(0.5,t)), zetan(0), n(0)
+{}
+
+
+void BTreeZipfian::Grow(const SIZE_T newn)
+{
+  SIZE_T i;
+
+  if (newn<n) {
+    n=0;
+    zetan=0;
+  }
+  for (i=n+1;i<=newn;i++) {
+    zetan+=1.0/pow((double)i,theta);
+  }
+  n=newn;
+}
+
+
+SIZE_T BTreeZipfian::Next(mt19937_64 &rng, const SIZE_T newn)
+{
+  double u;
+  double uz;
+  double eta;
+  SIZE_T r;
+
+  if (newn<=1) {
+    return 0;
+  }
+  if (newn!=n) {
+    Grow(newn);
+  }
+
+  u=uniform_real_distribution<double>(0,1)(rng);
+  uz=u*zetan;
+  if (uz<1.0) {
+    return 0;
+  }
+  if (uz<zeta2) {
+    return 1;
+  }
+  eta=(1.0-pow(2.0/n,1.0-theta))/(1.0-zeta2/zetan);
+  r=(SIZE_T)(n*pow(eta*u-eta+1.0,alpha));
+  return r<n ? r : n-1;
+}
+
+
+void BTreeMakeKey(const SIZE_T record, const bool ordered, const SIZE_T keysize, KEY_T &key)
+{
+  unsigned long long x;
+  unsigned long long mod;
+  SIZE_T digits;
+  SIZE_T i;
+
+  digits = keysize<19 ? keysize : 19;
+  for (mod=1,i=0;i<digits;i++) {
+    mod*=10;
+  }
+  x=record%mod;
+  if (!ordered) {
+    // Multiplying by anything prime to 10 permutes 0..mod-1, so
+    // distinct records keep distinct keys
+    x=(unsigned long long)(((unsigned __int128)x*2862933555777941757ULL)%mod);
+  }
+
+  key.Resize(keysize,false);
+  for (i=keysize;i>0;i--) {
+    key.data[i-1]='0'+x%10;
+    x/=10;
+  }
+}
+
+
+void BTreeMakeValue(const SIZE_T record, const SIZE_T version, const SIZE_T valuesize, VALUE_T &value)
+{
+  SIZE_T i;
+
+  value.Resize(valuesize,false);
+  for (i=0;i<valuesize;i++) {
+    value.data[i]='a'+(record+version+i)%26;
+  }
+}
+
+
+void BTreeLatency::Add(const unsigned long long ns)
+{
+  samples.push_back(ns);
+  sorted=false;
+}
+
+
+unsigned long long BTreeLatency::Percentile(const double q)
+{
+  SIZE_T i;
+
+  if (samples.empty()) {
+    return 0;
+  }
+  if (!sorted) {
+    sort(samples.begin(),samples.end());
+    sorted=true;
+  }
+  i=(SIZE_T)ceil(q*samples.size());
+  return samples[i>0 ? i-1 : 0];
+}
+
+
+BTreeWorkStats::BTreeWorkStats()
+{
+  SIZE_T i;
+
+  for (i=0;i<BTREE_WORK_NUMOPS;i++) {
+    count[i]=failed[i]=0;
+  }
+  seconds=0;
+  nodereads=nodewrites=0;
+  started=0;
+  startreads=startwrites=0;
+}
+
+
+void BTreeWorkStats::Start(const BTreeIndex &index)
+{
+  startreads=index.GetNumNodeReads();
+  startwrites=index.GetNumNodeWrites();
+  started=Now();
+}
+
+
+void BTreeWorkStats::Stop(const BTreeIndex &index)
+{
+  seconds+=Now()-started;
+  nodereads+=index.GetNumNodeReads()-startreads;
+  nodewrites+=index.GetNumNodeWrites()-startwrites;
+}
+
+
+// The read and write of an RMW: keep the old value, put in the new
+class BTreeWorkRMW : public BTreeModifier {
+ private:
+  VALUE_T       &found;
+  const VALUE_T &value;
+
+ public:
+  BTreeWorkRMW(VALUE_T &f, const VALUE_T &v) : found(f), value(v) {}
+
+  ERROR_T Modify(const KEY_T &key, char *old, const SIZE_T valuesize) {
+    if (value.length!=valuesize) {
+      return ERROR_SIZE;
+    }
+    if (found.length!=valuesize) {
+      found.Resize(valuesize,false);
+    }
+    memcpy(found.data,old,valuesize);
+    memcpy(old,value.data,valuesize);
+    return ERROR_NOERROR;
+  }
+};
+
+
+ERROR_T BTreeWorkStats::Execute(BTreeIndex &index,
+				const BTreeWorkOp op,
+				const KEY_T &key,
+				const VALUE_T &value,
+				const SIZE_T scanlen)
+{
+  ERROR_T rc;
+  VALUE_T found;
+  chrono::steady_clock::time_point begin;
+
+  begin=chrono::steady_clock::now();
+
+  switch (op) {
+  case BTREE_WORK_INSERT:
+    rc=index.Insert(key,value);
+    break;
+  case BTREE_WORK_LOOKUP:
+    rc=index.Lookup(key,found);
+    break;
+  case BTREE_WORK_UPDATE:
+    rc=index.Update(key,value);
+    break;
+  case BTREE_WORK_DELETE:
+    rc=index.Delete(key);
+    break;
+  case BTREE_WORK_SCAN:
+    rc=index.Scan(key,scanlen,scanned);
+    break;
+  case BTREE_WORK_RMW:
+    {
+      BTreeWorkRMW rmw(found,value);
+      rc=index.Modify(key,rmw);
+    }
+    break;
+  default:
+    return ERROR_BADCONFIG;
+  }
+
+  latency[op].Add(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-begin).count());
+  count[op]++;
+
+  switch (rc) {
+  case ERROR_NOERROR:
+    return ERROR_NOERROR;
+  case ERROR_NONEXISTENT:
+  case ERROR_CONFLICT:
+  case ERROR_UNIMPL:
+  case ERROR_SIZE:
+    failed[op]++;
+    return ERROR_NOERROR;
+  default:
+    return rc;
+  }
+}
+
+
+ostream & BTreeWorkStats::PrintJSON(ostream &os)
+{
+  SIZE_T i;
+  SIZE_T total;
+  bool first;
+
+  for (total=0,i=0;i<BTREE_WORK_NUMOPS;i++) {
+    total+=count[i];
+  }
+
+  os << "{\"operations\":" << total
+     << ",\"seconds\":" << seconds
+     << ",\"ops_per_sec\":" << (seconds>0 ? total/seconds : 0)
+     << ",\"block_reads\":" << nodereads
+     << ",\"block_writes\":" << nodewrites
+     << ",\"block_reads_per_op\":" << (total ? (double)nodereads/total : 0)
+     << ",\"block_writes_per_op\":" << (total ? (double)nodewrites/total : 0)
+     << ",\"ops\":{";
+  for (first=true,i=0;i<BTREE_WORK_NUMOPS;i++) {
+    if (count[i]==0) {
+      continue;
+    }
+    if (!first) {
+      os << ",";
+    }
+    first=false;
+    os << "\"" << opnames[i] << "\":{\"count\":" << count[i]
+       << ",\"failed\":" << failed[i]
+       << ",\"p50_ns\":" << latency[i].Percentile(0.5)
+       << ",\"p99_ns\":" << latency[i].Percentile(0.99)
+       << ",\"p999_ns\":" << latency[i].Percentile(0.999)
+       << "}";
+  }
+  os << "}}";
+  return os;
+}
+
+
+BTreeWorkloadRunner::BTreeWorkloadRunner(BTreeIndex &i, const BTreeWorkload &w) :
+  index(i), work(w), rng(w.seed), inserted(0), cursor(0), version(0)
+{}
+
+
+SIZE_T BTreeWorkloadRunner::ChooseRecord()
+{
+  SIZE_T r;
+  unsigned long long h;
+
+  if (inserted==0) {
+    return 0;
+  }
+
+  switch (work.dist) {
+  case BTREE_DIST_UNIFORM:
+    return uniform_int_distribution<SIZE_T>(0,inserted-1)(rng);
+  case BTREE_DIST_ZIPFIAN:
+    // Scatter the popular records instead of bunching them up at 0
+    r=zipf.Next(rng,inserted);
+    for (h=14695981039346656037ULL;r>0;r>>=8) {
+      h=(h^(r&0xff))*1099511628211ULL;
+    }
+    return h%inserted;
+  case BTREE_DIST_SEQUENTIAL:
+    return cursor++%inserted;
+  case BTREE_DIST_LATEST:
+    return inserted-1-zipf.Next(rng,inserted);
+  }
+  return 0;
+}
+
+
+BTreeWorkOp BTreeWorkloadRunner::ChooseOp()
+{
+  SIZE_T i;
+  double total;
+  double u;
+
+  for (total=0,i=0;i<BTREE_WORK_NUMOPS;i++) {
+    total+=work.mix[i];
+  }
+  u=uniform_real_distribution<double>(0,total)(rng);
+  for (i=0;i<BTREE_WORK_NUMOPS-1;i++) {
+    if (u<work.mix[i]) {
+      break;
+    }
+    u-=work.mix[i];
+  }
+  // Rounding can leave us past the last op with any weight
+  while (i>0 && work.mix[i]==0) {
+    i--;
+  }
+  return (BTreeWorkOp)i;
+}
+
+
+ERROR_T BTreeWorkloadRunner::Load(BTreeWorkStats &stats)
+{
+  ERROR_T rc;
+  KEY_T key;
+  VALUE_T value;
+
+  stats.Start(index);
+  for (;inserted<work.records;inserted++) {
+    BTreeMakeKey(inserted,work.ordered,index.GetKeySize(),key);
+    BTreeMakeValue(inserted,0,index.GetValueSize(),value);
+    rc=stats.Execute(index,BTREE_WORK_INSERT,key,value,0);
+    if (rc) {
+      stats.Stop(index);
+      return rc;
+    }
+  }
+  stats.Stop(index);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeWorkloadRunner::Run(BTreeWorkStats &stats)
+{
+  ERROR_T rc;
+  SIZE_T i;
+  SIZE_T record;
+  SIZE_T scanlen;
+  BTreeWorkOp op;
+  KEY_T key;
+  VALUE_T value;
+
+  stats.Start(index);
+  for (i=0;i<work.operations;i++) {
+    op=ChooseOp();
+    if (op==BTREE_WORK_INSERT) {
+      record=inserted++;
+    } else {
+      record=ChooseRecord();
+    }
+    BTreeMakeKey(record,work.ordered,index.GetKeySize(),key);
+    if (op==BTREE_WORK_UPDATE || op==BTREE_WORK_RMW) {
+      BTreeMakeValue(record,++version,index.GetValueSize(),value);
+    } else {
+      BTreeMakeValue(record,0,index.GetValueSize(),value);
+    }
+    scanlen=0;
+    if (op==BTREE_WORK_SCAN) {
+      scanlen=uniform_int_distribution<SIZE_T>(1,work.maxscan>0 ? work.maxscan : 1)(rng);
+    }
+    rc=stats.Execute(index,op,key,value,scanlen);
+    if (rc) {
+      stats.Stop(index);
+      return rc;
+    }
+  }
+  stats.Stop(index);
+  return ERROR_NOERROR;
+}
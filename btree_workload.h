@@ -0,0 +1,158 @@
+#ifndef _btree_workload
+#define _btree_workload
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+
+#include "btree.h"
+
+using namespace std;
+
+// Synthetic workloads for driving a BTreeIndex, after YCSB.  A workload
+// is a mix of operations over records numbered 0..n-1; each record
+// number maps to one key, so the index never has to be asked what is
+// in it.
+
+// How the record an operation touches is chosen
+enum BTreeKeyDist {BTREE_DIST_UNIFORM, BTREE_DIST_ZIPFIAN, BTREE_DIST_SEQUENTIAL, BTREE_DIST_LATEST};
+
+// RMW reads a key's value and writes a new one in a single Modify
+enum BTreeWorkOp {BTREE_WORK_INSERT, BTREE_WORK_LOOKUP, BTREE_WORK_UPDATE,
+		  BTREE_WORK_DELETE, BTREE_WORK_SCAN, BTREE_WORK_RMW,
+		  BTREE_WORK_NUMOPS};
+
+const char *BTreeWorkOpName(const BTreeWorkOp op);
+
+const char *BTreeKeyDistName(const BTreeKeyDist dist);
+
+struct BTreeWorkload {
+  string       name;
+  BTreeKeyDist dist;
+  double       mix[BTREE_WORK_NUMOPS];  // relative weights
+  SIZE_T       records;                 // inserted by Load
+  SIZE_T       operations;              // done by Run
+  SIZE_T       maxscan;                 // scans are 1..maxscan long
+  bool         ordered;                 // keys in record order, not hashed
+  unsigned long seed;
+
+  BTreeWorkload();
+
+  // One of the YCSB core workloads, 'A' to 'F'
+  // return ERROR_BADCONFIG for anything else
+  ERROR_T SetStandard(const char which);
+
+  // "uniform", "zipfian", "sequential" or "latest"
+  ERROR_T SetDist(const string &dist);
+
+  // Comma separated op=weight list, e.g. "lookup=0.9,insert=0.1"
+  ERROR_T SetMix(const string &mix);
+};
+
+// Zipfian over 0..n-1 with 0 the most popular, as in Gray et al.,
+// "Quickly Generating Billion-Record Synthetic Databases".  n may grow
+// between calls; the zeta sum is extended rather than recomputed.
+class BTreeZipfian {
+ private:
+  double       theta;
+  double       alpha;
+  double       zeta2;
+  double       zetan;
+  SIZE_T       n;
+
+  void         Grow(const SIZE_T newn);
+
+ public:
+  BTreeZipfian(const double theta=0.99);
+
+  SIZE_T       Next(mt19937_64 &rng, const SIZE_T n);
+};
+
+// Key and value contents for a record.  Ordered keys sort in record
+// order; otherwise the record number is scrambled first, so records
+// loaded in order land all over the index.  Different versions of a
+// record's value differ.
+void BTreeMakeKey(const SIZE_T record, const bool ordered, const SIZE_T keysize, KEY_T &key);
+
+void BTreeMakeValue(const SIZE_T record, const SIZE_T version, const SIZE_T valuesize, VALUE_T &value);
+
+// Every latency sample, in nanoseconds
+class BTreeLatency {
+ private:
+  vector<unsigned long long> samples;
+  bool         sorted;
+
+ public:
+  BTreeLatency() : sorted(true) {}
+
+  void         Add(const unsigned long long ns);
+
+  SIZE_T       GetCount() const { return samples.size(); }
+
+  // q in [0,1]
+  unsigned long long Percentile(const double q);
+};
+
+// What a run did: per-operation counts, failures and latencies, plus
+// the node I/O the index did while it ran
+class BTreeWorkStats {
+ public:
+  SIZE_T       count[BTREE_WORK_NUMOPS];
+  SIZE_T       failed[BTREE_WORK_NUMOPS];
+  BTreeLatency latency[BTREE_WORK_NUMOPS];
+  double       seconds;
+  SIZE_T       nodereads;
+  SIZE_T       nodewrites;
+
+  BTreeWorkStats();
+
+  void         Start(const BTreeIndex &index);
+
+  void         Stop(const BTreeIndex &index);
+
+  // Do one operation against index and account for it.  An operation
+  // that fails the ordinary way (missing key, key already there,
+  // unimplemented, wrong size) is counted as failed; anything else is
+  // returned.
+  ERROR_T      Execute(BTreeIndex &index,
+		       const BTreeWorkOp op,
+		       const KEY_T &key,
+		       const VALUE_T &value,
+		       const SIZE_T scanlen);
+
+  // One JSON object, no newline
+  ostream &    PrintJSON(ostream &os);
+
+ private:
+  double       started;
+  SIZE_T       startreads;
+  SIZE_T       startwrites;
+  vector<KeyValuePair> scanned;
+};
+
+class BTreeWorkloadRunner {
+ private:
+  BTreeIndex   &index;
+  const BTreeWorkload &work;
+  mt19937_64   rng;
+  BTreeZipfian zipf;
+  SIZE_T       inserted;
+  SIZE_T       cursor;
+  SIZE_T       version;
+
+  SIZE_T       ChooseRecord();
+
+  BTreeWorkOp  ChooseOp();
+
+ public:
+  BTreeWorkloadRunner(BTreeIndex &index, const BTreeWorkload &work);
+
+  // Insert the workload's initial records
+  ERROR_T      Load(BTreeWorkStats &stats);
+
+  // Do the workload's operations
+  ERROR_T      Run(BTreeWorkStats &stats);
+};
+
+#endif